@@ -0,0 +1,358 @@
+#ifndef ANNEXB_H
+#define ANNEXB_H
+
+#include <stdatomic.h>
+#include <stddef.h>
+#include <stdint.h>
+#include <stdlib.h>
+#include <string.h>
+
+#if defined(__x86_64__) || defined(__i386__)
+#include <immintrin.h>
+#define ANNEXB_X86 1
+#elif defined(__aarch64__)
+#include <arm_neon.h>
+#define ANNEXB_NEON 1
+#endif
+
+// Both start codes (00 00 01) and emulation prevention bytes (00 00 03) are a
+// zero byte pair followed by a small value. A zero pair scanner returns a
+// pointer to the first 00 00 <last> in [p, end), or NULL.
+typedef const uint8_t *(*ZeroPairScanner)(const uint8_t *p, const uint8_t *end, uint8_t last);
+
+static const uint8_t *scan_zero_pair_scalar(const uint8_t *p, const uint8_t *end, uint8_t last) {
+    if (end - p < 3) return NULL;
+
+    // Look at the last byte of a candidate match: anything other than 0 or
+    // last rules out the three matches that could contain it.
+    const uint8_t *q = p + 2;
+
+    while (q < end) {
+        if (*q > last) {
+            q += 3;
+        } else if (*q == last) {
+            if (q[-1] == 0 && q[-2] == 0) return q - 2;
+            q += 3;
+        } else if (*q != 0) {
+            q += 3;
+        } else {
+            q++;
+        }
+    }
+
+    return NULL;
+}
+
+#if defined(ANNEXB_X86)
+__attribute__((target("sse2")))
+static const uint8_t *scan_zero_pair_sse2(const uint8_t *p, const uint8_t *end, uint8_t last) {
+    const __m128i zero = _mm_setzero_si128();
+    const __m128i want = _mm_set1_epi8((char)last);
+
+    while (end - p >= 16 + 2) {
+        __m128i a = _mm_loadu_si128((const __m128i *)p);
+        __m128i b = _mm_loadu_si128((const __m128i *)(p + 1));
+        __m128i pairs = _mm_and_si128(_mm_cmpeq_epi8(a, zero), _mm_cmpeq_epi8(b, zero));
+
+        if (_mm_movemask_epi8(pairs)) {
+            __m128i c = _mm_loadu_si128((const __m128i *)(p + 2));
+            int mask = _mm_movemask_epi8(_mm_and_si128(pairs, _mm_cmpeq_epi8(c, want)));
+            if (mask) return p + __builtin_ctz(mask);
+        }
+
+        p += 16;
+    }
+
+    return scan_zero_pair_scalar(p, end, last);
+}
+
+__attribute__((target("avx2")))
+static const uint8_t *scan_zero_pair_avx2(const uint8_t *p, const uint8_t *end, uint8_t last) {
+    const __m256i zero = _mm256_setzero_si256();
+    const __m256i want = _mm256_set1_epi8((char)last);
+
+    while (end - p >= 32 + 2) {
+        __m256i a = _mm256_loadu_si256((const __m256i *)p);
+        __m256i b = _mm256_loadu_si256((const __m256i *)(p + 1));
+        __m256i pairs = _mm256_and_si256(_mm256_cmpeq_epi8(a, zero), _mm256_cmpeq_epi8(b, zero));
+
+        if (_mm256_movemask_epi8(pairs)) {
+            __m256i c = _mm256_loadu_si256((const __m256i *)(p + 2));
+            uint32_t mask = (uint32_t)_mm256_movemask_epi8(_mm256_and_si256(pairs, _mm256_cmpeq_epi8(c, want)));
+            if (mask) return p + __builtin_ctz(mask);
+        }
+
+        p += 32;
+    }
+
+    return scan_zero_pair_sse2(p, end, last);
+}
+#endif
+
+#if defined(ANNEXB_NEON)
+static const uint8_t *scan_zero_pair_neon(const uint8_t *p, const uint8_t *end, uint8_t last) {
+    const uint8x16_t want = vdupq_n_u8(last);
+
+    while (end - p >= 16 + 2) {
+        uint8x16_t a = vld1q_u8(p);
+        uint8x16_t b = vld1q_u8(p + 1);
+        uint8x16_t pairs = vandq_u8(vceqzq_u8(a), vceqzq_u8(b));
+
+        if (vmaxvq_u8(pairs)) {
+            uint8x16_t c = vld1q_u8(p + 2);
+            uint8x16_t m = vandq_u8(pairs, vceqq_u8(c, want));
+            // Narrow each byte of the mask to a nibble to get a 64-bit bitmap.
+            uint64_t bits = vget_lane_u64(vreinterpret_u64_u8(vshrn_n_u16(vreinterpretq_u16_u8(m), 4)), 0);
+            if (bits) return p + (__builtin_ctzll(bits) >> 2);
+        }
+
+        p += 16;
+    }
+
+    return scan_zero_pair_scalar(p, end, last);
+}
+#endif
+
+// Chosen on first use. Threads that race to it all store the same scanner,
+// so relaxed accesses are enough.
+static _Atomic(ZeroPairScanner) zero_pair_scanner;
+
+static ZeroPairScanner select_zero_pair_scanner(void) {
+#if defined(ANNEXB_X86)
+    if (__builtin_cpu_supports("avx2")) return scan_zero_pair_avx2;
+    if (__builtin_cpu_supports("sse2")) return scan_zero_pair_sse2;
+#elif defined(ANNEXB_NEON)
+    return scan_zero_pair_neon;
+#endif
+    return scan_zero_pair_scalar;
+}
+
+static inline const uint8_t *scan_zero_pair(const uint8_t *p, const uint8_t *end, uint8_t last) {
+    ZeroPairScanner scan = atomic_load_explicit(&zero_pair_scanner, memory_order_relaxed);
+
+    if (!scan) {
+        scan = select_zero_pair_scanner();
+        atomic_store_explicit(&zero_pair_scanner, scan, memory_order_relaxed);
+    }
+
+    return scan(p, end, last);
+}
+
+// Returns a pointer to the first 00 00 01 in [p, end), or NULL.
+static inline const uint8_t *scan_start_code(const uint8_t *p, const uint8_t *end) {
+    return scan_zero_pair(p, end, 1);
+}
+
+// Finds the next start code in data. A zero byte right before a 00 00 01 is
+// reported as part of a 4 byte start code, *offset is set to the start code
+// length.
+static inline const uint8_t *find_next_start_code(const uint8_t *data, size_t size, size_t *offset) {
+    const uint8_t *p = scan_start_code(data, data + size);
+    if (!p) return NULL;
+
+    if (p > data && p[-1] == 0) {
+        *offset = 4;
+        return p - 1;
+    }
+
+    *offset = 3;
+    return p;
+}
+
+// A NAL unit inside an Annex B buffer. data points at the NAL header byte in
+// the original buffer and size runs up to the next start code; the payload is
+// left escaped, read it with init_nal_bit_stream. offset is the position of
+// the NAL header byte in the whole stream, the start code sits right before.
+typedef struct {
+    uint8_t nal_unit_type;
+    uint8_t nal_ref_idc;
+    uint8_t forbidden_zero_bit;
+    uint8_t start_code_size;
+    const uint8_t *data;
+    size_t size;
+    uint64_t offset;
+} NALUnit;
+
+typedef struct {
+    const uint8_t *base;
+    const uint8_t *end;
+    const uint8_t *next;
+    size_t next_start_code_size;
+} NALIterator;
+
+static inline void init_nal_iterator(NALIterator *it, const uint8_t *data, size_t size) {
+    it->base = data;
+    it->end = data + size;
+    it->next = find_next_start_code(data, size, &it->next_start_code_size);
+}
+
+static inline void init_nal_unit(NALUnit *nal, const uint8_t *start, size_t size, uint64_t offset, size_t start_code_size) {
+    nal->forbidden_zero_bit = (start[0] >> 7) & 0x01;
+    nal->nal_ref_idc = (start[0] >> 5) & 0x03;
+    nal->nal_unit_type = start[0] & 0x1F;
+    nal->start_code_size = (uint8_t)start_code_size;
+    nal->data = start;
+    nal->size = size;
+    nal->offset = offset;
+}
+
+// Advances to the next non-empty NAL unit. Returns 0 once the buffer is
+// exhausted.
+static inline int next_nal_unit(NALIterator *it, NALUnit *nal) {
+    while (it->next) {
+        size_t start_code_size = it->next_start_code_size;
+        const uint8_t *start = it->next + start_code_size;
+        it->next = find_next_start_code(start, it->end - start, &it->next_start_code_size);
+
+        const uint8_t *stop = it->next ? it->next : it->end;
+        if (stop <= start) continue;
+
+        init_nal_unit(nal, start, stop - start, start - it->base, start_code_size);
+        return 1;
+    }
+
+    return 0;
+}
+
+typedef void (*NALCallback)(const NALUnit *nal, void *opaque);
+
+// Push-style counterpart of NALIterator for pipes and sockets. Bytes are fed
+// in arbitrary chunks and every NAL unit is handed to the callback as soon as
+// the start code after it has arrived, so start codes and NAL units may
+// straddle chunk boundaries. Only the NAL unit in progress is buffered, with
+// its start code right before nal->data, so a decoder that takes Annex B can
+// be passed nal->data - nal->start_code_size. The NALUnit passed to the
+// callback is valid until the callback returns.
+typedef struct {
+    uint8_t *buffer;
+    size_t size;
+    size_t capacity;
+    size_t nal_start;
+    size_t scan_pos;
+    size_t start_code_size;
+    uint64_t buffer_offset;
+    int in_nal;
+    NALCallback callback;
+    void *opaque;
+} NALStreamParser;
+
+static inline void init_nal_stream_parser(NALStreamParser *parser, NALCallback callback, void *opaque) {
+    memset(parser, 0, sizeof(*parser));
+    parser->callback = callback;
+    parser->opaque = opaque;
+}
+
+static inline void free_nal_stream_parser(NALStreamParser *parser) {
+    free(parser->buffer);
+    parser->buffer = NULL;
+    parser->size = 0;
+    parser->capacity = 0;
+}
+
+static inline void emit_nal_unit(NALStreamParser *parser, size_t start, size_t size) {
+    if (size == 0) return;
+
+    NALUnit nal;
+    init_nal_unit(&nal, parser->buffer + start, size, parser->buffer_offset + start, parser->start_code_size);
+
+    parser->callback(&nal, parser->opaque);
+}
+
+// Returns -1 if the buffer for the NAL unit in progress cannot grow.
+static inline int feed_nal_stream_parser(NALStreamParser *parser, const uint8_t *data, size_t size) {
+    // Drop what earlier calls already emitted before growing the buffer,
+    // keeping the start code of the NAL unit in progress.
+    size_t drop = parser->in_nal ? parser->nal_start - parser->start_code_size : parser->nal_start;
+
+    if (drop > 0) {
+        memmove(parser->buffer, parser->buffer + drop, parser->size - drop);
+        parser->buffer_offset += drop;
+        parser->size -= drop;
+        parser->scan_pos -= drop;
+        parser->nal_start -= drop;
+    }
+
+    if (parser->size + size > parser->capacity) {
+        size_t capacity = parser->capacity ? parser->capacity : 64 * 1024;
+        while (capacity < parser->size + size) capacity *= 2;
+
+        uint8_t *buffer = realloc(parser->buffer, capacity);
+        if (!buffer) return -1;
+
+        parser->buffer = buffer;
+        parser->capacity = capacity;
+    }
+
+    memcpy(parser->buffer + parser->size, data, size);
+    parser->size += size;
+
+    const uint8_t *base = parser->buffer;
+    const uint8_t *end = base + parser->size;
+    const uint8_t *p;
+
+    while ((p = scan_start_code(base + parser->scan_pos, end)) != NULL) {
+        size_t pos = p - base;
+
+        // Same framing as find_next_start_code: a zero byte right before
+        // the 00 00 01 belongs to a 4 byte start code.
+        size_t start_code = (pos > parser->nal_start && base[pos - 1] == 0) ? pos - 1 : pos;
+
+        if (parser->in_nal) {
+            emit_nal_unit(parser, parser->nal_start, start_code - parser->nal_start);
+        }
+
+        parser->in_nal = 1;
+        parser->nal_start = pos + 3;
+        parser->scan_pos = pos + 3;
+        parser->start_code_size = pos + 3 - start_code;
+    }
+
+    // Keep two bytes for a start code split across chunks, plus the zero
+    // byte of a 4 byte start code before the first one.
+    size_t keep = parser->size >= 2 ? parser->size - 2 : 0;
+    if (keep > parser->scan_pos) parser->scan_pos = keep;
+    if (!parser->in_nal) parser->nal_start = parser->scan_pos > 0 ? parser->scan_pos - 1 : 0;
+
+    return 0;
+}
+
+// Emits the last NAL unit, which only ends with the stream.
+static inline void flush_nal_stream_parser(NALStreamParser *parser) {
+    if (parser->in_nal) {
+        emit_nal_unit(parser, parser->nal_start, parser->size - parser->nal_start);
+    }
+
+    parser->buffer_offset += parser->size;
+    parser->size = 0;
+    parser->nal_start = 0;
+    parser->scan_pos = 0;
+    parser->in_nal = 0;
+}
+
+// Copies the clean runs between 00 00 03 escapes in bulk, so a payload
+// without escapes is a single memmove. dst may be equal to src.
+static inline void remove_emulation_prevention_bytes(const uint8_t *src, size_t src_size, uint8_t *dst, size_t *dst_size) {
+    const uint8_t *p = src;
+    const uint8_t *end = src + src_size;
+    const uint8_t *escape;
+    uint8_t *out = dst;
+
+    while ((escape = scan_zero_pair(p, end, 3)) != NULL) {
+        size_t run = escape + 2 - p;
+        if (out != p) memmove(out, p, run);
+        out += run;
+        p = escape + 3;
+    }
+
+    if (out != p) memmove(out, p, end - p);
+    *dst_size = (out - dst) + (end - p);
+}
+
+// Unescapes data in place and returns the RBSP size.
+static inline size_t remove_emulation_prevention_bytes_in_place(uint8_t *data, size_t size) {
+    size_t rbsp_size;
+    remove_emulation_prevention_bytes(data, size, data, &rbsp_size);
+    return rbsp_size;
+}
+
+#endif // ANNEXB_H
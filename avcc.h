@@ -0,0 +1,260 @@
+#ifndef AVCC_H
+#define AVCC_H
+
+#include <stddef.h>
+#include <stdint.h>
+#include <string.h>
+
+#include "annexb.h"
+#include "h264.h"
+
+// AVCC is how MP4 and Matroska carry H.264 (ISO/IEC 14496-15): every NAL
+// unit is prefixed with its size in 1, 2 or 4 big-endian bytes instead of a
+// start code, and the SPS and PPS live in the avcC box rather than in the
+// stream. Both forms keep the payload escaped, so converting is a matter of
+// swapping prefixes and never touches the NAL unit bytes themselves.
+//
+// With 4 byte lengths a prefix and a 4 byte start code are the same size and
+// a sample is rewritten where it lies. The other conversions copy; they
+// write nothing when dst is NULL and only report the size they need, so a
+// caller can size its buffer first. All of them return 0, or -1 when the
+// input is malformed or dst is too small.
+
+static const uint8_t avcc_start_code[4] = {0, 0, 0, 1};
+
+static inline uint32_t read_avcc_length(const uint8_t *p, int length_size) {
+    switch (length_size) {
+    case 1: return p[0];
+    case 2: return (uint32_t)p[0] << 8 | p[1];
+    default: return (uint32_t)p[0] << 24 | (uint32_t)p[1] << 16 | (uint32_t)p[2] << 8 | p[3];
+    }
+}
+
+static inline void write_avcc_length(uint8_t *p, int length_size, uint32_t length) {
+    for (int i = length_size - 1; i >= 0; i--) {
+        p[i] = (uint8_t)length;
+        length >>= 8;
+    }
+}
+
+static inline int valid_avcc_length_size(int length_size) {
+    return length_size == 1 || length_size == 2 || length_size == 4;
+}
+
+// Replaces the 4 byte length of every NAL unit in a sample with a start
+// code. A sample whose lengths overrun it is left partly rewritten.
+static inline int avcc_to_annexb_in_place(uint8_t *data, size_t size) {
+    uint8_t *p = data;
+    uint8_t *end = data + size;
+
+    while (end - p >= 4) {
+        uint32_t length = read_avcc_length(p, 4);
+        if (length > (size_t)(end - p) - 4) return -1;
+
+        memcpy(p, avcc_start_code, 4);
+        p += 4 + (size_t)length;
+    }
+
+    return p == end ? 0 : -1;
+}
+
+// Annex B with a 4 byte start code per NAL unit. dst may be equal to src
+// when length_size is 4.
+static inline int avcc_to_annexb(const uint8_t *src, size_t size, int length_size, uint8_t *dst, size_t capacity, size_t *dst_size) {
+    if (!valid_avcc_length_size(length_size)) return -1;
+
+    if (length_size == 4 && dst) {
+        if (capacity < size) return -1;
+        if (dst != src) memcpy(dst, src, size);
+        *dst_size = size;
+        return avcc_to_annexb_in_place(dst, size);
+    }
+
+    const uint8_t *p = src;
+    const uint8_t *end = src + size;
+    size_t out = 0;
+
+    while ((size_t)(end - p) >= (size_t)length_size) {
+        uint32_t length = read_avcc_length(p, length_size);
+        p += length_size;
+        if (length > (size_t)(end - p)) return -1;
+
+        if (dst) {
+            if (capacity - out < 4 + (size_t)length) return -1;
+            memcpy(dst + out, avcc_start_code, 4);
+            memcpy(dst + out + 4, p, length);
+        }
+
+        out += 4 + (size_t)length;
+        p += length;
+    }
+
+    if (p != end) return -1;
+
+    *dst_size = out;
+    return 0;
+}
+
+// Length prefixed NAL units from an Annex B buffer. Trailing zero bytes
+// between NAL units are dropped, anything before the first start code is
+// ignored. Fails for a NAL unit too large for length_size.
+static inline int annexb_to_avcc(const uint8_t *src, size_t size, int length_size, uint8_t *dst, size_t capacity, size_t *dst_size) {
+    if (!valid_avcc_length_size(length_size)) return -1;
+
+    uint64_t max_length = length_size == 4 ? UINT32_MAX : (1ULL << (8 * length_size)) - 1;
+    NALIterator it;
+    NALUnit nal;
+    size_t out = 0;
+
+    init_nal_iterator(&it, src, size);
+
+    while (next_nal_unit(&it, &nal)) {
+        size_t length = nal.size;
+        while (length > 0 && nal.data[length - 1] == 0) length--;
+
+        if (length == 0) continue;
+        if (length > max_length) return -1;
+
+        if (dst) {
+            if (capacity - out < length_size + length) return -1;
+            write_avcc_length(dst + out, length_size, (uint32_t)length);
+            memcpy(dst + out + length_size, nal.data, length);
+        }
+
+        out += length_size + length;
+    }
+
+    *dst_size = out;
+    return 0;
+}
+
+// Appends a parameter set with its 16 bit length to an avcC record. The
+// stored bytes may still carry the trailing zeros of an Annex B stream.
+static inline int add_avcc_parameter_set(const ParameterSetBytes *bytes, uint8_t *dst, size_t capacity, size_t *out) {
+    size_t length = bytes->size;
+    while (length > 0 && bytes->data[length - 1] == 0) length--;
+    if (length > UINT16_MAX) return -1;
+
+    if (dst) {
+        if (capacity - *out < 2 + length) return -1;
+        write_avcc_length(dst + *out, 2, (uint32_t)length);
+        memcpy(dst + *out + 2, bytes->data, length);
+    }
+
+    *out += 2 + length;
+    return 0;
+}
+
+// The AVCDecoderConfigurationRecord (ISO/IEC 14496-15 5.3.3.1) for every SPS
+// and PPS in ps, as it goes into the avcC box or codec extradata. Profile
+// and level come from the SPS with the lowest id.
+static inline int build_avcc(const ParameterSets *ps, int length_size, uint8_t *dst, size_t capacity, size_t *dst_size) {
+    const SPS *sps = NULL;
+    int sps_count = 0;
+    int pps_count = 0;
+
+    if (!valid_avcc_length_size(length_size)) return -1;
+
+    for (int i = 0; i < MAX_SPS_COUNT; i++) {
+        if (!ps->sps[i]) continue;
+        if (!sps) sps = ps->sps[i];
+        sps_count++;
+    }
+
+    for (int i = 0; i < MAX_PPS_COUNT; i++) {
+        if (ps->pps[i]) pps_count++;
+    }
+
+    if (!sps || sps_count > 31 || pps_count == 0) return -1;
+
+    uint8_t header[6] = {
+        1, // configurationVersion
+        sps->profile_idc,
+        sps->constraint_set_flags,
+        sps->level_idc,
+        0xFC | (length_size - 1),
+        0xE0 | sps_count,
+    };
+    size_t out = sizeof(header);
+
+    if (dst) {
+        if (capacity < out) return -1;
+        memcpy(dst, header, out);
+    }
+
+    for (int i = 0; i < MAX_SPS_COUNT; i++) {
+        if (ps->sps[i] && add_avcc_parameter_set(&ps->sps_bytes[i], dst, capacity, &out) < 0) return -1;
+    }
+
+    if (dst) {
+        if (capacity == out) return -1;
+        dst[out] = (uint8_t)pps_count;
+    }
+    out++;
+
+    for (int i = 0; i < MAX_PPS_COUNT; i++) {
+        if (ps->pps[i] && add_avcc_parameter_set(&ps->pps_bytes[i], dst, capacity, &out) < 0) return -1;
+    }
+
+    if (sps->profile_idc == 100 || sps->profile_idc == 110 || sps->profile_idc == 122 || sps->profile_idc == 144) {
+        uint8_t ext[4] = {
+            0xFC | sps->chroma_format_idc,
+            0xF8 | sps->bit_depth_luma_minus8,
+            0xF8 | sps->bit_depth_chroma_minus8,
+            0, // numOfSequenceParameterSetExt
+        };
+
+        if (dst) {
+            if (capacity - out < sizeof(ext)) return -1;
+            memcpy(dst + out, ext, sizeof(ext));
+        }
+
+        out += sizeof(ext);
+    }
+
+    *dst_size = out;
+    return 0;
+}
+
+// The SPS and PPS of an AVCDecoderConfigurationRecord as Annex B, ready to
+// go in front of the first converted sample, and the length size of the
+// samples it describes.
+static inline int parse_avcc(const uint8_t *avcc, size_t size, int *length_size, uint8_t *dst, size_t capacity, size_t *dst_size) {
+    if (size < 6 || avcc[0] != 1) return -1;
+
+    const uint8_t *p = avcc + 5;
+    const uint8_t *end = avcc + size;
+    size_t out = 0;
+
+    *length_size = (avcc[4] & 3) + 1;
+    if (!valid_avcc_length_size(*length_size)) return -1;
+
+    // numOfSequenceParameterSets in 5 bits, then numOfPictureParameterSets
+    // in 8, each followed by its 16 bit length prefixed sets.
+    for (int pass = 0; pass < 2; pass++) {
+        if (p == end) return -1;
+        int count = pass == 0 ? *p & 0x1F : *p;
+        p++;
+
+        for (int i = 0; i < count; i++) {
+            if (end - p < 2) return -1;
+            size_t length = read_avcc_length(p, 2);
+            p += 2;
+            if (length > (size_t)(end - p)) return -1;
+
+            if (dst) {
+                if (capacity - out < 4 + length) return -1;
+                memcpy(dst + out, avcc_start_code, 4);
+                memcpy(dst + out + 4, p, length);
+            }
+
+            out += 4 + length;
+            p += length;
+        }
+    }
+
+    *dst_size = out;
+    return 0;
+}
+
+#endif // AVCC_H
@@ -0,0 +1,260 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdint.h>
+#include <string.h>
+#include <time.h>
+
+#include "annexb.h"
+#include "avcc.h"
+#include "h264.h"
+#include "mapped_file.h"
+
+#define SYNTHETIC_SIZE (128 * 1024 * 1024)
+#define ITERATIONS 5
+
+enum {
+    ANNEXB_TO_AVCC,
+    AVCC_TO_ANNEXB,
+    AVCC_TO_ANNEXB_IN_PLACE,
+    MEMCPY,
+};
+
+static const char *conversion_names[] = {"annexb->avcc", "avcc->annexb", "in place", "memcpy"};
+
+// Annex B with 4 byte start codes and escaped random payloads between
+// min_nal_size and max_nal_size bytes, see bench_start_code.c. Payloads end
+// in a non-zero byte, as every RBSP does, so a round trip through AVCC gives
+// back the same bytes.
+static uint8_t *generate(size_t size, size_t min_nal_size, size_t max_nal_size) {
+    uint8_t *data = malloc(size);
+    uint32_t seed = 1;
+    size_t i = 0;
+
+    if (!data) return NULL;
+
+    while (i + 4 < size) {
+        seed = seed * 1664525 + 1013904223;
+        size_t nal_size = min_nal_size + (seed >> 8) % (max_nal_size - min_nal_size + 1);
+        int zeros = 0;
+
+        memcpy(data + i, "\0\0\0\1", 4);
+        i += 4;
+
+        for (size_t n = 0; n < nal_size && i < size; n++) {
+            seed = seed * 1664525 + 1013904223;
+            uint8_t byte = (uint8_t)(seed >> 16);
+
+            if (zeros >= 2 && byte <= 3) {
+                byte = 3;
+                zeros = 0;
+            }
+
+            data[i++] = byte;
+            zeros = byte == 0 ? zeros + 1 : 0;
+        }
+
+        if (data[i - 1] == 0) data[i - 1] = 0x80;
+    }
+
+    memset(data + i, 0x80, size - i);
+    return data;
+}
+
+static double now(void) {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec + ts.tv_nsec / 1e9;
+}
+
+static int convert(int conversion, int length_size, const uint8_t *annexb, size_t annexb_size, const uint8_t *avcc,
+                   size_t avcc_size, uint8_t *dst, size_t capacity, size_t *dst_size) {
+    switch (conversion) {
+    case ANNEXB_TO_AVCC:
+        return annexb_to_avcc(annexb, annexb_size, length_size, dst, capacity, dst_size);
+    case AVCC_TO_ANNEXB:
+        return avcc_to_annexb(avcc, avcc_size, length_size, dst, capacity, dst_size);
+    case AVCC_TO_ANNEXB_IN_PLACE:
+        *dst_size = avcc_size;
+        return avcc_to_annexb_in_place(dst, avcc_size);
+    default:
+        memcpy(dst, avcc, avcc_size);
+        *dst_size = avcc_size;
+        return 0;
+    }
+}
+
+// Best of ITERATIONS runs in seconds, or -1. The in place conversion gets a
+// fresh copy of the AVCC input before every run, outside the clock.
+static double time_conversion(int conversion, int length_size, const uint8_t *annexb, size_t annexb_size,
+                              const uint8_t *avcc, size_t avcc_size, uint8_t *dst, size_t capacity) {
+    double best = 0;
+
+    for (int i = 0; i < ITERATIONS; i++) {
+        size_t dst_size;
+
+        if (conversion == AVCC_TO_ANNEXB_IN_PLACE) memcpy(dst, avcc, avcc_size);
+
+        double t0 = now();
+        int ret = convert(conversion, length_size, annexb, annexb_size, avcc, avcc_size, dst, capacity, &dst_size);
+        double t = now() - t0;
+
+        if (ret < 0) return -1;
+        if (best == 0 || t < best) best = t;
+    }
+
+    return best;
+}
+
+// Converts to AVCC and back, every way, and checks that all of them agree:
+// both Annex B results are identical and convert back to the same AVCC.
+static int check_round_trip(int length_size, const uint8_t *avcc, size_t avcc_size, uint8_t *annexb, uint8_t *work,
+                            size_t capacity) {
+    size_t annexb_size, size;
+
+    if (avcc_to_annexb(avcc, avcc_size, length_size, annexb, capacity, &annexb_size) < 0) return 0;
+
+    if (length_size == 4) {
+        memcpy(work, avcc, avcc_size);
+        if (avcc_to_annexb_in_place(work, avcc_size) < 0) return 0;
+        if (annexb_size != avcc_size || memcmp(work, annexb, annexb_size) != 0) return 0;
+    }
+
+    if (annexb_to_avcc(annexb, annexb_size, length_size, work, capacity, &size) < 0) return 0;
+    return size == avcc_size && memcmp(work, avcc, size) == 0;
+}
+
+static int bench_length_size(int length_size, const uint8_t *annexb, size_t annexb_size) {
+    size_t avcc_size, size;
+
+    if (annexb_to_avcc(annexb, annexb_size, length_size, NULL, 0, &avcc_size) < 0) {
+        printf("length %d  NAL units too large\n", length_size);
+        return 0;
+    }
+
+    uint8_t *avcc = malloc(avcc_size ? avcc_size : 1);
+    if (avcc && annexb_to_avcc(annexb, annexb_size, length_size, avcc, avcc_size, &size) < 0) return -1;
+    if (avcc && avcc_to_annexb(avcc, avcc_size, length_size, NULL, 0, &size) < 0) return -1;
+
+    size_t capacity = size > avcc_size ? size : avcc_size;
+    uint8_t *dst = malloc(capacity ? capacity : 1);
+    uint8_t *work = malloc(capacity ? capacity : 1);
+
+    if (!avcc || !dst || !work) {
+        fprintf(stderr, "Failed to allocate memory\n");
+        return -1;
+    }
+
+    printf("length %d ", length_size);
+
+    for (int conversion = ANNEXB_TO_AVCC; conversion <= MEMCPY; conversion++) {
+        if (conversion == AVCC_TO_ANNEXB_IN_PLACE && length_size != 4) continue;
+
+        double t = time_conversion(conversion, length_size, annexb, annexb_size, avcc, avcc_size, dst, capacity);
+
+        if (t < 0) {
+            fprintf(stderr, "\n%s failed\n", conversion_names[conversion]);
+            return -1;
+        }
+
+        printf(" %s %6.2f GB/s", conversion_names[conversion], avcc_size / t / 1e9);
+    }
+
+    printf("  round trip %s\n", check_round_trip(length_size, avcc, avcc_size, dst, work, capacity) ? "ok" : "differs");
+
+    free(avcc);
+    free(dst);
+    free(work);
+    return 0;
+}
+
+// Builds the avcC record from the stream's parameter sets and parses it back
+// into the same SPS and PPS.
+static void check_avcc_record(const uint8_t *data, size_t size) {
+    ParameterSets ps;
+    NALIterator it;
+    NALUnit nal;
+    uint8_t *record = NULL, *annexb = NULL, *expected = NULL;
+    size_t record_size, annexb_size, expected_size = 0;
+    int length_size;
+
+    memset(&ps, 0, sizeof(ps));
+    init_nal_iterator(&it, data, size);
+
+    while (next_nal_unit(&it, &nal)) {
+        update_parameter_sets(&ps, &nal);
+    }
+
+    if (build_avcc(&ps, 4, NULL, 0, &record_size) < 0) {
+        printf("avcC: no parameter sets\n");
+        free_parameter_sets(&ps);
+        return;
+    }
+
+    record = malloc(record_size);
+    expected = malloc(record_size * 2);
+
+    if (record && expected && build_avcc(&ps, 4, record, record_size, &record_size) == 0 &&
+        parse_avcc(record, record_size, &length_size, NULL, 0, &annexb_size) == 0 &&
+        (annexb = malloc(annexb_size ? annexb_size : 1)) != NULL &&
+        parse_avcc(record, record_size, &length_size, annexb, annexb_size, &annexb_size) == 0) {
+        for (int i = 0; i < MAX_SPS_COUNT + MAX_PPS_COUNT; i++) {
+            const ParameterSetBytes *bytes = i < MAX_SPS_COUNT ? &ps.sps_bytes[i] : &ps.pps_bytes[i - MAX_SPS_COUNT];
+            size_t n;
+
+            if (!bytes->data) continue;
+            memcpy(expected + expected_size, avcc_start_code, 4);
+            n = bytes->size;
+            while (n > 0 && bytes->data[n - 1] == 0) n--;
+            memcpy(expected + expected_size + 4, bytes->data, n);
+            expected_size += 4 + n;
+        }
+
+        printf("avcC: %zu bytes, ", record_size);
+        for (size_t i = 0; i < record_size; i++) printf("%02x", record[i]);
+        printf(", parameter sets %s\n", length_size == 4 && annexb_size == expected_size &&
+               memcmp(annexb, expected, expected_size) == 0 ? "ok" : "differ");
+    } else {
+        fprintf(stderr, "Failed to build avcC\n");
+    }
+
+    free(record);
+    free(annexb);
+    free(expected);
+    free_parameter_sets(&ps);
+}
+
+int main(int argc, char *argv[]) {
+    MappedFile file = {0};
+
+    if (argc > 1) {
+        if (map_file(argv[1], &file) < 0) return 1;
+
+        printf("%zu bytes\n", file.size);
+        check_avcc_record(file.data, file.size);
+
+        for (int length_size = 4; length_size >= 1; length_size /= 2) {
+            if (bench_length_size(length_size, file.data, file.size) < 0) return 1;
+        }
+
+        unmap_file(&file);
+        return 0;
+    }
+
+    printf("%d bytes\n", SYNTHETIC_SIZE);
+
+    // Typical slices for 4 and 2 byte lengths, as small as 1 byte lengths
+    // allow otherwise, which is where the per NAL unit cost shows.
+    for (int length_size = 4; length_size >= 1; length_size /= 2) {
+        uint8_t *data = length_size == 1 ? generate(SYNTHETIC_SIZE, 16, 255) : generate(SYNTHETIC_SIZE, 1024, 65535);
+
+        if (!data) {
+            fprintf(stderr, "Failed to allocate memory\n");
+            return 1;
+        }
+
+        if (bench_length_size(length_size, data, SYNTHETIC_SIZE) < 0) return 1;
+        free(data);
+    }
+
+    return 0;
+}
@@ -0,0 +1,280 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdint.h>
+#include <string.h>
+#include <time.h>
+
+#include "annexb.h"
+#include "bitstream.h"
+
+#define NUM_SYMBOLS (1 << 22)
+#define ITERATIONS 10
+#define ESCAPE_ROUNDS 20000
+
+// The byte-at-a-time reader parse_h264.c used before bitstream.h, kept here
+// as the baseline.
+typedef struct {
+    const uint8_t *data;
+    size_t size;
+    size_t pos;
+} OldBitStream;
+
+static uint8_t old_read_bit(OldBitStream *bs) {
+    if (bs->pos >= bs->size * 8) return 0;
+
+    size_t byte_pos = bs->pos / 8;
+    size_t bit_pos = 7 - (bs->pos % 8);
+
+    uint8_t bit = (bs->data[byte_pos] >> bit_pos) & 0x01;
+    bs->pos++;
+
+    return bit;
+}
+
+static uint32_t old_read_bits(OldBitStream *bs, uint8_t n) {
+    uint32_t val = 0;
+
+    for (uint8_t i = 0; i < n; i++) {
+        val = (val << 1) | old_read_bit(bs);
+    }
+
+    return val;
+}
+
+static uint32_t old_read_ue(OldBitStream *bs) {
+    int leading_zero_bits = -1;
+    uint8_t bit;
+
+    do {
+        bit = old_read_bit(bs);
+        leading_zero_bits++;
+    } while (bit == 0);
+
+    if (leading_zero_bits == 0) {
+        return 0;
+    }
+
+    uint32_t suffix = old_read_bits(bs, leading_zero_bits);
+    return (1 << leading_zero_bits) - 1 + suffix;
+}
+
+static int32_t old_read_se(OldBitStream *bs) {
+    uint32_t val = old_read_ue(bs);
+
+    if (val & 0x01) {
+        return (val + 1) / 2;
+    } else {
+        return -(val / 2);
+    }
+}
+
+typedef struct {
+    uint8_t *data;
+    size_t capacity;
+    size_t pos;
+} BitWriter;
+
+static void write_bits(BitWriter *bw, uint32_t val, int n) {
+    for (int i = n - 1; i >= 0; i--) {
+        if (bw->pos / 8 >= bw->capacity) {
+            bw->capacity *= 2;
+            bw->data = realloc(bw->data, bw->capacity);
+            memset(bw->data + bw->capacity / 2, 0, bw->capacity / 2);
+        }
+        if ((val >> i) & 1) bw->data[bw->pos / 8] |= 0x80 >> (bw->pos % 8);
+        bw->pos++;
+    }
+}
+
+static void write_ue(BitWriter *bw, uint32_t val) {
+    uint32_t code = val + 1;
+    int len = 32 - __builtin_clz(code);
+    write_bits(bw, 0, len - 1);
+    write_bits(bw, code, len);
+}
+
+// The symbol mix of an SPS/PPS/slice header: mostly short ue(v)/se(v) with
+// the occasional fixed-width field. kinds[i] is 0 for ue, 1 for se and n + 1
+// for an n-bit field.
+static uint8_t *kinds;
+
+static void generate(BitWriter *bw) {
+    uint32_t seed = 1;
+    kinds = malloc(NUM_SYMBOLS);
+
+    for (int i = 0; i < NUM_SYMBOLS; i++) {
+        seed = seed * 1664525 + 1013904223;
+        uint32_t r = seed >> 8;
+        uint32_t magnitude = (r & 0xff) < 200 ? (r >> 8) & 0x7 : (r >> 8) & 0x3ff;
+
+        switch (r % 4) {
+        case 0:
+        case 1:
+            kinds[i] = 0;
+            write_ue(bw, magnitude);
+            break;
+        case 2:
+            kinds[i] = 1;
+            write_ue(bw, magnitude);
+            break;
+        default:
+            kinds[i] = 2 + (r >> 20) % 16;
+            write_bits(bw, r, kinds[i] - 1);
+            break;
+        }
+    }
+}
+
+static double now(void) {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec + ts.tv_nsec / 1e9;
+}
+
+static uint64_t run_old(const uint8_t *data, size_t size) {
+    OldBitStream bs = {data, size, 0};
+    uint64_t sum = 0;
+
+    for (int i = 0; i < NUM_SYMBOLS; i++) {
+        if (kinds[i] == 0) sum += old_read_ue(&bs);
+        else if (kinds[i] == 1) sum += (uint32_t)old_read_se(&bs);
+        else sum += old_read_bits(&bs, kinds[i] - 1);
+    }
+
+    return sum;
+}
+
+static uint64_t run_new(const uint8_t *data, size_t size) {
+    BitStream bs;
+    init_bit_stream(&bs, data, size);
+    uint64_t sum = 0;
+
+    for (int i = 0; i < NUM_SYMBOLS; i++) {
+        if (kinds[i] == 0) sum += read_ue(&bs);
+        else if (kinds[i] == 1) sum += (uint32_t)read_se(&bs);
+        else sum += read_bits(&bs, kinds[i] - 1);
+    }
+
+    return sum;
+}
+
+static uint32_t check_seed = 1;
+
+static uint32_t next_random(void) {
+    check_seed = check_seed * 1664525 + 1013904223;
+    return check_seed >> 8;
+}
+
+// Runs the same random mix of reads on both streams and fails on the first
+// value or position that differs. Reads go well past the end of the data.
+static int compare_readers(BitStream *escaped, BitStream *plain, size_t rbsp_size) {
+    while (bit_stream_tell(plain) < rbsp_size * 8 + 96) {
+        uint32_t r = next_random();
+        uint8_t n = 1 + (r >> 4) % 32;
+        uint32_t a, b;
+
+        switch (r % 6) {
+        case 0: a = read_bits(escaped, n); b = read_bits(plain, n); break;
+        case 1: a = read_ue(escaped); b = read_ue(plain); break;
+        case 2: a = (uint32_t)read_se(escaped); b = (uint32_t)read_se(plain); break;
+        case 3: a = read_bit(escaped); b = read_bit(plain); break;
+        case 4: a = peek_bits(escaped, n); b = peek_bits(plain, n); break;
+        default:
+            skip_bits(escaped, n * 3);
+            skip_bits(plain, n * 3);
+            a = b = 0;
+            break;
+        }
+
+        if (a != b || bit_stream_tell(escaped) != bit_stream_tell(plain)) return 0;
+    }
+
+    return 1;
+}
+
+// init_nal_bit_stream drops emulation prevention bytes while it refills.
+// It has to read exactly what a plain reader reads from the same payload
+// unescaped up front, including when a 00 00 03 is cut by the start or the
+// end of the buffer or sits across a refill.
+static int check_escaped_reader(void) {
+    uint8_t buf[256];
+    uint8_t rbsp[256];
+    uint64_t inputs = 0;
+
+    for (int round = 0; round < ESCAPE_ROUNDS; round++) {
+        size_t size = next_random() % sizeof(buf);
+        int density = next_random() % 3;
+
+        for (size_t i = 0; i < size; i++) {
+            uint32_t r = next_random();
+            switch (density) {
+            case 0: buf[i] = r % 8 == 0 ? 0 : (uint8_t)(r >> 8); break;
+            case 1: buf[i] = r % 3 == 0 ? 3 : (r % 3 == 1 ? 0 : (uint8_t)(r >> 8)); break;
+            default: buf[i] = (uint8_t)(r % 4); break;
+            }
+        }
+
+        // Escapes and parts of escapes right at both ends.
+        static const uint8_t escape[3] = {0, 0, 3};
+        size_t head = next_random() % 4, tail = next_random() % 4;
+        if (size >= 6) {
+            memcpy(buf, escape + 3 - head, head);
+            memcpy(buf + size - tail, escape, tail);
+        }
+
+        // Every window that starts or ends inside the first or last escape.
+        for (size_t start = 0; start < 4 && start <= size; start++) {
+            for (size_t end = size; end + 4 > size && end >= start; end--) {
+                BitStream escaped, plain;
+                size_t rbsp_size;
+
+                remove_emulation_prevention_bytes(buf + start, end - start, rbsp, &rbsp_size);
+                init_nal_bit_stream(&escaped, buf + start, end - start);
+                init_bit_stream(&plain, rbsp, rbsp_size);
+
+                if (!compare_readers(&escaped, &plain, rbsp_size)) {
+                    fprintf(stderr, "Mismatch: escaped reader, %zu byte input\n", end - start);
+                    return 0;
+                }
+
+                inputs++;
+                if (end == 0) break;
+            }
+        }
+    }
+
+    printf("escaped reader matches explicit unescaping on %llu inputs\n", (unsigned long long)inputs);
+    return 1;
+}
+
+int main(void) {
+    if (!check_escaped_reader()) return 1;
+
+    BitWriter bw = {calloc(1, 1024), 1024, 0};
+    generate(&bw);
+
+    size_t size = (bw.pos + 7) / 8;
+    double mbits = bw.pos * (double)ITERATIONS / 1e6;
+
+    printf("%d symbols, %zu bits\n", NUM_SYMBOLS, bw.pos);
+
+    uint64_t old_sum = 0, new_sum = 0;
+
+    double t0 = now();
+    for (int i = 0; i < ITERATIONS; i++) old_sum = run_old(bw.data, size);
+    double t1 = now();
+    for (int i = 0; i < ITERATIONS; i++) new_sum = run_new(bw.data, size);
+    double t2 = now();
+
+    if (old_sum != new_sum) {
+        fprintf(stderr, "Mismatch: old %llu, new %llu\n", (unsigned long long)old_sum, (unsigned long long)new_sum);
+        return 1;
+    }
+
+    printf("old reader: %8.1f Mbit/s\n", mbits / (t1 - t0));
+    printf("new reader: %8.1f Mbit/s (%.1fx)\n", mbits / (t2 - t1), (t1 - t0) / (t2 - t1));
+
+    free(kinds);
+    free(bw.data);
+    return 0;
+}
@@ -0,0 +1,264 @@
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+
+#include "annexb.h"
+#include "h264_index.h"
+#include "mapped_file.h"
+#include "openh264_decoder.h"
+
+#define ITERATIONS 3
+
+// One decoder over the whole file in every mode, then GOP-parallel decoding
+// in au mode at 1, 2, 4, ... threads up to the number of cores. The modes
+// are compared by decoder calls, frames per second and latency: the time
+// from the call a picture was stamped with to the callback that returned
+// it. Every decoding mode and thread count is also run once with picture
+// hashes, which have to match the nal mode's frame for frame.
+
+// Call times by timestamp and the latency of every frame, in seconds.
+typedef struct {
+    double *submitted;
+    uint64_t submitted_capacity;
+    double *latencies;
+    uint64_t count;
+    uint64_t capacity;
+    int failed;
+} FrameLatencies;
+
+typedef struct {
+    uint64_t *hashes;
+    uint64_t count;
+    uint64_t capacity;
+    uint64_t mismatch;
+    int compare;
+} FrameHashes;
+
+static double now(void) {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec + ts.tv_nsec / 1e9;
+}
+
+static int compare_double(const void *a, const void *b) {
+    double x = *(const double *)a, y = *(const double *)b;
+    return x < y ? -1 : x > y;
+}
+
+static void time_frame(const DecodedFrame *frame, void *opaque) {
+    FrameLatencies *l = opaque;
+    double t = now();
+
+    if (frame->timestamp == 0 || frame->timestamp >= l->submitted_capacity ||
+        reserve_index_entry((void **)&l->latencies, &l->capacity, l->count, sizeof(double)) < 0) {
+        l->failed = 1;
+        return;
+    }
+
+    l->latencies[l->count++] = t - l->submitted[frame->timestamp];
+}
+
+// Notes the time of the call that will get the next timestamp.
+static void submit_unit(OpenH264Stream *s, FrameLatencies *l, const uint8_t *data, size_t size) {
+    uint64_t timestamp = s->timestamp + 1;
+
+    if (l) {
+        if (reserve_index_entry((void **)&l->submitted, &l->submitted_capacity, timestamp, sizeof(double)) < 0) {
+            l->failed = 1;
+            l = NULL;
+        } else {
+            l->submitted[timestamp] = now();
+        }
+    }
+
+    decode_openh264_unit(s, data, size);
+}
+
+static void collect_hash(const DecodedFrame *frame, void *opaque) {
+    FrameHashes *h = opaque;
+
+    if (h->compare) {
+        if (frame->number >= h->count || h->hashes[frame->number] != frame->hash) h->mismatch++;
+        return;
+    }
+
+    if (reserve_index_entry((void **)&h->hashes, &h->capacity, h->count, sizeof(uint64_t)) < 0) {
+        h->mismatch++;
+        return;
+    }
+
+    h->hashes[h->count++] = frame->hash;
+}
+
+// One decoder over the whole file, in NAL units or in the access units of
+// the index. latencies, when given, gets the latency of every frame and
+// must be the callback's opaque. Returns the number of frames or -1.
+static int64_t decode_sequential(const MappedFile *file, const H264Index *index, int mode, int hash,
+                                 DecodedFrameCallback callback, void *opaque, FrameLatencies *latencies,
+                                 uint64_t *calls) {
+    OpenH264Stream s;
+
+    if (open_openh264_stream(&s, mode, hash, callback, opaque) < 0) return -1;
+
+    if (mode == OPENH264_MODE_NAL) {
+        NALIterator it;
+        NALUnit nal;
+
+        init_nal_iterator(&it, file->data, file->size);
+
+        while (next_nal_unit(&it, &nal)) {
+            submit_unit(&s, latencies, nal.data - nal.start_code_size, nal.size + nal.start_code_size);
+        }
+    } else {
+        for (uint64_t i = 0; i < index->header->access_unit_count; i++) {
+            const H264IndexAccessUnit *au = &index->access_units[i];
+            submit_unit(&s, latencies, file->data + au->offset, au->size);
+        }
+    }
+
+    // The calls that end the stream return what was held back by earlier
+    // ones, under their timestamps.
+    finish_openh264_stream(&s);
+    close_openh264_stream(&s);
+
+    if (calls) *calls = s.calls;
+    return (int64_t)s.frames;
+}
+
+// Best of ITERATIONS runs in seconds, threads 0 being the single decoder.
+// latencies keeps the frames of the best run.
+static double time_decode(const MappedFile *file, const H264Index *index, int mode, int threads,
+                          FrameLatencies *latencies, uint64_t *frames, uint64_t *calls) {
+    double best = 0;
+
+    for (int i = 0; i < ITERATIONS; i++) {
+        FrameLatencies run = {0};
+        double t0 = now();
+        int64_t ret = threads == 0 ? decode_sequential(file, index, mode, 0, time_frame, &run, &run, calls)
+                                   : decode_openh264_gops(file, index, threads, mode, 0, NULL, NULL);
+        double t = now() - t0;
+
+        free(run.submitted);
+
+        if (ret < 0 || run.failed) {
+            free(run.latencies);
+            return -1;
+        }
+
+        if (best == 0 || t < best) {
+            best = t;
+            *frames = (uint64_t)ret;
+            free(latencies->latencies);
+            *latencies = run;
+        } else {
+            free(run.latencies);
+        }
+    }
+
+    return best;
+}
+
+static double percentile(const FrameLatencies *l, double p) {
+    if (l->count == 0) return 0;
+
+    uint64_t i = (uint64_t)(p * (l->count - 1) + 0.5);
+    return l->latencies[i];
+}
+
+static const char *compare_output(FrameHashes *expected, int64_t frames) {
+    if (frames < 0) return "failed";
+    if (expected->mismatch || (uint64_t)frames != expected->count) return "differs";
+    return "identical";
+}
+
+int main(int argc, char *argv[]) {
+    if (argc != 2) {
+        fprintf(stderr, "Usage: %s <h264_file>\n", argv[0]);
+        return 1;
+    }
+
+    long cores = sysconf(_SC_NPROCESSORS_ONLN);
+    if (cores < 1) cores = 1;
+    if (cores > MAX_DECODE_THREADS) cores = MAX_DECODE_THREADS;
+
+    H264Index index;
+    MappedFile file;
+
+    if (open_h264_index(argv[1], (int)cores, &index) < 0) return 1;
+
+    if (map_file(argv[1], &file) < 0) {
+        unload_h264_index(&index);
+        return 1;
+    }
+
+    FrameHashes expected = {0};
+
+    if (decode_sequential(&file, &index, OPENH264_MODE_NAL, 1, collect_hash, &expected, NULL, NULL) < 0 ||
+        expected.mismatch) {
+        fprintf(stderr, "Failed to decode %s\n", argv[1]);
+        return 1;
+    }
+
+    expected.compare = 1;
+
+    printf("%zu bytes, %llu access units, %llu frames, %llu GOPs, %ld cores\n", file.size,
+           (unsigned long long)index.header->access_unit_count, (unsigned long long)expected.count,
+           (unsigned long long)index.header->keyframe_count, cores);
+
+    FrameLatencies latencies = {0};
+    uint64_t frames, calls;
+    double au = 0;
+
+    for (int mode = 0; mode < OPENH264_MODE_COUNT; mode++) {
+        double best = time_decode(&file, &index, mode, 0, &latencies, &frames, &calls);
+
+        if (best < 0) {
+            fprintf(stderr, "%s: failed to decode %s\n", openh264_mode_names[mode], argv[1]);
+            return 1;
+        }
+
+        if (mode == OPENH264_MODE_AU) au = best;
+
+        qsort(latencies.latencies, latencies.count, sizeof(double), compare_double);
+        printf("%-6s %9llu calls %9.1f frames/s  latency p50 %8.3f ms  p90 %8.3f ms  p99 %8.3f ms", openh264_mode_names[mode],
+               (unsigned long long)calls, frames / best, percentile(&latencies, 0.5) * 1e3,
+               percentile(&latencies, 0.9) * 1e3, percentile(&latencies, 0.99) * 1e3);
+
+        if (mode == OPENH264_MODE_PARSE) {
+            printf("  %llu pictures\n", (unsigned long long)frames);
+        } else {
+            expected.mismatch = 0;
+            int64_t checked = decode_sequential(&file, &index, mode, 1, collect_hash, &expected, NULL, NULL);
+            printf("  output %s\n", compare_output(&expected, checked));
+        }
+    }
+
+    int threads = 1;
+
+    for (;;) {
+        double best = time_decode(&file, &index, OPENH264_MODE_AU, threads, &latencies, &frames, &calls);
+
+        expected.mismatch = 0;
+        int64_t checked = best < 0 ? -1 : decode_openh264_gops(&file, &index, threads, OPENH264_MODE_AU, 1, collect_hash, &expected);
+
+        if (checked < 0) {
+            fprintf(stderr, "-j %d: failed to decode %s\n", threads, argv[1]);
+            return 1;
+        }
+
+        printf("-j %-3d %9.1f frames/s  %5.2fx  output %s\n", threads, frames / best, au / best,
+               compare_output(&expected, checked));
+
+        if (threads == cores) break;
+        threads = threads * 2 < cores ? threads * 2 : (int)cores;
+    }
+
+    free(latencies.latencies);
+    free(expected.hashes);
+    unmap_file(&file);
+    unload_h264_index(&index);
+    return 0;
+}
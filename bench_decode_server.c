@@ -0,0 +1,162 @@
+#ifdef __linux__
+#define _GNU_SOURCE
+#endif
+
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+
+#include "decode_server.h"
+#include "openh264_decoder.h"
+
+#define MAX_BENCH_STREAMS 4096
+
+// How many copies of one stream, each paced at the frame rate and looped,
+// a decode server with one worker per core keeps up with in real time. A
+// run is sustained when the streams together decode at least 98% of the
+// frames due and none ends it more than half a second behind. The count
+// doubles until a run falls behind and is then bisected. Meant for a
+// 640x480 stream, the size of a typical surveillance channel.
+
+typedef struct {
+    double frames_per_second;
+    double max_lag;
+    double load;
+    int width;
+    int height;
+} ServerRun;
+
+// Runs count streams of filename for seconds. Returns 1 if they were
+// sustained, 0 if not and -1 on failure.
+static int run_streams(const char *filename, int count, int workers, double frame_rate, double seconds, ServerRun *run) {
+    DecodeServer *server = malloc(sizeof(DecodeServer));
+    char **paths = malloc(count * sizeof(char *));
+    int ret = -1;
+
+    if (!server || !paths) {
+        fprintf(stderr, "Failed to allocate memory\n");
+        free(server);
+        free(paths);
+        return -1;
+    }
+
+    for (int i = 0; i < count; i++) paths[i] = (char *)filename;
+
+    if (init_decode_server(server, paths, count, workers, OPENH264_MODE_AU, NULL, NULL) == 0 &&
+        start_decode_server(server, frame_rate, 1) == 0) {
+        double end = server->start + seconds;
+
+        while (decode_server_running(server) && server_clock() < end) {
+            struct timespec tick = {0, 50 * 1000 * 1000};
+            nanosleep(&tick, NULL);
+        }
+
+        join_decode_server(server, 1);
+
+        double elapsed = server_clock() - server->start;
+        double due = elapsed * frame_rate;
+        uint64_t total = 0;
+        double busy = 0;
+
+        memset(run, 0, sizeof(*run));
+        ret = 1;
+
+        for (int i = 0; i < server->stream_count; i++) {
+            ServerStream *stream = &server->streams[i];
+            double lag = due - (double)stream->decoder.frames;
+
+            if (lag > run->max_lag) run->max_lag = lag;
+            if (stream->failed || stream->eof || lag > frame_rate / 2) ret = 0;
+            if (stream->failed) ret = -1;
+
+            total += stream->decoder.frames;
+            run->width = stream->width;
+            run->height = stream->height;
+        }
+
+        for (int i = 0; i < server->worker_count; i++) {
+            busy += atomic_load(&server->workers[i].busy_ns) / 1e9;
+        }
+
+        if (total < 0.98 * due * server->stream_count) ret = 0;
+
+        run->frames_per_second = total / elapsed;
+        run->load = busy / elapsed / server->worker_count;
+    }
+
+    free_decode_server(server);
+    free(server);
+    free(paths);
+    return ret;
+}
+
+static int try_streams(const char *filename, int count, int workers, double frame_rate, double seconds) {
+    ServerRun run;
+    int ret = run_streams(filename, count, workers, frame_rate, seconds, &run);
+
+    if (ret < 0) {
+        fprintf(stderr, "Failed to run %d streams\n", count);
+        return -1;
+    }
+
+    printf("%5d streams  %9.1f frames/s  max lag %6.1f frames  load %5.1f%%  %dx%d  %s\n", count,
+           run.frames_per_second, run.max_lag, 100 * run.load, run.width, run.height,
+           ret ? "sustained" : "falls behind");
+    return ret;
+}
+
+int main(int argc, char *argv[]) {
+    if (argc < 2 || argc > 4) {
+        fprintf(stderr, "Usage: %s <h264_file> [fps] [seconds]\n", argv[0]);
+        return 1;
+    }
+
+    const char *filename = argv[1];
+    double frame_rate = argc > 2 ? atof(argv[2]) : 30;
+    double seconds = argc > 3 ? atof(argv[3]) : 5;
+    long cores = sysconf(_SC_NPROCESSORS_ONLN);
+
+    if (frame_rate <= 0 || seconds <= 0) {
+        fprintf(stderr, "Usage: %s <h264_file> [fps] [seconds]\n", argv[0]);
+        return 1;
+    }
+
+    if (cores < 1) cores = 1;
+    if (cores > MAX_SERVER_WORKERS) cores = MAX_SERVER_WORKERS;
+
+    printf("%s at %.1f fps, %.1f s per run, %ld workers\n", filename, frame_rate, seconds, cores);
+
+    int good = 0, bad = 0;
+    int count = 1;
+
+    while (count <= MAX_BENCH_STREAMS) {
+        int ret = try_streams(filename, count, (int)cores, frame_rate, seconds);
+        if (ret < 0) return 1;
+
+        if (!ret) {
+            bad = count;
+            break;
+        }
+
+        good = count;
+        count *= 2;
+    }
+
+    while (bad && bad - good > 1) {
+        int mid = good + (bad - good) / 2;
+        int ret = try_streams(filename, mid, (int)cores, frame_rate, seconds);
+        if (ret < 0) return 1;
+
+        if (ret) {
+            good = mid;
+        } else {
+            bad = mid;
+        }
+    }
+
+    printf("Max streams in real time: %d%s\n", good, bad ? "" : " (limit of the benchmark)");
+    return 0;
+}
@@ -0,0 +1,459 @@
+#include <libavcodec/avcodec.h>
+#include <libavutil/log.h>
+
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/resource.h>
+#include <sys/wait.h>
+#include <time.h>
+#include <unistd.h>
+
+#include "h264_index.h"
+#include "mapped_file.h"
+#include "openh264_decoder.h"
+
+#define ITERATIONS 3
+#define MAX_THREAD_COUNTS 16
+
+// Decodes every file through openh264 and libavcodec at each thread count,
+// with nothing printed per frame, and writes the results as JSON. Each run
+// is a child process of its own, so its CPU time and peak RSS come from the
+// kernel and cover only that decoder. seconds is the decoding alone, from
+// the first input to the last picture, without opening the file and the
+// decoder. Of ITERATIONS runs the fastest is kept.
+//
+// ms/frame is the time between one picture coming out of the decoder and
+// the next, the first counted from the start of decoding. It is only
+// reported for single-threaded runs: openh264 on more threads decodes whole
+// GOPs on separate decoders and hands their pictures over in bursts, so its
+// intervals say nothing about the latency of one picture.
+
+typedef struct {
+    int per_frame; // intervals are recorded
+    double *intervals;
+    uint64_t count;
+    uint64_t capacity;
+    double start;
+    double last;
+    int width;
+    int height;
+    int failed;
+} FrameTimes;
+
+// What a child sends back through its pipe.
+typedef struct {
+    int64_t frames;
+    int width;
+    int height;
+    double seconds;
+    double p50;
+    double p99;
+} DecodeResult;
+
+typedef struct {
+    DecodeResult result;
+    double cpu_seconds;
+    long peak_rss_kb;
+} BenchRun;
+
+typedef int64_t (*DecodeFunction)(const char *filename, int threads, FrameTimes *times);
+
+typedef struct {
+    const char *name;
+    DecodeFunction decode;
+} Backend;
+
+static double now(void) {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec + ts.tv_nsec / 1e9;
+}
+
+static int compare_double(const void *a, const void *b) {
+    double x = *(const double *)a, y = *(const double *)b;
+    return x < y ? -1 : x > y;
+}
+
+static void record_frame(FrameTimes *times, int width, int height) {
+    double t = now();
+
+    if (times->per_frame) {
+        if (reserve_index_entry((void **)&times->intervals, &times->capacity, times->count, sizeof(double)) < 0) {
+            times->failed = 1;
+            return;
+        }
+
+        times->intervals[times->count] = t - times->last;
+    }
+
+    times->count++;
+    times->last = t;
+    times->width = width;
+    times->height = height;
+}
+
+static void record_openh264_frame(const DecodedFrame *frame, void *opaque) {
+    record_frame(opaque, frame->width, frame->height);
+}
+
+// One decoder over the access units of the index, or its GOPs on threads
+// decoders at once.
+static int64_t decode_with_openh264(const char *filename, int threads, FrameTimes *times) {
+    H264Index index;
+    MappedFile file;
+    int64_t frames = -1;
+
+    if (open_h264_index(filename, threads, &index) < 0) return -1;
+
+    if (map_file(filename, &file) < 0) {
+        unload_h264_index(&index);
+        return -1;
+    }
+
+    if (threads > 1) {
+        times->start = times->last = now();
+        frames = decode_openh264_gops(&file, &index, threads, OPENH264_MODE_AU, 0, record_openh264_frame, times);
+    } else {
+        OpenH264Stream s;
+
+        if (open_openh264_stream(&s, OPENH264_MODE_AU, 0, record_openh264_frame, times) == 0) {
+            times->start = times->last = now();
+
+            for (uint64_t i = 0; i < index.header->access_unit_count; i++) {
+                const H264IndexAccessUnit *au = &index.access_units[i];
+                decode_openh264_unit(&s, file.data + au->offset, au->size);
+            }
+
+            finish_openh264_stream(&s);
+            close_openh264_stream(&s);
+            frames = (int64_t)s.frames;
+        }
+    }
+
+    unmap_file(&file);
+    unload_h264_index(&index);
+    return frames;
+}
+
+static int receive_libavcodec_frames(AVCodecContext *ctx, AVFrame *frame, FrameTimes *times) {
+    int ret;
+
+    while ((ret = avcodec_receive_frame(ctx, frame)) >= 0) {
+        record_frame(times, frame->width, frame->height);
+        av_frame_unref(frame);
+    }
+
+    return ret == AVERROR(EAGAIN) || ret == AVERROR_EOF ? 0 : ret;
+}
+
+// The h264 parser splits the file into pictures for a decoder with threads
+// frame and slice threads. The file is copied into a padded buffer first,
+// as the parser and decoder read a little past the end of their input.
+static int64_t decode_with_libavcodec(const char *filename, int threads, FrameTimes *times) {
+    const AVCodec *codec = avcodec_find_decoder(AV_CODEC_ID_H264);
+    AVCodecParserContext *parser = NULL;
+    AVCodecContext *ctx = NULL;
+    AVPacket *packet = av_packet_alloc();
+    AVFrame *frame = av_frame_alloc();
+    MappedFile file;
+    uint8_t *data = NULL;
+    const uint8_t *p;
+    size_t left;
+    int size;
+    int64_t frames = -1;
+    int ret = 0;
+
+    if (map_file(filename, &file) < 0) {
+        av_packet_free(&packet);
+        av_frame_free(&frame);
+        return -1;
+    }
+
+    if (codec) {
+        parser = av_parser_init(codec->id);
+        ctx = avcodec_alloc_context3(codec);
+    }
+
+    if (!packet || !frame || !parser || !ctx) {
+        fprintf(stderr, "Failed to open libavcodec h264 decoder\n");
+        goto done;
+    }
+
+    ctx->thread_count = threads;
+
+    if (avcodec_open2(ctx, codec, NULL) < 0) {
+        fprintf(stderr, "Failed to open libavcodec h264 decoder\n");
+        goto done;
+    }
+
+    data = calloc(1, file.size + AV_INPUT_BUFFER_PADDING_SIZE);
+
+    if (!data) {
+        fprintf(stderr, "Failed to allocate memory\n");
+        goto done;
+    }
+
+    memcpy(data, file.data, file.size);
+    p = data;
+    left = file.size;
+    times->start = times->last = now();
+
+    // Once the input is used up, an empty input flushes the parser, which
+    // then hands over the last picture.
+    do {
+        size = left > INT32_MAX ? INT32_MAX : (int)left;
+        int used = av_parser_parse2(parser, ctx, &packet->data, &packet->size, p, size, AV_NOPTS_VALUE,
+                                    AV_NOPTS_VALUE, 0);
+
+        if (used < 0) {
+            ret = used;
+            break;
+        }
+
+        p += used;
+        left -= used;
+
+        if (packet->size > 0) {
+            ret = avcodec_send_packet(ctx, packet);
+            if (ret >= 0) ret = receive_libavcodec_frames(ctx, frame, times);
+            if (ret < 0) break;
+        }
+    } while (size > 0 || packet->size > 0);
+
+    if (ret >= 0) {
+        avcodec_send_packet(ctx, NULL);
+        ret = receive_libavcodec_frames(ctx, frame, times);
+    }
+
+    if (ret < 0) {
+        fprintf(stderr, "Failed to decode %s with libavcodec\n", filename);
+    } else {
+        frames = (int64_t)times->count;
+    }
+
+done:
+    free(data);
+    av_parser_close(parser);
+    avcodec_free_context(&ctx);
+    av_frame_free(&frame);
+    av_packet_free(&packet);
+    unmap_file(&file);
+    return frames;
+}
+
+static const Backend backends[] = {
+    {"openh264", decode_with_openh264},
+    {"libavcodec", decode_with_libavcodec},
+};
+
+static double percentile(const FrameTimes *times, double p) {
+    if (times->count == 0) return 0;
+
+    uint64_t i = (uint64_t)(p * (times->count - 1) + 0.5);
+    return times->intervals[i];
+}
+
+// Runs in the child: decodes and writes a DecodeResult to fd.
+static int report_decode(const Backend *backend, const char *filename, int threads, int fd) {
+    FrameTimes times = {0};
+    DecodeResult result = {0};
+
+    times.per_frame = threads == 1;
+    result.frames = backend->decode(filename, threads, &times);
+    result.seconds = times.last - times.start;
+
+    if (times.failed) {
+        fprintf(stderr, "Failed to allocate memory\n");
+        result.frames = -1;
+    }
+
+    if (result.frames > 0) {
+        result.width = times.width;
+        result.height = times.height;
+    }
+
+    if (result.frames > 0 && times.per_frame) {
+        qsort(times.intervals, times.count, sizeof(double), compare_double);
+        result.p50 = percentile(&times, 0.5);
+        result.p99 = percentile(&times, 0.99);
+    }
+
+    free(times.intervals);
+    return write(fd, &result, sizeof(result)) == sizeof(result) && result.frames >= 0 ? 0 : -1;
+}
+
+static double timeval_seconds(struct timeval tv) {
+    return tv.tv_sec + tv.tv_usec / 1e6;
+}
+
+// One decode in a child process.
+static int run_decode(const Backend *backend, const char *filename, int threads, BenchRun *run) {
+    int fds[2];
+    int status;
+    struct rusage usage;
+
+    if (pipe(fds) < 0) {
+        fprintf(stderr, "Failed to create pipe\n");
+        return -1;
+    }
+
+    fflush(stdout);
+    fflush(stderr);
+
+    pid_t pid = fork();
+
+    if (pid < 0) {
+        fprintf(stderr, "Failed to fork\n");
+        close(fds[0]);
+        close(fds[1]);
+        return -1;
+    }
+
+    if (pid == 0) {
+        close(fds[0]);
+        _exit(report_decode(backend, filename, threads, fds[1]) < 0 ? 1 : 0);
+    }
+
+    close(fds[1]);
+    ssize_t n = read(fds[0], &run->result, sizeof(run->result));
+    close(fds[0]);
+
+    if (wait4(pid, &status, 0, &usage) < 0 || !WIFEXITED(status) || WEXITSTATUS(status) != 0 ||
+        n != sizeof(run->result)) {
+        fprintf(stderr, "Failed to decode %s with %s on %d threads\n", filename, backend->name, threads);
+        return -1;
+    }
+
+    run->cpu_seconds = timeval_seconds(usage.ru_utime) + timeval_seconds(usage.ru_stime);
+#ifdef __APPLE__
+    run->peak_rss_kb = usage.ru_maxrss / 1024;
+#else
+    run->peak_rss_kb = usage.ru_maxrss;
+#endif
+    return 0;
+}
+
+static double best_of(const Backend *backend, const char *filename, int threads, BenchRun *best) {
+    for (int i = 0; i < ITERATIONS; i++) {
+        BenchRun run;
+
+        if (run_decode(backend, filename, threads, &run) < 0) return -1;
+        if (i == 0 || run.result.seconds < best->result.seconds) *best = run;
+    }
+
+    return best->result.seconds;
+}
+
+static void print_json_string(const char *s) {
+    putchar('"');
+
+    for (; *s; s++) {
+        if (*s == '"' || *s == '\\') {
+            printf("\\%c", *s);
+        } else if ((unsigned char)*s < 0x20) {
+            printf("\\u%04x", *s);
+        } else {
+            putchar(*s);
+        }
+    }
+
+    putchar('"');
+}
+
+static void print_run(const char *filename, const Backend *backend, int threads, const BenchRun *run, int first) {
+    const DecodeResult *r = &run->result;
+
+    printf("%s\n    {\"file\": ", first ? "" : ",");
+    print_json_string(filename);
+    printf(", \"width\": %d, \"height\": %d, \"backend\": \"%s\", \"threads\": %d, \"frames\": %lld, "
+           "\"seconds\": %.6f, \"fps\": %.2f, ",
+           r->width, r->height, backend->name, threads, (long long)r->frames, r->seconds,
+           r->seconds > 0 ? r->frames / r->seconds : 0);
+
+    if (threads == 1) {
+        printf("\"ms_per_frame_p50\": %.4f, \"ms_per_frame_p99\": %.4f, ", r->p50 * 1e3, r->p99 * 1e3);
+    } else {
+        printf("\"ms_per_frame_p50\": null, \"ms_per_frame_p99\": null, ");
+    }
+
+    printf("\"cpu_seconds\": %.6f, \"peak_rss_kb\": %ld}", run->cpu_seconds, run->peak_rss_kb);
+}
+
+// A comma separated list of thread counts, such as 1,2,4.
+static int parse_thread_counts(const char *list, int *counts) {
+    int count = 0;
+
+    while (*list && count < MAX_THREAD_COUNTS) {
+        char *end;
+        long n = strtol(list, &end, 10);
+
+        if (end == list || n < 1 || n > MAX_DECODE_THREADS || (*end && *end != ',')) return -1;
+
+        counts[count++] = (int)n;
+        list = *end ? end + 1 : end;
+    }
+
+    return *list ? -1 : count;
+}
+
+void usage(const char *name) {
+    fprintf(stderr, "Usage: %s [-threads <n,n,...>] <h264_file>...\n", name);
+}
+
+int main(int argc, char *argv[]) {
+    long cores = sysconf(_SC_NPROCESSORS_ONLN);
+    int counts[MAX_THREAD_COUNTS];
+    int count = 0;
+    int i = 1;
+
+    if (cores < 1) cores = 1;
+    if (cores > MAX_DECODE_THREADS) cores = MAX_DECODE_THREADS;
+
+    if (argc > 2 && strcmp(argv[1], "-threads") == 0) {
+        count = parse_thread_counts(argv[2], counts);
+        i = 3;
+    } else {
+        for (int threads = 1; count < MAX_THREAD_COUNTS; threads *= 2) {
+            counts[count++] = threads < cores ? threads : (int)cores;
+            if (threads >= cores) break;
+        }
+    }
+
+    if (i >= argc || count <= 0) {
+        usage(argv[0]);
+        return 1;
+    }
+
+    av_log_set_level(AV_LOG_ERROR);
+
+    // The sidecar indexes are built here, so that no openh264 run pays for
+    // its own.
+    for (int f = i; f < argc; f++) {
+        H264Index index;
+
+        if (open_h264_index(argv[f], (int)cores, &index) < 0) return 1;
+        unload_h264_index(&index);
+    }
+
+    printf("{\"cores\": %ld, \"iterations\": %d, \"runs\": [", cores, ITERATIONS);
+
+    int first = 1;
+
+    for (int f = i; f < argc; f++) {
+        for (size_t b = 0; b < sizeof(backends) / sizeof(backends[0]); b++) {
+            for (int t = 0; t < count; t++) {
+                BenchRun run = {0};
+
+                if (best_of(&backends[b], argv[f], counts[t], &run) < 0) return 1;
+
+                print_run(argv[f], &backends[b], counts[t], &run, first);
+                first = 0;
+            }
+        }
+    }
+
+    printf("\n]}\n");
+    return 0;
+}
@@ -0,0 +1,215 @@
+#include <libavcodec/avcodec.h>
+#include <libavcodec/bsf.h>
+#include <libavformat/avformat.h>
+
+#include <errno.h>
+#include <fcntl.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdint.h>
+#include <string.h>
+#include <sys/stat.h>
+#include <time.h>
+#include <unistd.h>
+
+#include "mapped_file.h"
+#include "mov.h"
+#include "mov_demux.h"
+#include "mov_sample_table.h"
+
+#define ITERATIONS 3
+
+// demux_mov next to what it replaces, ffmpeg -i <file> -c:v copy -bsf:v
+// h264_mp4toannexb -f h264 <output>, both from opening the input to the
+// last byte written.
+
+static double now(void) {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec + ts.tv_nsec / 1e9;
+}
+
+static int write_all(int fd, const uint8_t *data, size_t size) {
+    while (size > 0) {
+        ssize_t n = write(fd, data, size);
+
+        if (n < 0) {
+            if (errno == EINTR) continue;
+            return -1;
+        }
+
+        data += n;
+        size -= n;
+    }
+
+    return 0;
+}
+
+static int demux_native(const char *filename, int fd) {
+    MovFile *file = malloc(sizeof(MovFile));
+    MovBoxTree tree = {0};
+    MovSampleTable table = {0};
+    MovH264Demuxer demuxer = {0};
+    MappedFile mapped = {0};
+    int trak;
+    int ret = -1;
+
+    if (!file) return -1;
+
+    if (open_mov_file(filename, file) < 0) {
+        free(file);
+        return -1;
+    }
+
+    if (parse_mov_box_tree(file, &tree) == 0 && (trak = find_mov_track(&tree, file, MOV_FOURCC('v', 'i', 'd', 'e'))) >= 0 &&
+        load_mov_sample_table(file, &tree, trak, &table) == 0 && map_file(filename, &mapped) == 0 &&
+        init_mov_h264_demuxer(&demuxer, file, &tree, &table, fd) == 0) {
+        ret = table.sample_count == 0 ? write_mov_h264_fragments(&demuxer, mapped.data, mapped.size, table.track_id)
+                                       : write_mov_h264_track(&demuxer, mapped.data, mapped.size, &table);
+    }
+
+    free_mov_h264_demuxer(&demuxer);
+    unmap_file(&mapped);
+    free_mov_sample_table(&table);
+    free_mov_box_tree(&tree);
+    close_mov_file(file);
+    free(file);
+    return ret;
+}
+
+static int write_bsf_packets(AVBSFContext *bsf, AVPacket *pkt, int fd) {
+    int ret;
+
+    while ((ret = av_bsf_receive_packet(bsf, pkt)) == 0) {
+        ret = write_all(fd, pkt->data, pkt->size);
+        av_packet_unref(pkt);
+        if (ret < 0) return -1;
+    }
+
+    return ret == AVERROR(EAGAIN) || ret == AVERROR_EOF ? 0 : -1;
+}
+
+static int demux_ffmpeg(const char *filename, int fd) {
+    AVFormatContext *format = NULL;
+    AVBSFContext *bsf = NULL;
+    AVPacket *pkt = av_packet_alloc();
+    int stream;
+    int ret = -1;
+
+    if (!pkt || avformat_open_input(&format, filename, NULL, NULL) < 0) goto done;
+
+    stream = av_find_best_stream(format, AVMEDIA_TYPE_VIDEO, -1, -1, NULL, 0);
+
+    if (stream < 0 || av_bsf_list_parse_str("h264_mp4toannexb", &bsf) < 0 ||
+        avcodec_parameters_copy(bsf->par_in, format->streams[stream]->codecpar) < 0 ||
+        av_bsf_init(bsf) < 0) {
+        goto done;
+    }
+
+    while (av_read_frame(format, pkt) >= 0) {
+        if (pkt->stream_index != stream) {
+            av_packet_unref(pkt);
+            continue;
+        }
+
+        if (av_bsf_send_packet(bsf, pkt) < 0) {
+            av_packet_unref(pkt);
+            goto done;
+        }
+
+        if (write_bsf_packets(bsf, pkt, fd) < 0) goto done;
+    }
+
+    if (av_bsf_send_packet(bsf, NULL) < 0 || write_bsf_packets(bsf, pkt, fd) < 0) goto done;
+    ret = 0;
+
+done:
+    av_bsf_free(&bsf);
+    avformat_close_input(&format);
+    av_packet_free(&pkt);
+    return ret;
+}
+
+// Best of ITERATIONS runs, in seconds, or -1.
+static double time_demux(const char *filename, const char *output, int native) {
+    double best = 0;
+
+    for (int i = 0; i < ITERATIONS; i++) {
+        int fd = open(output, O_WRONLY | O_CREAT | O_TRUNC, 0644);
+        if (fd < 0) return -1;
+
+        double t0 = now();
+        int ret = native ? demux_native(filename, fd) : demux_ffmpeg(filename, fd);
+        double t = now() - t0;
+
+        close(fd);
+        if (ret < 0) return -1;
+        if (best == 0 || t < best) best = t;
+    }
+
+    return best;
+}
+
+// Runs both once into temporary files and compares what they wrote.
+static int same_output(const char *filename, size_t *size) {
+    char native_path[] = "/tmp/bench_demux_mov_XXXXXX";
+    char ffmpeg_path[] = "/tmp/bench_demux_mov_XXXXXX";
+    int native_fd = mkstemp(native_path);
+    int ffmpeg_fd = mkstemp(ffmpeg_path);
+    int same = 0;
+
+    *size = 0;
+
+    if (native_fd >= 0 && ffmpeg_fd >= 0 && demux_native(filename, native_fd) == 0 && demux_ffmpeg(filename, ffmpeg_fd) == 0) {
+        MappedFile a, b;
+
+        if (map_file(native_path, &a) == 0) {
+            if (map_file(ffmpeg_path, &b) == 0) {
+                same = a.size == b.size && (a.size == 0 || memcmp(a.data, b.data, a.size) == 0);
+                unmap_file(&b);
+            }
+
+            *size = a.size;
+            unmap_file(&a);
+        }
+    }
+
+    if (native_fd >= 0) {
+        close(native_fd);
+        unlink(native_path);
+    }
+
+    if (ffmpeg_fd >= 0) {
+        close(ffmpeg_fd);
+        unlink(ffmpeg_path);
+    }
+
+    return same;
+}
+
+int main(int argc, char *argv[]) {
+    if (argc != 2 && argc != 3) {
+        fprintf(stderr, "Usage: %s <mp4_file> [output_file]\n", argv[0]);
+        return 1;
+    }
+
+    const char *filename = argv[1];
+    const char *output = argc == 3 ? argv[2] : "/dev/null";
+    size_t size;
+
+    av_log_set_level(AV_LOG_ERROR);
+
+    int same = same_output(filename, &size);
+    double native = time_demux(filename, output, 1);
+    double ffmpeg = time_demux(filename, output, 0);
+
+    if (native < 0 || ffmpeg < 0) {
+        fprintf(stderr, "Failed to demux %s\n", native < 0 ? "natively" : "with ffmpeg");
+        return 1;
+    }
+
+    printf("%zu bytes of H.264 into %s\n", size, output);
+    printf("native %7.2f GB/s  ffmpeg %7.2f GB/s  %6.1fx  output %s\n", size / native / 1e9, size / ffmpeg / 1e9,
+           ffmpeg / native, same ? "identical" : "differs");
+    return 0;
+}
@@ -0,0 +1,178 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdint.h>
+#include <string.h>
+#include <time.h>
+
+#include "annexb.h"
+
+#define PAYLOAD_SIZE (64 * 1024 * 1024)
+#define ITERATIONS 10
+
+// The byte-at-a-time version parse_h264.c used before annexb.h. Every
+// input is checked against it before anything is timed.
+static void remove_emulation_prevention_bytes_reference(const uint8_t *src, size_t src_size, uint8_t *dst, size_t *dst_size) {
+    size_t i = 0, j = 0;
+
+    while (i < src_size) {
+        if (i + 2 < src_size && src[i] == 0 && src[i + 1] == 0 && src[i + 2] == 3) {
+            dst[j++] = 0;
+            dst[j++] = 0;
+            i += 3;
+        } else {
+            dst[j++] = src[i++];
+        }
+    }
+
+    *dst_size = j;
+}
+
+static uint32_t seed = 1;
+
+static uint32_t next_random(void) {
+    seed = seed * 1664525 + 1013904223;
+    return seed >> 8;
+}
+
+static int check(const char *name, const uint8_t *src, size_t size) {
+    uint8_t *expected = malloc(size + 1);
+    uint8_t *actual = malloc(size + 1);
+    uint8_t *in_place = malloc(size + 1);
+    size_t expected_size, actual_size;
+
+    remove_emulation_prevention_bytes_reference(src, size, expected, &expected_size);
+    remove_emulation_prevention_bytes(src, size, actual, &actual_size);
+
+    memcpy(in_place, src, size);
+    size_t in_place_size = remove_emulation_prevention_bytes_in_place(in_place, size);
+
+    int ok = actual_size == expected_size && in_place_size == expected_size &&
+             memcmp(actual, expected, expected_size) == 0 &&
+             memcmp(in_place, expected, expected_size) == 0;
+
+    if (!ok) {
+        fprintf(stderr, "%s: mismatch for a %zu byte input\n", name, size);
+    }
+
+    free(expected);
+    free(actual);
+    free(in_place);
+    return ok;
+}
+
+// Random and adversarial inputs: sparse and dense zeros, long zero runs,
+// chains of escapes and escapes straddling every 16 and 32 byte block
+// boundary the vector scanners use.
+static int check_all(void) {
+    uint8_t buf[4096];
+
+    for (int round = 0; round < 20000; round++) {
+        size_t size = next_random() % sizeof(buf);
+        int density = next_random() % 4;
+
+        for (size_t i = 0; i < size; i++) {
+            uint32_t r = next_random();
+            switch (density) {
+            case 0: buf[i] = (uint8_t)r; break;
+            case 1: buf[i] = r % 8 == 0 ? 0 : (uint8_t)(r >> 8); break;
+            case 2: buf[i] = r % 3 == 0 ? 3 : (r % 3 == 1 ? 0 : (uint8_t)(r >> 8)); break;
+            default: buf[i] = (uint8_t)(r % 4); break;
+            }
+        }
+
+        if (!check("random", buf, size)) return 0;
+    }
+
+    memset(buf, 0, sizeof(buf));
+    if (!check("zero run", buf, sizeof(buf))) return 0;
+
+    for (size_t i = 0; i + 3 <= sizeof(buf); i += 3) memcpy(buf + i, "\0\0\3", 3);
+    if (!check("escape chain", buf, sizeof(buf))) return 0;
+
+    for (size_t block = 16; block <= 64; block += 16) {
+        for (size_t shift = 0; shift < 8; shift++) {
+            memset(buf, 0x55, sizeof(buf));
+            for (size_t i = block - 4 + shift; i + 3 <= sizeof(buf); i += block) memcpy(buf + i, "\0\0\3", 3);
+            if (!check("block boundary", buf, sizeof(buf))) return 0;
+
+            for (size_t size = block - 4; size <= block + 4; size++) {
+                if (!check("block boundary tail", buf, size)) return 0;
+            }
+        }
+    }
+
+    return 1;
+}
+
+static double now(void) {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec + ts.tv_nsec / 1e9;
+}
+
+// Emulation prevention applied to random bytes; zero_one_in controls how
+// often a zero byte is drawn and therefore how often an escape is needed.
+static size_t generate(uint8_t *data, size_t size, uint32_t zero_one_in) {
+    size_t i = 0;
+    int zeros = 0;
+
+    while (i < size) {
+        uint32_t r = next_random();
+        uint8_t byte = r % zero_one_in == 0 ? 0 : (uint8_t)(r >> 8) | 4;
+
+        if (zeros >= 2 && byte <= 3) {
+            data[i++] = 3;
+            zeros = 0;
+            if (i == size) break;
+        }
+
+        data[i++] = byte;
+        zeros = byte == 0 ? zeros + 1 : 0;
+    }
+
+    return i;
+}
+
+static void bench(const char *name, uint32_t zero_one_in) {
+    uint8_t *src = malloc(PAYLOAD_SIZE);
+    uint8_t *dst = malloc(PAYLOAD_SIZE);
+    uint8_t *work = malloc(PAYLOAD_SIZE);
+    size_t size = generate(src, PAYLOAD_SIZE, zero_one_in);
+    size_t dst_size = 0;
+    double gb = (double)size * ITERATIONS / 1e9;
+
+    double t0 = now();
+    for (int i = 0; i < ITERATIONS; i++) remove_emulation_prevention_bytes_reference(src, size, dst, &dst_size);
+    double t1 = now();
+    for (int i = 0; i < ITERATIONS; i++) remove_emulation_prevention_bytes(src, size, dst, &dst_size);
+    double t2 = now();
+
+    // In-place runs consume their input, time only the unescaping.
+    double in_place = 0;
+    for (int i = 0; i < ITERATIONS; i++) {
+        memcpy(work, src, size);
+        double t = now();
+        dst_size = remove_emulation_prevention_bytes_in_place(work, size);
+        in_place += now() - t;
+    }
+
+    printf("%-16s %zu escapes\n", name, size - dst_size);
+    printf("  scalar   %6.2f GB/s\n", gb / (t1 - t0));
+    printf("  copy     %6.2f GB/s\n", gb / (t2 - t1));
+    printf("  in place %6.2f GB/s\n", gb / in_place);
+
+    free(src);
+    free(dst);
+    free(work);
+}
+
+int main(void) {
+    if (!check_all()) return 1;
+    printf("All inputs match the scalar reference\n");
+
+    bench("no escapes", 0xffffffff);
+    bench("sparse escapes", 16);
+    bench("dense escapes", 4);
+
+    return 0;
+}
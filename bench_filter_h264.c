@@ -0,0 +1,223 @@
+#include <libavcodec/avcodec.h>
+#include <libavcodec/bsf.h>
+#include <libavformat/avformat.h>
+
+#include <errno.h>
+#include <fcntl.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdint.h>
+#include <string.h>
+#include <sys/stat.h>
+#include <time.h>
+#include <unistd.h>
+
+#include "annexb.h"
+#include "h264_filter.h"
+#include "mapped_file.h"
+
+#define ITERATIONS 3
+
+// Each filter_h264 mode next to the ffmpeg bitstream filter that does the
+// same, as in ffmpeg -i <file> -c copy -bsf:v <bsf> -f h264 <output>.
+// discard needs FFmpeg 6.1 or later.
+typedef struct {
+    const char *name;
+    int drop;
+    const char *bsf;
+} FilterMode;
+
+static const FilterMode modes[] = {
+    {"sei+filler", H264_FILTER_SEI | H264_FILTER_FILLER, "filter_units=remove_types=6|12"},
+    {"nonref", H264_FILTER_NON_REF, "filter_units=discard=nonref"},
+    {"nonidr", H264_FILTER_NON_IDR, "filter_units=discard=nonkey"},
+};
+
+static double now(void) {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec + ts.tv_nsec / 1e9;
+}
+
+static int write_all(int fd, const uint8_t *data, size_t size) {
+    while (size > 0) {
+        ssize_t n = write(fd, data, size);
+
+        if (n < 0) {
+            if (errno == EINTR) continue;
+            return -1;
+        }
+
+        data += n;
+        size -= n;
+    }
+
+    return 0;
+}
+
+static int filter_native(const char *filename, int drop, int fd) {
+    MappedFile file;
+    H264Filter filter;
+    NALIterator it;
+    NALUnit nal;
+    int ret = 0;
+
+    if (map_file(filename, &file) < 0) return -1;
+
+    init_h264_filter(&filter, drop, fd, file.data);
+    init_nal_iterator(&it, file.data, file.size);
+
+    while (ret == 0 && next_nal_unit(&it, &nal)) {
+        ret = add_nal_to_h264_filter(&filter, &nal);
+    }
+
+    if (ret == 0) ret = finish_h264_filter(&filter);
+
+    free_h264_filter(&filter);
+    unmap_file(&file);
+    return ret;
+}
+
+static int write_bsf_packets(AVBSFContext *bsf, AVPacket *pkt, int fd) {
+    int ret;
+
+    while ((ret = av_bsf_receive_packet(bsf, pkt)) == 0) {
+        ret = write_all(fd, pkt->data, pkt->size);
+        av_packet_unref(pkt);
+        if (ret < 0) return -1;
+    }
+
+    return ret == AVERROR(EAGAIN) || ret == AVERROR_EOF ? 0 : -1;
+}
+
+static int filter_ffmpeg(const char *filename, const char *filters, int fd) {
+    AVFormatContext *format = NULL;
+    AVBSFContext *bsf = NULL;
+    AVPacket *pkt = av_packet_alloc();
+    int stream;
+    int ret = -1;
+
+    if (!pkt || avformat_open_input(&format, filename, NULL, NULL) < 0) goto done;
+
+    stream = av_find_best_stream(format, AVMEDIA_TYPE_VIDEO, -1, -1, NULL, 0);
+
+    if (stream < 0 || av_bsf_list_parse_str(filters, &bsf) < 0 ||
+        avcodec_parameters_copy(bsf->par_in, format->streams[stream]->codecpar) < 0 ||
+        av_bsf_init(bsf) < 0) {
+        goto done;
+    }
+
+    while (av_read_frame(format, pkt) >= 0) {
+        if (pkt->stream_index != stream) {
+            av_packet_unref(pkt);
+            continue;
+        }
+
+        if (av_bsf_send_packet(bsf, pkt) < 0) {
+            av_packet_unref(pkt);
+            goto done;
+        }
+
+        if (write_bsf_packets(bsf, pkt, fd) < 0) goto done;
+    }
+
+    if (av_bsf_send_packet(bsf, NULL) < 0 || write_bsf_packets(bsf, pkt, fd) < 0) goto done;
+    ret = 0;
+
+done:
+    av_bsf_free(&bsf);
+    avformat_close_input(&format);
+    av_packet_free(&pkt);
+    return ret;
+}
+
+// Best of ITERATIONS runs, in seconds, or -1.
+static double time_filter(const char *filename, const char *output, const FilterMode *mode, int native) {
+    double best = 0;
+
+    for (int i = 0; i < ITERATIONS; i++) {
+        int fd = open(output, O_WRONLY | O_CREAT | O_TRUNC, 0644);
+        if (fd < 0) return -1;
+
+        double t0 = now();
+        int ret = native ? filter_native(filename, mode->drop, fd) : filter_ffmpeg(filename, mode->bsf, fd);
+        double t = now() - t0;
+
+        close(fd);
+        if (ret < 0) return -1;
+        if (best == 0 || t < best) best = t;
+    }
+
+    return best;
+}
+
+// Runs both once into temporary files and compares what they wrote.
+static int same_output(const char *filename, const FilterMode *mode) {
+    char native_path[] = "/tmp/bench_filter_h264_XXXXXX";
+    char ffmpeg_path[] = "/tmp/bench_filter_h264_XXXXXX";
+    int native_fd = mkstemp(native_path);
+    int ffmpeg_fd = mkstemp(ffmpeg_path);
+    int same = 0;
+
+    if (native_fd >= 0 && ffmpeg_fd >= 0 &&
+        filter_native(filename, mode->drop, native_fd) == 0 && filter_ffmpeg(filename, mode->bsf, ffmpeg_fd) == 0) {
+        MappedFile a, b;
+
+        if (map_file(native_path, &a) == 0) {
+            if (map_file(ffmpeg_path, &b) == 0) {
+                same = a.size == b.size && (a.size == 0 || memcmp(a.data, b.data, a.size) == 0);
+                unmap_file(&b);
+            }
+            unmap_file(&a);
+        }
+    }
+
+    if (native_fd >= 0) {
+        close(native_fd);
+        unlink(native_path);
+    }
+
+    if (ffmpeg_fd >= 0) {
+        close(ffmpeg_fd);
+        unlink(ffmpeg_path);
+    }
+
+    return same;
+}
+
+int main(int argc, char *argv[]) {
+    if (argc != 2 && argc != 3) {
+        fprintf(stderr, "Usage: %s <h264_file> [output_file]\n", argv[0]);
+        return 1;
+    }
+
+    const char *filename = argv[1];
+    const char *output = argc == 3 ? argv[2] : "/dev/null";
+    struct stat st;
+
+    if (stat(filename, &st) < 0) {
+        fprintf(stderr, "Failed to open file: %s\n", filename);
+        return 1;
+    }
+
+    size_t size = st.st_size;
+
+    av_log_set_level(AV_LOG_ERROR);
+    printf("%zu bytes into %s\n", size, output);
+
+    for (size_t i = 0; i < sizeof(modes) / sizeof(modes[0]); i++) {
+        const FilterMode *mode = &modes[i];
+        double native = time_filter(filename, output, mode, 1);
+        double ffmpeg = time_filter(filename, output, mode, 0);
+
+        if (native < 0 || ffmpeg < 0) {
+            fprintf(stderr, "%s: Failed to filter %s\n", mode->name, native < 0 ? "natively" : "with ffmpeg");
+            return 1;
+        }
+
+        printf("%-10s  native %7.2f GB/s  ffmpeg %7.2f GB/s  %6.1fx  output %s\n", mode->name, size / native / 1e9,
+               size / ffmpeg / 1e9, ffmpeg / native, same_output(filename, mode) ? "identical" : "differs");
+    }
+
+    return 0;
+}
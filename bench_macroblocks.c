@@ -0,0 +1,414 @@
+#include <libavcodec/avcodec.h>
+#include <libavutil/log.h>
+#include <libavutil/opt.h>
+
+#include <stdarg.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+
+#include "annexb.h"
+#include "h264.h"
+#include "h264_macroblock.h"
+#include "mapped_file.h"
+
+#define ITERATIONS 3
+
+// Checks parse_h264 -mb against libavcodec, then times both. libavcodec's
+// h264 decoder with debug=mb_type+qp logs one row per macroblock row of
+// every output picture, each macroblock as its QP, a type character and a
+// partition character. Every macroblock the CAVLC parser decodes has to log
+// the same. The timing puts the parser against a full single-threaded
+// libavcodec decode without the debug output. Only streams without B-frames
+// are supported, as the parser handles I and P slices only and libavcodec
+// logs in output order.
+
+typedef struct {
+    uint8_t type;
+    uint8_t qp;
+    uint8_t decoded;
+} ExpectedMacroblock;
+
+typedef struct {
+    ExpectedMacroblock *mbs;
+    uint64_t count;
+    uint64_t capacity;
+    uint64_t *pictures;
+    uint64_t picture_count;
+    uint64_t picture_capacity;
+    uint32_t width;
+    int failed;
+} Expected;
+
+typedef struct {
+    AccessUnitAssembler assembler;
+    MacroblockParser parser;
+    Expected *expected;
+    uint64_t skipped_slices;
+} ParseContext;
+
+static double now(void) {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec + ts.tv_nsec / 1e9;
+}
+
+static void record_picture(ParseContext *ctx) {
+    const MacroblockParser *p = &ctx->parser;
+    Expected *e = ctx->expected;
+    uint64_t count = (uint64_t)p->width * p->height;
+
+    if (!e || e->failed) return;
+
+    if (e->count + count > e->capacity) {
+        uint64_t capacity = e->capacity ? e->capacity * 2 : 1 << 16;
+        while (capacity < e->count + count) capacity *= 2;
+
+        ExpectedMacroblock *mbs = realloc(e->mbs, capacity * sizeof(*mbs));
+        if (!mbs) {
+            e->failed = 1;
+            return;
+        }
+
+        e->mbs = mbs;
+        e->capacity = capacity;
+    }
+
+    if (e->picture_count == e->picture_capacity) {
+        uint64_t capacity = e->picture_capacity ? e->picture_capacity * 2 : 1024;
+        uint64_t *pictures = realloc(e->pictures, capacity * sizeof(*pictures));
+
+        if (!pictures) {
+            e->failed = 1;
+            return;
+        }
+
+        e->pictures = pictures;
+        e->picture_capacity = capacity;
+    }
+
+    e->pictures[e->picture_count++] = e->count;
+    e->width = p->width;
+
+    for (uint64_t i = 0; i < count; i++) {
+        ExpectedMacroblock *mb = &e->mbs[e->count++];
+
+        mb->decoded = is_macroblock_decoded(p, (uint32_t)i);
+        mb->type = mb->decoded ? p->mbs[i].type : 0;
+        mb->qp = mb->decoded ? p->mbs[i].qp : 0;
+    }
+}
+
+static void parse_nal_unit(const NALUnit *nal, void *opaque) {
+    ParseContext *ctx = opaque;
+    AccessUnit done;
+
+    if (add_nal_to_access_unit(&ctx->assembler, nal, &done)) {
+        if (done.slice_count) record_picture(ctx);
+        start_macroblock_picture(&ctx->parser);
+    }
+
+    if (is_slice_nal_unit(nal->nal_unit_type) && parse_macroblocks(&ctx->parser, nal, &ctx->assembler.ps) < 0) {
+        ctx->skipped_slices++;
+    }
+}
+
+// Runs the CAVLC parser over the whole file, keeping every macroblock in
+// expected when it is given. Returns the number of skipped slices, or -1.
+static int64_t parse_file(const MappedFile *file, Expected *expected) {
+    ParseContext ctx;
+    NALIterator it;
+    NALUnit nal;
+    AccessUnit done;
+
+    memset(&ctx, 0, sizeof(ctx));
+    init_access_unit_assembler(&ctx.assembler);
+    ctx.expected = expected;
+
+    if (init_macroblock_parser(&ctx.parser) < 0) {
+        fprintf(stderr, "Failed to allocate memory\n");
+        return -1;
+    }
+
+    init_nal_iterator(&it, file->data, file->size);
+    while (next_nal_unit(&it, &nal)) parse_nal_unit(&nal, &ctx);
+
+    if (finish_access_unit(&ctx.assembler, &done) && done.slice_count) record_picture(&ctx);
+
+    free_macroblock_parser(&ctx.parser);
+    free_access_unit_assembler(&ctx.assembler);
+
+    if (expected && expected->failed) {
+        fprintf(stderr, "Failed to allocate memory\n");
+        return -1;
+    }
+
+    return (int64_t)ctx.skipped_slices;
+}
+
+// The type and partition characters libavcodec logs for each macroblock
+// type. I_PCM macroblocks are logged with QP 0.
+static const char mb_type_chars[MB_TYPE_COUNT][2] = {
+    [MB_TYPE_I4x4] = {'i', ' '},
+    [MB_TYPE_I16x16] = {'I', ' '},
+    [MB_TYPE_I_PCM] = {'P', ' '},
+    [MB_TYPE_P16x16] = {'>', ' '},
+    [MB_TYPE_P16x8] = {'>', '-'},
+    [MB_TYPE_P8x16] = {'>', '|'},
+    [MB_TYPE_P8x8] = {'>', '+'},
+    [MB_TYPE_P8x8_REF0] = {'>', '+'},
+    [MB_TYPE_P_SKIP] = {'S', ' '},
+};
+
+// The log callback has no opaque pointer, so the comparison state is global.
+// Log messages can arrive in pieces and are joined into lines first.
+static struct {
+    const Expected *expected;
+    char line[65536];
+    size_t line_size;
+    uint64_t pictures;
+    uint64_t row;
+    int in_picture;
+    int header;
+    uint64_t compared;
+    uint64_t mismatches;
+    uint64_t undecoded;
+    uint64_t printed;
+} check;
+
+static void compare_row(const char *line) {
+    const Expected *e = check.expected;
+    const char *p = line;
+
+    // A row starts with its luma line number, then five characters per
+    // macroblock: "%2d" QP, type, partition and interlacing.
+    while (*p == ' ') p++;
+    if (*p < '0' || *p > '9') {
+        check.in_picture = 0;
+        return;
+    }
+    while (*p >= '0' && *p <= '9') p++;
+    if (*p++ != ' ') {
+        check.in_picture = 0;
+        return;
+    }
+
+    uint64_t picture = check.pictures - 1;
+
+    if (picture >= e->picture_count) {
+        check.mismatches++;
+        return;
+    }
+
+    uint64_t first = e->pictures[picture];
+    uint64_t end = picture + 1 < e->picture_count ? e->pictures[picture + 1] : e->count;
+
+    const char *line_end = p + strlen(p);
+
+    for (uint32_t x = 0; line_end - p >= 4; x++, p += 5) {
+        uint64_t i = first + check.row * e->width + x;
+        int qp = (p[0] == ' ' ? 0 : (p[0] - '0') * 10) + (p[1] - '0');
+
+        // Pictures the parser skipped entirely have no macroblocks at all.
+        if (i >= end || !e->mbs[i].decoded) {
+            check.undecoded++;
+            continue;
+        }
+
+        const ExpectedMacroblock *mb = &e->mbs[i];
+        int expected_qp = mb->type == MB_TYPE_I_PCM ? 0 : mb->qp;
+
+        check.compared++;
+
+        if (qp != expected_qp || p[2] != mb_type_chars[mb->type][0] || p[3] != mb_type_chars[mb->type][1]) {
+            if (check.printed++ < 10) {
+                fprintf(stderr, "Picture %llu, macroblock %llu: %s QP %d, libavcodec logged \"%.4s\"\n",
+                        (unsigned long long)picture, (unsigned long long)(i - first), mb_type_name(mb->type),
+                        expected_qp, p);
+            }
+            check.mismatches++;
+        }
+    }
+
+    check.row++;
+}
+
+static void check_line(const char *line) {
+    if (strncmp(line, "New frame", 9) == 0) {
+        check.pictures++;
+        check.in_picture = 1;
+        check.header = 1;
+        check.row = 0;
+    } else if (check.header) {
+        // The column ruler under "New frame".
+        check.header = 0;
+    } else if (check.in_picture) {
+        compare_row(line);
+    }
+}
+
+static void check_log_callback(void *avcl, int level, const char *fmt, va_list vl) {
+    (void)avcl;
+    (void)level;
+
+    size_t left = sizeof(check.line) - check.line_size;
+    int size = vsnprintf(check.line + check.line_size, left, fmt, vl);
+
+    if (size < 0) return;
+    check.line_size += (size_t)size < left ? (size_t)size : left - 1;
+
+    char *newline;
+
+    while ((newline = memchr(check.line, '\n', check.line_size))) {
+        *newline = 0;
+        check_line(check.line);
+
+        size_t rest = check.line_size - (newline + 1 - check.line);
+        memmove(check.line, newline + 1, rest);
+        check.line_size = rest;
+    }
+}
+
+static int receive_frames(AVCodecContext *ctx, AVFrame *frame, uint64_t *frames) {
+    int ret;
+
+    while ((ret = avcodec_receive_frame(ctx, frame)) >= 0) {
+        (*frames)++;
+        av_frame_unref(frame);
+    }
+
+    return ret == AVERROR(EAGAIN) || ret == AVERROR_EOF ? 0 : ret;
+}
+
+// Decodes the file with libavcodec on one thread, with the macroblock debug
+// output when debug is set. Returns the number of frames, or -1.
+static int64_t decode_file(const MappedFile *file, int debug) {
+    const AVCodec *codec = avcodec_find_decoder(AV_CODEC_ID_H264);
+    AVCodecParserContext *parser = av_parser_init(AV_CODEC_ID_H264);
+    AVCodecContext *ctx = codec ? avcodec_alloc_context3(codec) : NULL;
+    AVPacket *packet = av_packet_alloc();
+    AVFrame *frame = av_frame_alloc();
+    uint8_t *data = calloc(1, file->size + AV_INPUT_BUFFER_PADDING_SIZE);
+    uint64_t frames = 0;
+    int ret = -1;
+
+    if (!parser || !ctx || !packet || !frame || !data || av_opt_set_int(ctx, "threads", 1, 0) < 0 ||
+        (debug && av_opt_set(ctx, "debug", "mb_type+qp", 0) < 0) || avcodec_open2(ctx, codec, NULL) < 0) {
+        fprintf(stderr, "Failed to open libavcodec h264 decoder\n");
+        goto done;
+    }
+
+    // The parser and decoder read a little past the end of their input.
+    memcpy(data, file->data, file->size);
+
+    const uint8_t *p = data;
+    size_t left = file->size;
+    int size;
+
+    // Once the input is used up, an empty input flushes the parser, which
+    // then hands over the last picture.
+    do {
+        size = left > INT32_MAX ? INT32_MAX : (int)left;
+        int used = av_parser_parse2(parser, ctx, &packet->data, &packet->size, p, size, AV_NOPTS_VALUE,
+                                    AV_NOPTS_VALUE, 0);
+
+        if (used < 0) {
+            ret = used;
+            break;
+        }
+
+        p += used;
+        left -= used;
+        ret = 0;
+
+        if (packet->size > 0) {
+            ret = avcodec_send_packet(ctx, packet);
+            if (ret >= 0) ret = receive_frames(ctx, frame, &frames);
+            if (ret < 0) break;
+        }
+    } while (size > 0 || packet->size > 0);
+
+    if (ret >= 0) {
+        avcodec_send_packet(ctx, NULL);
+        ret = receive_frames(ctx, frame, &frames);
+    }
+
+    if (ret < 0) fprintf(stderr, "Failed to decode with libavcodec\n");
+
+done:
+    free(data);
+    av_parser_close(parser);
+    avcodec_free_context(&ctx);
+    av_frame_free(&frame);
+    av_packet_free(&packet);
+    return ret < 0 ? -1 : (int64_t)frames;
+}
+
+static int check_file(const char *filename) {
+    MappedFile file;
+    Expected expected = {0};
+
+    if (map_file(filename, &file) < 0) return -1;
+
+    int64_t skipped = parse_file(&file, &expected);
+    int ret = -1;
+
+    if (skipped < 0) goto done;
+
+    memset(&check, 0, sizeof(check));
+    check.expected = &expected;
+
+    av_log_set_callback(check_log_callback);
+    int64_t frames = decode_file(&file, 1);
+    av_log_set_callback(av_log_default_callback);
+
+    if (frames < 0) goto done;
+
+    double parse_time = 0, decode_time = 0;
+
+    for (int i = 0; i < ITERATIONS; i++) {
+        double t0 = now();
+        if (parse_file(&file, NULL) < 0) goto done;
+        double t1 = now();
+        if (decode_file(&file, 0) < 0) goto done;
+        double t2 = now();
+
+        if (i == 0 || t1 - t0 < parse_time) parse_time = t1 - t0;
+        if (i == 0 || t2 - t1 < decode_time) decode_time = t2 - t1;
+    }
+
+    // A picture count that differs means the rows were matched to the wrong
+    // pictures, whatever the macroblocks say.
+    if (check.pictures != expected.picture_count || check.pictures != (uint64_t)frames) check.mismatches++;
+
+    printf("%s: %llu pictures, %llu macroblocks compared, %llu mismatches, %llu not decoded (%lld slices skipped), "
+           "-mb %.3f s, libavcodec %.3f s\n",
+           filename, (unsigned long long)expected.picture_count, (unsigned long long)check.compared,
+           (unsigned long long)check.mismatches, (unsigned long long)check.undecoded, (long long)skipped, parse_time,
+           decode_time);
+
+    ret = check.mismatches || !check.compared ? 1 : 0;
+
+done:
+    free(expected.mbs);
+    free(expected.pictures);
+    unmap_file(&file);
+    return ret;
+}
+
+int main(int argc, char *argv[]) {
+    int failed = 0;
+
+    if (argc < 2) {
+        fprintf(stderr, "Usage: %s <h264_file>...\n", argv[0]);
+        return 1;
+    }
+
+    for (int i = 1; i < argc; i++) {
+        if (check_file(argv[i]) != 0) failed = 1;
+    }
+
+    return failed;
+}
@@ -0,0 +1,197 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdint.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+
+#include "annexb.h"
+#include "h264.h"
+#include "mapped_file.h"
+#include "parallel_nal.h"
+
+#define SYNTHETIC_SIZE (512 * 1024 * 1024)
+#define ITERATIONS 3
+
+// Random NAL payloads between 1 KB and 64 KB with emulation prevention
+// applied, see bench_start_code.c.
+static uint8_t *generate(size_t size) {
+    uint8_t *data = malloc(size);
+    uint32_t seed = 1;
+    size_t i = 0;
+
+    while (i < size) {
+        seed = seed * 1664525 + 1013904223;
+        size_t nal_size = 1024 + (seed >> 16);
+        int zeros = 0;
+
+        if (i + 4 <= size) {
+            memcpy(data + i, "\0\0\0\1", 4);
+            i += 4;
+        }
+
+        for (size_t n = 0; n < nal_size && i < size; n++) {
+            seed = seed * 1664525 + 1013904223;
+            uint8_t byte = (uint8_t)(seed >> 16);
+
+            if (zeros >= 2 && byte <= 3) {
+                data[i++] = 3;
+                zeros = 0;
+                if (i == size) break;
+            }
+
+            data[i++] = byte;
+            zeros = byte == 0 ? zeros + 1 : 0;
+        }
+    }
+
+    return data;
+}
+
+// The NAL units NALIterator finds on the whole buffer, which every thread
+// count has to reproduce exactly.
+static int find_nal_units_sequential(const uint8_t *data, size_t size, NALList *out) {
+    NALIterator it;
+    NALUnit nal;
+
+    memset(out, 0, sizeof(*out));
+    init_nal_iterator(&it, data, size);
+
+    while (next_nal_unit(&it, &nal)) {
+        if (append_nal_list(out, &nal) < 0) return -1;
+    }
+
+    return 0;
+}
+
+static int same_nal_units(const NALList *a, const NALList *b) {
+    if (a->count != b->count) return 0;
+
+    for (size_t i = 0; i < a->count; i++) {
+        if (a->nals[i].offset != b->nals[i].offset || a->nals[i].size != b->nals[i].size ||
+            a->nals[i].start_code_size != b->nals[i].start_code_size) {
+            return 0;
+        }
+    }
+
+    return 1;
+}
+
+static void collect_nal_unit(const NALUnit *nal, void *opaque) {
+    NALList *list = opaque;
+
+    // A failed append leaves the list short, which same_nal_units reports.
+    append_nal_list(list, nal);
+}
+
+typedef struct {
+    AccessUnitAssembler assembler;
+    uint64_t access_units;
+} AssembleContext;
+
+static void assemble_nal_unit(const NALUnit *nal, void *opaque) {
+    AssembleContext *ctx = opaque;
+    AccessUnit done;
+
+    ctx->access_units += add_nal_to_access_unit(&ctx->assembler, nal, &done);
+}
+
+// The whole pipeline parse_h264 runs: start code scan, slice headers and
+// access unit assembly. Returns the number of access units, or -1.
+static int64_t assemble(const uint8_t *data, size_t size, int threads) {
+    AssembleContext ctx = {0};
+    AccessUnit done;
+
+    init_access_unit_assembler(&ctx.assembler);
+    int ret = for_each_nal_unit(data, size, threads, assemble_nal_unit, &ctx);
+    ctx.access_units += finish_access_unit(&ctx.assembler, &done);
+    free_access_unit_assembler(&ctx.assembler);
+
+    return ret < 0 ? -1 : (int64_t)ctx.access_units;
+}
+
+static double now(void) {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec + ts.tv_nsec / 1e9;
+}
+
+// Checks every thread count against the sequential NALIterator, then times
+// the whole parse_h264 pipeline at each: the scan on the workers, slice
+// headers and access units on the calling thread.
+int main(int argc, char *argv[]) {
+    MappedFile file = {0};
+    const uint8_t *data;
+    size_t size;
+
+    if (argc > 1) {
+        if (map_file(argv[1], &file) < 0) return 1;
+        data = file.data;
+        size = file.size;
+    } else {
+        size = SYNTHETIC_SIZE;
+        data = generate(size);
+    }
+
+    long cores = sysconf(_SC_NPROCESSORS_ONLN);
+    if (cores < 1) cores = 1;
+    if (cores > MAX_NAL_THREADS) cores = MAX_NAL_THREADS;
+
+    NALList expected;
+
+    if (find_nal_units_sequential(data, size, &expected) < 0) {
+        fprintf(stderr, "Failed to allocate memory\n");
+        return 1;
+    }
+
+    int64_t access_units = assemble(data, size, 1);
+    printf("%zu bytes, %zu NAL units, %lld access units, %ld cores\n", size, expected.count,
+           (long long)access_units, cores);
+
+    double single = 0;
+    int threads = 1;
+
+    for (;;) {
+        NALList list = {0};
+
+        if (for_each_nal_unit(data, size, threads, collect_nal_unit, &list) < 0 ||
+            !same_nal_units(&list, &expected)) {
+            fprintf(stderr, "-j %d: NAL units differ from the sequential scan\n", threads);
+            return 1;
+        }
+
+        free_nal_list(&list);
+
+        double best = 0;
+
+        for (int i = 0; i < ITERATIONS; i++) {
+            double t0 = now();
+            int64_t count = assemble(data, size, threads);
+            double t = now() - t0;
+
+            if (count != access_units) {
+                fprintf(stderr, "-j %d: %lld access units instead of %lld\n", threads, (long long)count,
+                        (long long)access_units);
+                return 1;
+            }
+
+            if (best == 0 || t < best) best = t;
+        }
+
+        if (threads == 1) single = best;
+        printf("-j %-3d %7.2f GB/s  %5.2fx\n", threads, size / best / 1e9, single / best);
+
+        if (threads == cores) break;
+        threads = threads * 2 < cores ? threads * 2 : (int)cores;
+    }
+
+    free_nal_list(&expected);
+
+    if (file.data) {
+        unmap_file(&file);
+    } else {
+        free((void *)data);
+    }
+
+    return 0;
+}
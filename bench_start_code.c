@@ -0,0 +1,147 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdint.h>
+#include <string.h>
+#include <time.h>
+
+#include "annexb.h"
+
+#define SYNTHETIC_SIZE (256 * 1024 * 1024)
+#define ITERATIONS 5
+
+// The per-byte scan parse_h264.c used before annexb.h, kept as the baseline.
+static const uint8_t *scan_start_code_naive(const uint8_t *p, const uint8_t *end, uint8_t last) {
+    for (; end - p >= 3; p++) {
+        if (p[0] == 0 && p[1] == 0 && p[2] == last) return p;
+    }
+
+    return NULL;
+}
+
+typedef struct {
+    const char *name;
+    ZeroPairScanner scan;
+} Scanner;
+
+// Random NAL payloads between 1 KB and 64 KB. Entropy coded slice data is
+// close to uniformly random, emulation prevention is applied so that only the
+// real start codes match.
+static uint8_t *generate(size_t size) {
+    uint8_t *data = malloc(size);
+    uint32_t seed = 1;
+    size_t i = 0;
+
+    while (i < size) {
+        seed = seed * 1664525 + 1013904223;
+        size_t nal_size = 1024 + (seed >> 16);
+        int zeros = 0;
+
+        if (i + 4 <= size) {
+            memcpy(data + i, "\0\0\0\1", 4);
+            i += 4;
+        }
+
+        for (size_t n = 0; n < nal_size && i < size; n++) {
+            seed = seed * 1664525 + 1013904223;
+            uint8_t byte = (uint8_t)(seed >> 16);
+
+            if (zeros >= 2 && byte <= 3) {
+                data[i++] = 3;
+                zeros = 0;
+                if (i == size) break;
+            }
+
+            data[i++] = byte;
+            zeros = byte == 0 ? zeros + 1 : 0;
+        }
+    }
+
+    return data;
+}
+
+static uint8_t *load(const char *filename, size_t *size) {
+    FILE *file = fopen(filename, "rb");
+
+    if (!file) {
+        fprintf(stderr, "Failed to open file: %s\n", filename);
+        return NULL;
+    }
+
+    fseek(file, 0, SEEK_END);
+    *size = ftell(file);
+    fseek(file, 0, SEEK_SET);
+
+    uint8_t *data = malloc(*size);
+
+    if (!data || fread(data, 1, *size, file) != *size) {
+        fprintf(stderr, "Failed to read file\n");
+        free(data);
+        fclose(file);
+        return NULL;
+    }
+
+    fclose(file);
+    return data;
+}
+
+static double now(void) {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec + ts.tv_nsec / 1e9;
+}
+
+static uint64_t count_start_codes(ZeroPairScanner scan, const uint8_t *data, size_t size) {
+    const uint8_t *p = data;
+    const uint8_t *end = data + size;
+    uint64_t sum = 0;
+
+    while ((p = scan(p, end, 1)) != NULL) {
+        sum += (uint64_t)(p - data);
+        p += 3;
+    }
+
+    return sum;
+}
+
+int main(int argc, char *argv[]) {
+    size_t size = SYNTHETIC_SIZE;
+    uint8_t *data = argc > 1 ? load(argv[1], &size) : generate(size);
+    if (!data) return 1;
+
+    Scanner scanners[] = {
+        {"naive", scan_start_code_naive},
+        {"scalar", scan_zero_pair_scalar},
+#if defined(ANNEXB_X86)
+        {"sse2", scan_zero_pair_sse2},
+        {"avx2", __builtin_cpu_supports("avx2") ? scan_zero_pair_avx2 : NULL},
+#elif defined(ANNEXB_NEON)
+        {"neon", scan_zero_pair_neon},
+#endif
+    };
+
+    uint64_t expected = 0;
+
+    for (size_t s = 0; s < sizeof(scanners) / sizeof(scanners[0]); s++) {
+        if (!scanners[s].scan) {
+            printf("%-8s unsupported on this CPU\n", scanners[s].name);
+            continue;
+        }
+
+        uint64_t sum = 0;
+        double t0 = now();
+        for (int i = 0; i < ITERATIONS; i++) sum = count_start_codes(scanners[s].scan, data, size);
+        double t1 = now();
+
+        if (s == 0) {
+            expected = sum;
+        } else if (sum != expected) {
+            fprintf(stderr, "%s: start code positions differ from the naive scan\n", scanners[s].name);
+            return 1;
+        }
+
+        printf("%-8s %6.2f GB/s\n", scanners[s].name, (double)size * ITERATIONS / (t1 - t0) / 1e9);
+    }
+
+    free(data);
+    return 0;
+}
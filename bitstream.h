@@ -0,0 +1,180 @@
+#ifndef BITSTREAM_H
+#define BITSTREAM_H
+
+#include <stddef.h>
+#include <stdint.h>
+#include <string.h>
+
+// MSB-first bit reader over an RBSP buffer. Bits are served from a 64-bit
+// cache that is refilled a word at a time, so read_bits is a shift and a mask
+// and read_ue finds the Exp-Golomb prefix with a single count-leading-zeros.
+// Reads past the end of the buffer return zero bits, like the old reader.
+//
+// A stream opened with init_nal_bit_stream reads the payload of a NAL unit
+// in place and drops emulation prevention bytes while refilling, so only the
+// bytes that are actually read get unescaped.
+typedef struct {
+    const uint8_t *start;
+    const uint8_t *data;
+    const uint8_t *end;
+    uint64_t cache;
+    int bits;
+    size_t pad;
+    int escaped;
+    int zeros;
+    size_t skipped;
+} BitStream;
+
+static inline uint64_t load_u64_be(const uint8_t *p) {
+    uint64_t v;
+    memcpy(&v, p, sizeof(v));
+#if defined(__BYTE_ORDER__) && __BYTE_ORDER__ == __ORDER_LITTLE_ENDIAN__
+    v = __builtin_bswap64(v);
+#endif
+    return v;
+}
+
+static inline void init_bit_stream(BitStream *bs, const uint8_t *data, size_t size) {
+    bs->start = data;
+    bs->data = data;
+    bs->end = data + size;
+    bs->cache = 0;
+    bs->bits = 0;
+    bs->pad = 0;
+    bs->escaped = 0;
+    bs->zeros = 0;
+    bs->skipped = 0;
+}
+
+static inline void init_nal_bit_stream(BitStream *bs, const uint8_t *data, size_t size) {
+    init_bit_stream(bs, data, size);
+    bs->escaped = 1;
+}
+
+static inline int has_zero_byte(uint64_t v) {
+    return ((v - 0x0101010101010101ULL) & ~v & 0x8080808080808080ULL) != 0;
+}
+
+static inline void refill_bit_stream(BitStream *bs) {
+    if (bs->end - bs->data >= 8) {
+        uint64_t word = load_u64_be(bs->data);
+
+        // Without a zero byte in sight there is no 00 00 03 to drop either.
+        if (!bs->escaped || (bs->zeros == 0 && !has_zero_byte(word))) {
+            bs->cache |= word >> bs->bits;
+            bs->data += (63 - bs->bits) >> 3;
+            bs->bits |= 56;
+            return;
+        }
+    }
+
+    while (bs->bits <= 56) {
+        if (bs->data < bs->end) {
+            uint8_t byte = *bs->data++;
+
+            if (bs->escaped) {
+                if (bs->zeros >= 2 && byte == 3) {
+                    bs->zeros = 0;
+                    bs->skipped++;
+                    continue;
+                }
+                bs->zeros = byte == 0 ? bs->zeros + 1 : 0;
+            }
+
+            bs->cache |= (uint64_t)byte << (56 - bs->bits);
+        } else {
+            bs->pad++;
+        }
+        bs->bits += 8;
+    }
+}
+
+// Number of RBSP bits consumed so far.
+static inline size_t bit_stream_tell(const BitStream *bs) {
+    return ((size_t)(bs->data - bs->start) - bs->skipped + bs->pad) * 8 - bs->bits;
+}
+
+static inline uint32_t peek_bits(BitStream *bs, uint8_t n) {
+    if (n == 0) return 0;
+    if (bs->bits < n) refill_bit_stream(bs);
+    return (uint32_t)(bs->cache >> (64 - n));
+}
+
+static inline void skip_bits(BitStream *bs, uint32_t n) {
+    while (n > 32) {
+        if (bs->bits < 32) refill_bit_stream(bs);
+        bs->cache <<= 32;
+        bs->bits -= 32;
+        n -= 32;
+    }
+    if (n == 0) return;
+    if (bs->bits < (int)n) refill_bit_stream(bs);
+    bs->cache <<= n;
+    bs->bits -= n;
+}
+
+static inline uint8_t read_bit(BitStream *bs) {
+    if (bs->bits < 1) refill_bit_stream(bs);
+    uint8_t bit = (uint8_t)(bs->cache >> 63);
+    bs->cache <<= 1;
+    bs->bits--;
+    return bit;
+}
+
+// n must be <= 32.
+static inline uint32_t read_bits(BitStream *bs, uint8_t n) {
+    if (n == 0) return 0;
+    if (bs->bits < n) refill_bit_stream(bs);
+    uint32_t val = (uint32_t)(bs->cache >> (64 - n));
+    bs->cache <<= n;
+    bs->bits -= n;
+    return val;
+}
+
+// Long code words (16 or more leading zeros) only show up in huge values or
+// corrupt input. A prefix longer than 31 zeros is invalid and is reported as
+// UINT32_MAX, so a run of zero bytes at the end of a buffer cannot loop
+// forever.
+static uint32_t read_ue_slow(BitStream *bs) {
+    int leading_zero_bits = 0;
+
+    while (read_bit(bs) == 0) {
+        if (++leading_zero_bits > 31) return UINT32_MAX;
+    }
+
+    if (leading_zero_bits == 0) {
+        return 0;
+    }
+
+    uint32_t suffix = read_bits(bs, leading_zero_bits);
+    return (uint32_t)((1ULL << leading_zero_bits) - 1 + suffix);
+}
+
+static inline uint32_t read_ue(BitStream *bs) {
+    if (bs->bits < 32) refill_bit_stream(bs);
+
+    // After a refill at least 32 bits are cached, which covers every code
+    // word with up to 15 leading zeros: all values below 65535.
+    if (bs->cache >= (1ULL << 48)) {
+        int leading_zero_bits = __builtin_clzll(bs->cache);
+        int len = 2 * leading_zero_bits + 1;
+        uint32_t val = (uint32_t)(bs->cache >> (64 - len)) - 1;
+        bs->cache <<= len;
+        bs->bits -= len;
+        return val;
+    }
+
+    return read_ue_slow(bs);
+}
+
+static inline int32_t read_se(BitStream *bs) {
+    uint32_t val = read_ue(bs);
+
+    if (val & 0x01) {
+        return (int32_t)((val >> 1) + 1);
+    } else {
+        return -(int32_t)(val >> 1);
+    }
+}
+
+#endif // BITSTREAM_H
@@ -0,0 +1,546 @@
+#include <dirent.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <pthread.h>
+#include <stdatomic.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdint.h>
+#include <string.h>
+#include <sys/stat.h>
+#include <time.h>
+#include <unistd.h>
+
+#include "annexb.h"
+#include "h264.h"
+#include "h264_index.h"
+#include "mov.h"
+#include "mov_fragment.h"
+#include "mov_sample_table.h"
+#include "work_pool.h"
+
+// Catalogues every MP4/MOV and raw H.264 file under the given paths, one
+// CSV record per file, walking directories and parsing files on a work
+// stealing pool.
+//
+// MP4 and MOV files are read through their box headers with pread: the
+// sample count, keyframe count and duration come from the entry counts of
+// stsz and stss and from mdhd, without loading the tables, and for
+// fragmented files from the trun boxes. Raw H.264 has no container to ask,
+// so frames and keyframes are the access unit and IDR counts of its current
+// .idx sidecar (parse_h264 -index). Without one, only the first
+// H264_HEADER_READ bytes are read for the SPS and the counts and duration
+// are left empty, unless -scan asks to parse the whole stream for them. Other
+// files are skipped by their first bytes.
+
+#define OUTPUT_BUFFER_SIZE (64 * 1024)
+#define MAX_SPS_READ 1024
+#define H264_HEADER_READ (64 * 1024)
+
+typedef struct {
+    const char *container;
+    char codec[8];
+    uint32_t width;
+    uint32_t height;
+    double duration;
+    uint64_t frames;
+    uint64_t keyframes;
+    uint64_t size;
+    int uncounted; // frames, keyframes and duration are unknown
+} CatalogRecord;
+
+typedef struct {
+    MovFile *file;
+    char output[OUTPUT_BUFFER_SIZE];
+    size_t output_size;
+
+    uint64_t files;
+    uint64_t media;
+    uint64_t failed;
+    uint64_t directories;
+    uint64_t bytes_read;
+} CatalogWorker;
+
+typedef struct {
+    CatalogWorker workers[MAX_WORK_THREADS];
+    int scan;
+} Catalog;
+
+static void flush_catalog_output(CatalogWorker *w) {
+    fwrite(w->output, 1, w->output_size, stdout);
+    w->output_size = 0;
+}
+
+// CSV field, quoted when the path needs it.
+static size_t format_csv_path(char *out, size_t size, const char *path) {
+    size_t n = 0;
+
+    if (!strpbrk(path, ",\"\n")) return snprintf(out, size, "%s", path);
+
+    out[n++] = '"';
+
+    for (const char *p = path; *p && n + 3 < size; p++) {
+        if (*p == '"') out[n++] = '"';
+        out[n++] = *p;
+    }
+
+    out[n++] = '"';
+    out[n] = '\0';
+    return n;
+}
+
+static void add_catalog_record(CatalogWorker *w, const char *path, const CatalogRecord *r) {
+    char line[8192];
+    size_t n = format_csv_path(line, sizeof(line) - 256, path);
+
+    n += snprintf(line + n, sizeof(line) - n, ",%s,%s,%u,%u,", r->container, r->codec, r->width, r->height);
+
+    if (r->uncounted) {
+        n += snprintf(line + n, sizeof(line) - n, ",,,%llu\n", (unsigned long long)r->size);
+    } else {
+        n += snprintf(line + n, sizeof(line) - n, "%.3f,%llu,%llu,%llu\n", r->duration, (unsigned long long)r->frames,
+                      (unsigned long long)r->keyframes, (unsigned long long)r->size);
+    }
+
+    if (w->output_size + n > sizeof(w->output)) flush_catalog_output(w);
+    memcpy(w->output + w->output_size, line, n);
+    w->output_size += n;
+}
+
+static int is_mov_header(const uint8_t *p) {
+    static const uint32_t types[] = {
+        MOV_FOURCC('f', 't', 'y', 'p'), MOV_FOURCC('m', 'o', 'o', 'v'), MOV_FOURCC('m', 'd', 'a', 't'),
+        MOV_FOURCC('f', 'r', 'e', 'e'), MOV_FOURCC('s', 'k', 'i', 'p'), MOV_FOURCC('w', 'i', 'd', 'e'),
+        MOV_FOURCC('s', 't', 'y', 'p'), MOV_FOURCC('m', 'o', 'o', 'f'),
+    };
+    uint32_t type = read_u32_be(p + 4);
+
+    for (size_t i = 0; i < sizeof(types) / sizeof(types[0]); i++) {
+        if (type == types[i]) return 1;
+    }
+
+    return 0;
+}
+
+static int is_annexb_header(const uint8_t *p) {
+    return p[0] == 0 && p[1] == 0 && (p[2] == 1 || (p[2] == 0 && p[3] == 1));
+}
+
+typedef struct {
+    uint32_t track_id;
+    uint64_t frames;
+    uint64_t keyframes;
+    uint64_t duration;
+} FragmentCount;
+
+static int count_fragment_sample(const MovFragmentSample *sample, void *opaque) {
+    FragmentCount *count = opaque;
+
+    if (sample->track_id == count->track_id) {
+        count->frames++;
+        count->keyframes += sample->keyframe;
+        count->duration += sample->duration;
+    }
+
+    return 0;
+}
+
+// Feeds moov and every moof, which hold no sample data, to a fragment
+// parser. The mdat boxes in between are never read.
+static int count_mov_fragments(MovFile *file, const MovBoxTree *tree, FragmentCount *count) {
+    MovFragmentParser parser;
+    uint8_t *box = NULL;
+    int ret = 0;
+
+    init_mov_fragment_parser(&parser, count_fragment_sample, count);
+
+    for (int i = 0; i < tree->count && ret == 0; i++) {
+        const MovBox *b = &tree->boxes[i];
+
+        if (b->depth != 0 || (b->type != MOV_FOURCC('m', 'o', 'o', 'v') && b->type != MOV_FOURCC('m', 'o', 'o', 'f'))) {
+            continue;
+        }
+
+        if (b->truncated || b->size > MOV_FRAGMENT_MAX_BOX_SIZE) {
+            ret = -1;
+            break;
+        }
+
+        uint8_t *grown = realloc(box, b->size);
+
+        if (!grown) {
+            ret = -1;
+            break;
+        }
+
+        box = grown;
+        ret = read_mov_file(file, b->offset, box, b->size);
+        if (ret == 0) ret = feed_mov_fragment_parser(&parser, box, b->size);
+    }
+
+    free(box);
+    free_mov_fragment_parser(&parser);
+    return ret;
+}
+
+// The video track, else the sound track, else the first track.
+static int find_catalog_track(const MovBoxTree *tree, MovFile *file) {
+    int trak = find_mov_track(tree, file, MOV_FOURCC('v', 'i', 'd', 'e'));
+    if (trak < 0) trak = find_mov_track(tree, file, MOV_FOURCC('s', 'o', 'u', 'n'));
+
+    int moov = find_mov_box(tree, -1, MOV_FOURCC('m', 'o', 'o', 'v'), -1);
+    if (trak < 0 && moov >= 0) trak = find_mov_box(tree, moov, MOV_FOURCC('t', 'r', 'a', 'k'), -1);
+    return trak;
+}
+
+static int catalog_mov(MovFile *file, CatalogRecord *r) {
+    static const uint32_t minf_stbl[] = {MOV_FOURCC('m', 'i', 'n', 'f'), MOV_FOURCC('s', 't', 'b', 'l')};
+    MovBoxTree tree;
+    MovSampleTable table;
+    uint8_t p[12];
+    int ret = -1;
+
+    r->container = "mp4";
+    strcpy(r->codec, "none");
+
+    if (parse_mov_box_tree(file, &tree) < 0) goto done;
+
+    int trak = find_catalog_track(&tree, file);
+
+    if (trak < 0) {
+        ret = 0;
+        goto done;
+    }
+
+    int mdia = find_mov_box(&tree, trak, MOV_FOURCC('m', 'd', 'i', 'a'), -1);
+    int stbl = mdia >= 0 ? find_mov_box_path(&tree, mdia, minf_stbl, 2) : -1;
+
+    memset(&table, 0, sizeof(table));
+    if (stbl < 0 || load_mov_track_header(file, &tree, trak, mdia, stbl, &table) < 0) goto done;
+
+    if (table.sample_entry >= 0) {
+        mov_fourcc_string(table.codec, r->codec);
+
+        if (table.handler == MOV_FOURCC('v', 'i', 'd', 'e') &&
+            read_mov_box(file, &tree.boxes[table.sample_entry], 24, p, 4) == 4) {
+            r->width = read_u16_be(p);
+            r->height = read_u16_be(p + 2);
+        }
+    }
+
+    int stsz = find_mov_box(&tree, stbl, MOV_FOURCC('s', 't', 's', 'z'), -1);
+    int stss = find_mov_box(&tree, stbl, MOV_FOURCC('s', 't', 's', 's'), -1);
+
+    if (stsz < 0) stsz = find_mov_box(&tree, stbl, MOV_FOURCC('s', 't', 'z', '2'), -1);
+    if (stsz >= 0 && read_mov_box(file, &tree.boxes[stsz], 0, p, 12) == 12) r->frames = read_u32_be(p + 8);
+
+    // Without stss every sample is a sync sample.
+    r->keyframes = r->frames;
+    if (stss >= 0 && read_mov_box(file, &tree.boxes[stss], 0, p, 8) == 8) r->keyframes = read_u32_be(p + 4);
+
+    uint64_t duration = table.duration;
+
+    if (r->frames == 0 && find_mov_box(&tree, -1, MOV_FOURCC('m', 'o', 'o', 'f'), -1) >= 0) {
+        FragmentCount count = {table.track_id, 0, 0, 0};
+        if (count_mov_fragments(file, &tree, &count) < 0) goto done;
+
+        r->frames = count.frames;
+        r->keyframes = count.keyframes;
+        duration = count.duration;
+    }
+
+    if (table.timescale) r->duration = (double)duration / table.timescale;
+    ret = 0;
+
+done:
+    free_mov_box_tree(&tree);
+    return ret;
+}
+
+// Picture size and, with the frame count known, duration from the first SPS
+// in size bytes at offset. Returns 0 when there is none.
+static int read_h264_sps(int fd, uint64_t offset, size_t size, CatalogRecord *r, uint64_t *bytes_read) {
+    uint8_t *data = malloc(size);
+    NALIterator it;
+    NALUnit nal;
+    SPS *sps = NULL;
+
+    if (!data) return 0;
+
+    ssize_t n = pread(fd, data, size, (off_t)offset);
+
+    if (n > 0) {
+        *bytes_read += n;
+        init_nal_iterator(&it, data, n);
+
+        while (!sps && next_nal_unit(&it, &nal)) {
+            if (nal.nal_unit_type == 7) sps = parse_sps(&nal);
+        }
+    }
+
+    free(data);
+    if (!sps) return 0;
+
+    double frame_rate = sps_frame_rate(sps);
+
+    sps_picture_size(sps, &r->width, &r->height);
+    if (frame_rate > 0 && !r->uncounted) r->duration = r->frames / frame_rate;
+
+    free_sps(sps);
+    return 1;
+}
+
+// Frame counts from the sidecar index, and the first SPS read from the file.
+static int catalog_h264_index(const char *path, int fd, const struct stat *st, CatalogRecord *r, uint64_t *bytes_read) {
+    char index_path[4096];
+    H264Index index;
+
+    h264_index_path(path, index_path, sizeof(index_path));
+    if (load_current_h264_index(index_path, st, &index) < 0) return -1;
+
+    r->frames = index.header->access_unit_count;
+    r->keyframes = index.header->keyframe_count;
+    *bytes_read += index.file.size;
+
+    for (uint64_t i = 0; i < index.header->parameter_set_count; i++) {
+        const H264IndexParameterSet *ps = &index.parameter_sets[i];
+
+        if (ps->nal_unit_type != 7) continue;
+
+        read_h264_sps(fd, ps->offset, ps->size < MAX_SPS_READ ? ps->size : MAX_SPS_READ, r, bytes_read);
+        break;
+    }
+
+    unload_h264_index(&index);
+    return 0;
+}
+
+// Frames are access units and keyframes IDR access units, whether they come
+// from the sidecar index or, with scan, from indexing the stream here
+// without writing the index out. Scanning reads the whole file.
+static int catalog_h264(const char *path, int fd, const struct stat *st, int scan, CatalogRecord *r,
+                        uint64_t *bytes_read) {
+    r->container = "h264";
+    strcpy(r->codec, "avc");
+
+    if (catalog_h264_index(path, fd, st, r, bytes_read) == 0) return 0;
+
+    if (scan) {
+        H264IndexBuilder builder;
+        struct stat source;
+
+        // The pool already runs one file per thread.
+        int ret = build_h264_index(path, 1, &builder, &source);
+
+        r->frames = builder.access_unit_count;
+        r->keyframes = builder.keyframe_count;
+        free_h264_index_builder(&builder);
+
+        if (ret < 0) return -1;
+        *bytes_read += source.st_size;
+    } else {
+        r->uncounted = 1;
+    }
+
+    read_h264_sps(fd, 0, H264_HEADER_READ, r, bytes_read);
+    return 0;
+}
+
+static void catalog_file(WorkPool *pool, int worker, void *arg) {
+    Catalog *catalog = pool->opaque;
+    CatalogWorker *w = &catalog->workers[worker];
+    char *path = arg;
+    MovFile *file = w->file;
+    CatalogRecord r;
+    uint8_t header[8];
+    int ret = 0;
+
+    memset(&r, 0, sizeof(r));
+    w->files++;
+
+    if (open_mov_file(path, file) < 0) {
+        w->failed++;
+        free(path);
+        return;
+    }
+
+    // Box headers are scattered; read ahead would fetch mdat instead.
+    posix_fadvise(file->fd, 0, 0, POSIX_FADV_RANDOM);
+    r.size = file->size;
+
+    if (file->size >= sizeof(header) && read_mov_file(file, 0, header, sizeof(header)) == 0) {
+        if (is_mov_header(header)) {
+            ret = catalog_mov(file, &r);
+            w->media++;
+        } else if (is_annexb_header(header)) {
+            struct stat st;
+
+            ret = fstat(file->fd, &st) < 0 ? -1 : catalog_h264(path, file->fd, &st, catalog->scan, &r, &w->bytes_read);
+            w->media++;
+        }
+    }
+
+    w->bytes_read += file->bytes_read;
+    close_mov_file(file);
+
+    if (ret < 0) {
+        fprintf(stderr, "Failed to catalogue file: %s\n", path);
+        w->failed++;
+    } else if (r.container) {
+        add_catalog_record(w, path, &r);
+    }
+
+    free(path);
+}
+
+static char *join_path(const char *dir, const char *name) {
+    size_t dir_size = strlen(dir), name_size = strlen(name);
+    char *path = malloc(dir_size + name_size + 2);
+    if (!path) return NULL;
+
+    memcpy(path, dir, dir_size);
+    path[dir_size] = '/';
+    memcpy(path + dir_size + 1, name, name_size + 1);
+    if (dir_size > 0 && dir[dir_size - 1] == '/') memmove(path + dir_size, path + dir_size + 1, name_size + 1);
+    return path;
+}
+
+// Queues a task per regular file and subdirectory. Symbolic links are not
+// followed.
+static void catalog_directory(WorkPool *pool, int worker, void *arg) {
+    CatalogWorker *w = &((Catalog *)pool->opaque)->workers[worker];
+    char *path = arg;
+    DIR *dir = opendir(path);
+    struct dirent *entry;
+
+    w->directories++;
+
+    if (!dir) {
+        fprintf(stderr, "Failed to open directory: %s\n", path);
+        w->failed++;
+        free(path);
+        return;
+    }
+
+    while ((entry = readdir(dir)) != NULL) {
+        int type = entry->d_type;
+        struct stat st;
+
+        if (strcmp(entry->d_name, ".") == 0 || strcmp(entry->d_name, "..") == 0) continue;
+
+        if (type == DT_UNKNOWN && fstatat(dirfd(dir), entry->d_name, &st, AT_SYMLINK_NOFOLLOW) == 0) {
+            type = S_ISDIR(st.st_mode) ? DT_DIR : S_ISREG(st.st_mode) ? DT_REG : DT_UNKNOWN;
+        }
+
+        if (type != DT_DIR && type != DT_REG) continue;
+
+        char *child = join_path(path, entry->d_name);
+
+        if (!child) {
+            fprintf(stderr, "Failed to allocate memory\n");
+            w->failed++;
+            continue;
+        }
+
+        push_work(pool, worker, type == DT_DIR ? catalog_directory : catalog_file, child);
+    }
+
+    closedir(dir);
+    free(path);
+}
+
+static double now(void) {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec + ts.tv_nsec / 1e9;
+}
+
+int catalog_paths(char **paths, int count, int threads, int scan) {
+    static char output[1024 * 1024];
+    static WorkPool pool;
+    static Catalog catalog;
+    CatalogWorker total = {0};
+    int ret = 0;
+
+    init_work_pool(&pool, threads, &catalog);
+    catalog.scan = scan;
+
+    for (int i = 0; i < pool.threads; i++) {
+        if (!(catalog.workers[i].file = malloc(sizeof(MovFile)))) {
+            fprintf(stderr, "Failed to allocate memory\n");
+            ret = -1;
+            goto done;
+        }
+    }
+
+    setvbuf(stdout, output, _IOFBF, sizeof(output));
+    printf("path,container,codec,width,height,duration,frames,keyframes,bytes\n");
+
+    for (int i = 0; i < count; i++) {
+        struct stat st;
+        char *path = strdup(paths[i]);
+
+        if (!path || stat(paths[i], &st) < 0) {
+            fprintf(stderr, "Failed to open file: %s\n", paths[i]);
+            free(path);
+            ret = -1;
+            continue;
+        }
+
+        push_work(&pool, 0, S_ISDIR(st.st_mode) ? catalog_directory : catalog_file, path);
+    }
+
+    double start = now();
+    run_work_pool(&pool);
+    double elapsed = now() - start;
+
+    for (int i = 0; i < pool.threads; i++) {
+        CatalogWorker *w = &catalog.workers[i];
+
+        flush_catalog_output(w);
+        total.files += w->files;
+        total.media += w->media;
+        total.failed += w->failed;
+        total.directories += w->directories;
+        total.bytes_read += w->bytes_read;
+    }
+
+    fflush(stdout);
+    fprintf(stderr, "Files: %llu, Media: %llu, Failed: %llu, Directories: %llu, Read: %llu bytes, Steals: %llu\n",
+            (unsigned long long)total.files, (unsigned long long)total.media, (unsigned long long)total.failed,
+            (unsigned long long)total.directories, (unsigned long long)total.bytes_read,
+            (unsigned long long)atomic_load(&pool.steals));
+    fprintf(stderr, "Time: %.3f s, %.0f files/s on %d threads\n", elapsed, elapsed > 0 ? total.files / elapsed : 0,
+            pool.threads);
+
+done:
+    for (int i = 0; i < pool.threads; i++) free(catalog.workers[i].file);
+    free_work_pool(&pool);
+    return ret;
+}
+
+int main(int argc, char *argv[]) {
+    long cpus = sysconf(_SC_NPROCESSORS_ONLN);
+    int threads = cpus > 0 ? (int)cpus : 1;
+    int scan = 0;
+    int i = 1;
+
+    for (; i < argc; i++) {
+        if (strcmp(argv[i], "-j") == 0 && i + 1 < argc) {
+            threads = atoi(argv[++i]);
+        } else if (strcmp(argv[i], "-scan") == 0) {
+            scan = 1;
+        } else {
+            break;
+        }
+    }
+
+    if (i >= argc || threads < 1) {
+        fprintf(stderr, "Usage: %s [-j <threads>] [-scan] <directory | file>...\n", argv[0]);
+        fprintf(stderr, "Raw H.264 files without a current .idx sidecar get no frame counts; -scan parses\n"
+                        "them in full to count frames, reading every byte of each such file.\n");
+        return 1;
+    }
+
+    return catalog_paths(argv + i, argc - i, threads, scan) < 0 ? 1 : 0;
+}
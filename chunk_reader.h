@@ -0,0 +1,151 @@
+#ifndef CHUNK_READER_H
+#define CHUNK_READER_H
+
+#include <errno.h>
+#include <fcntl.h>
+#include <pthread.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+
+// Reads a file or pipe ahead of its consumer: a thread fills a ring of
+// CHUNK_READER_COUNT fixed-size chunks while the consumer works through the
+// chunks already read, so I/O overlaps with parsing or decoding and only
+// stalls it when the consumer is faster than the input. Memory is the ring
+// whatever the length of the stream.
+
+#define CHUNK_READER_SIZE (1024 * 1024)
+#define CHUNK_READER_COUNT 4
+
+typedef struct {
+    int fd;
+    uint8_t *chunks;
+    size_t sizes[CHUNK_READER_COUNT];
+
+    // Chunks head to head + filled - 1 are read; head is the consumer's.
+    int head;
+    int filled;
+    int eof;
+    int error;
+    int stop;
+
+    pthread_mutex_t lock;
+    pthread_cond_t cond;
+    pthread_t thread;
+} ChunkReader;
+
+// Fills chunk after chunk, each with up to CHUNK_READER_SIZE bytes, until
+// the end of the input.
+static void *run_chunk_reader(void *arg) {
+    ChunkReader *r = arg;
+
+    pthread_mutex_lock(&r->lock);
+
+    while (!r->stop) {
+        if (r->filled == CHUNK_READER_COUNT) {
+            pthread_cond_wait(&r->cond, &r->lock);
+            continue;
+        }
+
+        int slot = (r->head + r->filled) % CHUNK_READER_COUNT;
+        ssize_t n;
+
+        pthread_mutex_unlock(&r->lock);
+
+        // One read per chunk: a file fills it, a pipe returns what it has,
+        // which keeps a live stream from waiting for a whole chunk.
+        do {
+            n = read(r->fd, r->chunks + (size_t)slot * CHUNK_READER_SIZE, CHUNK_READER_SIZE);
+        } while (n < 0 && errno == EINTR);
+
+        pthread_mutex_lock(&r->lock);
+
+        if (n <= 0) {
+            r->error = n < 0;
+            r->eof = 1;
+            pthread_cond_broadcast(&r->cond);
+            break;
+        }
+
+        r->sizes[slot] = n;
+        r->filled++;
+        pthread_cond_broadcast(&r->cond);
+    }
+
+    pthread_mutex_unlock(&r->lock);
+    return NULL;
+}
+
+static int start_chunk_reader(ChunkReader *r, int fd) {
+    memset(r, 0, sizeof(*r));
+    r->fd = fd;
+    r->chunks = malloc((size_t)CHUNK_READER_COUNT * CHUNK_READER_SIZE);
+
+    if (!r->chunks) {
+        fprintf(stderr, "Failed to allocate memory\n");
+        return -1;
+    }
+
+    posix_fadvise(fd, 0, 0, POSIX_FADV_SEQUENTIAL);
+    pthread_mutex_init(&r->lock, NULL);
+    pthread_cond_init(&r->cond, NULL);
+
+    if (pthread_create(&r->thread, NULL, run_chunk_reader, r) != 0) {
+        fprintf(stderr, "Failed to start reader thread\n");
+        pthread_mutex_destroy(&r->lock);
+        pthread_cond_destroy(&r->cond);
+        free(r->chunks);
+        r->chunks = NULL;
+        return -1;
+    }
+
+    return 0;
+}
+
+// Waits for the next chunk, which stays valid until release_chunk. Returns
+// 1 with a chunk, 0 at the end of the input or -1 if reading failed.
+static int next_chunk(ChunkReader *r, const uint8_t **chunk, size_t *size) {
+    int ret;
+
+    pthread_mutex_lock(&r->lock);
+    while (r->filled == 0 && !r->eof) pthread_cond_wait(&r->cond, &r->lock);
+
+    if (r->filled > 0) {
+        *chunk = r->chunks + (size_t)r->head * CHUNK_READER_SIZE;
+        *size = r->sizes[r->head];
+        ret = 1;
+    } else {
+        ret = r->error ? -1 : 0;
+    }
+
+    pthread_mutex_unlock(&r->lock);
+    return ret;
+}
+
+static void release_chunk(ChunkReader *r) {
+    pthread_mutex_lock(&r->lock);
+    r->head = (r->head + 1) % CHUNK_READER_COUNT;
+    r->filled--;
+    pthread_cond_broadcast(&r->cond);
+    pthread_mutex_unlock(&r->lock);
+}
+
+// Stops the reader thread, wherever it is in the input.
+static void stop_chunk_reader(ChunkReader *r) {
+    if (!r->chunks) return;
+
+    pthread_mutex_lock(&r->lock);
+    r->stop = 1;
+    pthread_cond_broadcast(&r->cond);
+    pthread_mutex_unlock(&r->lock);
+
+    pthread_join(r->thread, NULL);
+    pthread_mutex_destroy(&r->lock);
+    pthread_cond_destroy(&r->cond);
+    free(r->chunks);
+    r->chunks = NULL;
+}
+
+#endif // CHUNK_READER_H
@@ -1,101 +1,166 @@
+#include <fcntl.h>
 #include <stdint.h>
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
+#include <unistd.h>
+
+#include "annexb.h"
+#include "chunk_reader.h"
+#include "h264_index.h"
+#include "mapped_file.h"
+#include "openh264_decoder.h"
+
+static void print_frame(const DecodedFrame *frame, void *opaque) {
+    int hash = *(const int *)opaque;
+
+    if (hash) {
+        printf("Frame %llu - Width: %d, Height: %d, Hash: %016llx\n", (unsigned long long)frame->number + 1,
+               frame->width, frame->height, (unsigned long long)frame->hash);
+    } else {
+        printf("Frame %llu - Width: %d, Height: %d\n", (unsigned long long)frame->number + 1, frame->width, frame->height);
+    }
+}
 
-#include <wels/codec_api.h>
-#include <wels/codec_app_def.h>
-#include <wels/codec_def.h>
+typedef struct {
+    OpenH264Stream *stream;
+    int failed;
+} StreamDecode;
 
-#define BUFFER_SIZE (1024*1024*64)
+// Hands each NAL unit to the decoder, or to the access unit it is part of,
+// with its start code, straight from the stream parser's buffer.
+void decode_nal_unit(const NALUnit *nal, void *opaque) {
+    StreamDecode *ctx = opaque;
 
-static uint8_t buffer[BUFFER_SIZE];
+    if (!ctx->failed && decode_openh264_stream_nal(ctx->stream, nal) < 0) ctx->failed = 1;
+}
 
-int main(int argc, char *argv[]) {
-    if (argc != 2) {
-        fprintf(stderr, "[USAGE]: ./decode ./video.h264\n");
-        return 1;
+// Decodes the stream as it is read: a reader thread keeps the next chunks
+// coming while the decoder works, and the parser only holds the NAL unit
+// that runs past the end of a chunk, so memory stays the same for any
+// length of stream.
+int64_t decode_stream(int fd, OpenH264Stream *s) {
+    StreamDecode ctx = {s, 0};
+    NALStreamParser parser;
+    ChunkReader reader;
+    const uint8_t *chunk;
+    size_t size;
+    int ret;
+
+    if (start_chunk_reader(&reader, fd) < 0) return -1;
+    init_nal_stream_parser(&parser, decode_nal_unit, &ctx);
+
+    while ((ret = next_chunk(&reader, &chunk, &size)) > 0) {
+        ret = feed_nal_stream_parser(&parser, chunk, size);
+        release_chunk(&reader);
+
+        if (ret < 0 || ctx.failed) {
+            ret = -1;
+            fprintf(stderr, "Failed to allocate memory\n");
+            break;
+        }
     }
 
-    SDecodingParam decoder_params = {
-        .sVideoProperty.size = sizeof(decoder_params.sVideoProperty),
-        .eEcActiveIdc = ERROR_CON_SLICE_COPY,
-        .uiTargetDqLayer = (uint8_t)-1,
-        .sVideoProperty.eVideoBsType = VIDEO_BITSTREAM_DEFAULT,
-    };
+    if (ret == 0) {
+        flush_nal_stream_parser(&parser);
 
-    ISVCDecoder *decoder = NULL;
-    if (WelsCreateDecoder(&decoder) < 0) {
-        fprintf(stderr, "ERROR: WelsCreateDecoder\n");
-        return 1;
+        if (ctx.failed) {
+            fprintf(stderr, "Failed to allocate memory\n");
+            ret = -1;
+        } else {
+            finish_openh264_stream(s);
+        }
+    } else if (ret < 0 && reader.error) {
+        fprintf(stderr, "Failed to read stream\n");
     }
-    (*decoder)->Initialize(decoder, &decoder_params);
 
-    FILE *file = fopen(argv[1], "rb");
-    if (!file) {
-        perror("fopen");
-        return 1;
+    stop_chunk_reader(&reader);
+    free_nal_stream_parser(&parser);
+
+    return ret < 0 ? -1 : (int64_t)s->frames;
+}
+
+// Decodes the GOPs of filename on threads decoders at once, through the
+// sidecar index, which is built first if needed.
+int64_t decode_file_gops(const char *filename, int threads, int mode, int *hash) {
+    H264Index index;
+    MappedFile file;
+    int64_t frames;
+
+    if (open_h264_index(filename, threads, &index) < 0) return -1;
+
+    if (map_file(filename, &file) < 0) {
+        unload_h264_index(&index);
+        return -1;
     }
 
-    SBufferInfo buffer_info;
-    int32_t buffer_pos = 0;
-    uint64_t timestamp = 0;
-    int32_t slice_size;
-    uint8_t start_code[4] = {0, 0, 0, 1};
-    uint8_t *data[3] = {NULL};
-    uint8_t *dst[3] = {NULL};
-    int32_t end_of_stream = 0;
-
-    ssize_t nbytes;
-    if ((nbytes = fread(buffer, 1, BUFFER_SIZE, file)) < 0) {
-        perror("fread");
-        return 1;
+    if (file.size != index.header->source_size) {
+        fprintf(stderr, "Failed to open file: %s\n", filename);
+        frames = -1;
+    } else {
+        frames = decode_openh264_gops(&file, &index, threads, mode, *hash, print_frame, hash);
     }
-    memcpy(buffer + nbytes, start_code, 4);
 
-    int frames = 0;
-    for (;;) {
-        if (buffer_pos >= nbytes) {
-            end_of_stream = 1;
-            (*decoder)->SetOption(decoder, DECODER_OPTION_END_OF_STREAM, (void *)&end_of_stream);
-            break;
-        }
+    unmap_file(&file);
+    unload_h264_index(&index);
+    return frames;
+}
 
-        for (slice_size = 0; slice_size < nbytes - buffer_pos; slice_size++) {
-            if ((buffer[buffer_pos + slice_size + 0] == 0 && buffer[buffer_pos + slice_size + 1] == 0 &&
-                 buffer[buffer_pos + slice_size + 2] == 0 && buffer[buffer_pos + slice_size + 3] == 1 && slice_size > 0) ||
-                (buffer[buffer_pos + slice_size + 0] == 0 && buffer[buffer_pos + slice_size + 1] == 0 &&
-                 buffer[buffer_pos + slice_size + 2] == 1 && slice_size > 0)) {
-                break;
-            }
-        }
+void usage(const char *name) {
+    fprintf(stderr, "Usage: %s [-mode nal|au|batch|parse] [-hash] <h264_file | ->\n", name);
+    fprintf(stderr, "       %s -j <threads> [-mode nal|au|batch|parse] [-hash] <h264_file>\n", name);
+}
 
-        if (slice_size < 4) {
-            buffer_pos += slice_size;
-            continue;
+int main(int argc, char *argv[]) {
+    int threads = 0;
+    int mode = OPENH264_MODE_AU;
+    int hash = 0;
+    int64_t frames;
+    int i;
+
+    for (i = 1; i < argc - 1; i++) {
+        if (strcmp(argv[i], "-hash") == 0) {
+            hash = 1;
+        } else if (strcmp(argv[i], "-j") == 0 && i + 2 < argc) {
+            threads = atoi(argv[++i]);
+        } else if (strcmp(argv[i], "-mode") == 0 && i + 2 < argc) {
+            mode = openh264_mode(argv[++i]);
+        } else {
+            break;
         }
+    }
 
-        memset(&buffer_info, 0, sizeof(SBufferInfo));
-        buffer_info.uiInBsTimeStamp = ++timestamp;
-        (*decoder)->DecodeFrameNoDelay(decoder, buffer + buffer_pos, slice_size, data, &buffer_info);
+    if (i != argc - 1 || threads < 0 || mode < 0 || (threads > 0 && strcmp(argv[i], "-") == 0)) {
+        usage(argv[0]);
+        return 1;
+    }
 
-        if (buffer_info.iBufferStatus == 1) {
-            dst[0] = buffer_info.pDst[0];
-            dst[1] = buffer_info.pDst[1];
-            dst[2] = buffer_info.pDst[2];
+    if (threads > 0) {
+        frames = decode_file_gops(argv[i], threads, mode, &hash);
+    } else {
+        OpenH264Stream s;
+        int fd = strcmp(argv[i], "-") == 0 ? STDIN_FILENO : open(argv[i], O_RDONLY);
+
+        if (fd < 0) {
+            fprintf(stderr, "Failed to open file: %s\n", argv[i]);
+            return 1;
+        }
 
-            int width = buffer_info.UsrData.sSystemBuffer.iWidth;
-            int height = buffer_info.UsrData.sSystemBuffer.iHeight;
-            frames++;
-            printf("Frame %d - Width: %d, Height: %d\n", frames, width, height);
+        if (open_openh264_stream(&s, mode, hash, print_frame, &hash) < 0) {
+            if (fd != STDIN_FILENO) close(fd);
+            return 1;
         }
 
-        buffer_pos += slice_size;
+        frames = decode_stream(fd, &s);
+
+        if (fd != STDIN_FILENO) close(fd);
+        close_openh264_stream(&s);
     }
 
+    if (frames < 0) return 1;
+
     printf("-------------------------------------------------------\n");
-    printf("Total frames decoded: %d\n", frames);
+    printf("Total frames decoded: %lld\n", (long long)frames);
     printf("-------------------------------------------------------\n");
-
     return 0;
 }
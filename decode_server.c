@@ -0,0 +1,135 @@
+#ifdef __linux__
+#define _GNU_SOURCE
+#endif
+
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+
+#include "decode_server.h"
+#include "openh264_decoder.h"
+
+// Decodes every input as its own stream in one process, with one worker
+// thread per core, and reports the load of each core once a second.
+
+static void print_frame(int stream, const DecodedFrame *frame, void *opaque) {
+    (void)opaque;
+    printf("Stream %d Frame %llu - Width: %d, Height: %d\n", stream, (unsigned long long)frame->number + 1,
+           frame->width, frame->height);
+}
+
+static void report_load(DecodeServer *server, ServerWorkerSample *samples, double interval) {
+    for (int i = 0; i < server->worker_count; i++) {
+        double busy;
+        uint64_t frames;
+
+        sample_server_worker(&server->workers[i], &samples[i], &busy, &frames);
+        fprintf(stderr, "Core %d: %5.1f%% busy, %8.1f frames/s, %d streams\n", server->workers[i].core,
+                100 * busy / interval, frames / interval, server->workers[i].count);
+    }
+}
+
+int serve_streams(char **paths, int count, int workers, int mode, double frame_rate, int loop, double duration,
+                  int frames) {
+    DecodeServer *server = malloc(sizeof(DecodeServer));
+    ServerWorkerSample samples[MAX_SERVER_WORKERS] = {{0}};
+    int ret = 0;
+
+    if (!server) {
+        fprintf(stderr, "Failed to allocate memory\n");
+        return -1;
+    }
+
+    if (init_decode_server(server, paths, count, workers, mode, frames ? print_frame : NULL, NULL) < 0) {
+        free_decode_server(server);
+        free(server);
+        return -1;
+    }
+
+    if (start_decode_server(server, frame_rate, loop) < 0) ret = -1;
+
+    double last = server->start;
+
+    // Wakes up often enough to notice the end of the inputs soon after.
+    while (ret == 0 && decode_server_running(server)) {
+        struct timespec tick = {0, 50 * 1000 * 1000};
+        nanosleep(&tick, NULL);
+
+        double now = server_clock();
+
+        if (now - last >= 1) {
+            report_load(server, samples, now - last);
+            last = now;
+        }
+
+        if (duration > 0 && now - server->start >= duration) break;
+    }
+
+    join_decode_server(server, 1);
+
+    double elapsed = server_clock() - server->start;
+    uint64_t total = 0;
+
+    for (int i = 0; i < server->stream_count; i++) {
+        ServerStream *stream = &server->streams[i];
+
+        printf("Stream %d: %s, Frames: %llu, Width: %d, Height: %d, Bytes: %llu%s\n", i, stream->path,
+               (unsigned long long)stream->decoder.frames, stream->width, stream->height,
+               (unsigned long long)stream->bytes, stream->failed ? ", failed" : "");
+        total += stream->decoder.frames;
+        if (stream->failed) ret = -1;
+    }
+
+    printf("-------------------------------------------------------\n");
+    printf("Total frames decoded: %llu in %.2f s, %.1f frames/s on %d workers\n", (unsigned long long)total,
+           elapsed, total / elapsed, server->worker_count);
+    printf("-------------------------------------------------------\n");
+
+    free_decode_server(server);
+    free(server);
+    return ret;
+}
+
+void usage(const char *name) {
+    fprintf(stderr, "Usage: %s [-j <workers>] [-mode nal|au|batch|parse] [-fps <rate>] [-loop] [-duration <seconds>] "
+                    "[-frames] <h264_file | fifo | ->...\n", name);
+}
+
+int main(int argc, char *argv[]) {
+    long cpus = sysconf(_SC_NPROCESSORS_ONLN);
+    int workers = cpus > 0 ? (int)cpus : 1;
+    int mode = OPENH264_MODE_AU;
+    double frame_rate = 0;
+    double duration = 0;
+    int loop = 0;
+    int frames = 0;
+    int i;
+
+    for (i = 1; i < argc - 1; i++) {
+        if (strcmp(argv[i], "-j") == 0) {
+            workers = atoi(argv[++i]);
+        } else if (strcmp(argv[i], "-mode") == 0) {
+            mode = openh264_mode(argv[++i]);
+        } else if (strcmp(argv[i], "-fps") == 0) {
+            frame_rate = atof(argv[++i]);
+        } else if (strcmp(argv[i], "-duration") == 0) {
+            duration = atof(argv[++i]);
+        } else if (strcmp(argv[i], "-loop") == 0) {
+            loop = 1;
+        } else if (strcmp(argv[i], "-frames") == 0) {
+            frames = 1;
+        } else {
+            break;
+        }
+    }
+
+    if (i >= argc || workers < 1 || mode < 0 || frame_rate < 0 || duration < 0 || (loop && duration == 0)) {
+        usage(argv[0]);
+        return 1;
+    }
+
+    return serve_streams(argv + i, argc - i, workers, mode, frame_rate, loop, duration, frames) < 0 ? 1 : 0;
+}
@@ -0,0 +1,401 @@
+#ifndef DECODE_SERVER_H
+#define DECODE_SERVER_H
+
+#include <errno.h>
+#include <fcntl.h>
+#include <poll.h>
+#include <pthread.h>
+#include <sched.h>
+#include <stdatomic.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/stat.h>
+#include <time.h>
+#include <unistd.h>
+
+#include "annexb.h"
+#include "openh264_decoder.h"
+
+// Decodes many independent streams on a few threads: one worker per core,
+// pinned to it where the system allows (Linux, with _GNU_SOURCE defined
+// before the first include), and every stream owned by one worker for its
+// whole life, so its decoder stays in that core's caches. A worker polls
+// its streams' inputs, files or named pipes opened non-blocking, and takes
+// turns between those that have data, one read of up to SERVER_READ_SIZE
+// bytes at a time. A stream can be paced at a frame rate, as a live source
+// would deliver it, which is how the number of streams a host sustains in
+// real time is measured.
+
+#define MAX_SERVER_WORKERS 256
+#define SERVER_READ_SIZE (32 * 1024)
+
+typedef void (*StreamFrameCallback)(int stream, const DecodedFrame *frame, void *opaque);
+
+typedef struct DecodeServer DecodeServer;
+
+typedef struct {
+    DecodeServer *server;
+    int index;
+    const char *path;
+    int fd;
+    int pipe;
+    OpenH264Stream decoder;
+    NALStreamParser parser;
+
+    uint64_t bytes;
+    int width;
+    int height;
+    int eof;
+    int failed;
+} ServerStream;
+
+typedef struct {
+    DecodeServer *server;
+    int core;
+    ServerStream **streams;
+    int count;
+    struct pollfd *fds;
+    ServerStream **polled;
+    uint8_t *buffer;
+    pthread_t thread;
+    int started;
+
+    // Read by the load reports while the worker runs.
+    atomic_uint_fast64_t busy_ns;
+    atomic_uint_fast64_t frames;
+} ServerWorker;
+
+struct DecodeServer {
+    ServerStream *streams;
+    int stream_count;
+    ServerWorker workers[MAX_SERVER_WORKERS];
+    int worker_count;
+
+    int mode;
+    double frame_rate;
+    int loop;
+    StreamFrameCallback callback;
+    void *opaque;
+
+    double start;
+    atomic_int stop;
+    atomic_int running;
+};
+
+static inline double server_clock(void) {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec + ts.tv_nsec / 1e9;
+}
+
+static void server_frame(const DecodedFrame *frame, void *opaque) {
+    ServerStream *stream = opaque;
+    DecodeServer *server = stream->server;
+
+    stream->width = frame->width;
+    stream->height = frame->height;
+    atomic_fetch_add_explicit(&server->workers[stream->index % server->worker_count].frames, 1, memory_order_relaxed);
+
+    if (server->callback) server->callback(stream->index, frame, server->opaque);
+}
+
+static void server_nal_unit(const NALUnit *nal, void *opaque) {
+    ServerStream *stream = opaque;
+
+    if (!stream->failed && decode_openh264_stream_nal(&stream->decoder, nal) < 0) {
+        fprintf(stderr, "Failed to allocate memory\n");
+        stream->failed = 1;
+    }
+}
+
+static int open_server_stream(DecodeServer *server, ServerStream *stream, int index, const char *path) {
+    struct stat st;
+
+    memset(stream, 0, sizeof(*stream));
+    stream->server = server;
+    stream->index = index;
+    stream->path = path;
+    stream->fd = strcmp(path, "-") == 0 ? STDIN_FILENO : open(path, O_RDONLY | O_NONBLOCK);
+
+    if (stream->fd < 0) {
+        fprintf(stderr, "Failed to open file: %s\n", path);
+        return -1;
+    }
+
+    if (stream->fd == STDIN_FILENO) fcntl(stream->fd, F_SETFL, fcntl(stream->fd, F_GETFL) | O_NONBLOCK);
+    stream->pipe = fstat(stream->fd, &st) == 0 && !S_ISREG(st.st_mode);
+
+    if (open_openh264_stream(&stream->decoder, server->mode, 0, server_frame, stream) < 0) {
+        if (stream->fd != STDIN_FILENO) close(stream->fd);
+        stream->fd = -1;
+        return -1;
+    }
+
+    init_nal_stream_parser(&stream->parser, server_nal_unit, stream);
+    return 0;
+}
+
+static void finish_server_stream(ServerStream *stream) {
+    stream->eof = 1;
+
+    if (!stream->failed) {
+        flush_nal_stream_parser(&stream->parser);
+        if (!stream->failed) finish_openh264_stream(&stream->decoder);
+    }
+}
+
+static void close_server_stream(ServerStream *stream) {
+    if (stream->fd < 0) return;
+
+    free_nal_stream_parser(&stream->parser);
+    close_openh264_stream(&stream->decoder);
+    if (stream->fd != STDIN_FILENO) close(stream->fd);
+    stream->fd = -1;
+}
+
+// Whether a paced stream has decoded all the frames due by now.
+static inline int server_stream_ahead(const DecodeServer *server, const ServerStream *stream, double now) {
+    return server->frame_rate > 0 && stream->decoder.frames >= (uint64_t)((now - server->start) * server->frame_rate) + 1;
+}
+
+// Reads once from a stream and decodes what came. A paced stream reads
+// about a frame's worth of bytes, going by the stream so far, so that it
+// does not run ahead of its rate. Regular files restart at the end when
+// looping.
+static void serve_stream(ServerWorker *w, ServerStream *stream) {
+    size_t size = SERVER_READ_SIZE;
+
+    if (w->server->frame_rate > 0 && stream->decoder.frames > 0) {
+        uint64_t frame_size = stream->bytes / stream->decoder.frames;
+        if (frame_size < size) size = frame_size < 4096 ? 4096 : frame_size;
+    }
+
+    ssize_t n = read(stream->fd, w->buffer, size);
+
+    if (n < 0) {
+        if (errno == EAGAIN || errno == EINTR) return;
+        fprintf(stderr, "Failed to read stream: %s\n", stream->path);
+        stream->failed = 1;
+        stream->eof = 1;
+        return;
+    }
+
+    if (n == 0) {
+        if (w->server->loop && !stream->pipe && stream->bytes > 0 && lseek(stream->fd, 0, SEEK_SET) == 0) return;
+        finish_server_stream(stream);
+        return;
+    }
+
+    stream->bytes += n;
+
+    if (feed_nal_stream_parser(&stream->parser, w->buffer, n) < 0) {
+        fprintf(stderr, "Failed to allocate memory\n");
+        stream->failed = 1;
+    }
+
+    if (stream->failed) stream->eof = 1;
+}
+
+static void pin_server_worker(ServerWorker *w) {
+#if defined(__linux__) && defined(_GNU_SOURCE)
+    long cpus = sysconf(_SC_NPROCESSORS_ONLN);
+    cpu_set_t set;
+
+    CPU_ZERO(&set);
+    CPU_SET(cpus > 0 ? w->core % cpus : 0, &set);
+    pthread_setaffinity_np(pthread_self(), sizeof(set), &set);
+#else
+    (void)w;
+#endif
+}
+
+static void *run_server_worker(void *arg) {
+    ServerWorker *w = arg;
+    DecodeServer *server = w->server;
+
+    pin_server_worker(w);
+
+    while (!atomic_load(&server->stop)) {
+        double now = server_clock();
+        double next_due = 0;
+        int active = 0, polled = 0;
+
+        for (int i = 0; i < w->count; i++) {
+            ServerStream *stream = w->streams[i];
+            if (stream->eof) continue;
+
+            active++;
+
+            // A paced stream sits out until its next frame is due.
+            if (server_stream_ahead(server, stream, now)) {
+                double due = server->start + (double)stream->decoder.frames / server->frame_rate;
+                if (next_due == 0 || due < next_due) next_due = due;
+                continue;
+            }
+
+            w->fds[polled] = (struct pollfd){.fd = stream->fd, .events = POLLIN};
+            w->polled[polled++] = stream;
+        }
+
+        if (active == 0) break;
+
+        if (polled == 0) {
+            double wait = next_due - now;
+            if (wait > 0) {
+                struct timespec ts = {(time_t)wait, (long)((wait - (time_t)wait) * 1e9)};
+                nanosleep(&ts, NULL);
+            }
+            continue;
+        }
+
+        int timeout = next_due > 0 ? (int)((next_due - now) * 1000) + 1 : 100;
+        int ready = poll(w->fds, polled, timeout);
+
+        if (ready < 0) {
+            if (errno == EINTR) continue;
+            fprintf(stderr, "Failed to poll streams\n");
+            break;
+        }
+
+        double t0 = server_clock();
+
+        // Round robin: every stream with data gets one read per pass.
+        for (int i = 0; i < polled && ready > 0; i++) {
+            if (!(w->fds[i].revents & (POLLIN | POLLHUP | POLLERR))) continue;
+            serve_stream(w, w->polled[i]);
+            ready--;
+        }
+
+        atomic_fetch_add_explicit(&w->busy_ns, (uint64_t)((server_clock() - t0) * 1e9), memory_order_relaxed);
+    }
+
+    atomic_fetch_sub(&server->running, 1);
+    return NULL;
+}
+
+// Opens every input and deals the streams out to workers in turn.
+static int init_decode_server(DecodeServer *server, char **paths, int count, int workers, int mode,
+                              StreamFrameCallback callback, void *opaque) {
+    memset(server, 0, sizeof(*server));
+
+    if (workers < 1) workers = 1;
+    if (workers > MAX_SERVER_WORKERS) workers = MAX_SERVER_WORKERS;
+    if (workers > count) workers = count;
+
+    server->mode = mode;
+    server->callback = callback;
+    server->opaque = opaque;
+    server->worker_count = workers;
+    server->streams = calloc(count, sizeof(ServerStream));
+
+    if (!server->streams) {
+        fprintf(stderr, "Failed to allocate memory\n");
+        return -1;
+    }
+
+    for (int i = 0; i < count; i++) server->streams[i].fd = -1;
+
+    for (int i = 0; i < workers; i++) {
+        ServerWorker *w = &server->workers[i];
+        int owned = count / workers + (i < count % workers);
+
+        w->server = server;
+        w->core = i;
+        w->streams = calloc(owned, sizeof(ServerStream *));
+        w->polled = calloc(owned, sizeof(ServerStream *));
+        w->fds = calloc(owned, sizeof(struct pollfd));
+        w->buffer = malloc(SERVER_READ_SIZE);
+        atomic_init(&w->busy_ns, 0);
+        atomic_init(&w->frames, 0);
+
+        if (!w->streams || !w->polled || !w->fds || !w->buffer) {
+            fprintf(stderr, "Failed to allocate memory\n");
+            return -1;
+        }
+    }
+
+    for (int i = 0; i < count; i++) {
+        ServerWorker *w = &server->workers[i % workers];
+
+        if (open_server_stream(server, &server->streams[i], i, paths[i]) < 0) return -1;
+
+        server->stream_count = i + 1;
+        w->streams[w->count++] = &server->streams[i];
+    }
+
+    return 0;
+}
+
+static void free_decode_server(DecodeServer *server) {
+    for (int i = 0; i < server->stream_count; i++) close_server_stream(&server->streams[i]);
+
+    for (int i = 0; i < server->worker_count; i++) {
+        ServerWorker *w = &server->workers[i];
+        free(w->streams);
+        free(w->polled);
+        free(w->fds);
+        free(w->buffer);
+    }
+
+    free(server->streams);
+    server->streams = NULL;
+}
+
+// Starts the workers. frame_rate paces every stream, 0 decodes as fast as
+// the inputs allow.
+static int start_decode_server(DecodeServer *server, double frame_rate, int loop) {
+    server->frame_rate = frame_rate;
+    server->loop = loop;
+    server->start = server_clock();
+    atomic_init(&server->stop, 0);
+    atomic_init(&server->running, server->worker_count);
+
+    for (int i = 0; i < server->worker_count; i++) {
+        ServerWorker *w = &server->workers[i];
+
+        if (pthread_create(&w->thread, NULL, run_server_worker, w) != 0) {
+            fprintf(stderr, "Failed to start worker thread\n");
+            atomic_fetch_sub(&server->running, server->worker_count - i);
+            atomic_store(&server->stop, 1);
+            return -1;
+        }
+
+        w->started = 1;
+    }
+
+    return 0;
+}
+
+static inline int decode_server_running(DecodeServer *server) {
+    return atomic_load(&server->running) > 0;
+}
+
+// Stops the workers, at once if stop is set or else when their inputs end.
+static void join_decode_server(DecodeServer *server, int stop) {
+    if (stop) atomic_store(&server->stop, 1);
+
+    for (int i = 0; i < server->worker_count; i++) {
+        if (server->workers[i].started) pthread_join(server->workers[i].thread, NULL);
+        server->workers[i].started = 0;
+    }
+}
+
+// Busy time and frames of a worker since the previous sample.
+typedef struct {
+    uint64_t busy_ns;
+    uint64_t frames;
+} ServerWorkerSample;
+
+static inline void sample_server_worker(ServerWorker *w, ServerWorkerSample *last, double *busy, uint64_t *frames) {
+    uint64_t busy_ns = atomic_load_explicit(&w->busy_ns, memory_order_relaxed);
+    uint64_t count = atomic_load_explicit(&w->frames, memory_order_relaxed);
+
+    *busy = (busy_ns - last->busy_ns) / 1e9;
+    *frames = count - last->frames;
+    last->busy_ns = busy_ns;
+    last->frames = count;
+}
+
+#endif // DECODE_SERVER_H
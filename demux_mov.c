@@ -0,0 +1,100 @@
+#include <fcntl.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdint.h>
+#include <string.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+#include "mapped_file.h"
+#include "mov.h"
+#include "mov_demux.h"
+#include "mov_sample_table.h"
+
+// Extracts the first H.264 video track of an MP4 or MOV file as a raw
+// Annex B stream, like ffmpeg -i <file> -c:v copy -bsf:v h264_mp4toannexb
+// -f h264 <output>, without libavformat. "-" writes stdout.
+int demux_mov_file(const char *input, const char *output) {
+    struct stat in_st, out_st;
+
+    if (strcmp(output, "-") != 0 && stat(input, &in_st) == 0 && stat(output, &out_st) == 0 &&
+        in_st.st_dev == out_st.st_dev && in_st.st_ino == out_st.st_ino) {
+        fprintf(stderr, "Output is also the input: %s\n", input);
+        return -1;
+    }
+
+    MovFile *file = malloc(sizeof(MovFile));
+    MovBoxTree tree = {0};
+    MovSampleTable table = {0};
+    MovH264Demuxer demuxer = {0};
+    MappedFile mapped = {0};
+    int fd = -1;
+    int ret = -1;
+
+    if (!file) {
+        fprintf(stderr, "Failed to allocate memory\n");
+        return -1;
+    }
+
+    if (open_mov_file(input, file) < 0) {
+        free(file);
+        return -1;
+    }
+
+    if (parse_mov_box_tree(file, &tree) < 0) goto done;
+
+    int trak = find_mov_track(&tree, file, MOV_FOURCC('v', 'i', 'd', 'e'));
+
+    if (trak < 0) {
+        fprintf(stderr, "Failed to find a video track\n");
+        goto done;
+    }
+
+    if (load_mov_sample_table(file, &tree, trak, &table) < 0) goto done;
+
+    // Fragmented files keep their samples in moof boxes instead.
+    int fragmented = table.sample_count == 0 && find_mov_box(&tree, -1, MOV_FOURCC('m', 'o', 'o', 'f'), -1) >= 0;
+
+    if (map_file(input, &mapped) < 0) goto done;
+
+    fd = strcmp(output, "-") == 0 ? STDOUT_FILENO : open(output, O_WRONLY | O_CREAT | O_TRUNC, 0644);
+
+    if (fd < 0) {
+        fprintf(stderr, "Failed to open file: %s\n", output);
+        goto done;
+    }
+
+    if (init_mov_h264_demuxer(&demuxer, file, &tree, &table, fd) < 0) goto done;
+    if (fragmented) {
+        if (write_mov_h264_fragments(&demuxer, mapped.data, mapped.size, table.track_id) < 0) goto done;
+    } else if (write_mov_h264_track(&demuxer, mapped.data, mapped.size, &table) < 0) {
+        goto done;
+    }
+
+    fprintf(stderr, "Track: %u, Samples: %llu, Bytes: %llu\n", table.track_id, (unsigned long long)demuxer.samples,
+            (unsigned long long)demuxer.writer.bytes);
+    ret = 0;
+
+done:
+    if (fd >= 0 && fd != STDOUT_FILENO && close(fd) < 0 && ret == 0) {
+        fprintf(stderr, "Failed to write output\n");
+        ret = -1;
+    }
+
+    free_mov_h264_demuxer(&demuxer);
+    unmap_file(&mapped);
+    free_mov_sample_table(&table);
+    free_mov_box_tree(&tree);
+    close_mov_file(file);
+    free(file);
+    return ret;
+}
+
+int main(int argc, char *argv[]) {
+    if (argc != 3) {
+        fprintf(stderr, "Usage: %s <mp4_file> <output_file | ->\n", argv[0]);
+        return 1;
+    }
+
+    return demux_mov_file(argv[1], argv[2]) < 0 ? 1 : 0;
+}
@@ -7,8 +7,8 @@
 
 #include <x264.h>
 
-#define WIDTH 640
-#define HEIGHT 480
+static int width  = 640;
+static int height = 480;
 
 void encode_fractal_noise_vertex(int frame, x264_picture_t pic_in);
 void encode_polar_coordinate_color_cycling(int frame, x264_picture_t pic_in);
@@ -18,39 +18,109 @@ void encode_water_effect(int frame, x264_picture_t pic_in);
 void encode_neon_glow_effect(int frame, x264_picture_t pic_in);
 void encode_game_of_life(int frame, x264_picture_t pic_in);
 
-int main() {
+typedef struct {
+    const char *name;
+    void (*encode)(int frame, x264_picture_t pic_in);
+} Pattern;
+
+static const Pattern patterns[] = {
+    {"game_of_life", encode_game_of_life},
+    {"fractal_noise", encode_fractal_noise_vertex},
+    {"fractal_noise2", encode_fractal_noise_vertex2},
+    {"polar", encode_polar_coordinate_color_cycling},
+    {"vortex", encode_swirling_vortex},
+    {"water", encode_water_effect},
+    {"neon", encode_neon_glow_effect},
+};
+
+void usage(const char *name) {
+    fprintf(stderr, "Usage: %s [-size <width>x<height>] [-preset <preset>] [-tune <tune>] [-profile <profile>] "
+                    "[-frames <count>] [-fps <rate>] [-pattern <pattern>] [output_file]\n", name);
+    fprintf(stderr, "Patterns:");
+    for (size_t i = 0; i < sizeof(patterns) / sizeof(patterns[0]); i++) fprintf(stderr, " %s", patterns[i].name);
+    fprintf(stderr, "\n");
+}
+
+int main(int argc, char *argv[]) {
     int fps        = 5;
     int num_frames = 200;
 
+    const char *preset     = "veryfast";
+    const char *tune       = "zerolatency";
+    const char *profile    = "baseline";
+    const char *output     = "video.h264";
+    const Pattern *pattern = &patterns[0];
+    int arg;
+
+    for (arg = 1; arg < argc - 1; arg++) {
+        if (strcmp(argv[arg], "-size") == 0) {
+            if (sscanf(argv[++arg], "%dx%d", &width, &height) != 2) width = 0;
+        } else if (strcmp(argv[arg], "-preset") == 0) {
+            preset = argv[++arg];
+        } else if (strcmp(argv[arg], "-tune") == 0) {
+            tune = strcmp(argv[++arg], "none") == 0 ? NULL : argv[arg];
+        } else if (strcmp(argv[arg], "-profile") == 0) {
+            profile = argv[++arg];
+        } else if (strcmp(argv[arg], "-frames") == 0) {
+            num_frames = atoi(argv[++arg]);
+        } else if (strcmp(argv[arg], "-fps") == 0) {
+            fps = atoi(argv[++arg]);
+        } else if (strcmp(argv[arg], "-pattern") == 0) {
+            const char *name = argv[++arg];
+            pattern = NULL;
+            for (size_t j = 0; j < sizeof(patterns) / sizeof(patterns[0]); j++) {
+                if (strcmp(patterns[j].name, name) == 0) pattern = &patterns[j];
+            }
+        } else {
+            break;
+        }
+    }
+
+    if (arg < argc - 1 || (arg == argc - 1 && argv[arg][0] == '-') || !pattern || width <= 0 || height <= 0 ||
+        width % 2 || height % 2 || num_frames < 1 || fps < 1) {
+        usage(argv[0]);
+        return 1;
+    }
+
+    if (arg == argc - 1) output = argv[arg];
+
     x264_t *encoder;
     x264_picture_t pic_in, pic_out;
     x264_param_t param;
     FILE *h264_file;
 
-    x264_param_default_preset(&param, "veryfast", "zerolatency");
+    if (x264_param_default_preset(&param, preset, tune) < 0) {
+        fprintf(stderr, "Failed to apply preset: %s\n", preset);
+        return 1;
+    }
+
     param.i_csp            = X264_CSP_I420;
-    param.i_width          = WIDTH;
-    param.i_height         = HEIGHT;
+    param.i_width          = width;
+    param.i_height         = height;
     param.i_fps_num        = fps;
     param.i_fps_den        = 1;
     param.i_keyint_max     = fps;
     param.b_repeat_headers = 1;
-    x264_param_apply_profile(&param, "baseline");
+
+    if (x264_param_apply_profile(&param, profile) < 0) {
+        fprintf(stderr, "Failed to apply profile: %s\n", profile);
+        return 1;
+    }
 
     encoder   = x264_encoder_open(&param);
-    h264_file = fopen("video.h264", "wb");
+    h264_file = fopen(output, "wb");
 
-    x264_picture_alloc(&pic_in, X264_CSP_I420, WIDTH, HEIGHT);
+    if (!encoder || !h264_file) {
+        fprintf(stderr, "Failed to open %s\n", encoder ? output : "encoder");
+        return 1;
+    }
+
+    x264_picture_alloc(&pic_in, X264_CSP_I420, width, height);
     pic_in.i_type = X264_TYPE_AUTO;
 
     for (int i = 0; i < num_frames; i++) {
-        // encode_fractal_noise_vertex(i, pic_in);
-        // encode_swirling_vortex(i, pic_in);
-        //encode_polar_coordinate_color_cycling(i, pic_in);
-        // encode_fractal_noise_vertex2(i, pic_in);
-        // encode_water_effect(i, pic_in);
-        // encode_neon_glow_effect(i, pic_in);
-         encode_game_of_life(i, pic_in);
+        pattern->encode(i, pic_in);
+        pic_in.i_pts = i;
 
         x264_nal_t *nals;
         int i_nal;
@@ -77,19 +147,19 @@ int main() {
 }
 
 void encode_polar_coordinate_color_cycling(int frame, x264_picture_t pic_in) {
-    for (int y = 0; y < HEIGHT; y++) {
-        for (int x = 0; x < WIDTH; x++) {
-            double angle                       = atan2(y - HEIGHT / 2, x - WIDTH / 2);
-            double radius                      = sqrt(pow(x - WIDTH / 2, 2) + pow(y - HEIGHT / 2, 2));
+    for (int y = 0; y < height; y++) {
+        for (int x = 0; x < width; x++) {
+            double angle                       = atan2(y - height / 2, x - width / 2);
+            double radius                      = sqrt(pow(x - width / 2, 2) + pow(y - height / 2, 2));
             double intensity                   = 128 + 127 * sin(radius * 0.05 + angle * 3 + frame * 0.1);
-            pic_in.img.plane[0][x + y * WIDTH] = (int)intensity;
+            pic_in.img.plane[0][x + y * width] = (int)intensity;
         }
-        if (y < HEIGHT / 2) {
+        if (y < height / 2) {
             uint8_t *u_plane = pic_in.img.plane[1] + y * pic_in.img.i_stride[1];
             uint8_t *v_plane = pic_in.img.plane[2] + y * pic_in.img.i_stride[2];
-            for (int x = 0; x < WIDTH / 2; x++) {
-                double angle  = atan2(y - HEIGHT / 4, x - WIDTH / 4);
-                double radius = sqrt(pow(x - WIDTH / 4, 2) + pow(y - HEIGHT / 4, 2));
+            for (int x = 0; x < width / 2; x++) {
+                double angle  = atan2(y - height / 4, x - width / 4);
+                double radius = sqrt(pow(x - width / 4, 2) + pow(y - height / 4, 2));
                 u_plane[x]    = 128 + (int)(127 * sin(radius * 0.1 + frame * 0.05));
                 v_plane[x]    = 128 + (int)(127 * cos(angle * 5 + frame * 0.03));
             }
@@ -98,23 +168,23 @@ void encode_polar_coordinate_color_cycling(int frame, x264_picture_t pic_in) {
 }
 
 void encode_fractal_noise_vertex(int frame, x264_picture_t pic_in) {
-    for (int y = 0; y < HEIGHT; y++) {
-        for (int x = 0; x < WIDTH; x++) {
-            double angle     = atan2(y - HEIGHT / 2, x - WIDTH / 2);
-            double radius    = sqrt(pow(x - WIDTH / 2, 2) + pow(y - HEIGHT / 2, 2));
+    for (int y = 0; y < height; y++) {
+        for (int x = 0; x < width; x++) {
+            double angle     = atan2(y - height / 2, x - width / 2);
+            double radius    = sqrt(pow(x - width / 2, 2) + pow(y - height / 2, 2));
             double phase     = frame * 0.02;
             double frequency = 0.1 * (radius + 1);
             double intensity = 128 + 127 * sin(frequency * radius + 5 * angle + phase);
             intensity += 127 * sin(3 * frequency * (radius * 0.5) - 3 * angle + phase);
             intensity                          = intensity / 2;
-            pic_in.img.plane[0][x + y * WIDTH] = (int)intensity;
+            pic_in.img.plane[0][x + y * width] = (int)intensity;
         }
-        if (y < HEIGHT / 2) {
+        if (y < height / 2) {
             uint8_t *u_plane = pic_in.img.plane[1] + y * pic_in.img.i_stride[1];
             uint8_t *v_plane = pic_in.img.plane[2] + y * pic_in.img.i_stride[2];
-            for (int x = 0; x < WIDTH / 2; x++) {
-                double angle     = atan2(y - HEIGHT / 4, x - WIDTH / 4);
-                double radius    = sqrt(pow(x - WIDTH / 4, 2) + pow(y - HEIGHT / 4, 2));
+            for (int x = 0; x < width / 2; x++) {
+                double angle     = atan2(y - height / 4, x - width / 4);
+                double radius    = sqrt(pow(x - width / 4, 2) + pow(y - height / 4, 2));
                 double phase     = frame * 0.03;
                 double frequency = 0.15 * (radius + 1); // Higher frequency for color
                 u_plane[x]       = 128 + (int)(127 * cos(frequency * radius - 4 * angle + phase));
@@ -125,21 +195,21 @@ void encode_fractal_noise_vertex(int frame, x264_picture_t pic_in) {
 }
 
 void encode_swirling_vortex(int frame, x264_picture_t pic_in) {
-    for (int y = 0; y < HEIGHT; y++) {
-        for (int x = 0; x < WIDTH; x++) {
-            double angle                       = atan2(y - HEIGHT / 2, x - WIDTH / 2);
-            double radius                      = sqrt(pow(x - WIDTH / 2, 2) + pow(y - HEIGHT / 2, 2));
+    for (int y = 0; y < height; y++) {
+        for (int x = 0; x < width; x++) {
+            double angle                       = atan2(y - height / 2, x - width / 2);
+            double radius                      = sqrt(pow(x - width / 2, 2) + pow(y - height / 2, 2));
             double wave                        = (radius * 0.05) + (frame * 0.15);
             double swirl                       = angle + wave;
             double intensity                   = 128 + 127 * sin(swirl * 2);
-            pic_in.img.plane[0][x + y * WIDTH] = (int)intensity;
+            pic_in.img.plane[0][x + y * width] = (int)intensity;
         }
-        if (y < HEIGHT / 2) {
+        if (y < height / 2) {
             uint8_t *u_plane = pic_in.img.plane[1] + y * pic_in.img.i_stride[1];
             uint8_t *v_plane = pic_in.img.plane[2] + y * pic_in.img.i_stride[2];
-            for (int x = 0; x < WIDTH / 2; x++) {
-                double angle  = atan2(y - HEIGHT / 4, x - WIDTH / 4);
-                double radius = sqrt(pow(x - WIDTH / 4, 2) + pow(y - HEIGHT / 4, 2));
+            for (int x = 0; x < width / 2; x++) {
+                double angle  = atan2(y - height / 4, x - width / 4);
+                double radius = sqrt(pow(x - width / 4, 2) + pow(y - height / 4, 2));
                 double wave   = (radius * 0.1) + (frame * 0.1);
                 double swirl  = angle + wave;
                 u_plane[x]    = 128 + (int)(127 * sin(swirl * 3));
@@ -165,20 +235,20 @@ void encode_fractal_noise_vertex2(int frame, x264_picture_t pic_in) {
       return modulate_intensity(local_radius, local_angle, phase_shift);
     };
 
-    for (int y = 0; y < HEIGHT; y++) {
-        for (int x = 0; x < WIDTH; x++) {
-            int cx                             = x - WIDTH / 2;
-            int cy                             = y - HEIGHT / 2;
-            pic_in.img.plane[0][x + y * WIDTH] = (int)complex_wave(cx, cy, phase_shift);
+    for (int y = 0; y < height; y++) {
+        for (int x = 0; x < width; x++) {
+            int cx                             = x - width / 2;
+            int cy                             = y - height / 2;
+            pic_in.img.plane[0][x + y * width] = (int)complex_wave(cx, cy, phase_shift);
         }
     }
 
-    for (int y = 0; y < HEIGHT / 2; y++) {
+    for (int y = 0; y < height / 2; y++) {
         uint8_t *u_plane = pic_in.img.plane[1] + y * pic_in.img.i_stride[1];
         uint8_t *v_plane = pic_in.img.plane[2] + y * pic_in.img.i_stride[2];
-        for (int x = 0; x < WIDTH / 2; x++) {
-            int cx        = x - WIDTH / 4;
-            int cy        = y - HEIGHT / 4;
+        for (int x = 0; x < width / 2; x++) {
+            int cx        = x - width / 4;
+            int cy        = y - height / 4;
             double u_wave = complex_wave(cx, cy, color_shift);
             double v_wave = complex_wave(-cx, -cy, -color_shift);
             u_plane[x]    = 128 + (int)(127 * cos(u_wave));
@@ -202,12 +272,12 @@ void encode_water_effect(int frame, x264_picture_t pic_in) {
       return modulate_intensity(local_radius, local_angle, phase_shift);
     };
 
-    for (int y = 0; y < HEIGHT / 2; y++) {
+    for (int y = 0; y < height / 2; y++) {
         uint8_t *u_plane = pic_in.img.plane[1] + y * pic_in.img.i_stride[1];
         uint8_t *v_plane = pic_in.img.plane[2] + y * pic_in.img.i_stride[2];
-        for (int x = 0; x < WIDTH / 2; x++) {
-            int cx        = x - WIDTH / 4;
-            int cy        = y - HEIGHT / 4;
+        for (int x = 0; x < width / 2; x++) {
+            int cx        = x - width / 4;
+            int cy        = y - height / 4;
             double u_wave = complex_wave(cx, cy, color_shift);
             double v_wave = complex_wave(-cx, -cy, -color_shift);
             u_plane[x]    = 128 + (int)(127 * cos(u_wave));
@@ -231,12 +301,12 @@ void encode_neon_glow_effect(int frame, x264_picture_t pic_in) {
       return modulate_intensity(local_radius, local_angle, phase_shift);
     };
 
-    for (int y = 0; y < HEIGHT / 2; y++) {
+    for (int y = 0; y < height / 2; y++) {
         uint8_t *u_plane = pic_in.img.plane[1] + y * pic_in.img.i_stride[1];
         uint8_t *v_plane = pic_in.img.plane[2] + y * pic_in.img.i_stride[2];
-        for (int x = 0; x < WIDTH / 2; x++) {
-            int cx        = x - WIDTH / 4;
-            int cy        = y - HEIGHT / 4;
+        for (int x = 0; x < width / 2; x++) {
+            int cx        = x - width / 4;
+            int cy        = y - height / 4;
             double u_wave = complex_wave(cx, cy, color_shift);
             double v_wave = complex_wave(-cx, -cy, -color_shift);
             u_plane[x]    = 128 + (int)(127 * sin(u_wave));
@@ -246,15 +316,23 @@ void encode_neon_glow_effect(int frame, x264_picture_t pic_in) {
 }
 
 void encode_game_of_life(int frame, x264_picture_t pic_in) {
-    static uint8_t current[HEIGHT / 2][WIDTH / 2];
-    static uint8_t next[HEIGHT / 2][WIDTH / 2];
-    int half_width  = WIDTH / 2;
-    int half_height = HEIGHT / 2;
+    static uint8_t *current;
+    static uint8_t *next;
+    int half_width  = width / 2;
+    int half_height = height / 2;
 
     if (frame == 0) {
+        current = realloc(current, half_width * half_height);
+        next    = realloc(next, half_width * half_height);
+
+        if (!current || !next) {
+            fprintf(stderr, "Failed to allocate memory\n");
+            exit(1);
+        }
+
         for (int y = 0; y < half_height; y++) {
             for (int x = 0; x < half_width; x++) {
-                current[y][x] = (rand() % 2) * 255;
+                current[y * half_width + x] = (rand() % 2) * 255;
             }
         }
     } else {
@@ -266,20 +344,21 @@ void encode_game_of_life(int frame, x264_picture_t pic_in) {
                         if (dx == 0 && dy == 0) continue;
                         int ny = y + dy, nx = x + dx;
                         if (ny >= 0 && ny < half_height && nx >= 0 && nx < half_width) {
-                            live_neighbors += (current[ny][nx] == 255) ? 1 : 0;
+                            live_neighbors += (current[ny * half_width + nx] == 255) ? 1 : 0;
                         }
                     }
                 }
-                next[y][x] = (current[y][x] == 255 && (live_neighbors < 2 || live_neighbors > 3)) ? 0 : ((current[y][x] == 0 && live_neighbors == 3) ? 255 : current[y][x]);
+                uint8_t cell             = current[y * half_width + x];
+                next[y * half_width + x] = (cell == 255 && (live_neighbors < 2 || live_neighbors > 3)) ? 0 : ((cell == 0 && live_neighbors == 3) ? 255 : cell);
             }
         }
-        memcpy(current, next, sizeof(current));
+        memcpy(current, next, half_width * half_height);
     }
 
     for (int y = 0; y < half_height; y++) {
         uint8_t *u_plane = pic_in.img.plane[1] + y * pic_in.img.i_stride[1];
         for (int x = 0; x < half_width; x++) {
-            u_plane[x] = current[y][x];
+            u_plane[x] = current[y * half_width + x];
         }
     }
 }
@@ -0,0 +1,114 @@
+#include <fcntl.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdint.h>
+#include <string.h>
+#include <unistd.h>
+
+#include "annexb.h"
+#include "h264.h"
+#include "h264_filter.h"
+#include "mapped_file.h"
+#include "parallel_nal.h"
+
+typedef struct {
+    H264Filter filter;
+    int ret;
+} FilterContext;
+
+void filter_nal_unit(const NALUnit *nal, void *opaque) {
+    FilterContext *ctx = opaque;
+
+    if (ctx->ret == 0) {
+        ctx->ret = add_nal_to_h264_filter(&ctx->filter, nal);
+    }
+}
+
+// Copies the NAL units of input that drop lets through to output. "-" reads
+// stdin, which is mapped when it is a regular file and read in full
+// otherwise, and writes stdout.
+int filter_h264_file(const char *input, const char *output, int drop, int threads) {
+    MappedFile file;
+
+    if (map_file(strcmp(input, "-") == 0 ? "/dev/stdin" : input, &file) < 0) return -1;
+
+    int fd = STDOUT_FILENO;
+
+    if (strcmp(output, "-") != 0) {
+        fd = open(output, O_WRONLY | O_CREAT | O_TRUNC, 0644);
+
+        if (fd < 0) {
+            fprintf(stderr, "Failed to open file: %s\n", output);
+            unmap_file(&file);
+            return -1;
+        }
+    }
+
+    FilterContext ctx;
+    H264Filter *filter = &ctx.filter;
+
+    init_h264_filter(filter, drop, fd, file.data);
+    ctx.ret = 0;
+
+    if (for_each_nal_unit(file.data, file.size, threads, filter_nal_unit, &ctx) < 0) {
+        fprintf(stderr, "Failed to allocate memory\n");
+        ctx.ret = -1;
+    }
+
+    int ret = ctx.ret;
+    if (ret == 0) ret = finish_h264_filter(filter);
+
+    if (fd != STDOUT_FILENO && close(fd) < 0 && ret == 0) {
+        fprintf(stderr, "Failed to write output\n");
+        ret = -1;
+    }
+
+    if (ret == 0) {
+        fprintf(stderr, "Access units: %llu of %llu, Bytes: %llu of %llu\n",
+                (unsigned long long)filter->kept_access_units, (unsigned long long)filter->access_units,
+                (unsigned long long)filter->kept_bytes, (unsigned long long)filter->bytes);
+    }
+
+    free_h264_filter(filter);
+    unmap_file(&file);
+    return ret;
+}
+
+void usage(const char *name) {
+    fprintf(stderr, "Usage: %s [-j <threads>] [-drop <nonref | nonidr | sei | filler>]... <h264_file | -> <output_file | ->\n", name);
+}
+
+int main(int argc, char *argv[]) {
+    int threads = 1;
+    int drop = 0;
+    int i;
+
+    for (i = 1; i < argc - 2; i++) {
+        if (strcmp(argv[i], "-j") == 0 && i + 3 < argc) {
+            threads = atoi(argv[++i]);
+        } else if (strcmp(argv[i], "-drop") == 0 && i + 3 < argc) {
+            const char *what = argv[++i];
+
+            if (strcmp(what, "nonref") == 0) {
+                drop |= H264_FILTER_NON_REF;
+            } else if (strcmp(what, "nonidr") == 0) {
+                drop |= H264_FILTER_NON_IDR;
+            } else if (strcmp(what, "sei") == 0) {
+                drop |= H264_FILTER_SEI;
+            } else if (strcmp(what, "filler") == 0) {
+                drop |= H264_FILTER_FILLER;
+            } else {
+                break;
+            }
+        } else {
+            break;
+        }
+    }
+
+    if (i != argc - 2 || threads < 1 || drop == 0) {
+        usage(argv[0]);
+        return 1;
+    }
+
+    return filter_h264_file(argv[i], argv[i + 1], drop, threads) < 0 ? 1 : 0;
+}
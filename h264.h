@@ -0,0 +1,865 @@
+#ifndef H264_H
+#define H264_H
+
+#include <stdint.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "annexb.h"
+#include "bitstream.h"
+
+typedef struct {
+    uint8_t profile_idc;
+    uint8_t constraint_set_flags;
+    uint8_t level_idc;
+    uint8_t seq_parameter_set_id;
+    uint8_t chroma_format_idc;
+    uint8_t separate_colour_plane_flag;
+    uint8_t bit_depth_luma_minus8;
+    uint8_t bit_depth_chroma_minus8;
+    uint8_t log2_max_frame_num_minus4;
+    uint8_t pic_order_cnt_type;
+    uint8_t log2_max_pic_order_cnt_lsb_minus4;
+    uint8_t delta_pic_order_always_zero_flag;
+    uint8_t num_ref_frames;
+    uint8_t gaps_in_frame_num_value_allowed_flag;
+    uint16_t pic_width_in_mbs_minus1;
+    uint16_t pic_height_in_map_units_minus1;
+    uint8_t frame_mbs_only_flag;
+    uint8_t direct_8x8_inference_flag;
+    uint8_t frame_cropping_flag;
+    uint32_t frame_crop_left_offset;
+    uint32_t frame_crop_right_offset;
+    uint32_t frame_crop_top_offset;
+    uint32_t frame_crop_bottom_offset;
+    uint8_t vui_parameters_present_flag;
+    uint8_t timing_info_present_flag;
+    uint8_t fixed_frame_rate_flag;
+    uint32_t num_units_in_tick;
+    uint32_t time_scale;
+} SPS;
+
+// vui_parameters() (E.1.1) up to the timing info, the rest is not needed.
+static void parse_vui_timing(BitStream *bs, SPS *sps) {
+    if (read_bit(bs)) { // aspect_ratio_info_present_flag
+        if (read_bits(bs, 8) == 255) { // aspect_ratio_idc == Extended_SAR
+            skip_bits(bs, 16); // sar_width
+            skip_bits(bs, 16); // sar_height
+        }
+    }
+
+    if (read_bit(bs)) { // overscan_info_present_flag
+        read_bit(bs); // overscan_appropriate_flag
+    }
+
+    if (read_bit(bs)) { // video_signal_type_present_flag
+        skip_bits(bs, 4); // video_format, video_full_range_flag
+
+        if (read_bit(bs)) { // colour_description_present_flag
+            skip_bits(bs, 24); // colour_primaries, transfer_characteristics, matrix_coefficients
+        }
+    }
+
+    if (read_bit(bs)) { // chroma_loc_info_present_flag
+        read_ue(bs); // chroma_sample_loc_type_top_field
+        read_ue(bs); // chroma_sample_loc_type_bottom_field
+    }
+
+    sps->timing_info_present_flag = read_bit(bs);
+
+    if (sps->timing_info_present_flag) {
+        sps->num_units_in_tick = read_bits(bs, 32);
+        sps->time_scale = read_bits(bs, 32);
+        sps->fixed_frame_rate_flag = read_bit(bs);
+    }
+}
+
+typedef struct {
+    uint8_t pic_parameter_set_id;
+    uint8_t seq_parameter_set_id;
+    uint8_t entropy_coding_mode_flag;
+    uint8_t pic_order_present_flag;
+    uint8_t num_slice_groups_minus1;
+    uint8_t slice_group_map_type;
+    uint32_t slice_group_change_rate_minus1;
+    uint8_t num_ref_idx_l0_active_minus1;
+    uint8_t num_ref_idx_l1_active_minus1;
+    uint8_t weighted_pred_flag;
+    uint8_t weighted_bipred_idc;
+    int8_t pic_init_qp_minus26;
+    int8_t pic_init_qs_minus26;
+    int8_t chroma_qp_index_offset;
+    uint8_t deblocking_filter_control_present_flag;
+    uint8_t constrained_intra_pred_flag;
+    uint8_t redundant_pic_cnt_present_flag;
+} PPS;
+
+static SPS* parse_sps(const NALUnit *nal) {
+    if (nal->nal_unit_type != 7) return NULL;
+
+    BitStream stream;
+    BitStream *bs = &stream;
+    init_nal_bit_stream(bs, nal->data + 1, nal->size - 1);
+    SPS *sps = calloc(1, sizeof(SPS));
+    if (!sps) return NULL;
+
+    sps->profile_idc = read_bits(bs, 8);
+    sps->constraint_set_flags = read_bits(bs, 8);
+    sps->level_idc = read_bits(bs, 8);
+    sps->seq_parameter_set_id = read_ue(bs);
+    sps->chroma_format_idc = 1;
+
+    if (sps->profile_idc == 100 || sps->profile_idc == 110 ||
+        sps->profile_idc == 122 || sps->profile_idc == 244 ||
+        sps->profile_idc == 44  || sps->profile_idc == 83  ||
+        sps->profile_idc == 86  || sps->profile_idc == 118 ||
+        sps->profile_idc == 128 || sps->profile_idc == 138) {
+
+        uint32_t chroma_format_idc = read_ue(bs);
+        sps->chroma_format_idc = chroma_format_idc;
+
+        if (chroma_format_idc == 3) {
+            sps->separate_colour_plane_flag = read_bit(bs);
+        }
+
+        sps->bit_depth_luma_minus8 = read_ue(bs);
+        sps->bit_depth_chroma_minus8 = read_ue(bs);
+        read_bit(bs); // qpprime_y_zero_transform_bypass_flag
+
+        uint8_t seq_scaling_matrix_present_flag = read_bit(bs);
+
+        if (seq_scaling_matrix_present_flag) {
+            int size = (chroma_format_idc != 3) ? 8 : 12;
+            for (int i = 0; i < size; i++) {
+                uint8_t seq_scaling_list_present_flag = read_bit(bs);
+                if (seq_scaling_list_present_flag) {
+                    if (i < 6) {
+                        // scaling_list(ScalingList4x4[i], 16)
+                        // Skip the scaling list
+                        for (int j = 0; j < 16; j++) {
+                            read_se(bs);
+                        }
+                    } else {
+                        // scaling_list(ScalingList8x8[i - 6], 64)
+                        // Skip the scaling list
+                        for (int j = 0; j < 64; j++) {
+                            read_se(bs);
+                        }
+                    }
+                }
+            }
+        }
+    }
+
+    // Both widths are read with read_bits in every slice header, and 7.4.2.1.1
+    // limits them to 16 bits.
+    uint32_t log2_max_frame_num_minus4 = read_ue(bs);
+
+    if (log2_max_frame_num_minus4 > 12) {
+        free(sps);
+        return NULL;
+    }
+
+    sps->log2_max_frame_num_minus4 = log2_max_frame_num_minus4;
+    sps->pic_order_cnt_type = read_ue(bs);
+
+    if (sps->pic_order_cnt_type == 0) {
+        uint32_t log2_max_pic_order_cnt_lsb_minus4 = read_ue(bs);
+
+        if (log2_max_pic_order_cnt_lsb_minus4 > 12) {
+            free(sps);
+            return NULL;
+        }
+
+        sps->log2_max_pic_order_cnt_lsb_minus4 = log2_max_pic_order_cnt_lsb_minus4;
+    } else if (sps->pic_order_cnt_type == 1) {
+        // Skip
+        sps->delta_pic_order_always_zero_flag = read_bit(bs);
+        read_se(bs);  // offset_for_non_ref_pic
+        read_se(bs);  // offset_for_top_to_bottom_field
+
+        uint32_t num_ref_frames_in_pic_order_cnt_cycle = read_ue(bs);
+
+        for (uint32_t i = 0; i < num_ref_frames_in_pic_order_cnt_cycle; i++) {
+            read_se(bs); // offset_for_ref_frame[i]
+        }
+    }
+
+    sps->num_ref_frames = read_ue(bs);
+    sps->gaps_in_frame_num_value_allowed_flag = read_bit(bs);
+    sps->pic_width_in_mbs_minus1 = read_ue(bs);
+    sps->pic_height_in_map_units_minus1 = read_ue(bs);
+    sps->frame_mbs_only_flag = read_bit(bs);
+
+    if (!sps->frame_mbs_only_flag) {
+        read_bit(bs); // mb_adaptive_frame_field_flag
+    }
+
+    sps->direct_8x8_inference_flag = read_bit(bs);
+    sps->frame_cropping_flag = read_bit(bs);
+
+    if (sps->frame_cropping_flag) {
+        sps->frame_crop_left_offset = read_ue(bs);
+        sps->frame_crop_right_offset = read_ue(bs);
+        sps->frame_crop_top_offset = read_ue(bs);
+        sps->frame_crop_bottom_offset = read_ue(bs);
+    }
+
+    sps->vui_parameters_present_flag = read_bit(bs);
+
+    if (sps->vui_parameters_present_flag) {
+        parse_vui_timing(bs, sps);
+    }
+
+    return sps;
+}
+
+// Frames per second from the VUI timing info, or 0 when the SPS has none.
+// One frame takes two ticks (E.2.1).
+static inline double sps_frame_rate(const SPS *sps) {
+    if (!sps->timing_info_present_flag || sps->num_units_in_tick == 0) return 0;
+    return (double)sps->time_scale / (2.0 * sps->num_units_in_tick);
+}
+
+// Picture size in pixels after frame cropping, whose units depend on the
+// chroma format and on field coding (7.4.2.1.1).
+static inline void sps_picture_size(const SPS *sps, uint32_t *width, uint32_t *height) {
+    uint32_t crop_unit_x = 1, crop_unit_y = 2 - sps->frame_mbs_only_flag;
+
+    if (sps->chroma_format_idc != 0 && !sps->separate_colour_plane_flag) {
+        crop_unit_x = sps->chroma_format_idc == 3 ? 1 : 2;
+        crop_unit_y *= sps->chroma_format_idc == 1 ? 2 : 1;
+    }
+
+    uint32_t coded_width = (sps->pic_width_in_mbs_minus1 + 1) * 16;
+    uint32_t coded_height = (sps->pic_height_in_map_units_minus1 + 1) * 16 * (2 - sps->frame_mbs_only_flag);
+    uint32_t crop_x = crop_unit_x * (sps->frame_crop_left_offset + sps->frame_crop_right_offset);
+    uint32_t crop_y = crop_unit_y * (sps->frame_crop_top_offset + sps->frame_crop_bottom_offset);
+
+    *width = crop_x < coded_width ? coded_width - crop_x : coded_width;
+    *height = crop_y < coded_height ? coded_height - crop_y : coded_height;
+}
+
+static inline void free_sps(SPS *sps) {
+    free(sps);
+}
+
+static PPS* parse_pps(const NALUnit *nal) {
+    if (nal->nal_unit_type != 8) return NULL;
+
+    BitStream stream;
+    BitStream *bs = &stream;
+    init_nal_bit_stream(bs, nal->data + 1, nal->size - 1);
+    PPS *pps = calloc(1, sizeof(PPS));
+    if (!pps) return NULL;
+
+    pps->pic_parameter_set_id = read_ue(bs);
+    pps->seq_parameter_set_id = read_ue(bs);
+    pps->entropy_coding_mode_flag = read_bit(bs);
+    pps->pic_order_present_flag = read_bit(bs);
+    pps->num_slice_groups_minus1 = read_ue(bs);
+
+    if (pps->num_slice_groups_minus1 > 0) {
+        uint32_t slice_group_map_type = read_ue(bs);
+        pps->slice_group_map_type = slice_group_map_type;
+
+        if (slice_group_map_type == 0) {
+            for (uint32_t i = 0; i <= pps->num_slice_groups_minus1; i++) {
+                read_ue(bs); // run_length_minus1[i]
+            }
+        } else if (slice_group_map_type == 2) {
+            for (uint32_t i = 0; i < pps->num_slice_groups_minus1; i++) {
+                read_ue(bs); // top_left[i]
+                read_ue(bs); // bottom_right[i]
+            }
+        } else if (slice_group_map_type == 3 || slice_group_map_type == 4 || slice_group_map_type == 5) {
+            read_bit(bs); // slice_group_change_direction_flag
+            pps->slice_group_change_rate_minus1 = read_ue(bs);
+        } else if (slice_group_map_type == 6) {
+            uint32_t pic_size_in_map_units_minus1 = read_ue(bs);
+
+            uint32_t bits_needed = 0;
+            uint32_t temp = pps->num_slice_groups_minus1 + 1;
+
+            while (temp > 0) {
+                bits_needed++;
+                temp >>= 1;
+            }
+
+            for (uint32_t i = 0; i <= pic_size_in_map_units_minus1; i++) {
+                read_bits(bs, bits_needed); // slice_group_id[i]
+            }
+        }
+    }
+
+    pps->num_ref_idx_l0_active_minus1 = read_ue(bs);
+    pps->num_ref_idx_l1_active_minus1 = read_ue(bs);
+    pps->weighted_pred_flag = read_bit(bs);
+    pps->weighted_bipred_idc = read_bits(bs, 2);
+    pps->pic_init_qp_minus26 = read_se(bs);
+    pps->pic_init_qs_minus26 = read_se(bs);
+    pps->chroma_qp_index_offset = read_se(bs);
+    pps->deblocking_filter_control_present_flag = read_bit(bs);
+    pps->constrained_intra_pred_flag = read_bit(bs);
+    pps->redundant_pic_cnt_present_flag = read_bit(bs);
+
+    return pps;
+}
+
+static inline void free_pps(PPS *pps) {
+    free(pps);
+}
+
+#define MAX_SPS_COUNT 32
+#define MAX_PPS_COUNT 256
+
+enum {
+    SLICE_TYPE_P = 0,
+    SLICE_TYPE_B = 1,
+    SLICE_TYPE_I = 2,
+    SLICE_TYPE_SP = 3,
+    SLICE_TYPE_SI = 4,
+};
+
+static inline const char *slice_type_name(uint8_t slice_type) {
+    static const char *names[] = {"P", "B", "I", "SP", "SI"};
+    return names[slice_type % 5];
+}
+
+static inline uint64_t fnv1a64(uint64_t hash, const void *data, size_t size) {
+    const uint8_t *p = data;
+
+    for (size_t i = 0; i < size; i++) {
+        hash = (hash ^ p[i]) * 0x100000001b3ULL;
+    }
+
+    return hash;
+}
+
+#define FNV1A64_INIT 0xcbf29ce484222325ULL
+
+// The escaped NAL unit bytes a stored parameter set was parsed from.
+typedef struct {
+    uint8_t *data;
+    size_t size;
+    uint64_t hash;
+} ParameterSetBytes;
+
+// Called when an SPS or PPS arrives whose bytes differ from the stored set
+// with the same id. Repeats of the same bytes and the first set for an id do
+// not count as a change.
+typedef void (*ParameterSetCallback)(uint8_t nal_unit_type, uint32_t id, void *opaque);
+
+// Active parameter sets by id, as the slice header parser needs them.
+// Encoders repeat identical headers before every keyframe, so the raw bytes
+// of each set are kept and a repeat is recognised by hash and compare
+// instead of being parsed again. pps_sps resolves a PPS to its SPS, updated
+// whenever either side changes.
+typedef struct {
+    SPS *sps[MAX_SPS_COUNT];
+    PPS *pps[MAX_PPS_COUNT];
+    const SPS *pps_sps[MAX_PPS_COUNT];
+    ParameterSetBytes sps_bytes[MAX_SPS_COUNT];
+    ParameterSetBytes pps_bytes[MAX_PPS_COUNT];
+    const SPS *last_sps;
+    const PPS *last_pps;
+    ParameterSetCallback changed;
+    void *opaque;
+} ParameterSets;
+
+enum {
+    PARAMETER_SET_NEW = 1,
+    PARAMETER_SET_UNCHANGED = 2,
+    PARAMETER_SET_CHANGED = 3,
+};
+
+static inline void free_parameter_sets(ParameterSets *ps) {
+    for (int i = 0; i < MAX_SPS_COUNT; i++) {
+        free_sps(ps->sps[i]);
+        free(ps->sps_bytes[i].data);
+    }
+
+    for (int i = 0; i < MAX_PPS_COUNT; i++) {
+        free_pps(ps->pps[i]);
+        free(ps->pps_bytes[i].data);
+    }
+
+    ParameterSetCallback changed = ps->changed;
+    void *opaque = ps->opaque;
+
+    memset(ps, 0, sizeof(*ps));
+    ps->changed = changed;
+    ps->opaque = opaque;
+}
+
+// The id of an SPS or PPS without parsing the rest of it.
+static inline uint32_t parameter_set_id(const NALUnit *nal) {
+    BitStream bs;
+    init_nal_bit_stream(&bs, nal->data + 1, nal->size - 1);
+
+    if (nal->nal_unit_type == 7) {
+        skip_bits(&bs, 24); // profile_idc, constraint_set_flags, level_idc
+    }
+
+    return read_ue(&bs);
+}
+
+static inline int same_parameter_set_bytes(const ParameterSetBytes *bytes, const NALUnit *nal, uint64_t hash) {
+    return bytes->data && bytes->size == nal->size && bytes->hash == hash &&
+           memcmp(bytes->data, nal->data, nal->size) == 0;
+}
+
+static inline int set_parameter_set_bytes(ParameterSetBytes *bytes, const NALUnit *nal, uint64_t hash) {
+    uint8_t *data = malloc(nal->size);
+    if (!data) return -1;
+
+    memcpy(data, nal->data, nal->size);
+    free(bytes->data);
+    bytes->data = data;
+    bytes->size = nal->size;
+    bytes->hash = hash;
+    return 0;
+}
+
+static int update_sps(ParameterSets *ps, const NALUnit *nal, uint64_t hash) {
+    uint32_t id = parameter_set_id(nal);
+    if (id >= MAX_SPS_COUNT) return -1;
+
+    if (same_parameter_set_bytes(&ps->sps_bytes[id], nal, hash)) {
+        ps->last_sps = ps->sps[id];
+        return PARAMETER_SET_UNCHANGED;
+    }
+
+    SPS *sps = parse_sps(nal);
+
+    if (!sps || set_parameter_set_bytes(&ps->sps_bytes[id], nal, hash) < 0) {
+        free_sps(sps);
+        return -1;
+    }
+
+    SPS *old = ps->sps[id];
+    ps->sps[id] = sps;
+    ps->last_sps = sps;
+
+    for (int i = 0; i < MAX_PPS_COUNT; i++) {
+        if (ps->pps[i] && ps->pps[i]->seq_parameter_set_id == id) ps->pps_sps[i] = sps;
+    }
+
+    free_sps(old);
+
+    if (!old) return PARAMETER_SET_NEW;
+    if (ps->changed) ps->changed(7, id, ps->opaque);
+    return PARAMETER_SET_CHANGED;
+}
+
+static int update_pps(ParameterSets *ps, const NALUnit *nal, uint64_t hash) {
+    uint32_t id = parameter_set_id(nal);
+    if (id >= MAX_PPS_COUNT) return -1;
+
+    if (same_parameter_set_bytes(&ps->pps_bytes[id], nal, hash)) {
+        ps->last_pps = ps->pps[id];
+        return PARAMETER_SET_UNCHANGED;
+    }
+
+    PPS *pps = parse_pps(nal);
+
+    if (!pps || pps->seq_parameter_set_id >= MAX_SPS_COUNT || set_parameter_set_bytes(&ps->pps_bytes[id], nal, hash) < 0) {
+        free_pps(pps);
+        return -1;
+    }
+
+    PPS *old = ps->pps[id];
+    ps->pps[id] = pps;
+    ps->pps_sps[id] = ps->sps[pps->seq_parameter_set_id];
+    ps->last_pps = pps;
+    free_pps(old);
+
+    if (!old) return PARAMETER_SET_NEW;
+    if (ps->changed) ps->changed(8, id, ps->opaque);
+    return PARAMETER_SET_CHANGED;
+}
+
+// Stores an SPS or PPS NAL unit under its id. Returns PARAMETER_SET_NEW,
+// _UNCHANGED or _CHANGED, 0 for other NAL units and -1 for a parameter set
+// with an out of range id or when memory ran out. last_sps or last_pps
+// points at the stored set afterwards.
+static int update_parameter_sets(ParameterSets *ps, const NALUnit *nal) {
+    if (nal->nal_unit_type != 7 && nal->nal_unit_type != 8) return 0;
+
+    uint64_t hash = fnv1a64(FNV1A64_INIT, nal->data, nal->size);
+
+    if (nal->nal_unit_type == 7) {
+        ps->last_sps = NULL;
+        return update_sps(ps, nal, hash);
+    }
+
+    ps->last_pps = NULL;
+    return update_pps(ps, nal, hash);
+}
+
+// The slice header up to the fields that tell the first slice of a new
+// picture apart (7.4.1.2.4).
+typedef struct {
+    uint8_t nal_unit_type;
+    uint8_t nal_ref_idc;
+    uint32_t first_mb_in_slice;
+    uint8_t slice_type;
+    uint8_t pic_parameter_set_id;
+    uint8_t colour_plane_id;
+    uint32_t frame_num;
+    uint8_t field_pic_flag;
+    uint8_t bottom_field_flag;
+    uint32_t idr_pic_id;
+    uint32_t pic_order_cnt_lsb;
+    int32_t delta_pic_order_cnt_bottom;
+    int32_t delta_pic_order_cnt[2];
+    uint32_t redundant_pic_cnt;
+
+    // The rest of the header, only filled in by parse_slice_header_tail.
+    uint8_t direct_spatial_mv_pred_flag;
+    uint8_t num_ref_idx_l0_active_minus1;
+    uint8_t num_ref_idx_l1_active_minus1;
+    int8_t slice_qp_delta;
+    int8_t slice_qs_delta;
+    uint8_t disable_deblocking_filter_idc;
+    int8_t slice_alpha_c0_offset_div2;
+    int8_t slice_beta_offset_div2;
+    uint32_t slice_group_change_cycle;
+} SliceHeader;
+
+static inline int is_slice_nal_unit(uint8_t nal_unit_type) {
+    return nal_unit_type == 1 || nal_unit_type == 5;
+}
+
+// Reads the slice header up to redundant_pic_cnt. Returns 0 on success and
+// -1 when the header references a parameter set that has not been seen.
+// first_mb_in_slice, slice_type and pic_parameter_set_id are filled in
+// either way.
+static int read_slice_header(BitStream *bs, const NALUnit *nal, const ParameterSets *ps, SliceHeader *sh) {
+    if (!is_slice_nal_unit(nal->nal_unit_type)) return -1;
+
+    memset(sh, 0, sizeof(*sh));
+
+    sh->nal_unit_type = nal->nal_unit_type;
+    sh->nal_ref_idc = nal->nal_ref_idc;
+    sh->first_mb_in_slice = read_ue(bs);
+    sh->slice_type = read_ue(bs) % 5;
+    uint32_t pps_id = read_ue(bs);
+
+    if (pps_id >= MAX_PPS_COUNT || !ps->pps[pps_id]) return -1;
+    sh->pic_parameter_set_id = pps_id;
+
+    const PPS *pps = ps->pps[pps_id];
+    const SPS *sps = ps->pps_sps[pps_id];
+    if (!sps) return -1;
+
+    if (sps->separate_colour_plane_flag) {
+        sh->colour_plane_id = read_bits(bs, 2);
+    }
+
+    sh->frame_num = read_bits(bs, sps->log2_max_frame_num_minus4 + 4);
+
+    if (!sps->frame_mbs_only_flag) {
+        sh->field_pic_flag = read_bit(bs);
+
+        if (sh->field_pic_flag) {
+            sh->bottom_field_flag = read_bit(bs);
+        }
+    }
+
+    if (nal->nal_unit_type == 5) {
+        sh->idr_pic_id = read_ue(bs);
+    }
+
+    if (sps->pic_order_cnt_type == 0) {
+        sh->pic_order_cnt_lsb = read_bits(bs, sps->log2_max_pic_order_cnt_lsb_minus4 + 4);
+
+        if (pps->pic_order_present_flag && !sh->field_pic_flag) {
+            sh->delta_pic_order_cnt_bottom = read_se(bs);
+        }
+    } else if (sps->pic_order_cnt_type == 1 && !sps->delta_pic_order_always_zero_flag) {
+        sh->delta_pic_order_cnt[0] = read_se(bs);
+
+        if (pps->pic_order_present_flag && !sh->field_pic_flag) {
+            sh->delta_pic_order_cnt[1] = read_se(bs);
+        }
+    }
+
+    if (pps->redundant_pic_cnt_present_flag) {
+        sh->redundant_pic_cnt = read_ue(bs);
+    }
+
+    return 0;
+}
+
+static inline int parse_slice_header(const NALUnit *nal, const ParameterSets *ps, SliceHeader *sh) {
+    BitStream bs;
+    init_nal_bit_stream(&bs, nal->data + 1, nal->size - 1);
+    return read_slice_header(&bs, nal, ps, sh);
+}
+
+// Upper bounds for the loops of ref_pic_list_modification() and
+// dec_ref_pic_marking(), so that corrupt input cannot spin forever.
+#define MAX_REF_PIC_LIST_MODIFICATIONS 33
+#define MAX_MEMORY_MANAGEMENT_OPERATIONS 66
+
+static int read_ref_pic_list_modification(BitStream *bs) {
+    if (!read_bit(bs)) return 0; // ref_pic_list_modification_flag_lX
+
+    for (int i = 0; i < MAX_REF_PIC_LIST_MODIFICATIONS; i++) {
+        uint32_t modification_of_pic_nums_idc = read_ue(bs);
+
+        if (modification_of_pic_nums_idc == 3) return 0;
+        if (modification_of_pic_nums_idc > 3) return -1;
+
+        read_ue(bs); // abs_diff_pic_num_minus1 or long_term_pic_num
+    }
+
+    return -1;
+}
+
+static void read_pred_weight_table(BitStream *bs, const SPS *sps, const SliceHeader *sh) {
+    int chroma = !sps->separate_colour_plane_flag && sps->chroma_format_idc != 0;
+
+    read_ue(bs); // luma_log2_weight_denom
+    if (chroma) read_ue(bs); // chroma_log2_weight_denom
+
+    for (int list = 0; list < (sh->slice_type == SLICE_TYPE_B ? 2 : 1); list++) {
+        int count = (list ? sh->num_ref_idx_l1_active_minus1 : sh->num_ref_idx_l0_active_minus1) + 1;
+
+        for (int i = 0; i < count; i++) {
+            if (read_bit(bs)) { // luma_weight_lX_flag
+                read_se(bs); // luma_weight_lX
+                read_se(bs); // luma_offset_lX
+            }
+
+            if (chroma && read_bit(bs)) { // chroma_weight_lX_flag
+                for (int j = 0; j < 4; j++) read_se(bs); // chroma_weight_lX, chroma_offset_lX
+            }
+        }
+    }
+}
+
+static int read_dec_ref_pic_marking(BitStream *bs, const SliceHeader *sh) {
+    if (sh->nal_unit_type == 5) {
+        read_bit(bs); // no_output_of_prior_pics_flag
+        read_bit(bs); // long_term_reference_flag
+        return 0;
+    }
+
+    if (!read_bit(bs)) return 0; // adaptive_ref_pic_marking_mode_flag
+
+    for (int i = 0; i < MAX_MEMORY_MANAGEMENT_OPERATIONS; i++) {
+        uint32_t memory_management_control_operation = read_ue(bs);
+
+        switch (memory_management_control_operation) {
+        case 0:
+            return 0;
+        case 1: // difference_of_pic_nums_minus1
+        case 2: // long_term_pic_num
+        case 4: // max_long_term_frame_idx_plus1
+        case 6: // long_term_frame_idx
+            read_ue(bs);
+            break;
+        case 3:
+            read_ue(bs); // difference_of_pic_nums_minus1
+            read_ue(bs); // long_term_frame_idx
+            break;
+        case 5:
+            break;
+        default:
+            return -1;
+        }
+    }
+
+    return -1;
+}
+
+// Continues after read_slice_header with the rest of slice_header() (7.3.3),
+// leaving bs at the start of slice_data(). Returns -1 on invalid syntax.
+static inline int parse_slice_header_tail(BitStream *bs, const ParameterSets *ps, SliceHeader *sh) {
+    const PPS *pps = ps->pps[sh->pic_parameter_set_id];
+    const SPS *sps = ps->pps_sps[sh->pic_parameter_set_id];
+    uint8_t type = sh->slice_type;
+
+    if (!pps || !sps) return -1;
+
+    if (type == SLICE_TYPE_B) {
+        sh->direct_spatial_mv_pred_flag = read_bit(bs);
+    }
+
+    sh->num_ref_idx_l0_active_minus1 = pps->num_ref_idx_l0_active_minus1;
+    sh->num_ref_idx_l1_active_minus1 = pps->num_ref_idx_l1_active_minus1;
+
+    if (type == SLICE_TYPE_P || type == SLICE_TYPE_SP || type == SLICE_TYPE_B) {
+        if (read_bit(bs)) { // num_ref_idx_active_override_flag
+            uint32_t l0 = read_ue(bs);
+            uint32_t l1 = type == SLICE_TYPE_B ? read_ue(bs) : 0;
+
+            if (l0 > 31 || l1 > 31) return -1;
+            sh->num_ref_idx_l0_active_minus1 = l0;
+            if (type == SLICE_TYPE_B) sh->num_ref_idx_l1_active_minus1 = l1;
+        }
+    }
+
+    if (type != SLICE_TYPE_I && type != SLICE_TYPE_SI) {
+        if (read_ref_pic_list_modification(bs) < 0) return -1;
+        if (type == SLICE_TYPE_B && read_ref_pic_list_modification(bs) < 0) return -1;
+    }
+
+    if ((pps->weighted_pred_flag && (type == SLICE_TYPE_P || type == SLICE_TYPE_SP)) ||
+        (pps->weighted_bipred_idc == 1 && type == SLICE_TYPE_B)) {
+        read_pred_weight_table(bs, sps, sh);
+    }
+
+    if (sh->nal_ref_idc != 0 && read_dec_ref_pic_marking(bs, sh) < 0) return -1;
+
+    if (pps->entropy_coding_mode_flag && type != SLICE_TYPE_I && type != SLICE_TYPE_SI) {
+        read_ue(bs); // cabac_init_idc
+    }
+
+    sh->slice_qp_delta = read_se(bs);
+
+    if (type == SLICE_TYPE_SP || type == SLICE_TYPE_SI) {
+        if (type == SLICE_TYPE_SP) read_bit(bs); // sp_for_switch_flag
+        sh->slice_qs_delta = read_se(bs);
+    }
+
+    if (pps->deblocking_filter_control_present_flag) {
+        sh->disable_deblocking_filter_idc = read_ue(bs);
+
+        if (sh->disable_deblocking_filter_idc != 1) {
+            sh->slice_alpha_c0_offset_div2 = read_se(bs);
+            sh->slice_beta_offset_div2 = read_se(bs);
+        }
+    }
+
+    if (pps->num_slice_groups_minus1 > 0 && pps->slice_group_map_type >= 3 && pps->slice_group_map_type <= 5) {
+        uint32_t pic_size = (sps->pic_width_in_mbs_minus1 + 1) * (sps->pic_height_in_map_units_minus1 + 1);
+        uint64_t rate = (uint64_t)pps->slice_group_change_rate_minus1 + 1;
+        // The division in Ceil(Log2(PicSizeInMapUnits / SliceGroupChangeRate + 1))
+        // is exact, so it rounds up here: 10 map units at rate 3 take 3 bits.
+        uint64_t cycles = (pic_size + rate - 1) / rate + 1;
+        uint8_t bits = 0;
+
+        while ((1ull << bits) < cycles) bits++;
+        sh->slice_group_change_cycle = read_bits(bs, bits);
+    }
+
+    int qp = 26 + pps->pic_init_qp_minus26 + sh->slice_qp_delta;
+    return qp < 0 || qp > 51 ? -1 : 0;
+}
+
+// 7.4.1.2.4: does slice cur belong to a different primary coded picture
+// than the slice prev before it?
+static int is_first_slice_of_picture(const SliceHeader *prev, const SliceHeader *cur) {
+    return cur->frame_num != prev->frame_num ||
+           cur->pic_parameter_set_id != prev->pic_parameter_set_id ||
+           cur->field_pic_flag != prev->field_pic_flag ||
+           cur->bottom_field_flag != prev->bottom_field_flag ||
+           (cur->nal_ref_idc != prev->nal_ref_idc && (cur->nal_ref_idc == 0 || prev->nal_ref_idc == 0)) ||
+           cur->pic_order_cnt_lsb != prev->pic_order_cnt_lsb ||
+           cur->delta_pic_order_cnt_bottom != prev->delta_pic_order_cnt_bottom ||
+           cur->delta_pic_order_cnt[0] != prev->delta_pic_order_cnt[0] ||
+           cur->delta_pic_order_cnt[1] != prev->delta_pic_order_cnt[1] ||
+           (cur->nal_unit_type == 5) != (prev->nal_unit_type == 5) ||
+           (cur->nal_unit_type == 5 && cur->idr_pic_id != prev->idr_pic_id);
+}
+
+// One access unit: the NAL units of one primary coded picture plus the
+// AUD/SPS/PPS/SEI in front of it. offset is the position of its first start
+// code and size runs up to the start code of the next access unit.
+typedef struct {
+    uint64_t offset;
+    uint64_t size;
+    uint32_t nal_count;
+    uint32_t slice_count;
+    uint8_t has_sps;
+    uint8_t has_pps;
+    uint8_t idr;
+    SliceHeader first_slice;
+} AccessUnit;
+
+// Groups NAL units into access units (7.4.1.2.3) and keeps the parameter
+// sets the slice headers need. Works on NAL units from either NALIterator or
+// NALStreamParser.
+typedef struct {
+    ParameterSets ps;
+    AccessUnit current;
+    SliceHeader last_slice;
+    int in_access_unit;
+    int has_vcl;
+    uint64_t end;
+} AccessUnitAssembler;
+
+static inline void init_access_unit_assembler(AccessUnitAssembler *a) {
+    memset(a, 0, sizeof(*a));
+}
+
+static inline void free_access_unit_assembler(AccessUnitAssembler *a) {
+    free_parameter_sets(&a->ps);
+}
+
+// Feeds the next NAL unit. When it starts a new access unit the previous one
+// is complete: it is copied to *done and 1 is returned.
+static inline int add_nal_to_access_unit(AccessUnitAssembler *a, const NALUnit *nal, AccessUnit *done) {
+    uint8_t type = nal->nal_unit_type;
+    int starts_new = 0;
+    SliceHeader sh = {0};
+
+    update_parameter_sets(&a->ps, nal);
+
+    if (is_slice_nal_unit(type)) {
+        int ok = parse_slice_header(nal, &a->ps, &sh) == 0;
+
+        // Without its parameter sets a slice can only be placed by position.
+        starts_new = a->has_vcl && (ok ? is_first_slice_of_picture(&a->last_slice, &sh) : sh.first_mb_in_slice == 0);
+        a->last_slice = sh;
+    } else if (type == 6 || type == 7 || type == 8 || type == 9 || (type >= 14 && type <= 18)) {
+        starts_new = a->has_vcl;
+    }
+
+    int completed = 0;
+    uint64_t start = nal->offset - nal->start_code_size;
+
+    if (!a->in_access_unit || starts_new) {
+        if (a->in_access_unit) {
+            a->current.size = a->end - a->current.offset;
+            *done = a->current;
+            completed = 1;
+        }
+
+        memset(&a->current, 0, sizeof(a->current));
+        a->current.offset = start;
+        a->in_access_unit = 1;
+        a->has_vcl = 0;
+    }
+
+    a->current.nal_count++;
+    a->current.has_sps |= type == 7;
+    a->current.has_pps |= type == 8;
+
+    if (is_slice_nal_unit(type)) {
+        if (a->current.slice_count++ == 0) {
+            a->current.first_slice = sh;
+            a->current.idr = type == 5;
+        }
+        a->has_vcl = 1;
+    }
+
+    a->end = nal->offset + nal->size;
+    return completed;
+}
+
+// Completes the last access unit at the end of the stream.
+static inline int finish_access_unit(AccessUnitAssembler *a, AccessUnit *done) {
+    if (!a->in_access_unit) return 0;
+
+    a->current.size = a->end - a->current.offset;
+    *done = a->current;
+    a->in_access_unit = 0;
+    a->has_vcl = 0;
+    return 1;
+}
+
+#endif // H264_H
@@ -0,0 +1,159 @@
+#ifndef H264_FILTER_H
+#define H264_FILTER_H
+
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "annexb.h"
+#include "h264.h"
+#include "iov_writer.h"
+
+// Rewrites an Annex B stream without the NAL units a lower frame rate or a
+// leaner stream can do without. Nothing is decoded: access units are told
+// apart by their slice headers and whole access units or single NAL units
+// are dropped. What is kept goes out with writev straight from the input
+// buffer, adjacent NAL units merged into one iovec, so an input that is
+// mostly kept costs a handful of system calls per batch.
+//
+// SPS and PPS are always kept, wherever they are, so every remaining slice
+// still finds its parameter sets.
+
+enum {
+    H264_FILTER_NON_REF = 1 << 0, // access units of non-reference pictures
+    H264_FILTER_NON_IDR = 1 << 1, // access units of anything but IDR pictures
+    H264_FILTER_SEI = 1 << 2,
+    H264_FILTER_FILLER = 1 << 3,
+};
+
+typedef struct {
+    uint64_t offset;
+    uint64_t size;
+    uint8_t nal_unit_type;
+    uint8_t start_code_size;
+} H264FilterNAL;
+
+typedef struct {
+    AccessUnitAssembler assembler;
+    IOVWriter writer;
+    int drop;
+    const uint8_t *data;
+
+    // NAL units of the access unit in progress, offsets from data.
+    H264FilterNAL *nals;
+    size_t nal_count;
+    size_t nal_capacity;
+
+    uint64_t access_units;
+    uint64_t kept_access_units;
+    uint64_t bytes;
+    uint64_t kept_bytes;
+} H264Filter;
+
+// Every NAL unit handed to the filter has to point into data, which has to
+// stay valid until finish_h264_filter returns.
+static inline void init_h264_filter(H264Filter *f, int drop, int fd, const uint8_t *data) {
+    memset(f, 0, sizeof(*f));
+    init_access_unit_assembler(&f->assembler);
+    init_iov_writer(&f->writer, fd);
+    f->drop = drop;
+    f->data = data;
+}
+
+static inline void free_h264_filter(H264Filter *f) {
+    free_access_unit_assembler(&f->assembler);
+    free(f->nals);
+    f->nals = NULL;
+}
+
+static int write_h264_filter(H264Filter *f, const uint8_t *data, size_t size) {
+    f->kept_bytes += size;
+    return write_iov_writer(&f->writer, data, size);
+}
+
+static int keep_h264_filter_access_unit(const H264Filter *f, const AccessUnit *au) {
+    if (au->slice_count == 0) return 1;
+    if ((f->drop & H264_FILTER_NON_REF) && au->first_slice.nal_ref_idc == 0) return 0;
+    if ((f->drop & H264_FILTER_NON_IDR) && !au->idr) return 0;
+    return 1;
+}
+
+static int keep_h264_filter_nal(const H264Filter *f, int keep_access_unit, uint8_t nal_unit_type) {
+    if (nal_unit_type == 7 || nal_unit_type == 8) return 1;
+    if (!keep_access_unit) return 0;
+    if ((f->drop & H264_FILTER_SEI) && nal_unit_type == 6) return 0;
+    if ((f->drop & H264_FILTER_FILLER) && nal_unit_type == 12) return 0;
+    return 1;
+}
+
+static int write_h264_filter_access_unit(H264Filter *f, const AccessUnit *au) {
+    static const uint8_t zero_byte = 0;
+    int keep_access_unit = keep_h264_filter_access_unit(f, au);
+    int first = 1;
+
+    f->access_units++;
+    f->kept_access_units += keep_access_unit;
+
+    for (size_t i = 0; i < f->nal_count; i++) {
+        const H264FilterNAL *nal = &f->nals[i];
+
+        if (!keep_h264_filter_nal(f, keep_access_unit, nal->nal_unit_type)) continue;
+
+        // The first NAL unit of an access unit and parameter sets take the
+        // four byte start code (B.1.2), which a dropped AUD or SEI in front
+        // may have had instead.
+        if (nal->start_code_size == 3 && (first || nal->nal_unit_type == 7 || nal->nal_unit_type == 8)) {
+            if (write_h264_filter(f, &zero_byte, 1) < 0) return -1;
+        }
+
+        if (write_h264_filter(f, f->data + nal->offset, nal->size) < 0) return -1;
+        first = 0;
+    }
+
+    f->nal_count = 0;
+    return 0;
+}
+
+static int add_nal_to_h264_filter(H264Filter *f, const NALUnit *nal) {
+    AccessUnit done;
+
+    if (add_nal_to_access_unit(&f->assembler, nal, &done) && write_h264_filter_access_unit(f, &done) < 0) {
+        return -1;
+    }
+
+    if (f->nal_count == f->nal_capacity) {
+        size_t capacity = f->nal_capacity ? f->nal_capacity * 2 : 64;
+        H264FilterNAL *nals = realloc(f->nals, capacity * sizeof(H264FilterNAL));
+
+        if (!nals) {
+            fprintf(stderr, "Failed to allocate memory\n");
+            return -1;
+        }
+
+        f->nals = nals;
+        f->nal_capacity = capacity;
+    }
+
+    H264FilterNAL *entry = &f->nals[f->nal_count++];
+    entry->offset = nal->offset - nal->start_code_size;
+    entry->size = nal->size + nal->start_code_size;
+    entry->nal_unit_type = nal->nal_unit_type;
+    entry->start_code_size = nal->start_code_size;
+
+    f->bytes += entry->size;
+    return 0;
+}
+
+// Writes out the last access unit and everything still batched.
+static int finish_h264_filter(H264Filter *f) {
+    AccessUnit done;
+
+    if (finish_access_unit(&f->assembler, &done) && write_h264_filter_access_unit(f, &done) < 0) {
+        return -1;
+    }
+
+    return flush_iov_writer(&f->writer);
+}
+
+#endif // H264_FILTER_H
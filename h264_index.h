@@ -0,0 +1,477 @@
+#ifndef H264_INDEX_H
+#define H264_INDEX_H
+
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+#include "annexb.h"
+#include "h264.h"
+#include "mapped_file.h"
+#include "parallel_nal.h"
+
+// Sidecar index of a raw Annex B file: the byte range of every access unit,
+// the access unit number of every IDR and the position of every SPS and PPS.
+// The file is a header followed by the three tables, written in host (little
+// endian) byte order so that a loaded index is used straight from the mapping:
+//
+//   H264IndexHeader
+//   H264IndexAccessUnit   [access_unit_count]
+//   uint64_t              [keyframe_count]
+//   H264IndexParameterSet [parameter_set_count]
+//
+// checksum is FNV-1a over everything after the header. source_size and
+// source_mtime_ns, the modification time in nanoseconds, tell a stale index
+// from a current one.
+
+#define H264_INDEX_MAGIC "H264IDX"
+#define H264_INDEX_VERSION 2
+#define H264_INDEX_SUFFIX ".idx"
+
+enum {
+    H264_INDEX_IDR = 1 << 0,
+    H264_INDEX_HAS_SPS = 1 << 1,
+    H264_INDEX_HAS_PPS = 1 << 2,
+};
+
+typedef struct {
+    char magic[8];
+    uint32_t version;
+    uint32_t header_size;
+    uint64_t source_size;
+    int64_t source_mtime_ns;
+    uint64_t access_unit_count;
+    uint64_t keyframe_count;
+    uint64_t parameter_set_count;
+    uint64_t checksum;
+} H264IndexHeader;
+
+typedef struct {
+    uint64_t offset;
+    uint32_t size;
+    uint8_t flags;
+    uint8_t slice_type;
+    uint16_t nal_count;
+} H264IndexAccessUnit;
+
+// offset and size cover the start code as well.
+typedef struct {
+    uint64_t offset;
+    uint32_t size;
+    uint8_t nal_unit_type;
+    uint8_t id;
+    uint16_t reserved;
+} H264IndexParameterSet;
+
+_Static_assert(sizeof(H264IndexHeader) == 64, "H264IndexHeader layout");
+_Static_assert(sizeof(H264IndexAccessUnit) == 16, "H264IndexAccessUnit layout");
+_Static_assert(sizeof(H264IndexParameterSet) == 16, "H264IndexParameterSet layout");
+
+typedef struct {
+    AccessUnitAssembler assembler;
+    H264IndexAccessUnit *access_units;
+    uint64_t access_unit_count;
+    uint64_t access_unit_capacity;
+    uint64_t *keyframes;
+    uint64_t keyframe_count;
+    uint64_t keyframe_capacity;
+    H264IndexParameterSet *parameter_sets;
+    uint64_t parameter_set_count;
+    uint64_t parameter_set_capacity;
+} H264IndexBuilder;
+
+static inline void init_h264_index_builder(H264IndexBuilder *b) {
+    memset(b, 0, sizeof(*b));
+    init_access_unit_assembler(&b->assembler);
+}
+
+static inline void free_h264_index_builder(H264IndexBuilder *b) {
+    free_access_unit_assembler(&b->assembler);
+    free(b->access_units);
+    free(b->keyframes);
+    free(b->parameter_sets);
+    memset(b, 0, sizeof(*b));
+}
+
+// Grows one of the builder tables to hold one more entry.
+static inline int reserve_index_entry(void **table, uint64_t *capacity, uint64_t count, size_t entry_size) {
+    if (count < *capacity) return 0;
+
+    uint64_t new_capacity = *capacity ? *capacity * 2 : 1024;
+    void *new_table = realloc(*table, new_capacity * entry_size);
+    if (!new_table) return -1;
+
+    *table = new_table;
+    *capacity = new_capacity;
+    return 0;
+}
+
+static int add_access_unit_to_h264_index(H264IndexBuilder *b, const AccessUnit *au) {
+    if (reserve_index_entry((void **)&b->access_units, &b->access_unit_capacity, b->access_unit_count, sizeof(H264IndexAccessUnit)) < 0) return -1;
+
+    H264IndexAccessUnit *entry = &b->access_units[b->access_unit_count];
+    entry->offset = au->offset;
+    entry->size = (uint32_t)au->size;
+    entry->flags = (au->idr ? H264_INDEX_IDR : 0) |
+                   (au->has_sps ? H264_INDEX_HAS_SPS : 0) |
+                   (au->has_pps ? H264_INDEX_HAS_PPS : 0);
+    entry->slice_type = au->slice_count ? au->first_slice.slice_type : 0xff;
+    entry->nal_count = au->nal_count > UINT16_MAX ? UINT16_MAX : (uint16_t)au->nal_count;
+
+    if (au->idr) {
+        if (reserve_index_entry((void **)&b->keyframes, &b->keyframe_capacity, b->keyframe_count, sizeof(uint64_t)) < 0) return -1;
+        b->keyframes[b->keyframe_count++] = b->access_unit_count;
+    }
+
+    b->access_unit_count++;
+    return 0;
+}
+
+static int add_nal_to_h264_index(H264IndexBuilder *b, const NALUnit *nal) {
+    AccessUnit done;
+
+    if (add_nal_to_access_unit(&b->assembler, nal, &done) && add_access_unit_to_h264_index(b, &done) < 0) {
+        return -1;
+    }
+
+    if (nal->nal_unit_type == 7 || nal->nal_unit_type == 8) {
+        if (reserve_index_entry((void **)&b->parameter_sets, &b->parameter_set_capacity, b->parameter_set_count, sizeof(H264IndexParameterSet)) < 0) return -1;
+
+        H264IndexParameterSet *entry = &b->parameter_sets[b->parameter_set_count++];
+        entry->offset = nal->offset - nal->start_code_size;
+        entry->size = (uint32_t)(nal->size + nal->start_code_size);
+        entry->nal_unit_type = nal->nal_unit_type;
+        entry->id = (uint8_t)parameter_set_id(nal);
+        entry->reserved = 0;
+    }
+
+    return 0;
+}
+
+static inline int finish_h264_index(H264IndexBuilder *b) {
+    AccessUnit done;
+
+    if (finish_access_unit(&b->assembler, &done)) {
+        return add_access_unit_to_h264_index(b, &done);
+    }
+
+    return 0;
+}
+
+typedef struct {
+    H264IndexBuilder *builder;
+    int ret;
+} H264IndexScan;
+
+static void index_nal_unit(const NALUnit *nal, void *opaque) {
+    H264IndexScan *scan = opaque;
+
+    if (scan->ret == 0) {
+        scan->ret = add_nal_to_h264_index(scan->builder, nal);
+    }
+}
+
+// Indexes filename into builder, which has to be freed either way. source
+// receives the stat of filename for write_h264_index.
+static int build_h264_index(const char *filename, int threads, H264IndexBuilder *builder, struct stat *source) {
+    MappedFile file;
+
+    init_h264_index_builder(builder);
+
+    if (stat(filename, source) < 0 || map_file(filename, &file) < 0) {
+        fprintf(stderr, "Failed to open file: %s\n", filename);
+        return -1;
+    }
+
+    H264IndexScan scan = {builder, 0};
+
+    if (for_each_nal_unit(file.data, file.size, threads, index_nal_unit, &scan) < 0) scan.ret = -1;
+    if (scan.ret == 0) scan.ret = finish_h264_index(builder);
+    if (scan.ret < 0) fprintf(stderr, "Failed to allocate memory\n");
+
+    unmap_file(&file);
+    return scan.ret;
+}
+
+static inline void h264_index_path(const char *source, char *path, size_t size) {
+    snprintf(path, size, "%s%s", source, H264_INDEX_SUFFIX);
+}
+
+// Whole seconds would let a file rewritten at the same size within the same
+// second pass for the one indexed.
+static inline int64_t h264_index_mtime_ns(const struct stat *st) {
+#ifdef __APPLE__
+    return (int64_t)st->st_mtimespec.tv_sec * 1000000000 + st->st_mtimespec.tv_nsec;
+#else
+    return (int64_t)st->st_mtim.tv_sec * 1000000000 + st->st_mtim.tv_nsec;
+#endif
+}
+
+// Lays the index out in memory exactly as it is stored, header and
+// checksum included, into image, which unmap_file frees.
+static inline int pack_h264_index(const H264IndexBuilder *b, const struct stat *source, MappedFile *image) {
+    size_t access_units_size = b->access_unit_count * sizeof(H264IndexAccessUnit);
+    size_t keyframes_size = b->keyframe_count * sizeof(uint64_t);
+    size_t parameter_sets_size = b->parameter_set_count * sizeof(H264IndexParameterSet);
+    size_t size = sizeof(H264IndexHeader) + access_units_size + keyframes_size + parameter_sets_size;
+    uint8_t *data = malloc(size);
+
+    if (!data) {
+        fprintf(stderr, "Failed to allocate memory\n");
+        return -1;
+    }
+
+    H264IndexHeader *header = (H264IndexHeader *)data;
+    uint8_t *tables = data + sizeof(*header);
+
+    memset(header, 0, sizeof(*header));
+    memcpy(header->magic, H264_INDEX_MAGIC, sizeof(H264_INDEX_MAGIC));
+    header->version = H264_INDEX_VERSION;
+    header->header_size = sizeof(*header);
+    header->source_size = source->st_size;
+    header->source_mtime_ns = h264_index_mtime_ns(source);
+    header->access_unit_count = b->access_unit_count;
+    header->keyframe_count = b->keyframe_count;
+    header->parameter_set_count = b->parameter_set_count;
+
+    // Tables of an empty stream were never allocated.
+    if (access_units_size) memcpy(tables, b->access_units, access_units_size);
+    if (keyframes_size) memcpy(tables + access_units_size, b->keyframes, keyframes_size);
+    if (parameter_sets_size) {
+        memcpy(tables + access_units_size + keyframes_size, b->parameter_sets, parameter_sets_size);
+    }
+
+    header->checksum = fnv1a64(FNV1A64_INIT, tables, size - sizeof(*header));
+
+    image->data = data;
+    image->size = size;
+    image->mapped = 0;
+    return 0;
+}
+
+// Written next to path and renamed over it, so that a reader never maps
+// a half-written index.
+static inline int write_h264_index_image(const MappedFile *image, const char *path) {
+    char temp[4096];
+    int length = snprintf(temp, sizeof(temp), "%s.%ld.tmp", path, (long)getpid());
+    FILE *file = length < (int)sizeof(temp) ? fopen(temp, "wb") : NULL;
+
+    if (!file) {
+        fprintf(stderr, "Failed to open file: %s\n", temp);
+        return -1;
+    }
+
+    int ok = fwrite(image->data, 1, image->size, file) == image->size;
+
+    if (fclose(file) != 0) ok = 0;
+    if (ok && rename(temp, path) != 0) ok = 0;
+
+    if (!ok) {
+        fprintf(stderr, "Failed to write file: %s\n", path);
+        unlink(temp);
+        return -1;
+    }
+
+    return 0;
+}
+
+static inline int write_h264_index(const H264IndexBuilder *b, const char *path, const struct stat *source) {
+    MappedFile image;
+
+    if (pack_h264_index(b, source, &image) < 0) return -1;
+
+    int ret = write_h264_index_image(&image, path);
+
+    unmap_file(&image);
+    return ret;
+}
+
+// A loaded index points straight into the mapped sidecar file, or into
+// its image in memory when it was just rebuilt.
+typedef struct {
+    MappedFile file;
+    const H264IndexHeader *header;
+    const H264IndexAccessUnit *access_units;
+    const uint64_t *keyframes;
+    const H264IndexParameterSet *parameter_sets;
+} H264Index;
+
+static inline void unload_h264_index(H264Index *index) {
+    unmap_file(&index->file);
+    index->header = NULL;
+}
+
+// Whether the byte range lies within a source of the given size.
+static inline int h264_index_range_fits(uint64_t offset, uint32_t size, uint64_t source_size) {
+    return offset <= source_size && size <= source_size - offset;
+}
+
+// Checks every table entry that a lookup follows: access units have to
+// follow each other without overlap, keyframes have to name access units in
+// increasing order, and every byte range has to lie within the source.
+// Lookups and the readers of the source, which take whole runs of access
+// units from the first offset to the last end, rely on this instead of
+// checking each access.
+static inline int check_h264_index_tables(const H264Index *index) {
+    const H264IndexHeader *header = index->header;
+    uint64_t end = 0;
+
+    for (uint64_t i = 0; i < header->access_unit_count; i++) {
+        const H264IndexAccessUnit *au = &index->access_units[i];
+
+        if (au->offset < end || !h264_index_range_fits(au->offset, au->size, header->source_size)) return 0;
+        end = au->offset + au->size;
+    }
+
+    for (uint64_t i = 0; i < header->keyframe_count; i++) {
+        if (index->keyframes[i] >= header->access_unit_count) return 0;
+        if (i > 0 && index->keyframes[i] <= index->keyframes[i - 1]) return 0;
+    }
+
+    for (uint64_t i = 0; i < header->parameter_set_count; i++) {
+        const H264IndexParameterSet *ps = &index->parameter_sets[i];
+        if (!h264_index_range_fits(ps->offset, ps->size, header->source_size)) return 0;
+    }
+
+    return 1;
+}
+
+// Checks the header, table sizes and table entries of the index image in
+// index->file, so that no lookup can leave the index or the source, and
+// points the tables into it. The checksum is only verified by
+// verify_h264_index. The image is released when it does not pass.
+static int attach_h264_index(const char *path, H264Index *index) {
+    const uint8_t *data = index->file.data;
+    size_t size = index->file.size;
+    const H264IndexHeader *header = (const H264IndexHeader *)data;
+
+    if (size < sizeof(*header) || memcmp(header->magic, H264_INDEX_MAGIC, sizeof(H264_INDEX_MAGIC)) != 0 ||
+        header->version != H264_INDEX_VERSION || header->header_size != sizeof(*header)) {
+        fprintf(stderr, "Not a version %d H.264 index: %s\n", H264_INDEX_VERSION, path);
+        unmap_file(&index->file);
+        return -1;
+    }
+
+    // Each count is checked against the bytes left before it is multiplied,
+    // so a corrupt count cannot wrap around to a plausible size.
+    uint64_t left = size - sizeof(*header);
+    int fits = header->access_unit_count <= left / sizeof(H264IndexAccessUnit);
+
+    if (fits) {
+        left -= header->access_unit_count * sizeof(H264IndexAccessUnit);
+        fits = header->keyframe_count <= left / sizeof(uint64_t);
+    }
+
+    if (fits) {
+        left -= header->keyframe_count * sizeof(uint64_t);
+        fits = header->parameter_set_count <= left / sizeof(H264IndexParameterSet);
+    }
+
+    if (!fits || left != header->parameter_set_count * sizeof(H264IndexParameterSet)) {
+        fprintf(stderr, "Truncated H.264 index: %s\n", path);
+        unmap_file(&index->file);
+        return -1;
+    }
+
+    if (index->file.mapped) {
+        madvise(index->file.data, size, MADV_RANDOM);
+    }
+
+    index->header = header;
+    index->access_units = (const H264IndexAccessUnit *)(data + sizeof(*header));
+    index->keyframes = (const uint64_t *)(index->access_units + header->access_unit_count);
+    index->parameter_sets = (const H264IndexParameterSet *)(index->keyframes + header->keyframe_count);
+
+    if (!check_h264_index_tables(index)) {
+        fprintf(stderr, "Corrupt H.264 index: %s\n", path);
+        unload_h264_index(index);
+        return -1;
+    }
+
+    return 0;
+}
+
+static int load_h264_index(const char *path, H264Index *index) {
+    if (map_file(path, &index->file) < 0) return -1;
+    return attach_h264_index(path, index);
+}
+
+static inline int verify_h264_index(const H264Index *index) {
+    const uint8_t *tables = index->file.data + sizeof(H264IndexHeader);
+    size_t size = index->file.size - sizeof(H264IndexHeader);
+
+    return fnv1a64(FNV1A64_INIT, tables, size) == index->header->checksum;
+}
+
+static inline int h264_index_matches(const H264Index *index, const struct stat *source) {
+    return index->header->source_size == (uint64_t)source->st_size &&
+           index->header->source_mtime_ns == h264_index_mtime_ns(source);
+}
+
+// Loads the index at path if it is there and up to date with source. The
+// checksum is left to verify_h264_index: indexes are replaced by rename, so
+// one that loads was written in full, and load_h264_index has checked every
+// entry a lookup uses.
+static inline int load_current_h264_index(const char *path, const struct stat *source, H264Index *index) {
+    // A missing index is expected and not worth a message.
+    if (access(path, F_OK) != 0 || load_h264_index(path, index) < 0) return -1;
+
+    if (!h264_index_matches(index, source)) {
+        unload_h264_index(index);
+        return -1;
+    }
+
+    return 0;
+}
+
+// The sidecar index of filename, (re)built first when it is missing,
+// malformed or older than the file. A rebuilt index is used from memory, and
+// also when it cannot be written out, e.g. next to a file in a read-only
+// directory.
+static inline int open_h264_index(const char *filename, int threads, H264Index *index) {
+    char path[4096];
+    struct stat st;
+
+    if (stat(filename, &st) < 0) {
+        fprintf(stderr, "Failed to open file: %s\n", filename);
+        return -1;
+    }
+
+    h264_index_path(filename, path, sizeof(path));
+
+    if (load_current_h264_index(path, &st, index) == 0) return 0;
+
+    H264IndexBuilder builder;
+    int ret = build_h264_index(filename, threads, &builder, &st);
+
+    if (ret == 0) ret = pack_h264_index(&builder, &st, &index->file);
+
+    free_h264_index_builder(&builder);
+    if (ret < 0) return -1;
+
+    if (write_h264_index_image(&index->file, path) < 0) {
+        fprintf(stderr, "Using an in-memory index for %s\n", filename);
+    }
+
+    return attach_h264_index(path, index);
+}
+
+// The access unit of the nth IDR, or NULL past the last one.
+static inline const H264IndexAccessUnit *h264_index_keyframe(const H264Index *index, uint64_t n) {
+    if (n >= index->header->keyframe_count) return NULL;
+    return &index->access_units[index->keyframes[n]];
+}
+
+// Number of access units from the nth IDR up to the next one.
+static inline uint64_t h264_index_gop_length(const H264Index *index, uint64_t n) {
+    if (n >= index->header->keyframe_count) return 0;
+
+    uint64_t end = n + 1 < index->header->keyframe_count ? index->keyframes[n + 1] : index->header->access_unit_count;
+    return end - index->keyframes[n];
+}
+
+#endif // H264_INDEX_H
@@ -0,0 +1,825 @@
+#ifndef H264_MACROBLOCK_H
+#define H264_MACROBLOCK_H
+
+#include <stdint.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "annexb.h"
+#include "bitstream.h"
+#include "h264.h"
+
+// Entropy decoding of CAVLC slice_data() (7.3.4, 7.3.5, 9.2) without any
+// reconstruction: every macroblock is parsed for its mb_type, QP and coded
+// block pattern, and residual blocks are read only as far as needed to find
+// the next syntax element. Covers what baseline streams use, meaning I and P
+// slices, 4:2:0, frame coding and a single slice group. Anything else is
+// reported as unsupported.
+
+enum {
+    MB_TYPE_I4x4,
+    MB_TYPE_I16x16,
+    MB_TYPE_I_PCM,
+    MB_TYPE_P16x16,
+    MB_TYPE_P16x8,
+    MB_TYPE_P8x16,
+    MB_TYPE_P8x8,
+    MB_TYPE_P8x8_REF0,
+    MB_TYPE_P_SKIP,
+    MB_TYPE_COUNT,
+};
+
+static inline const char *mb_type_name(uint8_t type) {
+    static const char *names[] = {"I4x4", "I16x16", "I_PCM", "P16x16", "P16x8", "P8x16", "P8x8", "P8x8ref0", "P_Skip"};
+    return names[type];
+}
+
+static inline int is_intra_mb_type(uint8_t type) {
+    return type <= MB_TYPE_I_PCM;
+}
+
+typedef struct {
+    uint8_t type;
+    uint8_t qp;
+    int8_t qp_delta;
+    uint8_t cbp;
+    uint16_t coeffs;
+} Macroblock;
+
+// A two level lookup table for one of the CAVLC code tables. The first level
+// is indexed by the next 8 bits. Codes longer than that continue in a second
+// level table of 256 entries. An entry is symbol << 5 | code length, a zero
+// length marks an invalid code, and bit 15 set in a first level entry is the
+// offset of a second level table.
+typedef struct {
+    uint16_t *table;
+} CAVLCTable;
+
+// Table 9-5, indexed by TotalCoeff * 4 + TrailingOnes, one column per nC
+// range (0 to 1, 2 to 3, 4 to 7) and the chroma DC column (nC == -1).
+static const uint8_t coeff_token_len[4][4 * 17] = {
+    {
+         1,  0,  0,  0,
+         6,  2,  0,  0,   8,  6,  3,  0,   9,  8,  7,  5,  10,  9,  8,  6,
+        11, 10,  9,  7,  13, 11, 10,  8,  13, 13, 11,  9,  13, 13, 13, 10,
+        14, 14, 13, 11,  14, 14, 14, 13,  15, 15, 14, 14,  15, 15, 15, 14,
+        16, 15, 15, 15,  16, 16, 16, 15,  16, 16, 16, 16,  16, 16, 16, 16,
+    },
+    {
+         2,  0,  0,  0,
+         6,  2,  0,  0,   6,  5,  3,  0,   7,  6,  6,  4,   8,  6,  6,  4,
+         8,  7,  7,  5,   9,  8,  8,  6,  11,  9,  9,  6,  11, 11, 11,  7,
+        12, 11, 11,  9,  12, 12, 12, 11,  12, 12, 12, 11,  13, 13, 13, 12,
+        13, 13, 13, 13,  13, 14, 13, 13,  14, 14, 14, 13,  14, 14, 14, 14,
+    },
+    {
+         4,  0,  0,  0,
+         6,  4,  0,  0,   6,  5,  4,  0,   6,  5,  5,  4,   7,  5,  5,  4,
+         7,  5,  5,  4,   7,  6,  6,  4,   7,  6,  6,  4,   8,  7,  7,  5,
+         8,  8,  7,  6,   9,  8,  8,  7,   9,  9,  8,  8,   9,  9,  9,  8,
+        10,  9,  9,  9,  10, 10, 10, 10,  10, 10, 10, 10,  10, 10, 10, 10,
+    },
+    {
+         2,  0,  0,  0,
+         6,  1,  0,  0,   6,  6,  3,  0,   6,  7,  7,  6,   6,  8,  8,  7,
+    },
+};
+
+static const uint8_t coeff_token_code[4][4 * 17] = {
+    {
+         1,  0,  0,  0,
+         5,  1,  0,  0,   7,  4,  1,  0,   7,  6,  5,  3,   7,  6,  5,  3,
+         7,  6,  5,  4,  15,  6,  5,  4,  11, 14,  5,  4,   8, 10, 13,  4,
+        15, 14,  9,  4,  11, 10, 13, 12,  15, 14,  9, 12,  11, 10, 13,  8,
+        15,  1,  9, 12,  11, 14, 13,  8,   7, 10,  9, 12,   4,  6,  5,  8,
+    },
+    {
+         3,  0,  0,  0,
+        11,  2,  0,  0,   7,  7,  3,  0,   7, 10,  9,  5,   7,  6,  5,  4,
+         4,  6,  5,  6,   7,  6,  5,  8,  15,  6,  5,  4,  11, 14, 13,  4,
+        15, 10,  9,  4,  11, 14, 13, 12,   8, 10,  9,  8,  15, 14, 13, 12,
+        11, 10,  9, 12,   7, 11,  6,  8,   9,  8, 10,  1,   7,  6,  5,  4,
+    },
+    {
+        15,  0,  0,  0,
+        15, 14,  0,  0,  11, 15, 13,  0,   8, 12, 14, 12,  15, 10, 11, 11,
+        11,  8,  9, 10,   9, 14, 13,  9,   8, 10,  9,  8,  15, 14, 13, 13,
+        11, 14, 10, 12,  15, 10, 13, 12,  11, 14,  9, 12,   8, 10, 13,  8,
+        13,  7,  9, 12,   9, 12, 11, 10,   5,  8,  7,  6,   1,  4,  3,  2,
+    },
+    {
+         1,  0,  0,  0,
+         7,  1,  0,  0,   4,  6,  1,  0,   3,  3,  2,  5,   2,  3,  2,  0,
+    },
+};
+
+// Tables 9-7 and 9-8, total_zeros for tzVlcIndex 1 to 15.
+static const uint8_t total_zeros_len[15][16] = {
+    {1, 3, 3, 4, 4, 5, 5, 6, 6, 7, 7, 8, 8, 9, 9, 9},
+    {3, 3, 3, 3, 3, 4, 4, 4, 4, 5, 5, 6, 6, 6, 6},
+    {4, 3, 3, 3, 4, 4, 3, 3, 4, 5, 5, 6, 5, 6},
+    {5, 3, 4, 4, 3, 3, 3, 4, 3, 4, 5, 5, 5},
+    {4, 4, 4, 3, 3, 3, 3, 3, 4, 5, 4, 5},
+    {6, 5, 3, 3, 3, 3, 3, 3, 4, 3, 6},
+    {6, 5, 3, 3, 3, 2, 3, 4, 3, 6},
+    {6, 4, 5, 3, 2, 2, 3, 3, 6},
+    {6, 6, 4, 2, 2, 3, 2, 5},
+    {5, 5, 3, 2, 2, 2, 4},
+    {4, 4, 3, 3, 1, 3},
+    {4, 4, 2, 1, 3},
+    {3, 3, 1, 2},
+    {2, 2, 1},
+    {1, 1},
+};
+
+static const uint8_t total_zeros_code[15][16] = {
+    {1, 3, 2, 3, 2, 3, 2, 3, 2, 3, 2, 3, 2, 3, 2, 1},
+    {7, 6, 5, 4, 3, 5, 4, 3, 2, 3, 2, 3, 2, 1, 0},
+    {5, 7, 6, 5, 4, 3, 4, 3, 2, 3, 2, 1, 1, 0},
+    {3, 7, 5, 4, 6, 5, 4, 3, 3, 2, 2, 1, 0},
+    {5, 4, 3, 7, 6, 5, 4, 3, 2, 1, 1, 0},
+    {1, 1, 7, 6, 5, 4, 3, 2, 1, 1, 0},
+    {1, 1, 5, 4, 3, 3, 2, 1, 1, 0},
+    {1, 1, 1, 3, 3, 2, 2, 1, 0},
+    {1, 0, 1, 3, 2, 1, 1, 1},
+    {1, 0, 1, 3, 2, 1, 1},
+    {0, 1, 1, 2, 1, 3},
+    {0, 1, 1, 1, 1},
+    {0, 1, 1, 1},
+    {0, 1, 1},
+    {0, 1},
+};
+
+// Table 9-9 (a), total_zeros of 4:2:0 chroma DC for tzVlcIndex 1 to 3.
+static const uint8_t chroma_dc_total_zeros_len[3][4] = {
+    {1, 2, 3, 3},
+    {1, 2, 2},
+    {1, 1},
+};
+
+static const uint8_t chroma_dc_total_zeros_code[3][4] = {
+    {1, 1, 1, 0},
+    {1, 1, 0},
+    {1, 0},
+};
+
+// Table 9-10, run_before for zerosLeft 1 to 6 and above 6.
+static const uint8_t run_before_len[7][16] = {
+    {1, 1},
+    {1, 2, 2},
+    {2, 2, 2, 2},
+    {2, 2, 2, 3, 3},
+    {2, 2, 3, 3, 3, 3},
+    {2, 3, 3, 3, 3, 3, 3},
+    {3, 3, 3, 3, 3, 3, 3, 4, 5, 6, 7, 8, 9, 10, 11},
+};
+
+static const uint8_t run_before_code[7][16] = {
+    {1, 0},
+    {1, 1, 0},
+    {3, 2, 1, 0},
+    {3, 2, 1, 1, 0},
+    {3, 2, 3, 2, 1, 0},
+    {3, 0, 1, 3, 2, 5, 4},
+    {7, 6, 5, 4, 3, 2, 1, 1, 1, 1, 1, 1, 1, 1, 1},
+};
+
+// Table 9-4, coded_block_pattern for codeNum 0 to 47 with chroma_format_idc 1.
+static const uint8_t intra_coded_block_pattern[48] = {
+    47, 31, 15,  0, 23, 27, 29, 30,  7, 11, 13, 14, 39, 43, 45, 46,
+    16,  3,  5, 10, 12, 19, 21, 26, 28, 35, 37, 42, 44,  1,  2,  4,
+     8, 17, 18, 20, 24,  6,  9, 22, 25, 32, 33, 34, 36, 40, 38, 41,
+};
+
+static const uint8_t inter_coded_block_pattern[48] = {
+     0, 16,  1,  2,  4,  8, 32,  3,  5, 10, 12, 15, 47,  7, 11, 13,
+    14,  6,  9, 31, 35, 37, 42, 44, 33, 34, 36, 40, 39, 43, 45, 46,
+    17, 18, 20, 24, 19, 21, 26, 28, 23, 27, 29, 30, 22, 25, 38, 41,
+};
+
+// Builds the lookup table for count codes, code i standing for symbol i.
+// Codes of length 0 are unused symbols.
+static int build_cavlc_table(CAVLCTable *vlc, const uint8_t *len, const uint8_t *code, int count) {
+    int subtables = 0;
+    uint16_t prefixes[256];
+
+    for (int i = 0; i < count; i++) {
+        if (len[i] <= 8) continue;
+
+        uint16_t prefix = code[i] >> (len[i] - 8);
+        int found = 0;
+
+        for (int j = 0; j < subtables; j++) found |= prefixes[j] == prefix;
+        if (!found) prefixes[subtables++] = prefix;
+    }
+
+    vlc->table = calloc(256 * (1 + subtables), sizeof(uint16_t));
+    if (!vlc->table) return -1;
+
+    for (int j = 0; j < subtables; j++) {
+        vlc->table[prefixes[j]] = 0x8000 | (256 * (j + 1));
+    }
+
+    for (int i = 0; i < count; i++) {
+        if (len[i] == 0) continue;
+
+        uint16_t entry = (uint16_t)(i << 5 | len[i]);
+
+        if (len[i] <= 8) {
+            int first = code[i] << (8 - len[i]);
+            for (int k = 0; k < 1 << (8 - len[i]); k++) vlc->table[first + k] = entry;
+        } else {
+            uint16_t prefix = code[i] >> (len[i] - 8);
+            uint16_t *sub = vlc->table + (vlc->table[prefix] & 0x7fff);
+            int first = (code[i] & ((1 << (len[i] - 8)) - 1)) << (16 - len[i]);
+            for (int k = 0; k < 1 << (16 - len[i]); k++) sub[first + k] = entry;
+        }
+    }
+
+    return 0;
+}
+
+// Returns the symbol, or -1 for a code that is not in the table.
+static inline int read_cavlc(BitStream *bs, const CAVLCTable *vlc) {
+    uint32_t bits = peek_bits(bs, 16);
+    uint16_t entry = vlc->table[bits >> 8];
+
+    if (entry & 0x8000) {
+        entry = vlc->table[(entry & 0x7fff) + (bits & 0xff)];
+    }
+
+    if ((entry & 31) == 0) return -1;
+
+    // peek_bits left at least 16 bits in the cache, enough for any code.
+    bs->cache <<= entry & 31;
+    bs->bits -= entry & 31;
+    return entry >> 5;
+}
+
+typedef struct {
+    CAVLCTable coeff_token[4];
+    CAVLCTable total_zeros[15];
+    CAVLCTable chroma_dc_total_zeros[3];
+    CAVLCTable run_before[7];
+} CAVLCTables;
+
+static inline void free_cavlc_tables(CAVLCTables *t) {
+    for (int i = 0; i < 4; i++) free(t->coeff_token[i].table);
+    for (int i = 0; i < 15; i++) free(t->total_zeros[i].table);
+    for (int i = 0; i < 3; i++) free(t->chroma_dc_total_zeros[i].table);
+    for (int i = 0; i < 7; i++) free(t->run_before[i].table);
+    memset(t, 0, sizeof(*t));
+}
+
+static int init_cavlc_tables(CAVLCTables *t) {
+    int ret = 0;
+
+    memset(t, 0, sizeof(*t));
+
+    for (int i = 0; i < 4; i++) {
+        ret |= build_cavlc_table(&t->coeff_token[i], coeff_token_len[i], coeff_token_code[i], i == 3 ? 4 * 5 : 4 * 17);
+    }
+
+    for (int i = 0; i < 15; i++) {
+        ret |= build_cavlc_table(&t->total_zeros[i], total_zeros_len[i], total_zeros_code[i], 16 - i);
+    }
+
+    for (int i = 0; i < 3; i++) {
+        ret |= build_cavlc_table(&t->chroma_dc_total_zeros[i], chroma_dc_total_zeros_len[i], chroma_dc_total_zeros_code[i], 4 - i);
+    }
+
+    for (int i = 0; i < 7; i++) {
+        ret |= build_cavlc_table(&t->run_before[i], run_before_len[i], run_before_code[i], i == 6 ? 15 : i + 2);
+    }
+
+    if (ret < 0) free_cavlc_tables(t);
+    return ret;
+}
+
+// Per macroblock TotalCoeff of every 4x4 block, which the nC of the blocks
+// to the right and below depends on (9.2.1): luma in raster order, then the
+// Cb and Cr AC blocks.
+typedef struct {
+    uint8_t luma[16];
+    uint8_t chroma[2][4];
+} MacroblockCoeffs;
+
+// The macroblocks of the current picture. slice is the number of the slice
+// a macroblock was decoded in, 0 for not (yet) decoded, and is what makes a
+// neighbour available.
+typedef struct {
+    CAVLCTables tables;
+    uint32_t width;
+    uint32_t height;
+    Macroblock *mbs;
+    MacroblockCoeffs *coeffs;
+    uint32_t *slice;
+    uint32_t slice_count;
+    uint8_t *rbsp;
+    size_t rbsp_capacity;
+    const char *error;
+} MacroblockParser;
+
+static inline int init_macroblock_parser(MacroblockParser *p) {
+    memset(p, 0, sizeof(*p));
+    return init_cavlc_tables(&p->tables);
+}
+
+static inline void free_macroblock_parser(MacroblockParser *p) {
+    free_cavlc_tables(&p->tables);
+    free(p->mbs);
+    free(p->coeffs);
+    free(p->slice);
+    free(p->rbsp);
+    memset(p, 0, sizeof(*p));
+}
+
+// Forgets the macroblocks of the previous picture.
+static inline void start_macroblock_picture(MacroblockParser *p) {
+    if (p->slice) memset(p->slice, 0, (size_t)p->width * p->height * sizeof(uint32_t));
+    p->slice_count = 0;
+}
+
+static inline int is_macroblock_decoded(const MacroblockParser *p, uint32_t mb) {
+    return p->slice[mb] != 0;
+}
+
+static int resize_macroblock_picture(MacroblockParser *p, uint32_t width, uint32_t height) {
+    if (width == p->width && height == p->height) return 0;
+
+    size_t count = (size_t)width * height;
+
+    free(p->mbs);
+    free(p->coeffs);
+    free(p->slice);
+    p->mbs = malloc(count * sizeof(Macroblock));
+    p->coeffs = malloc(count * sizeof(MacroblockCoeffs));
+    p->slice = calloc(count, sizeof(uint32_t));
+    p->width = width;
+    p->height = height;
+    p->slice_count = 0;
+
+    if (!p->mbs || !p->coeffs || !p->slice) {
+        p->width = p->height = 0;
+        return -1;
+    }
+
+    return 0;
+}
+
+// 7.2: more_rbsp_data() is true while the read position is before the
+// rbsp_stop_one_bit.
+static inline int more_rbsp_data(const BitStream *bs, size_t stop_bit) {
+    return bit_stream_tell(bs) < stop_bit;
+}
+
+// Reads residual_block_cavlc() (7.3.5.3.2) and returns TotalCoeff, or -1 on
+// invalid codes. nc == -1 selects the chroma DC tables.
+static int read_residual_block(BitStream *bs, const CAVLCTables *t, int nc, int max_coeffs) {
+    int token;
+
+    if (nc >= 8) {
+        uint32_t code = read_bits(bs, 6);
+        if (code == 3) return 0;
+
+        token = ((code >> 2) + 1) * 4 + (code & 3);
+    } else {
+        int table = nc < 0 ? 3 : (nc < 2 ? 0 : (nc < 4 ? 1 : 2));
+        token = read_cavlc(bs, &t->coeff_token[table]);
+    }
+
+    if (token < 0) return -1;
+
+    int total_coeff = token >> 2;
+    int trailing_ones = token & 3;
+
+    if (total_coeff > max_coeffs || trailing_ones > total_coeff) return -1;
+    if (total_coeff == 0) return 0;
+
+    int suffix_length = total_coeff > 10 && trailing_ones < 3 ? 1 : 0;
+
+    // trailing_ones_sign_flag
+    if (bs->bits < trailing_ones) refill_bit_stream(bs);
+    bs->cache <<= trailing_ones;
+    bs->bits -= trailing_ones;
+
+    for (int i = trailing_ones; i < total_coeff; i++) {
+        int level_prefix;
+
+        // As in read_ue, one count-leading-zeros covers every prefix below 16
+        // once 32 bits are cached. Longer ones only come with escape codes.
+        if (bs->bits < 32) refill_bit_stream(bs);
+
+        if (bs->cache >= (1ULL << 48)) {
+            level_prefix = __builtin_clzll(bs->cache);
+            bs->cache <<= level_prefix + 1;
+            bs->bits -= level_prefix + 1;
+        } else {
+            level_prefix = 0;
+
+            while (read_bit(bs) == 0) {
+                if (++level_prefix > 31) return -1;
+            }
+        }
+
+        int level_code = (level_prefix < 15 ? level_prefix : 15) << suffix_length;
+        int suffix_size = suffix_length;
+
+        if (level_prefix == 14 && suffix_length == 0) suffix_size = 4;
+        if (level_prefix >= 15) suffix_size = level_prefix - 3;
+        if (suffix_size > 0) level_code += read_bits(bs, suffix_size);
+
+        if (level_prefix >= 15 && suffix_length == 0) level_code += 15;
+        if (level_prefix >= 16) level_code += (1 << (level_prefix - 3)) - 4096;
+        if (i == trailing_ones && trailing_ones < 3) level_code += 2;
+
+        int magnitude = (level_code + 2) >> 1;
+
+        if (suffix_length == 0) suffix_length = 1;
+        if (magnitude > (3 << (suffix_length - 1)) && suffix_length < 6) suffix_length++;
+    }
+
+    int zeros_left = 0;
+
+    if (total_coeff < max_coeffs) {
+        const CAVLCTable *table = max_coeffs == 4 ? &t->chroma_dc_total_zeros[total_coeff - 1] : &t->total_zeros[total_coeff - 1];
+
+        zeros_left = read_cavlc(bs, table);
+        if (zeros_left < 0 || zeros_left > max_coeffs - total_coeff) return -1;
+    }
+
+    for (int i = 0; i < total_coeff - 1 && zeros_left > 0; i++) {
+        int run_before = read_cavlc(bs, &t->run_before[(zeros_left < 7 ? zeros_left : 7) - 1]);
+        if (run_before < 0 || run_before > zeros_left) return -1;
+
+        zeros_left -= run_before;
+    }
+
+    return total_coeff;
+}
+
+// nC of a 4x4 block (9.2.1) from the blocks left of it (a) and above it (b),
+// -1 standing for not available.
+static inline int predict_total_coeff(int a, int b) {
+    if (a >= 0 && b >= 0) return (a + b + 1) >> 1;
+    if (a >= 0) return a;
+    if (b >= 0) return b;
+    return 0;
+}
+
+typedef struct {
+    const MacroblockCoeffs *left;
+    const MacroblockCoeffs *top;
+    MacroblockCoeffs *current;
+} MacroblockNeighbours;
+
+static inline int luma_nc(const MacroblockNeighbours *n, int x, int y) {
+    int a = x > 0 ? n->current->luma[y * 4 + x - 1] : (n->left ? n->left->luma[y * 4 + 3] : -1);
+    int b = y > 0 ? n->current->luma[(y - 1) * 4 + x] : (n->top ? n->top->luma[12 + x] : -1);
+    return predict_total_coeff(a, b);
+}
+
+static inline int chroma_nc(const MacroblockNeighbours *n, int plane, int x, int y) {
+    int a = x > 0 ? n->current->chroma[plane][y * 2 + x - 1] : (n->left ? n->left->chroma[plane][y * 2 + 1] : -1);
+    int b = y > 0 ? n->current->chroma[plane][(y - 1) * 2 + x] : (n->top ? n->top->chroma[plane][2 + x] : -1);
+    return predict_total_coeff(a, b);
+}
+
+// residual() for 4:2:0 CAVLC (7.3.5.3). Returns the number of non-zero
+// coefficients or -1.
+static int read_residual(BitStream *bs, const CAVLCTables *t, const MacroblockNeighbours *n, int intra16x16, uint8_t cbp) {
+    int coeffs = 0;
+    int count;
+
+    if (intra16x16) {
+        // Intra16x16DCLevel takes the nC of luma block 0.
+        if ((count = read_residual_block(bs, t, luma_nc(n, 0, 0), 16)) < 0) return -1;
+        coeffs += count;
+    }
+
+    for (int i8x8 = 0; i8x8 < 4; i8x8++) {
+        for (int i4x4 = 0; i4x4 < 4; i4x4++) {
+            int x = (i8x8 & 1) * 2 + (i4x4 & 1);
+            int y = (i8x8 >> 1) * 2 + (i4x4 >> 1);
+
+            count = 0;
+
+            if (cbp & (1 << i8x8)) {
+                if ((count = read_residual_block(bs, t, luma_nc(n, x, y), intra16x16 ? 15 : 16)) < 0) return -1;
+            }
+
+            n->current->luma[y * 4 + x] = count;
+            coeffs += count;
+        }
+    }
+
+    if (cbp & 0x30) {
+        for (int plane = 0; plane < 2; plane++) {
+            if ((count = read_residual_block(bs, t, -1, 4)) < 0) return -1;
+            coeffs += count;
+        }
+    }
+
+    for (int plane = 0; plane < 2; plane++) {
+        for (int i = 0; i < 4; i++) {
+            count = 0;
+
+            if (cbp & 0x20) {
+                if ((count = read_residual_block(bs, t, chroma_nc(n, plane, i & 1, i >> 1), 15)) < 0) return -1;
+            }
+
+            n->current->chroma[plane][i] = count;
+            coeffs += count;
+        }
+    }
+
+    return coeffs;
+}
+
+// te(v) for a reference index with num_ref_idx_active_minus1 as the range.
+static inline uint32_t read_ref_idx(BitStream *bs, uint8_t num_ref_idx_active_minus1) {
+    if (num_ref_idx_active_minus1 == 1) return !read_bit(bs);
+    return read_ue(bs);
+}
+
+static int read_inter_prediction(BitStream *bs, const SliceHeader *sh, uint8_t type) {
+    static const uint8_t sub_mb_partitions[4] = {1, 2, 2, 4};
+    uint8_t refs = sh->num_ref_idx_l0_active_minus1;
+
+    if (type == MB_TYPE_P8x8 || type == MB_TYPE_P8x8_REF0) {
+        uint8_t sub_mb_type[4];
+
+        for (int i = 0; i < 4; i++) {
+            uint32_t sub = read_ue(bs);
+            if (sub > 3) return -1;
+            sub_mb_type[i] = sub;
+        }
+
+        if (refs > 0 && type == MB_TYPE_P8x8) {
+            for (int i = 0; i < 4; i++) {
+                if (read_ref_idx(bs, refs) > refs) return -1;
+            }
+        }
+
+        for (int i = 0; i < 4; i++) {
+            for (int j = 0; j < sub_mb_partitions[sub_mb_type[i]]; j++) {
+                read_se(bs); // mvd_l0[0]
+                read_se(bs); // mvd_l0[1]
+            }
+        }
+
+        return 0;
+    }
+
+    int partitions = type == MB_TYPE_P16x16 ? 1 : 2;
+
+    if (refs > 0) {
+        for (int i = 0; i < partitions; i++) {
+            if (read_ref_idx(bs, refs) > refs) return -1;
+        }
+    }
+
+    for (int i = 0; i < partitions; i++) {
+        read_se(bs); // mvd_l0[0]
+        read_se(bs); // mvd_l0[1]
+    }
+
+    return 0;
+}
+
+// macroblock_layer() (7.3.5) of the macroblock at mb_addr. qp is QP_Y of the
+// previous macroblock and is updated.
+static int read_macroblock(MacroblockParser *p, BitStream *bs, const SliceHeader *sh, uint32_t mb_addr, int *qp) {
+    Macroblock *mb = &p->mbs[mb_addr];
+    uint32_t x = mb_addr % p->width;
+    uint32_t y = mb_addr / p->width;
+    MacroblockNeighbours n;
+
+    n.current = &p->coeffs[mb_addr];
+    n.left = x > 0 && p->slice[mb_addr - 1] == p->slice_count ? &p->coeffs[mb_addr - 1] : NULL;
+    n.top = y > 0 && p->slice[mb_addr - p->width] == p->slice_count ? &p->coeffs[mb_addr - p->width] : NULL;
+
+    static const uint8_t p_types[5] = {MB_TYPE_P16x16, MB_TYPE_P16x8, MB_TYPE_P8x16, MB_TYPE_P8x8, MB_TYPE_P8x8_REF0};
+    uint32_t mb_type = read_ue(bs);
+    uint8_t cbp = 0;
+
+    memset(mb, 0, sizeof(*mb));
+
+    // P slices number the intra types from 5 on (Table 7-13).
+    if (sh->slice_type == SLICE_TYPE_P && mb_type < 5) {
+        mb->type = p_types[mb_type];
+    } else {
+        if (sh->slice_type == SLICE_TYPE_P) mb_type -= 5;
+
+        if (mb_type == 0) {
+            mb->type = MB_TYPE_I4x4;
+        } else if (mb_type <= 24) {
+            // I_16x16_<pred mode>_<chroma cbp>_<luma cbp> (Table 7-11)
+            mb->type = MB_TYPE_I16x16;
+            cbp = ((mb_type - 1) / 4 % 3) << 4 | (mb_type >= 13 ? 15 : 0);
+        } else if (mb_type == 25) {
+            mb->type = MB_TYPE_I_PCM;
+        } else {
+            p->error = "invalid mb_type";
+            return -1;
+        }
+    }
+
+    if (mb->type == MB_TYPE_I_PCM) {
+        // pcm_alignment_zero_bit, then 256 luma and 2 x 64 chroma samples
+        skip_bits(bs, (8 - bit_stream_tell(bs) % 8) % 8);
+        skip_bits(bs, 384 * 8);
+
+        memset(n.current, 16, sizeof(*n.current));
+        mb->qp = *qp;
+        mb->coeffs = 384;
+        return 0;
+    }
+
+    if (is_intra_mb_type(mb->type)) {
+        if (mb->type == MB_TYPE_I4x4) {
+            for (int i = 0; i < 16; i++) {
+                if (!read_bit(bs)) skip_bits(bs, 3); // prev_intra4x4_pred_mode_flag, rem_intra4x4_pred_mode
+            }
+        }
+
+        if (read_ue(bs) > 3) { // intra_chroma_pred_mode
+            p->error = "invalid intra_chroma_pred_mode";
+            return -1;
+        }
+    } else if (read_inter_prediction(bs, sh, mb->type) < 0) {
+        p->error = "invalid inter prediction";
+        return -1;
+    }
+
+    if (mb->type != MB_TYPE_I16x16) {
+        uint32_t code = read_ue(bs);
+
+        if (code > 47) {
+            p->error = "invalid coded_block_pattern";
+            return -1;
+        }
+
+        cbp = mb->type == MB_TYPE_I4x4 ? intra_coded_block_pattern[code] : inter_coded_block_pattern[code];
+    }
+
+    mb->cbp = cbp;
+
+    if (cbp == 0 && mb->type != MB_TYPE_I16x16) {
+        memset(n.current, 0, sizeof(*n.current));
+        mb->qp = *qp;
+        return 0;
+    }
+
+    int32_t qp_delta = read_se(bs);
+
+    if (qp_delta < -26 || qp_delta > 25) {
+        p->error = "invalid mb_qp_delta";
+        return -1;
+    }
+
+    *qp = (*qp + qp_delta + 52) % 52;
+    mb->qp = *qp;
+    mb->qp_delta = qp_delta;
+
+    int coeffs = read_residual(bs, &p->tables, &n, mb->type == MB_TYPE_I16x16, cbp);
+
+    if (coeffs < 0) {
+        p->error = "invalid residual";
+        return -1;
+    }
+
+    mb->coeffs = coeffs;
+    return 0;
+}
+
+// Parses the slice data of a slice NAL unit into the current picture.
+// Returns 0, or -1 with error set when the slice is corrupt or uses
+// something this parser does not cover.
+static int parse_macroblocks(MacroblockParser *p, const NALUnit *nal, const ParameterSets *ps) {
+    SliceHeader sh;
+    BitStream bs;
+    size_t size;
+
+    if (nal->size < 2) {
+        p->error = "truncated slice";
+        return -1;
+    }
+
+    if (nal->size > p->rbsp_capacity) {
+        uint8_t *rbsp = realloc(p->rbsp, nal->size);
+
+        if (!rbsp) {
+            p->error = "out of memory";
+            return -1;
+        }
+
+        p->rbsp = rbsp;
+        p->rbsp_capacity = nal->size;
+    }
+
+    remove_emulation_prevention_bytes(nal->data + 1, nal->size - 1, p->rbsp, &size);
+
+    while (size > 0 && p->rbsp[size - 1] == 0) size--;
+
+    if (size == 0) {
+        p->error = "missing rbsp_stop_one_bit";
+        return -1;
+    }
+
+    size_t stop_bit = size * 8 - 1 - __builtin_ctz(p->rbsp[size - 1]);
+
+    init_bit_stream(&bs, p->rbsp, size);
+
+    if (read_slice_header(&bs, nal, ps, &sh) < 0) {
+        p->error = "missing parameter set";
+        return -1;
+    }
+
+    const PPS *pps = ps->pps[sh.pic_parameter_set_id];
+    const SPS *sps = ps->pps_sps[sh.pic_parameter_set_id];
+
+    if (pps->entropy_coding_mode_flag) {
+        p->error = "CABAC";
+        return -1;
+    }
+
+    if (sps->profile_idc != 66 && sps->profile_idc != 77 && sps->profile_idc != 88) {
+        p->error = "unsupported profile";
+        return -1;
+    }
+
+    if (sps->chroma_format_idc != 1 || !sps->frame_mbs_only_flag || pps->num_slice_groups_minus1 > 0) {
+        p->error = "unsupported picture format";
+        return -1;
+    }
+
+    if (sh.slice_type != SLICE_TYPE_I && sh.slice_type != SLICE_TYPE_P) {
+        p->error = "unsupported slice type";
+        return -1;
+    }
+
+    if (parse_slice_header_tail(&bs, ps, &sh) < 0) {
+        p->error = "invalid slice header";
+        return -1;
+    }
+
+    if (resize_macroblock_picture(p, sps->pic_width_in_mbs_minus1 + 1, sps->pic_height_in_map_units_minus1 + 1) < 0) {
+        p->error = "out of memory";
+        return -1;
+    }
+
+    uint32_t count = p->width * p->height;
+    uint32_t mb_addr = sh.first_mb_in_slice;
+    int qp = 26 + pps->pic_init_qp_minus26 + sh.slice_qp_delta;
+    int more = 1;
+
+    if (mb_addr >= count) {
+        p->error = "first_mb_in_slice out of range";
+        return -1;
+    }
+
+    p->slice_count++;
+
+    while (more) {
+        if (sh.slice_type != SLICE_TYPE_I) {
+            uint32_t mb_skip_run = read_ue(&bs);
+
+            if (mb_skip_run > count - mb_addr) {
+                p->error = "mb_skip_run out of range";
+                return -1;
+            }
+
+            for (uint32_t i = 0; i < mb_skip_run; i++, mb_addr++) {
+                Macroblock *mb = &p->mbs[mb_addr];
+
+                memset(mb, 0, sizeof(*mb));
+                memset(&p->coeffs[mb_addr], 0, sizeof(MacroblockCoeffs));
+                mb->type = MB_TYPE_P_SKIP;
+                mb->qp = qp;
+                p->slice[mb_addr] = p->slice_count;
+            }
+
+            if (mb_skip_run > 0 && !more_rbsp_data(&bs, stop_bit)) break;
+        }
+
+        if (mb_addr >= count) {
+            p->error = "too many macroblocks";
+            return -1;
+        }
+
+        if (read_macroblock(p, &bs, &sh, mb_addr, &qp) < 0) return -1;
+
+        p->slice[mb_addr++] = p->slice_count;
+        more = more_rbsp_data(&bs, stop_bit);
+    }
+
+    if (bit_stream_tell(&bs) != stop_bit) {
+        p->error = "slice data overrun";
+        return -1;
+    }
+
+    return 0;
+}
+
+#endif // H264_MACROBLOCK_H
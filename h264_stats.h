@@ -0,0 +1,298 @@
+#ifndef H264_STATS_H
+#define H264_STATS_H
+
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "annexb.h"
+#include "h264.h"
+
+// Bitstream statistics gathered in one pass over the NAL units, from the
+// access unit sizes and slice headers alone: frame type counts, access unit
+// sizes, the peak bitrate over a sliding time window and GOP lengths (IDR to
+// IDR). Access unit timing comes from a fixed frame rate, either given by the
+// user or taken from the VUI timing info of the active SPS. Without either,
+// everything that needs time is left out. Times are decode times: access
+// units are timed in stream order, so with B-frames they are not the
+// presentation times.
+
+enum {
+    H264_STATS_IDR,
+    H264_STATS_I,
+    H264_STATS_P,
+    H264_STATS_B,
+    H264_STATS_OTHER,
+    H264_STATS_TYPE_COUNT,
+};
+
+static inline const char *h264_stats_type_name(int type) {
+    static const char *names[] = {"idr", "i", "p", "b", "other"};
+    return names[type];
+}
+
+typedef struct {
+    double time;
+    uint64_t size;
+} H264StatsSample;
+
+typedef struct {
+    AccessUnitAssembler assembler;
+    FILE *csv;
+    double user_frame_rate;
+    double window;
+    double frame_rate;
+    double time;
+
+    uint64_t access_units;
+    uint64_t bytes;
+    uint64_t min_size;
+    uint64_t max_size;
+    uint64_t type_count[H264_STATS_TYPE_COUNT];
+    uint64_t type_bytes[H264_STATS_TYPE_COUNT];
+    uint64_t type_max_size[H264_STATS_TYPE_COUNT];
+
+    // Access units of the last window seconds, oldest at head.
+    H264StatsSample *samples;
+    size_t sample_capacity;
+    size_t sample_head;
+    size_t sample_count;
+    uint64_t window_bytes;
+    double peak_bitrate;
+    double peak_time;
+
+    uint64_t gop_count;
+    uint64_t gop_length;
+    uint64_t gop_min;
+    uint64_t gop_max;
+    uint64_t gop_total;
+    uint64_t gop_bytes;
+    uint64_t gop_max_bytes;
+    int in_gop;
+
+    int ret;
+} H264Stats;
+
+// csv, when set, receives one row per access unit as soon as it completes.
+// frame_rate overrides the SPS timing when it is not 0.
+static inline void init_h264_stats(H264Stats *stats, FILE *csv, double frame_rate, double window) {
+    memset(stats, 0, sizeof(*stats));
+    init_access_unit_assembler(&stats->assembler);
+    stats->csv = csv;
+    stats->user_frame_rate = frame_rate;
+    stats->window = window;
+
+    if (csv) {
+        fprintf(csv, "access_unit,offset,size,type,nal_units,slices,gop,decode_time,window_bitrate\n");
+    }
+}
+
+static inline void free_h264_stats(H264Stats *stats) {
+    free_access_unit_assembler(&stats->assembler);
+    free(stats->samples);
+    stats->samples = NULL;
+}
+
+static inline int h264_stats_type(const AccessUnit *au) {
+    if (au->slice_count == 0) return H264_STATS_OTHER;
+    if (au->idr) return H264_STATS_IDR;
+
+    switch (au->first_slice.slice_type) {
+    case SLICE_TYPE_I: return H264_STATS_I;
+    case SLICE_TYPE_P: return H264_STATS_P;
+    case SLICE_TYPE_B: return H264_STATS_B;
+    default: return H264_STATS_OTHER;
+    }
+}
+
+static int push_h264_stats_sample(H264Stats *stats, double time, uint64_t size) {
+    if (stats->sample_count == stats->sample_capacity) {
+        size_t capacity = stats->sample_capacity ? stats->sample_capacity * 2 : 256;
+        H264StatsSample *samples = malloc(capacity * sizeof(H264StatsSample));
+        if (!samples) return -1;
+
+        for (size_t i = 0; i < stats->sample_count; i++) {
+            samples[i] = stats->samples[(stats->sample_head + i) % stats->sample_capacity];
+        }
+
+        free(stats->samples);
+        stats->samples = samples;
+        stats->sample_capacity = capacity;
+        stats->sample_head = 0;
+    }
+
+    H264StatsSample *sample = &stats->samples[(stats->sample_head + stats->sample_count) % stats->sample_capacity];
+    sample->time = time;
+    sample->size = size;
+    stats->sample_count++;
+    stats->window_bytes += size;
+    return 0;
+}
+
+// Bitrate over the window that ends at end, in bits per second.
+static double update_h264_stats_window(H264Stats *stats, double end) {
+    // A small tolerance keeps exactly one window of frames in it despite
+    // rounding in the accumulated time.
+    double start = end - stats->window + 1e-9;
+
+    while (stats->sample_count > 0 && stats->samples[stats->sample_head].time < start) {
+        stats->window_bytes -= stats->samples[stats->sample_head].size;
+        stats->sample_head = (stats->sample_head + 1) % stats->sample_capacity;
+        stats->sample_count--;
+    }
+
+    double bitrate = stats->window_bytes * 8.0 / stats->window;
+
+    // Only whole windows count towards the peak.
+    if (end >= stats->window - 1e-9 && bitrate > stats->peak_bitrate) {
+        stats->peak_bitrate = bitrate;
+        stats->peak_time = end - stats->window > 0 ? end - stats->window : 0;
+    }
+
+    return bitrate;
+}
+
+static inline void finish_h264_stats_gop(H264Stats *stats) {
+    if (!stats->in_gop) return;
+
+    if (stats->gop_count == 0 || stats->gop_length < stats->gop_min) stats->gop_min = stats->gop_length;
+    if (stats->gop_length > stats->gop_max) stats->gop_max = stats->gop_length;
+    if (stats->gop_bytes > stats->gop_max_bytes) stats->gop_max_bytes = stats->gop_bytes;
+
+    stats->gop_total += stats->gop_length;
+    stats->gop_count++;
+    stats->in_gop = 0;
+}
+
+static int add_access_unit_to_h264_stats(H264Stats *stats, const AccessUnit *au) {
+    int type = h264_stats_type(au);
+
+    if (au->idr) {
+        finish_h264_stats_gop(stats);
+        stats->in_gop = 1;
+        stats->gop_length = 0;
+        stats->gop_bytes = 0;
+    }
+
+    if (stats->in_gop) {
+        stats->gop_length++;
+        stats->gop_bytes += au->size;
+    }
+
+    if (stats->access_units == 0 || au->size < stats->min_size) stats->min_size = au->size;
+    if (au->size > stats->max_size) stats->max_size = au->size;
+    if (au->size > stats->type_max_size[type]) stats->type_max_size[type] = au->size;
+
+    stats->type_count[type]++;
+    stats->type_bytes[type] += au->size;
+    stats->bytes += au->size;
+
+    double frame_rate = stats->user_frame_rate;
+
+    if (frame_rate == 0 && au->slice_count) {
+        const SPS *sps = stats->assembler.ps.pps_sps[au->first_slice.pic_parameter_set_id];
+        if (sps) frame_rate = sps_frame_rate(sps);
+    }
+
+    if (frame_rate == 0) frame_rate = stats->frame_rate;
+    if (stats->frame_rate == 0) stats->frame_rate = frame_rate;
+
+    double time = stats->time;
+    double bitrate = 0;
+
+    // Access units without a slice take no time, a field takes half a frame.
+    if (frame_rate > 0) {
+        if (au->slice_count) {
+            stats->time += (au->first_slice.field_pic_flag ? 0.5 : 1.0) / frame_rate;
+        }
+
+        if (push_h264_stats_sample(stats, time, au->size) < 0) return -1;
+        bitrate = update_h264_stats_window(stats, stats->time);
+    }
+
+    if (stats->csv) {
+        fprintf(stats->csv, "%llu,%llu,%llu,%s,%u,%u,",
+                (unsigned long long)stats->access_units, (unsigned long long)au->offset,
+                (unsigned long long)au->size, h264_stats_type_name(type), au->nal_count, au->slice_count);
+
+        if (stats->in_gop) {
+            fprintf(stats->csv, "%llu", (unsigned long long)stats->gop_count);
+        }
+
+        if (frame_rate > 0) {
+            fprintf(stats->csv, ",%.6f,%.0f\n", time, bitrate);
+        } else {
+            fprintf(stats->csv, ",,\n");
+        }
+    }
+
+    stats->access_units++;
+    return 0;
+}
+
+static void add_nal_to_h264_stats(H264Stats *stats, const NALUnit *nal) {
+    AccessUnit done;
+
+    if (stats->ret == 0 && add_nal_to_access_unit(&stats->assembler, nal, &done)) {
+        stats->ret = add_access_unit_to_h264_stats(stats, &done);
+    }
+}
+
+static int finish_h264_stats(H264Stats *stats) {
+    AccessUnit done;
+
+    if (stats->ret == 0 && finish_access_unit(&stats->assembler, &done)) {
+        stats->ret = add_access_unit_to_h264_stats(stats, &done);
+    }
+
+    finish_h264_stats_gop(stats);
+
+    // A stream shorter than the window peaks at its mean.
+    if (stats->peak_bitrate == 0 && stats->time > 0) {
+        stats->peak_bitrate = stats->bytes * 8.0 / stats->time;
+        stats->peak_time = 0;
+    }
+
+    return stats->ret;
+}
+
+static void print_h264_stats_json(const H264Stats *stats, FILE *out) {
+    fprintf(out, "{\n");
+    fprintf(out, "  \"access_units\": %llu,\n", (unsigned long long)stats->access_units);
+    fprintf(out, "  \"bytes\": %llu,\n", (unsigned long long)stats->bytes);
+
+    fprintf(out, "  \"size\": {\"min\": %llu, \"max\": %llu, \"mean\": %.1f},\n",
+            (unsigned long long)stats->min_size, (unsigned long long)stats->max_size,
+            stats->access_units ? (double)stats->bytes / stats->access_units : 0.0);
+
+    fprintf(out, "  \"types\": {");
+
+    for (int type = 0; type < H264_STATS_TYPE_COUNT; type++) {
+        fprintf(out, "%s\n    \"%s\": {\"count\": %llu, \"bytes\": %llu, \"max_size\": %llu}",
+                type ? "," : "", h264_stats_type_name(type), (unsigned long long)stats->type_count[type],
+                (unsigned long long)stats->type_bytes[type], (unsigned long long)stats->type_max_size[type]);
+    }
+
+    fprintf(out, "\n  },\n");
+
+    fprintf(out, "  \"gops\": {\"count\": %llu, \"min_length\": %llu, \"max_length\": %llu, \"mean_length\": %.2f, \"max_bytes\": %llu},\n",
+            (unsigned long long)stats->gop_count, (unsigned long long)stats->gop_min, (unsigned long long)stats->gop_max,
+            stats->gop_count ? (double)stats->gop_total / stats->gop_count : 0.0,
+            (unsigned long long)stats->gop_max_bytes);
+
+    if (stats->frame_rate > 0 && stats->time > 0) {
+        fprintf(out, "  \"frame_rate\": %.6f,\n", stats->frame_rate);
+        fprintf(out, "  \"duration\": %.6f,\n", stats->time);
+        fprintf(out, "  \"bitrate\": {\"mean\": %.0f, \"window\": %.6f, \"peak\": %.0f, \"peak_decode_start\": %.6f}\n",
+                stats->bytes * 8.0 / stats->time, stats->window, stats->peak_bitrate, stats->peak_time);
+    } else {
+        fprintf(out, "  \"frame_rate\": null,\n");
+        fprintf(out, "  \"duration\": null,\n");
+        fprintf(out, "  \"bitrate\": null\n");
+    }
+
+    fprintf(out, "}\n");
+}
+
+#endif // H264_STATS_H
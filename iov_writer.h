@@ -0,0 +1,81 @@
+#ifndef IOV_WRITER_H
+#define IOV_WRITER_H
+
+#include <errno.h>
+#include <limits.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <string.h>
+#include <sys/uio.h>
+#include <unistd.h>
+
+// Batches writes of buffers that stay valid until the next flush, typically
+// ranges of a mapped input, into writev calls. A range that continues the
+// one before is merged into its iovec.
+
+#define IOV_WRITER_IOV 1024
+
+typedef struct {
+    int fd;
+    struct iovec iov[IOV_WRITER_IOV];
+    int iov_count;
+    uint64_t bytes;
+} IOVWriter;
+
+static inline void init_iov_writer(IOVWriter *w, int fd) {
+    w->fd = fd;
+    w->iov_count = 0;
+    w->bytes = 0;
+}
+
+static int flush_iov_writer(IOVWriter *w) {
+    struct iovec *iov = w->iov;
+    int count = w->iov_count;
+
+    w->iov_count = 0;
+
+    while (count > 0) {
+        ssize_t n = writev(w->fd, iov, count);
+
+        if (n < 0) {
+            if (errno == EINTR) continue;
+            fprintf(stderr, "Failed to write output\n");
+            return -1;
+        }
+
+        while (count > 0 && (size_t)n >= iov->iov_len) {
+            n -= iov->iov_len;
+            iov++;
+            count--;
+        }
+
+        if (count > 0) {
+            iov->iov_base = (uint8_t *)iov->iov_base + n;
+            iov->iov_len -= n;
+        }
+    }
+
+    return 0;
+}
+
+static inline int write_iov_writer(IOVWriter *w, const void *data, size_t size) {
+    w->bytes += size;
+
+    if (w->iov_count > 0) {
+        struct iovec *last = &w->iov[w->iov_count - 1];
+
+        if ((const uint8_t *)last->iov_base + last->iov_len == data && last->iov_len + size <= SSIZE_MAX) {
+            last->iov_len += size;
+            return 0;
+        }
+    }
+
+    if (w->iov_count == IOV_WRITER_IOV && flush_iov_writer(w) < 0) return -1;
+
+    w->iov[w->iov_count].iov_base = (void *)data;
+    w->iov[w->iov_count].iov_len = size;
+    w->iov_count++;
+    return 0;
+}
+
+#endif // IOV_WRITER_H
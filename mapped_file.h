@@ -0,0 +1,107 @@
+#ifndef MAPPED_FILE_H
+#define MAPPED_FILE_H
+
+#include <errno.h>
+#include <fcntl.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+#define MAPPED_FILE_READ_CHUNK (1024 * 1024)
+
+// A whole input file as one read-only buffer. Regular files are mapped with
+// MADV_SEQUENTIAL, so pages are read ahead and can be dropped once parsed
+// and the private footprint does not grow with the file. Pipes and anything
+// else mmap refuses are read into a malloc'd buffer instead.
+typedef struct {
+    uint8_t *data;
+    size_t size;
+    int mapped;
+} MappedFile;
+
+static int read_file_stream(int fd, MappedFile *file) {
+    size_t capacity = 0;
+
+    for (;;) {
+        if (file->size + MAPPED_FILE_READ_CHUNK > capacity) {
+            capacity = capacity ? capacity * 2 : MAPPED_FILE_READ_CHUNK;
+            uint8_t *data = realloc(file->data, capacity);
+
+            if (!data) {
+                fprintf(stderr, "Failed to allocate memory\n");
+                return -1;
+            }
+
+            file->data = data;
+        }
+
+        ssize_t n = read(fd, file->data + file->size, capacity - file->size);
+
+        if (n < 0) {
+            if (errno == EINTR) continue;
+            fprintf(stderr, "Failed to read file\n");
+            return -1;
+        }
+
+        if (n == 0) return 0;
+
+        file->size += n;
+    }
+}
+
+static inline void unmap_file(MappedFile *file) {
+    if (file->mapped) {
+        munmap(file->data, file->size);
+    } else {
+        free(file->data);
+    }
+
+    file->data = NULL;
+    file->size = 0;
+    file->mapped = 0;
+}
+
+static inline int map_file(const char *filename, MappedFile *file) {
+    file->data = NULL;
+    file->size = 0;
+    file->mapped = 0;
+
+    int fd = open(filename, O_RDONLY);
+
+    if (fd < 0) {
+        fprintf(stderr, "Failed to open file: %s\n", filename);
+        return -1;
+    }
+
+    struct stat st;
+
+    if (fstat(fd, &st) == 0 && S_ISREG(st.st_mode)) {
+        if (st.st_size == 0) {
+            close(fd);
+            return 0;
+        }
+
+        void *data = mmap(NULL, st.st_size, PROT_READ, MAP_PRIVATE, fd, 0);
+
+        if (data != MAP_FAILED) {
+            madvise(data, st.st_size, MADV_SEQUENTIAL);
+            file->data = data;
+            file->size = st.st_size;
+            file->mapped = 1;
+            close(fd);
+            return 0;
+        }
+    }
+
+    int ret = read_file_stream(fd, file);
+    close(fd);
+
+    if (ret < 0) unmap_file(file);
+    return ret;
+}
+
+#endif // MAPPED_FILE_H
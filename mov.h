@@ -0,0 +1,363 @@
+#ifndef MOV_H
+#define MOV_H
+
+#include <errno.h>
+#include <fcntl.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+// The box (atom) tree of an MP4 or QuickTime file, read with pread. Only box
+// headers are fetched while walking, container boxes are descended into and
+// everything else, mdat first of all, is skipped by its size, so the tree of
+// a file of any size costs a few KB of I/O. Payloads are read on demand
+// afterwards, whole or in part.
+//
+// Reads go through a small window so that the headers of neighbouring boxes
+// inside moov come from one pread.
+
+#define MOV_WINDOW_SIZE 4096
+#define MOV_MAX_DEPTH 16
+
+#define MOV_FOURCC(a, b, c, d) ((uint32_t)(a) << 24 | (uint32_t)(b) << 16 | (uint32_t)(c) << 8 | (uint32_t)(d))
+
+typedef struct {
+    int fd;
+    uint64_t size;
+    uint8_t window[MOV_WINDOW_SIZE];
+    uint64_t window_offset;
+    size_t window_size;
+    uint64_t bytes_read;
+    uint64_t reads;
+} MovFile;
+
+// offset is where the header starts, payload_offset where the box's own
+// fields start, after the 64-bit size and uuid if it has them. children is
+// the offset of the first child for container boxes and 0 otherwise.
+// Boxes that claim more than their parent or the file holds are cut to fit
+// and marked truncated.
+typedef struct {
+    uint32_t type;
+    int parent;
+    int depth;
+    int truncated;
+    uint64_t offset;
+    uint64_t size;
+    uint64_t payload_offset;
+    uint64_t children;
+} MovBox;
+
+typedef struct {
+    MovBox *boxes;
+    int count;
+    int capacity;
+} MovBoxTree;
+
+static inline uint16_t read_u16_be(const uint8_t *p) {
+    return (uint16_t)(p[0] << 8 | p[1]);
+}
+
+static inline uint32_t read_u32_be(const uint8_t *p) {
+    return (uint32_t)p[0] << 24 | (uint32_t)p[1] << 16 | (uint32_t)p[2] << 8 | p[3];
+}
+
+static inline uint64_t read_u64_be(const uint8_t *p) {
+    return (uint64_t)read_u32_be(p) << 32 | read_u32_be(p + 4);
+}
+
+static inline void mov_fourcc_string(uint32_t type, char out[5]) {
+    for (int i = 0; i < 4; i++) {
+        uint8_t c = (uint8_t)(type >> (24 - 8 * i));
+        out[i] = c >= 0x20 && c < 0x7F ? (char)c : '?';
+    }
+
+    out[4] = '\0';
+}
+
+static inline uint64_t mov_box_payload_size(const MovBox *box) {
+    return box->offset + box->size - box->payload_offset;
+}
+
+static int open_mov_file(const char *path, MovFile *file) {
+    struct stat st;
+
+    memset(file, 0, sizeof(*file));
+    file->fd = open(path, O_RDONLY);
+
+    if (file->fd < 0) {
+        fprintf(stderr, "Failed to open file: %s\n", path);
+        return -1;
+    }
+
+    if (fstat(file->fd, &st) < 0 || !S_ISREG(st.st_mode)) {
+        fprintf(stderr, "Failed to open file: %s is not a regular file\n", path);
+        close(file->fd);
+        file->fd = -1;
+        return -1;
+    }
+
+    file->size = st.st_size;
+    return 0;
+}
+
+static inline void close_mov_file(MovFile *file) {
+    if (file->fd >= 0) close(file->fd);
+    file->fd = -1;
+}
+
+static int pread_mov_file(MovFile *file, uint64_t offset, uint8_t *dst, size_t size) {
+    while (size > 0) {
+        ssize_t n = pread(file->fd, dst, size, (off_t)offset);
+
+        if (n < 0) {
+            if (errno == EINTR) continue;
+            return -1;
+        }
+
+        if (n == 0) return -1;
+
+        file->bytes_read += n;
+        file->reads++;
+        dst += n;
+        offset += n;
+        size -= n;
+    }
+
+    return 0;
+}
+
+// Reads size bytes at offset, all of them or fails.
+static int read_mov_file(MovFile *file, uint64_t offset, void *dst, size_t size) {
+    if (offset > file->size || size > file->size - offset) return -1;
+
+    if (offset >= file->window_offset && offset + size <= file->window_offset + file->window_size) {
+        memcpy(dst, file->window + (offset - file->window_offset), size);
+        return 0;
+    }
+
+    if (size > MOV_WINDOW_SIZE) return pread_mov_file(file, offset, dst, size);
+
+    size_t window_size = file->size - offset < MOV_WINDOW_SIZE ? file->size - offset : MOV_WINDOW_SIZE;
+
+    if (pread_mov_file(file, offset, file->window, window_size) < 0) {
+        file->window_size = 0;
+        return -1;
+    }
+
+    file->window_offset = offset;
+    file->window_size = window_size;
+    memcpy(dst, file->window, size);
+    return 0;
+}
+
+// Reads up to size bytes of a box payload starting offset bytes into it.
+// Returns the number of bytes read or -1.
+static inline int64_t read_mov_box(MovFile *file, const MovBox *box, uint64_t offset, void *dst, size_t size) {
+    uint64_t payload_size = mov_box_payload_size(box);
+
+    if (offset > payload_size) return -1;
+    if (size > payload_size - offset) size = payload_size - offset;
+    if (read_mov_file(file, box->payload_offset + offset, dst, size) < 0) return -1;
+    return size;
+}
+
+// The whole payload of a box in a malloc'd buffer, for boxes up to
+// max_size bytes.
+static inline uint8_t *load_mov_box(MovFile *file, const MovBox *box, size_t max_size, size_t *size) {
+    uint64_t payload_size = mov_box_payload_size(box);
+    char type[5];
+
+    mov_fourcc_string(box->type, type);
+
+    if (payload_size > max_size) {
+        fprintf(stderr, "Failed to load %s box: %llu bytes\n", type, (unsigned long long)payload_size);
+        return NULL;
+    }
+
+    uint8_t *data = malloc(payload_size ? payload_size : 1);
+
+    if (!data) {
+        fprintf(stderr, "Failed to allocate memory\n");
+        return NULL;
+    }
+
+    if (read_mov_file(file, box->payload_offset, data, payload_size) < 0) {
+        fprintf(stderr, "Failed to read %s box\n", type);
+        free(data);
+        return NULL;
+    }
+
+    *size = payload_size;
+    return data;
+}
+
+// Where the children of a box start, counted from its payload, or -1 for
+// boxes that have none. Full boxes and sample entries have fields of their
+// own in front of the children.
+static int mov_children_offset(MovFile *file, const MovBox *box) {
+    switch (box->type) {
+    case MOV_FOURCC('m', 'o', 'o', 'v'):
+    case MOV_FOURCC('t', 'r', 'a', 'k'):
+    case MOV_FOURCC('m', 'd', 'i', 'a'):
+    case MOV_FOURCC('m', 'i', 'n', 'f'):
+    case MOV_FOURCC('s', 't', 'b', 'l'):
+    case MOV_FOURCC('d', 'i', 'n', 'f'):
+    case MOV_FOURCC('e', 'd', 't', 's'):
+    case MOV_FOURCC('u', 'd', 't', 'a'):
+    case MOV_FOURCC('t', 'r', 'e', 'f'):
+    case MOV_FOURCC('m', 'v', 'e', 'x'):
+    case MOV_FOURCC('m', 'o', 'o', 'f'):
+    case MOV_FOURCC('t', 'r', 'a', 'f'):
+    case MOV_FOURCC('m', 'f', 'r', 'a'):
+    case MOV_FOURCC('s', 'i', 'n', 'f'):
+    case MOV_FOURCC('s', 'c', 'h', 'i'):
+        return 0;
+    case MOV_FOURCC('s', 't', 's', 'd'):
+    case MOV_FOURCC('d', 'r', 'e', 'f'):
+        return 8; // version, flags, entry_count
+    case MOV_FOURCC('a', 'v', 'c', '1'):
+    case MOV_FOURCC('a', 'v', 'c', '3'):
+    case MOV_FOURCC('h', 'v', 'c', '1'):
+    case MOV_FOURCC('h', 'e', 'v', '1'):
+    case MOV_FOURCC('e', 'n', 'c', 'v'):
+        return 78; // VisualSampleEntry fields
+    case MOV_FOURCC('m', 'e', 't', 'a'): {
+        // A full box in MP4, a plain container in QuickTime, where the
+        // payload starts right away with the size of the first child.
+        uint8_t version[4];
+        if (read_mov_box(file, box, 0, version, 4) != 4) return -1;
+        return read_u32_be(version) == 0 ? 4 : 0;
+    }
+    default:
+        return -1;
+    }
+}
+
+static int add_mov_box(MovBoxTree *tree, const MovBox *box) {
+    if (tree->count == tree->capacity) {
+        int capacity = tree->capacity ? tree->capacity * 2 : 64;
+        MovBox *boxes = realloc(tree->boxes, capacity * sizeof(MovBox));
+
+        if (!boxes) {
+            fprintf(stderr, "Failed to allocate memory\n");
+            return -1;
+        }
+
+        tree->boxes = boxes;
+        tree->capacity = capacity;
+    }
+
+    tree->boxes[tree->count] = *box;
+    return tree->count++;
+}
+
+// Reads the header of the box at offset, which has to end by end.
+static int read_mov_box_header(MovFile *file, uint64_t offset, uint64_t end, MovBox *box) {
+    uint8_t header[16];
+
+    if (end - offset < 8 || read_mov_file(file, offset, header, 8) < 0) {
+        fprintf(stderr, "Failed to read box header at %llu\n", (unsigned long long)offset);
+        return -1;
+    }
+
+    memset(box, 0, sizeof(*box));
+    box->offset = offset;
+    box->size = read_u32_be(header);
+    box->type = read_u32_be(header + 4);
+    box->payload_offset = offset + 8;
+
+    if (box->size == 1) {
+        if (end - offset < 16 || read_mov_file(file, offset + 8, header + 8, 8) < 0) {
+            fprintf(stderr, "Failed to read box header at %llu\n", (unsigned long long)offset);
+            return -1;
+        }
+
+        box->size = read_u64_be(header + 8);
+        box->payload_offset += 8;
+    } else if (box->size == 0) {
+        box->size = end - offset; // up to the end of the file or parent
+    }
+
+    if (box->type == MOV_FOURCC('u', 'u', 'i', 'd')) box->payload_offset += 16;
+
+    if (box->size < box->payload_offset - offset || box->payload_offset > end) {
+        fprintf(stderr, "Failed to parse box at %llu: size %llu\n", (unsigned long long)offset, (unsigned long long)box->size);
+        return -1;
+    }
+
+    if (box->size > end - offset) {
+        box->size = end - offset;
+        box->truncated = 1;
+    }
+
+    return 0;
+}
+
+static int parse_mov_children(MovFile *file, MovBoxTree *tree, int parent, uint64_t offset, uint64_t end, int depth) {
+    while (offset < end) {
+        MovBox box;
+
+        // Some writers pad containers with a 32-bit zero terminator.
+        if (end - offset < 8) return 0;
+        if (read_mov_box_header(file, offset, end, &box) < 0) return -1;
+
+        box.parent = parent;
+        box.depth = depth;
+
+        int index = add_mov_box(tree, &box);
+        if (index < 0) return -1;
+
+        int children = depth + 1 < MOV_MAX_DEPTH ? mov_children_offset(file, &box) : -1;
+
+        if (children >= 0 && (uint64_t)children <= mov_box_payload_size(&box)) {
+            uint64_t first = box.payload_offset + children;
+            tree->boxes[index].children = first;
+            if (parse_mov_children(file, tree, index, first, box.offset + box.size, depth + 1) < 0) return -1;
+        }
+
+        offset = box.offset + box.size;
+    }
+
+    return 0;
+}
+
+// Reads the box tree of the whole file, parents before their children. On
+// failure the tree keeps what was parsed up to the bad box.
+static int parse_mov_box_tree(MovFile *file, MovBoxTree *tree) {
+    memset(tree, 0, sizeof(*tree));
+    return parse_mov_children(file, tree, -1, 0, file->size, 0);
+}
+
+static inline void free_mov_box_tree(MovBoxTree *tree) {
+    free(tree->boxes);
+    memset(tree, 0, sizeof(*tree));
+}
+
+// The next box of the given type among the direct children of parent (-1
+// for top level) after index after. Start with after = -1. Returns the box
+// index or -1.
+static inline int find_mov_box(const MovBoxTree *tree, int parent, uint32_t type, int after) {
+    for (int i = after < parent ? parent + 1 : after + 1; i < tree->count; i++) {
+        const MovBox *box = &tree->boxes[i];
+        if (box->parent == parent && box->type == type) return i;
+        if (parent >= 0 && box->depth <= tree->boxes[parent].depth) break;
+    }
+
+    return -1;
+}
+
+// Follows a path of box types down from parent, e.g. mdia, minf, stbl,
+// taking the first match on every level.
+static inline int find_mov_box_path(const MovBoxTree *tree, int parent, const uint32_t *types, int count) {
+    for (int i = 0; i < count; i++) {
+        parent = find_mov_box(tree, parent, types[i], -1);
+        if (parent < 0) return -1;
+    }
+
+    return parent;
+}
+
+#endif // MOV_H
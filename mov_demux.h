@@ -0,0 +1,248 @@
+#ifndef MOV_DEMUX_H
+#define MOV_DEMUX_H
+
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "annexb.h"
+#include "avcc.h"
+#include "iov_writer.h"
+#include "mov.h"
+#include "mov_fragment.h"
+#include "mov_sample_table.h"
+
+// Writes the samples of an H.264 track as an Annex B stream. Samples are
+// never copied: every NAL unit goes out as two iovecs, a start code from a
+// constant and the payload straight from the mapped input, and writev
+// batches them. The SPS and PPS from avcC are put in front of IDR pictures
+// that do not carry their own, by the same rules as ffmpeg's
+// h264_mp4toannexb, so the output matches ffmpeg -c copy -bsf:v
+// h264_mp4toannexb -f h264 byte for byte: 4 byte start codes on the first
+// NAL unit of a sample and on parameter sets, 3 bytes on the rest.
+
+#define MOV_DEMUX_MAX_AVCC_SIZE (1024 * 1024)
+
+static const uint8_t mov_demux_start_code[4] = {0, 0, 0, 1};
+
+typedef struct {
+    IOVWriter writer;
+    int length_size;
+
+    // SPS and then PPS from avcC, as Annex B.
+    uint8_t *parameter_sets;
+    size_t sps_size;
+    size_t pps_size;
+
+    // h264_mp4toannexb state, carried from one sample to the next.
+    int new_idr;
+    int sps_seen;
+    int pps_seen;
+
+    uint64_t samples;
+} MovH264Demuxer;
+
+static inline void free_mov_h264_demuxer(MovH264Demuxer *d) {
+    free(d->parameter_sets);
+    d->parameter_sets = NULL;
+}
+
+// Reads avcC from the sample entry of table. For avc3 tracks, which carry
+// their parameter sets in band, avcC may list none.
+static int init_mov_h264_demuxer(MovH264Demuxer *d, MovFile *file, const MovBoxTree *tree, const MovSampleTable *table,
+                                 int fd) {
+    memset(d, 0, sizeof(*d));
+    init_iov_writer(&d->writer, fd);
+    d->new_idr = 1;
+
+    if (table->codec != MOV_FOURCC('a', 'v', 'c', '1') && table->codec != MOV_FOURCC('a', 'v', 'c', '3')) {
+        fprintf(stderr, "Failed to find an H.264 sample entry\n");
+        return -1;
+    }
+
+    int avcc = find_mov_box(tree, table->sample_entry, MOV_FOURCC('a', 'v', 'c', 'C'), -1);
+    uint8_t *record;
+    size_t record_size, size;
+
+    if (avcc < 0) {
+        fprintf(stderr, "Failed to find avcC box\n");
+        return -1;
+    }
+
+    if (!(record = load_mov_box(file, &tree->boxes[avcc], MOV_DEMUX_MAX_AVCC_SIZE, &record_size))) return -1;
+
+    if (parse_avcc(record, record_size, &d->length_size, NULL, 0, &size) < 0 ||
+        !(d->parameter_sets = malloc(size ? size : 1)) ||
+        parse_avcc(record, record_size, &d->length_size, d->parameter_sets, size, &size) < 0) {
+        fprintf(stderr, "Failed to parse avcC box\n");
+        free(record);
+        free_mov_h264_demuxer(d);
+        return -1;
+    }
+
+    free(record);
+
+    // parse_avcc lists every SPS before the first PPS.
+    NALIterator it;
+    NALUnit nal;
+
+    d->sps_size = size;
+    init_nal_iterator(&it, d->parameter_sets, size);
+
+    while (next_nal_unit(&it, &nal)) {
+        if (nal.nal_unit_type == 8) {
+            d->sps_size = nal.offset - nal.start_code_size;
+            break;
+        }
+    }
+
+    d->pps_size = size - d->sps_size;
+    return 0;
+}
+
+static inline int write_mov_h264_nal(MovH264Demuxer *d, const uint8_t *nal, size_t size, int start_code_size) {
+    if (write_iov_writer(&d->writer, mov_demux_start_code + 4 - start_code_size, start_code_size) < 0) return -1;
+    return write_iov_writer(&d->writer, nal, size);
+}
+
+static inline int write_mov_h264_sps(MovH264Demuxer *d) {
+    return d->sps_size ? write_iov_writer(&d->writer, d->parameter_sets, d->sps_size) : 0;
+}
+
+static inline int write_mov_h264_pps(MovH264Demuxer *d) {
+    return d->pps_size ? write_iov_writer(&d->writer, d->parameter_sets + d->sps_size, d->pps_size) : 0;
+}
+
+// Queues one sample, which has to stay mapped until the next flush.
+static int write_mov_h264_sample(MovH264Demuxer *d, const uint8_t *sample, size_t size) {
+    const uint8_t *p = sample;
+    const uint8_t *end = sample + size;
+    int first = 1;
+    int ret = 0;
+
+    while ((size_t)(end - p) >= (size_t)d->length_size && ret == 0) {
+        uint32_t nal_size = read_avcc_length(p, d->length_size);
+        p += d->length_size;
+
+        if (nal_size > (size_t)(end - p)) {
+            fprintf(stderr, "Failed to parse sample %llu: NAL unit overruns it\n", (unsigned long long)d->samples);
+            return -1;
+        }
+
+        if (nal_size == 0) continue;
+
+        uint8_t nal_unit_type = p[0] & 0x1F;
+
+        if (nal_unit_type == 7) {
+            d->sps_seen = d->new_idr = 1;
+        } else if (nal_unit_type == 8) {
+            d->pps_seen = d->new_idr = 1;
+
+            if (!d->sps_seen && d->sps_size) {
+                ret = write_mov_h264_sps(d);
+                d->sps_seen = 1;
+                first = 0;
+            }
+        }
+
+        // A second IDR picture right after the first, told apart by
+        // first_mb_in_slice being 0.
+        if (nal_unit_type == 5 && !d->new_idr && nal_size > 1 && (p[1] & 0x80)) d->new_idr = 1;
+
+        // A buffering period SEI without parameter sets in front.
+        if (nal_unit_type == 6 && nal_size > 1 && p[1] == 0 && !d->sps_seen && !d->pps_seen) {
+            if (d->sps_size) {
+                ret |= write_mov_h264_sps(d);
+                d->sps_seen = 1;
+                first = 0;
+            }
+
+            if (d->pps_size) {
+                ret |= write_mov_h264_pps(d);
+                d->pps_seen = 1;
+                first = 0;
+            }
+        }
+
+        if (d->new_idr && nal_unit_type == 5 && !d->sps_seen && !d->pps_seen) {
+            ret |= write_mov_h264_sps(d);
+            ret |= write_mov_h264_pps(d);
+            if (d->sps_size || d->pps_size) first = 0;
+            d->new_idr = 0;
+        } else if (d->new_idr && nal_unit_type == 5 && d->sps_seen && !d->pps_seen) {
+            ret |= write_mov_h264_pps(d);
+            if (d->pps_size) first = 0;
+        }
+
+        ret |= write_mov_h264_nal(d, p, nal_size, first || nal_unit_type == 7 || nal_unit_type == 8 ? 4 : 3);
+        first = 0;
+
+        if (nal_unit_type == 1) {
+            d->new_idr = 1;
+            d->sps_seen = 0;
+            d->pps_seen = 0;
+        }
+
+        p += nal_size;
+    }
+
+    d->samples++;
+    return ret;
+}
+
+// Writes every sample of table from data, the whole mapped file.
+static int write_mov_h264_track(MovH264Demuxer *d, const uint8_t *data, uint64_t data_size, const MovSampleTable *table) {
+    for (uint32_t i = 0; i < table->sample_count; i++) {
+        uint64_t offset = mov_sample_offset(table, i);
+        uint32_t size = mov_sample_size(table, i);
+
+        if (offset > data_size || size > data_size - offset) {
+            fprintf(stderr, "Failed to read sample %u: beyond the end of the file\n", i);
+            return -1;
+        }
+
+        if (write_mov_h264_sample(d, data + offset, size) < 0) return -1;
+    }
+
+    return flush_iov_writer(&d->writer);
+}
+
+typedef struct {
+    MovH264Demuxer *demuxer;
+    const uint8_t *data;
+    uint64_t data_size;
+    uint32_t track_id;
+} MovFragmentDemux;
+
+static int write_mov_fragment_sample(const MovFragmentSample *sample, void *opaque) {
+    MovFragmentDemux *demux = opaque;
+
+    if (sample->track_id != demux->track_id) return 0;
+
+    if (sample->offset > demux->data_size || sample->size > demux->data_size - sample->offset) {
+        fprintf(stderr, "Failed to read sample %llu: beyond the end of the file\n",
+                (unsigned long long)demux->demuxer->samples);
+        return -1;
+    }
+
+    return write_mov_h264_sample(demux->demuxer, demux->data + sample->offset, sample->size);
+}
+
+// Writes every sample of track_id from data, a whole fragmented file, in
+// the order of its moofs. The file is fed in one piece, so each moof is
+// parsed where it is mapped.
+static int write_mov_h264_fragments(MovH264Demuxer *d, const uint8_t *data, uint64_t data_size, uint32_t track_id) {
+    MovFragmentDemux demux = {d, data, data_size, track_id};
+    MovFragmentParser parser;
+    int ret;
+
+    init_mov_fragment_parser(&parser, write_mov_fragment_sample, &demux);
+    ret = feed_mov_fragment_parser(&parser, data, data_size);
+    if (ret == 0) ret = finish_mov_fragment_parser(&parser);
+    free_mov_fragment_parser(&parser);
+
+    return ret < 0 ? -1 : flush_iov_writer(&d->writer);
+}
+
+#endif // MOV_DEMUX_H
@@ -0,0 +1,527 @@
+#ifndef MOV_FRAGMENT_H
+#define MOV_FRAGMENT_H
+
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "mov.h"
+
+// Incremental parser for fragmented MP4, fed bytes as they arrive, say from
+// a pipe or a file that is still being written. Top level boxes are
+// tracked by their headers alone: moov and moof are gathered until
+// complete and parsed, and everything else, mdat included, is skipped as
+// it goes past. A moof that arrives whole in one feed is parsed where it
+// is, so only boxes split between feeds are copied.
+//
+// Each moof yields one MovFragmentSample per sample, with the byte offset
+// of its data in the stream, before that data has arrived. The samples are
+// passed to the callback as the truns are read and never stored, so memory
+// is the largest moov or moof seen, at most MOV_FRAGMENT_MAX_BOX_SIZE.
+//
+// moov is only read for the trex defaults and the track timescales; a
+// stream that starts at a moof is parsed with no defaults. Samples in the
+// moov sample tables are not reported.
+
+#define MOV_FRAGMENT_MAX_BOX_SIZE (16 * 1024 * 1024)
+#define MOV_FRAGMENT_MAX_TRACKS 32
+
+// tfhd flags
+#define MOV_TFHD_BASE_DATA_OFFSET 0x000001
+#define MOV_TFHD_SAMPLE_DESCRIPTION_INDEX 0x000002
+#define MOV_TFHD_DEFAULT_DURATION 0x000008
+#define MOV_TFHD_DEFAULT_SIZE 0x000010
+#define MOV_TFHD_DEFAULT_FLAGS 0x000020
+#define MOV_TFHD_DEFAULT_BASE_IS_MOOF 0x020000
+
+// trun flags
+#define MOV_TRUN_DATA_OFFSET 0x000001
+#define MOV_TRUN_FIRST_SAMPLE_FLAGS 0x000004
+#define MOV_TRUN_DURATION 0x000100
+#define MOV_TRUN_SIZE 0x000200
+#define MOV_TRUN_FLAGS 0x000400
+#define MOV_TRUN_COMPOSITION_OFFSET 0x000800
+
+// sample_is_non_sync_sample in sample flags.
+#define MOV_SAMPLE_NON_SYNC 0x00010000
+
+typedef struct {
+    uint32_t track_id;
+    uint32_t sequence_number; // from mfhd
+    uint64_t offset;          // of the sample data in the stream
+    uint32_t size;
+    uint32_t duration;
+    int64_t dts;
+    int64_t pts;
+    int keyframe;
+} MovFragmentSample;
+
+// Returning -1 stops the parser, and the feed returns -1.
+typedef int (*MovFragmentCallback)(const MovFragmentSample *sample, void *opaque);
+
+typedef struct {
+    uint32_t track_id;
+    uint32_t timescale; // 0 until the moov is seen
+    uint32_t handler;
+
+    // trex
+    uint32_t default_duration;
+    uint32_t default_size;
+    uint32_t default_flags;
+
+    // Decode time after the last sample, for fragments without tfdt.
+    int64_t next_dts;
+} MovFragmentTrack;
+
+enum {
+    MOV_FRAGMENT_HEADER,
+    MOV_FRAGMENT_GATHER,
+    MOV_FRAGMENT_SKIP,
+};
+
+typedef struct {
+    MovFragmentCallback callback;
+    void *opaque;
+
+    MovFragmentTrack tracks[MOV_FRAGMENT_MAX_TRACKS];
+    int track_count;
+
+    uint64_t offset; // of the next byte to be fed
+
+    // Top level box in progress. box_size 0 runs to the end of the stream.
+    int state;
+    uint8_t header[16];
+    size_t header_size;
+    uint32_t box_type;
+    uint64_t box_offset;
+    uint64_t box_size;
+    uint64_t box_remaining;
+
+    // A moov or moof split between feeds.
+    uint8_t *buffer;
+    size_t buffer_size;
+    size_t buffer_capacity;
+
+    uint32_t sequence_number;
+    uint64_t fragments;
+    uint64_t samples;
+} MovFragmentParser;
+
+static inline void init_mov_fragment_parser(MovFragmentParser *parser, MovFragmentCallback callback, void *opaque) {
+    memset(parser, 0, sizeof(*parser));
+    parser->callback = callback;
+    parser->opaque = opaque;
+}
+
+static inline void free_mov_fragment_parser(MovFragmentParser *parser) {
+    free(parser->buffer);
+    parser->buffer = NULL;
+    parser->buffer_size = 0;
+    parser->buffer_capacity = 0;
+}
+
+// Steps through the boxes of an in-memory payload. Returns 1 with the next
+// box, 0 at the end or -1 if a box overruns it.
+static inline int next_mov_memory_box(const uint8_t **p, const uint8_t *end, uint32_t *type, const uint8_t **payload,
+                                      size_t *payload_size) {
+    size_t left = end - *p;
+
+    if (left < 8) return 0;
+
+    uint64_t size = read_u32_be(*p);
+    size_t header_size = 8;
+
+    *type = read_u32_be(*p + 4);
+
+    if (size == 1) {
+        if (left < 16) return -1;
+        size = read_u64_be(*p + 8);
+        header_size = 16;
+    } else if (size == 0) {
+        size = left;
+    }
+
+    if (size < header_size || size > left) return -1;
+
+    *payload = *p + header_size;
+    *payload_size = size - header_size;
+    *p += size;
+    return 1;
+}
+
+// Finds the track, adding it if it is new. NULL when there are too many.
+static MovFragmentTrack *find_mov_fragment_track(MovFragmentParser *parser, uint32_t track_id) {
+    for (int i = 0; i < parser->track_count; i++) {
+        if (parser->tracks[i].track_id == track_id) return &parser->tracks[i];
+    }
+
+    if (parser->track_count == MOV_FRAGMENT_MAX_TRACKS) {
+        fprintf(stderr, "Failed to add track %u: more than %d tracks\n", track_id, MOV_FRAGMENT_MAX_TRACKS);
+        return NULL;
+    }
+
+    MovFragmentTrack *track = &parser->tracks[parser->track_count++];
+    memset(track, 0, sizeof(*track));
+    track->track_id = track_id;
+    return track;
+}
+
+static int parse_mov_fragment_trak(MovFragmentParser *parser, const uint8_t *p, const uint8_t *end) {
+    const uint8_t *payload, *mdia_end = NULL, *mdia = NULL;
+    size_t size;
+    uint32_t type, track_id = 0;
+    int ret;
+
+    while ((ret = next_mov_memory_box(&p, end, &type, &payload, &size)) > 0) {
+        if (type == MOV_FOURCC('t', 'k', 'h', 'd') && size >= 24) {
+            track_id = read_u32_be(payload + (payload[0] == 1 ? 20 : 12));
+        } else if (type == MOV_FOURCC('m', 'd', 'i', 'a')) {
+            mdia = payload;
+            mdia_end = payload + size;
+        }
+    }
+
+    if (ret < 0 || track_id == 0) return ret;
+
+    MovFragmentTrack *track = find_mov_fragment_track(parser, track_id);
+    if (!track) return -1;
+
+    while (mdia && (ret = next_mov_memory_box(&mdia, mdia_end, &type, &payload, &size)) > 0) {
+        if (type == MOV_FOURCC('m', 'd', 'h', 'd') && size >= 24) {
+            track->timescale = read_u32_be(payload + (payload[0] == 1 ? 20 : 12));
+        } else if (type == MOV_FOURCC('h', 'd', 'l', 'r') && size >= 12) {
+            track->handler = read_u32_be(payload + 8);
+        }
+    }
+
+    return ret;
+}
+
+static int parse_mov_fragment_moov(MovFragmentParser *parser, const uint8_t *p, const uint8_t *end) {
+    const uint8_t *payload, *trex;
+    size_t size, trex_size;
+    uint32_t type;
+    int ret;
+
+    while ((ret = next_mov_memory_box(&p, end, &type, &payload, &size)) > 0) {
+        if (type == MOV_FOURCC('t', 'r', 'a', 'k')) {
+            if (parse_mov_fragment_trak(parser, payload, payload + size) < 0) return -1;
+        } else if (type == MOV_FOURCC('m', 'v', 'e', 'x')) {
+            const uint8_t *q = payload;
+
+            while ((ret = next_mov_memory_box(&q, payload + size, &type, &trex, &trex_size)) > 0) {
+                if (type != MOV_FOURCC('t', 'r', 'e', 'x') || trex_size < 24) continue;
+
+                MovFragmentTrack *track = find_mov_fragment_track(parser, read_u32_be(trex + 4));
+                if (!track) return -1;
+
+                track->default_duration = read_u32_be(trex + 12);
+                track->default_size = read_u32_be(trex + 16);
+                track->default_flags = read_u32_be(trex + 20);
+            }
+
+            if (ret < 0) return -1;
+        }
+    }
+
+    return ret;
+}
+
+// Track fragment defaults from tfhd and tfdt, with the trex values under
+// them.
+typedef struct {
+    MovFragmentTrack *track;
+    uint64_t base_offset;
+    uint32_t default_duration;
+    uint32_t default_size;
+    uint32_t default_flags;
+} MovTrackFragment;
+
+// Reports the samples of one trun. next_offset is where the data of the
+// run starts when it does not say, and is moved past it.
+static int parse_mov_trun(MovFragmentParser *parser, MovTrackFragment *traf, const uint8_t *p, size_t size,
+                          uint64_t *next_offset) {
+    if (size < 8) return -1;
+
+    uint32_t flags = read_u32_be(p) & 0xFFFFFF;
+    int version = p[0];
+    uint32_t sample_count = read_u32_be(p + 4);
+    uint32_t first_sample_flags = traf->default_flags;
+    uint64_t offset = *next_offset;
+    const uint8_t *end = p + size;
+
+    p += 8;
+
+    if (flags & MOV_TRUN_DATA_OFFSET) {
+        if (end - p < 4) return -1;
+        offset = traf->base_offset + (int32_t)read_u32_be(p);
+        p += 4;
+    }
+
+    if (flags & MOV_TRUN_FIRST_SAMPLE_FLAGS) {
+        if (end - p < 4) return -1;
+        first_sample_flags = read_u32_be(p);
+        p += 4;
+    }
+
+    size_t entry_size = 4 * (!!(flags & MOV_TRUN_DURATION) + !!(flags & MOV_TRUN_SIZE) + !!(flags & MOV_TRUN_FLAGS) +
+                             !!(flags & MOV_TRUN_COMPOSITION_OFFSET));
+
+    if ((uint64_t)sample_count * entry_size > (size_t)(end - p)) return -1;
+
+    MovFragmentTrack *track = traf->track;
+    MovFragmentSample sample;
+
+    sample.track_id = track->track_id;
+    sample.sequence_number = parser->sequence_number;
+
+    for (uint32_t i = 0; i < sample_count; i++) {
+        uint32_t sample_flags = i == 0 ? first_sample_flags : traf->default_flags;
+        int64_t composition_offset = 0;
+
+        sample.duration = traf->default_duration;
+        sample.size = traf->default_size;
+
+        if (flags & MOV_TRUN_DURATION) sample.duration = read_u32_be(p), p += 4;
+        if (flags & MOV_TRUN_SIZE) sample.size = read_u32_be(p), p += 4;
+        if (flags & MOV_TRUN_FLAGS) sample_flags = read_u32_be(p), p += 4;
+
+        if (flags & MOV_TRUN_COMPOSITION_OFFSET) {
+            composition_offset = version == 0 ? (int64_t)read_u32_be(p) : (int32_t)read_u32_be(p);
+            p += 4;
+        }
+
+        sample.offset = offset;
+        sample.dts = track->next_dts;
+        sample.pts = (int64_t)((uint64_t)sample.dts + (uint64_t)composition_offset);
+        sample.keyframe = !(sample_flags & MOV_SAMPLE_NON_SYNC);
+
+        if (parser->callback(&sample, parser->opaque) < 0) return -1;
+
+        offset += sample.size;
+        track->next_dts = (int64_t)((uint64_t)track->next_dts + sample.duration);
+        parser->samples++;
+    }
+
+    *next_offset = offset;
+    return 0;
+}
+
+// data_end is where the data of the previous track fragment ended, the
+// base for one whose tfhd gives none.
+static int parse_mov_traf(MovFragmentParser *parser, const uint8_t *p, const uint8_t *end, uint64_t moof_offset,
+                          uint64_t *data_end) {
+    const uint8_t *runs = p;
+    const uint8_t *payload;
+    size_t size;
+    uint32_t type;
+    MovTrackFragment traf = {0};
+    int ret;
+
+    // tfhd and tfdt first, since the truns depend on them wherever they are.
+    while ((ret = next_mov_memory_box(&p, end, &type, &payload, &size)) > 0) {
+        if (type == MOV_FOURCC('t', 'f', 'h', 'd')) {
+            if (size < 8) return -1;
+
+            uint32_t flags = read_u32_be(payload) & 0xFFFFFF;
+            const uint8_t *q = payload + 8;
+            size_t need = 8 + 8 * !!(flags & MOV_TFHD_BASE_DATA_OFFSET) +
+                          4 * (!!(flags & MOV_TFHD_SAMPLE_DESCRIPTION_INDEX) + !!(flags & MOV_TFHD_DEFAULT_DURATION) +
+                               !!(flags & MOV_TFHD_DEFAULT_SIZE) + !!(flags & MOV_TFHD_DEFAULT_FLAGS));
+
+            if (size < need || !(traf.track = find_mov_fragment_track(parser, read_u32_be(payload + 4)))) return -1;
+
+            traf.default_duration = traf.track->default_duration;
+            traf.default_size = traf.track->default_size;
+            traf.default_flags = traf.track->default_flags;
+
+            if (flags & MOV_TFHD_BASE_DATA_OFFSET) {
+                traf.base_offset = read_u64_be(q);
+                q += 8;
+            } else {
+                traf.base_offset = flags & MOV_TFHD_DEFAULT_BASE_IS_MOOF ? moof_offset : *data_end;
+            }
+
+            if (flags & MOV_TFHD_SAMPLE_DESCRIPTION_INDEX) q += 4;
+            if (flags & MOV_TFHD_DEFAULT_DURATION) traf.default_duration = read_u32_be(q), q += 4;
+            if (flags & MOV_TFHD_DEFAULT_SIZE) traf.default_size = read_u32_be(q), q += 4;
+            if (flags & MOV_TFHD_DEFAULT_FLAGS) traf.default_flags = read_u32_be(q);
+        } else if (type == MOV_FOURCC('t', 'f', 'd', 't') && traf.track) {
+            if (size < 8 || (payload[0] == 1 && size < 12)) return -1;
+            traf.track->next_dts = payload[0] == 1 ? (int64_t)read_u64_be(payload + 4) : read_u32_be(payload + 4);
+        }
+    }
+
+    if (ret < 0 || !traf.track) return -1;
+
+    uint64_t offset = traf.base_offset;
+
+    while ((ret = next_mov_memory_box(&runs, end, &type, &payload, &size)) > 0) {
+        if (type == MOV_FOURCC('t', 'r', 'u', 'n') && parse_mov_trun(parser, &traf, payload, size, &offset) < 0) return -1;
+    }
+
+    *data_end = offset;
+    return ret;
+}
+
+static int parse_mov_fragment_moof(MovFragmentParser *parser, const uint8_t *p, const uint8_t *end, uint64_t moof_offset) {
+    const uint8_t *payload;
+    size_t size;
+    uint32_t type;
+    uint64_t data_end = moof_offset;
+    int ret;
+
+    parser->fragments++;
+
+    while ((ret = next_mov_memory_box(&p, end, &type, &payload, &size)) > 0) {
+        if (type == MOV_FOURCC('m', 'f', 'h', 'd') && size >= 8) {
+            parser->sequence_number = read_u32_be(payload + 4);
+        } else if (type == MOV_FOURCC('t', 'r', 'a', 'f')) {
+            if (parse_mov_traf(parser, payload, payload + size, moof_offset, &data_end) < 0) return -1;
+        }
+    }
+
+    return ret;
+}
+
+// Parses the payload of a complete moov or moof.
+static int parse_mov_fragment_box(MovFragmentParser *parser, const uint8_t *payload, size_t size) {
+    char type[5];
+    int ret;
+
+    if (parser->box_type == MOV_FOURCC('m', 'o', 'o', 'v')) {
+        ret = parse_mov_fragment_moov(parser, payload, payload + size);
+    } else {
+        ret = parse_mov_fragment_moof(parser, payload, payload + size, parser->box_offset);
+    }
+
+    if (ret < 0) {
+        mov_fourcc_string(parser->box_type, type);
+        fprintf(stderr, "Failed to parse %s box at offset %llu\n", type, (unsigned long long)parser->box_offset);
+    }
+
+    return ret;
+}
+
+// Starts the box whose header is complete in parser->header.
+static int start_mov_fragment_box(MovFragmentParser *parser) {
+    uint64_t size = read_u32_be(parser->header);
+
+    parser->box_type = read_u32_be(parser->header + 4);
+    parser->box_offset = parser->offset - parser->header_size;
+
+    if (size == 1) size = read_u64_be(parser->header + 8);
+
+    if (size != 0 && size < parser->header_size) {
+        fprintf(stderr, "Failed to parse box at offset %llu: size %llu\n", (unsigned long long)parser->box_offset,
+                (unsigned long long)size);
+        return -1;
+    }
+
+    parser->box_size = size;
+    parser->box_remaining = size ? size - parser->header_size : UINT64_MAX;
+    parser->buffer_size = 0;
+    parser->header_size = 0;
+
+    if (parser->box_type != MOV_FOURCC('m', 'o', 'o', 'v') && parser->box_type != MOV_FOURCC('m', 'o', 'o', 'f')) {
+        parser->state = MOV_FRAGMENT_SKIP;
+        return 0;
+    }
+
+    if (size == 0 || parser->box_remaining > MOV_FRAGMENT_MAX_BOX_SIZE) {
+        char type[5];
+        mov_fourcc_string(parser->box_type, type);
+        fprintf(stderr, "Failed to read %s box at offset %llu: larger than %d bytes\n", type,
+                (unsigned long long)parser->box_offset, MOV_FRAGMENT_MAX_BOX_SIZE);
+        return -1;
+    }
+
+    parser->state = parser->box_remaining ? MOV_FRAGMENT_GATHER : MOV_FRAGMENT_HEADER;
+    return 0;
+}
+
+// Returns -1 on a malformed box or when the callback asks to stop.
+static int feed_mov_fragment_parser(MovFragmentParser *parser, const uint8_t *data, size_t size) {
+    const uint8_t *p = data;
+    const uint8_t *end = data + size;
+
+    while (p < end) {
+        size_t left = end - p;
+
+        if (parser->state == MOV_FRAGMENT_HEADER) {
+            // 8 bytes, or 16 with a 64-bit size.
+            size_t need = parser->header_size < 8 ? 8 : 16;
+            size_t n = need - parser->header_size < left ? need - parser->header_size : left;
+
+            memcpy(parser->header + parser->header_size, p, n);
+            parser->header_size += n;
+            parser->offset += n;
+            p += n;
+
+            if (parser->header_size == 8 && read_u32_be(parser->header) == 1) continue;
+            if (parser->header_size == 8 || parser->header_size == 16) {
+                if (start_mov_fragment_box(parser) < 0) return -1;
+            }
+        } else if (parser->state == MOV_FRAGMENT_SKIP) {
+            size_t n = parser->box_remaining < left ? parser->box_remaining : left;
+
+            parser->box_remaining -= parser->box_size ? n : 0;
+            parser->offset += n;
+            p += n;
+
+            if (parser->box_remaining == 0) parser->state = MOV_FRAGMENT_HEADER;
+        } else {
+            size_t n = parser->box_remaining < left ? parser->box_remaining : left;
+            const uint8_t *payload = p;
+
+            // Parsed in place when the whole payload is here.
+            if (parser->buffer_size > 0 || n < parser->box_remaining) {
+                if (parser->buffer_size + n > parser->buffer_capacity) {
+                    size_t capacity = parser->buffer_capacity ? parser->buffer_capacity : 64 * 1024;
+                    while (capacity < parser->buffer_size + parser->box_remaining) capacity *= 2;
+
+                    uint8_t *buffer = realloc(parser->buffer, capacity);
+                    if (!buffer) {
+                        fprintf(stderr, "Failed to allocate memory\n");
+                        return -1;
+                    }
+
+                    parser->buffer = buffer;
+                    parser->buffer_capacity = capacity;
+                }
+
+                memcpy(parser->buffer + parser->buffer_size, p, n);
+                parser->buffer_size += n;
+                payload = parser->buffer;
+            }
+
+            parser->box_remaining -= n;
+            parser->offset += n;
+            p += n;
+
+            if (parser->box_remaining == 0) {
+                size_t payload_size = parser->buffer_size ? parser->buffer_size : n;
+
+                parser->state = MOV_FRAGMENT_HEADER;
+                if (parse_mov_fragment_box(parser, payload, payload_size) < 0) return -1;
+            }
+        }
+    }
+
+    return 0;
+}
+
+// Returns -1 if the stream ended inside a moov or moof, or inside a box
+// header. Anything else may be cut short, as a recording in progress is.
+static inline int finish_mov_fragment_parser(MovFragmentParser *parser) {
+    if (parser->state == MOV_FRAGMENT_GATHER || parser->header_size > 0) {
+        fprintf(stderr, "Failed to parse box at offset %llu: truncated\n",
+                (unsigned long long)(parser->header_size ? parser->offset - parser->header_size : parser->box_offset));
+        return -1;
+    }
+
+    return 0;
+}
+
+#endif // MOV_FRAGMENT_H
@@ -0,0 +1,530 @@
+#ifndef MOV_SAMPLE_TABLE_H
+#define MOV_SAMPLE_TABLE_H
+
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "mov.h"
+
+// The sample tables of one track (stsz/stz2, stco/co64, stsc, stts, ctts,
+// stss) flattened for random access, one array per field:
+//
+// - offsets and sizes are expanded to one entry per sample, with sizes left
+//   out when stsz gives one size for all of them.
+// - stts is kept as runs, each with the number and decode time of its first
+//   sample, since a whole constant frame rate track is a single run.
+//   dts and time lookups binary search the runs.
+// - ctts is kept as runs the same way, each with the number of its first
+//   sample and its composition offset. With B-frames the runs are mostly one
+//   sample long, but an entry is still smaller than one per sample.
+// - stss is kept as the sorted list of sync samples, absent when every
+//   sample is one.
+//
+// That is 8 to 12 bytes per sample, plus the runs. Times are in the track's
+// timescale; edit lists are not applied. Sample numbers count from 0.
+
+// A table larger than this is rejected rather than loaded.
+#define MOV_MAX_TABLE_SIZE (1024 * 1024 * 1024)
+
+typedef struct {
+    uint32_t first_sample;
+    uint32_t delta;
+    int64_t first_dts;
+} MovTimeRun;
+
+typedef struct {
+    uint32_t first_sample;
+    int32_t offset;
+} MovCompositionRun;
+
+typedef struct {
+    uint32_t track_id;
+    uint32_t handler;
+    uint32_t timescale;
+    uint64_t duration;
+    uint32_t codec;
+    int sample_entry; // box index of the first sample entry, or -1
+
+    uint32_t sample_count;
+    uint64_t *offsets;
+    uint32_t *sizes; // NULL when every sample is constant_size bytes
+    uint32_t constant_size;
+
+    MovTimeRun *time_runs;
+    uint32_t time_run_count;
+
+    MovCompositionRun *composition_runs; // NULL without ctts
+    uint32_t composition_run_count;
+
+    uint32_t *sync_samples; // NULL when every sample is a sync sample
+    uint32_t sync_sample_count;
+} MovSampleTable;
+
+static inline void free_mov_sample_table(MovSampleTable *table) {
+    free(table->offsets);
+    free(table->sizes);
+    free(table->time_runs);
+    free(table->composition_runs);
+    free(table->sync_samples);
+    memset(table, 0, sizeof(*table));
+}
+
+static inline uint64_t mov_sample_offset(const MovSampleTable *table, uint32_t sample) {
+    return table->offsets[sample];
+}
+
+static inline uint32_t mov_sample_size(const MovSampleTable *table, uint32_t sample) {
+    return table->sizes ? table->sizes[sample] : table->constant_size;
+}
+
+// Index of the time run holding sample.
+static inline uint32_t find_mov_time_run(const MovSampleTable *table, uint32_t sample) {
+    uint32_t lo = 0, hi = table->time_run_count;
+
+    while (hi - lo > 1) {
+        uint32_t mid = lo + (hi - lo) / 2;
+        if (table->time_runs[mid].first_sample <= sample) lo = mid; else hi = mid;
+    }
+
+    return lo;
+}
+
+static inline int64_t mov_sample_dts(const MovSampleTable *table, uint32_t sample) {
+    const MovTimeRun *run = &table->time_runs[find_mov_time_run(table, sample)];
+    return run->first_dts + (int64_t)(sample - run->first_sample) * run->delta;
+}
+
+// Index of the composition run holding sample.
+static inline uint32_t find_mov_composition_run(const MovSampleTable *table, uint32_t sample) {
+    uint32_t lo = 0, hi = table->composition_run_count;
+
+    while (hi - lo > 1) {
+        uint32_t mid = lo + (hi - lo) / 2;
+        if (table->composition_runs[mid].first_sample <= sample) lo = mid; else hi = mid;
+    }
+
+    return lo;
+}
+
+static inline int64_t mov_sample_pts(const MovSampleTable *table, uint32_t sample) {
+    int64_t dts = mov_sample_dts(table, sample);
+    if (!table->composition_runs) return dts;
+
+    return dts + table->composition_runs[find_mov_composition_run(table, sample)].offset;
+}
+
+// Position in sync_samples of the last sync sample at or before sample, or
+// -1 when there is none.
+static inline int64_t find_mov_sync_index(const MovSampleTable *table, uint32_t sample) {
+    uint32_t lo = 0, hi = table->sync_sample_count;
+
+    while (lo < hi) {
+        uint32_t mid = lo + (hi - lo) / 2;
+        if (table->sync_samples[mid] <= sample) lo = mid + 1; else hi = mid;
+    }
+
+    return (int64_t)lo - 1;
+}
+
+static inline int mov_sample_is_sync(const MovSampleTable *table, uint32_t sample) {
+    if (!table->sync_samples) return 1;
+
+    int64_t i = find_mov_sync_index(table, sample);
+    return i >= 0 && table->sync_samples[i] == sample;
+}
+
+// The sample decoding at dts, the last one that starts at or before it.
+// Times before the first sample give sample 0.
+static inline uint32_t find_mov_sample(const MovSampleTable *table, int64_t dts) {
+    uint32_t lo = 0, hi = table->time_run_count;
+
+    if (table->sample_count == 0) return 0;
+
+    while (hi - lo > 1) {
+        uint32_t mid = lo + (hi - lo) / 2;
+        if (table->time_runs[mid].first_dts <= dts) lo = mid; else hi = mid;
+    }
+
+    const MovTimeRun *run = &table->time_runs[lo];
+    uint32_t last = lo + 1 < table->time_run_count ? table->time_runs[lo + 1].first_sample - 1 : table->sample_count - 1;
+
+    if (dts <= run->first_dts || run->delta == 0) return run->first_sample;
+
+    uint64_t sample = run->first_sample + (uint64_t)(dts - run->first_dts) / run->delta;
+    return sample < last ? (uint32_t)sample : last;
+}
+
+// The sync sample to start decoding from to reach sample, or sample itself
+// when there is no sync sample before it.
+static inline uint32_t find_mov_keyframe(const MovSampleTable *table, uint32_t sample) {
+    if (!table->sync_samples) return sample;
+
+    int64_t i = find_mov_sync_index(table, sample);
+    return i >= 0 ? table->sync_samples[i] : sample;
+}
+
+// Loads a full box holding version and flags, an entry count and count
+// entries of entry_size bytes, after extra header bytes. Returns the box
+// payload, entries start at header + 8, or NULL.
+static uint8_t *load_mov_table(MovFile *file, const MovBoxTree *tree, int index, size_t header, size_t entry_size,
+                               uint32_t *count) {
+    size_t size;
+    char type[5];
+    uint8_t *data = load_mov_box(file, &tree->boxes[index], MOV_MAX_TABLE_SIZE, &size);
+
+    if (!data) return NULL;
+
+    mov_fourcc_string(tree->boxes[index].type, type);
+
+    if (size < header + 8) {
+        fprintf(stderr, "Failed to parse %s box\n", type);
+        free(data);
+        return NULL;
+    }
+
+    *count = read_u32_be(data + header + 4);
+
+    if ((size - header - 8) / entry_size < *count) {
+        fprintf(stderr, "Failed to parse %s box: %u entries do not fit\n", type, *count);
+        free(data);
+        return NULL;
+    }
+
+    return data;
+}
+
+static int load_mov_sample_sizes(MovFile *file, const MovBoxTree *tree, int stbl, MovSampleTable *table) {
+    int stsz = find_mov_box(tree, stbl, MOV_FOURCC('s', 't', 's', 'z'), -1);
+    uint32_t count;
+    uint8_t *data;
+
+    if (stsz >= 0) {
+        // sample_size, then sizes only when it is 0.
+        uint8_t header[12];
+
+        if (read_mov_box(file, &tree->boxes[stsz], 0, header, sizeof(header)) != sizeof(header)) {
+            fprintf(stderr, "Failed to parse stsz box\n");
+            return -1;
+        }
+
+        table->sample_count = read_u32_be(header + 8);
+        table->constant_size = read_u32_be(header + 4);
+        if (table->constant_size != 0 || table->sample_count == 0) return 0;
+
+        if (!(data = load_mov_table(file, tree, stsz, 4, 4, &count))) return -1;
+        if (!(table->sizes = malloc(count * sizeof(uint32_t)))) goto fail;
+
+        for (uint32_t i = 0; i < count; i++) table->sizes[i] = read_u32_be(data + 12 + 4 * i);
+    } else {
+        // stz2: version, flags, reserved, field_size, sample_count, then
+        // sizes of 4, 8 or 16 bits.
+        int stz2 = find_mov_box(tree, stbl, MOV_FOURCC('s', 't', 'z', '2'), -1);
+        size_t size;
+
+        if (stz2 < 0) {
+            fprintf(stderr, "Failed to find stsz box\n");
+            return -1;
+        }
+
+        if (!(data = load_mov_box(file, &tree->boxes[stz2], MOV_MAX_TABLE_SIZE, &size))) return -1;
+
+        int field_size = size >= 12 ? data[7] : 0;
+        count = size >= 12 ? read_u32_be(data + 8) : 0;
+
+        if ((field_size != 4 && field_size != 8 && field_size != 16) ||
+            ((uint64_t)count * field_size + 7) / 8 > size - 12) {
+            fprintf(stderr, "Failed to parse stz2 box\n");
+            free(data);
+            return -1;
+        }
+
+        if (!(table->sizes = malloc(count ? count * sizeof(uint32_t) : 1))) goto fail;
+
+        for (uint32_t i = 0; i < count; i++) {
+            const uint8_t *p = data + 12;
+            if (field_size == 16) table->sizes[i] = read_u16_be(p + 2 * i);
+            else if (field_size == 8) table->sizes[i] = p[i];
+            else table->sizes[i] = i & 1 ? p[i / 2] & 0x0F : p[i / 2] >> 4;
+        }
+    }
+
+    table->sample_count = count;
+    free(data);
+    return 0;
+
+fail:
+    fprintf(stderr, "Failed to allocate memory\n");
+    free(data);
+    return -1;
+}
+
+// Walks stsc over the chunk offsets of stco or co64 and places every sample
+// right after the one before it in its chunk. Samples that no chunk holds
+// are dropped from the table.
+static int load_mov_sample_offsets(MovFile *file, const MovBoxTree *tree, int stbl, MovSampleTable *table) {
+    int co64 = find_mov_box(tree, stbl, MOV_FOURCC('c', 'o', '6', '4'), -1);
+    int stco = co64 >= 0 ? co64 : find_mov_box(tree, stbl, MOV_FOURCC('s', 't', 'c', 'o'), -1);
+    int stsc = find_mov_box(tree, stbl, MOV_FOURCC('s', 't', 's', 'c'), -1);
+    uint32_t chunk_count, entry_count;
+    uint8_t *chunks = NULL, *entries = NULL;
+    uint32_t sample = 0;
+    int ret = -1;
+
+    if (stco < 0 || stsc < 0) {
+        fprintf(stderr, "Failed to find %s box\n", stsc < 0 ? "stsc" : "stco");
+        return -1;
+    }
+
+    size_t chunk_size = co64 >= 0 ? 8 : 4;
+
+    if (!(chunks = load_mov_table(file, tree, stco, 0, chunk_size, &chunk_count))) goto done;
+    if (!(entries = load_mov_table(file, tree, stsc, 0, 12, &entry_count))) goto done;
+
+    if (!(table->offsets = malloc(table->sample_count ? table->sample_count * sizeof(uint64_t) : 1))) {
+        fprintf(stderr, "Failed to allocate memory\n");
+        goto done;
+    }
+
+    for (uint32_t i = 0; i < entry_count && sample < table->sample_count; i++) {
+        const uint8_t *entry = entries + 8 + 12 * i;
+        uint32_t first_chunk = read_u32_be(entry);
+        uint32_t samples_per_chunk = read_u32_be(entry + 4);
+        uint32_t next_chunk = i + 1 < entry_count ? read_u32_be(entry + 12) : chunk_count + 1;
+
+        // Chunks count from 1 in stsc.
+        if (first_chunk == 0 || (i + 1 < entry_count && next_chunk < first_chunk)) {
+            fprintf(stderr, "Failed to parse stsc box: entry %u\n", i);
+            goto done;
+        }
+
+        if (next_chunk > chunk_count + 1) next_chunk = chunk_count + 1;
+
+        for (uint32_t chunk = first_chunk; chunk < next_chunk && sample < table->sample_count; chunk++) {
+            const uint8_t *p = chunks + 8 + chunk_size * (chunk - 1);
+            uint64_t offset = chunk_size == 8 ? read_u64_be(p) : read_u32_be(p);
+
+            for (uint32_t j = 0; j < samples_per_chunk && sample < table->sample_count; j++) {
+                table->offsets[sample] = offset;
+                offset += mov_sample_size(table, sample);
+                sample++;
+            }
+        }
+    }
+
+    table->sample_count = sample;
+    ret = 0;
+
+done:
+    free(chunks);
+    free(entries);
+    return ret;
+}
+
+static int load_mov_sample_times(MovFile *file, const MovBoxTree *tree, int stbl, MovSampleTable *table) {
+    int stts = find_mov_box(tree, stbl, MOV_FOURCC('s', 't', 't', 's'), -1);
+    int ctts = find_mov_box(tree, stbl, MOV_FOURCC('c', 't', 't', 's'), -1);
+    uint32_t count;
+    uint8_t *data;
+    uint32_t sample = 0;
+    int64_t dts = 0;
+
+    if (stts < 0) {
+        fprintf(stderr, "Failed to find stts box\n");
+        return -1;
+    }
+
+    if (!(data = load_mov_table(file, tree, stts, 0, 8, &count))) return -1;
+
+    if (!(table->time_runs = malloc((count ? count : 1) * sizeof(MovTimeRun)))) {
+        fprintf(stderr, "Failed to allocate memory\n");
+        free(data);
+        return -1;
+    }
+
+    for (uint32_t i = 0; i < count && sample < table->sample_count; i++) {
+        uint32_t run_samples = read_u32_be(data + 8 + 8 * i);
+        uint32_t delta = read_u32_be(data + 12 + 8 * i);
+
+        if (run_samples == 0) continue;
+        if (run_samples > table->sample_count - sample) run_samples = table->sample_count - sample;
+
+        // Runs with the same delta as the one before are merged.
+        if (table->time_run_count > 0 && table->time_runs[table->time_run_count - 1].delta == delta) {
+            sample += run_samples;
+            dts += (int64_t)run_samples * delta;
+            continue;
+        }
+
+        MovTimeRun *run = &table->time_runs[table->time_run_count++];
+        run->first_sample = sample;
+        run->delta = delta;
+        run->first_dts = dts;
+        sample += run_samples;
+        dts += (int64_t)run_samples * delta;
+    }
+
+    free(data);
+
+    // Samples without a time are dropped like samples without a chunk.
+    table->sample_count = sample;
+
+    if (table->time_run_count == 0) {
+        table->time_runs[0] = (MovTimeRun){0, 0, 0};
+        table->time_run_count = 1;
+    }
+
+    if (ctts < 0 || table->sample_count == 0) return 0;
+    if (!(data = load_mov_table(file, tree, ctts, 0, 8, &count))) return -1;
+
+    if (!(table->composition_runs = malloc((count + 1) * sizeof(MovCompositionRun)))) {
+        fprintf(stderr, "Failed to allocate memory\n");
+        free(data);
+        return -1;
+    }
+
+    // Offsets are signed in version 1 and in practice in version 0 as well.
+    sample = 0;
+
+    for (uint32_t i = 0; i < count && sample < table->sample_count; i++) {
+        uint32_t run_samples = read_u32_be(data + 8 + 8 * i);
+        int32_t offset = (int32_t)read_u32_be(data + 12 + 8 * i);
+
+        if (run_samples == 0) continue;
+        if (run_samples > table->sample_count - sample) run_samples = table->sample_count - sample;
+
+        // Runs with the same offset as the one before are merged.
+        if (table->composition_run_count == 0 || table->composition_runs[table->composition_run_count - 1].offset != offset) {
+            table->composition_runs[table->composition_run_count++] = (MovCompositionRun){sample, offset};
+        }
+
+        sample += run_samples;
+    }
+
+    // Samples past the end of ctts have no composition offset.
+    if (sample < table->sample_count &&
+        (table->composition_run_count == 0 || table->composition_runs[table->composition_run_count - 1].offset != 0)) {
+        table->composition_runs[table->composition_run_count++] = (MovCompositionRun){sample, 0};
+    }
+
+    free(data);
+    return 0;
+}
+
+static int load_mov_sync_samples(MovFile *file, const MovBoxTree *tree, int stbl, MovSampleTable *table) {
+    int stss = find_mov_box(tree, stbl, MOV_FOURCC('s', 't', 's', 's'), -1);
+    uint32_t count;
+    uint8_t *data;
+
+    if (stss < 0) return 0;
+    if (!(data = load_mov_table(file, tree, stss, 0, 4, &count))) return -1;
+
+    if (!(table->sync_samples = malloc((count ? count : 1) * sizeof(uint32_t)))) {
+        fprintf(stderr, "Failed to allocate memory\n");
+        free(data);
+        return -1;
+    }
+
+    // Sample numbers count from 1 in stss and have to increase.
+    for (uint32_t i = 0; i < count; i++) {
+        uint32_t sample = read_u32_be(data + 8 + 4 * i);
+
+        if (sample == 0 || (table->sync_sample_count > 0 && sample - 1 <= table->sync_samples[table->sync_sample_count - 1])) {
+            fprintf(stderr, "Failed to parse stss box: entry %u\n", i);
+            free(data);
+            return -1;
+        }
+
+        if (sample - 1 < table->sample_count) table->sync_samples[table->sync_sample_count++] = sample - 1;
+    }
+
+    free(data);
+    return 0;
+}
+
+// track id from tkhd, timescale and duration from mdhd, handler from hdlr
+// and the first sample entry of stsd.
+static int load_mov_track_header(MovFile *file, const MovBoxTree *tree, int trak, int mdia, int stbl, MovSampleTable *table) {
+    int tkhd = find_mov_box(tree, trak, MOV_FOURCC('t', 'k', 'h', 'd'), -1);
+    int mdhd = find_mov_box(tree, mdia, MOV_FOURCC('m', 'd', 'h', 'd'), -1);
+    int hdlr = find_mov_box(tree, mdia, MOV_FOURCC('h', 'd', 'l', 'r'), -1);
+    int stsd = find_mov_box(tree, stbl, MOV_FOURCC('s', 't', 's', 'd'), -1);
+    uint8_t p[32];
+
+    if (tkhd < 0 || mdhd < 0 || hdlr < 0 || stsd < 0) {
+        fprintf(stderr, "Failed to find track header boxes\n");
+        return -1;
+    }
+
+    if (read_mov_box(file, &tree->boxes[tkhd], 0, p, 24) != 24) goto fail;
+    table->track_id = read_u32_be(p + (p[0] == 1 ? 20 : 12));
+
+    int64_t n = read_mov_box(file, &tree->boxes[mdhd], 0, p, 32);
+    if (n < 20 || (p[0] == 1 && n < 32)) goto fail;
+
+    if (p[0] == 1) {
+        table->timescale = read_u32_be(p + 20);
+        table->duration = read_u64_be(p + 24);
+    } else {
+        table->timescale = read_u32_be(p + 12);
+        table->duration = read_u32_be(p + 16);
+    }
+
+    if (read_mov_box(file, &tree->boxes[hdlr], 0, p, 12) != 12) goto fail;
+    table->handler = read_u32_be(p + 8);
+
+    table->sample_entry = tree->boxes[stsd].children ? stsd + 1 : -1;
+    if (table->sample_entry >= tree->count || tree->boxes[table->sample_entry].parent != stsd) table->sample_entry = -1;
+    if (table->sample_entry >= 0) table->codec = tree->boxes[table->sample_entry].type;
+    return 0;
+
+fail:
+    fprintf(stderr, "Failed to parse track header boxes\n");
+    return -1;
+}
+
+// Loads the sample table of the track in the trak box at index trak.
+static inline int load_mov_sample_table(MovFile *file, const MovBoxTree *tree, int trak, MovSampleTable *table) {
+    static const uint32_t minf_stbl[] = {MOV_FOURCC('m', 'i', 'n', 'f'), MOV_FOURCC('s', 't', 'b', 'l')};
+    int mdia = find_mov_box(tree, trak, MOV_FOURCC('m', 'd', 'i', 'a'), -1);
+    int stbl = mdia >= 0 ? find_mov_box_path(tree, mdia, minf_stbl, 2) : -1;
+
+    memset(table, 0, sizeof(*table));
+    table->sample_entry = -1;
+
+    if (stbl < 0) {
+        fprintf(stderr, "Failed to find stbl box\n");
+        return -1;
+    }
+
+    if (load_mov_track_header(file, tree, trak, mdia, stbl, table) < 0 ||
+        load_mov_sample_sizes(file, tree, stbl, table) < 0 ||
+        load_mov_sample_offsets(file, tree, stbl, table) < 0 ||
+        load_mov_sample_times(file, tree, stbl, table) < 0 ||
+        load_mov_sync_samples(file, tree, stbl, table) < 0) {
+        free_mov_sample_table(table);
+        return -1;
+    }
+
+    return 0;
+}
+
+// The trak box of the first track with the given handler, e.g. vide, or -1.
+static inline int find_mov_track(const MovBoxTree *tree, MovFile *file, uint32_t handler) {
+    static const uint32_t mdia_hdlr[] = {MOV_FOURCC('m', 'd', 'i', 'a'), MOV_FOURCC('h', 'd', 'l', 'r')};
+    int moov = find_mov_box(tree, -1, MOV_FOURCC('m', 'o', 'o', 'v'), -1);
+
+    for (int trak = -1; moov >= 0 && (trak = find_mov_box(tree, moov, MOV_FOURCC('t', 'r', 'a', 'k'), trak)) >= 0;) {
+        int hdlr = find_mov_box_path(tree, trak, mdia_hdlr, 2);
+        uint8_t p[12];
+
+        if (hdlr >= 0 && read_mov_box(file, &tree->boxes[hdlr], 0, p, 12) == 12 && read_u32_be(p + 8) == handler) {
+            return trak;
+        }
+    }
+
+    return -1;
+}
+
+#endif // MOV_SAMPLE_TABLE_H
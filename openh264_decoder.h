@@ -0,0 +1,511 @@
+#ifndef OPENH264_DECODER_H
+#define OPENH264_DECODER_H
+
+#include <pthread.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include <wels/codec_api.h>
+#include <wels/codec_app_def.h>
+#include <wels/codec_def.h>
+
+#include "annexb.h"
+#include "h264.h"
+#include "h264_index.h"
+#include "mapped_file.h"
+
+#define MAX_DECODE_THREADS 256
+
+// What the decoder is handed per call. nal and au return every picture from
+// the call that completes it; batch leaves the end of a picture to be found
+// at the start of the next one, which halves the calls but holds each
+// picture back by one access unit; parse only parses, no pictures.
+enum {
+    OPENH264_MODE_NAL,   // DecodeFrameNoDelay per NAL unit
+    OPENH264_MODE_AU,    // DecodeFrameNoDelay per access unit
+    OPENH264_MODE_BATCH, // DecodeFrame2 per access unit
+    OPENH264_MODE_PARSE, // DecodeParser per access unit
+    OPENH264_MODE_COUNT,
+};
+
+static const char *const openh264_mode_names[OPENH264_MODE_COUNT] = {"nal", "au", "batch", "parse"};
+
+static inline int openh264_mode(const char *name) {
+    for (int i = 0; i < OPENH264_MODE_COUNT; i++) {
+        if (strcmp(name, openh264_mode_names[i]) == 0) return i;
+    }
+
+    return -1;
+}
+
+// A decoded picture as the caller sees it. timestamp is that of the call
+// whose input the decoder put the picture down to. hash is FNV-1a over the
+// visible Y, U and V rows when hashing is on, which is enough to compare the
+// output of two decoding runs without keeping the pictures.
+typedef struct {
+    uint64_t number;
+    uint64_t timestamp;
+    int width;
+    int height;
+    uint64_t hash;
+} DecodedFrame;
+
+typedef void (*DecodedFrameCallback)(const DecodedFrame *frame, void *opaque);
+
+// One ISVCDecoder fed in the units of its mode, start codes included. Every
+// call gets the next timestamp, counting from 1.
+typedef struct {
+    ISVCDecoder *decoder;
+    int mode;
+    uint64_t timestamp;
+    uint64_t frames;
+    uint64_t calls;
+    int hash;
+    DecodedFrameCallback callback;
+    void *opaque;
+
+    // NAL units of the access unit in progress, for decode_openh264_stream_nal.
+    AccessUnitAssembler assembler;
+    uint8_t *access_unit;
+    size_t access_unit_size;
+    size_t access_unit_capacity;
+} OpenH264Stream;
+
+static int open_openh264_stream(OpenH264Stream *s, int mode, int hash, DecodedFrameCallback callback, void *opaque) {
+    SDecodingParam decoder_params = {
+        .sVideoProperty.size = sizeof(decoder_params.sVideoProperty),
+        .eEcActiveIdc = ERROR_CON_SLICE_COPY,
+        .uiTargetDqLayer = (uint8_t)-1,
+        .bParseOnly = mode == OPENH264_MODE_PARSE,
+        .sVideoProperty.eVideoBsType = VIDEO_BITSTREAM_DEFAULT,
+    };
+
+    memset(s, 0, sizeof(*s));
+    s->mode = mode;
+    s->hash = hash;
+    s->callback = callback;
+    s->opaque = opaque;
+    init_access_unit_assembler(&s->assembler);
+
+    if (WelsCreateDecoder(&s->decoder) < 0 || !s->decoder) {
+        fprintf(stderr, "Failed to create decoder\n");
+        s->decoder = NULL;
+        return -1;
+    }
+
+    (*s->decoder)->Initialize(s->decoder, &decoder_params);
+    return 0;
+}
+
+static inline void close_openh264_stream(OpenH264Stream *s) {
+    free_access_unit_assembler(&s->assembler);
+    free(s->access_unit);
+    s->access_unit = NULL;
+
+    if (!s->decoder) return;
+
+    (*s->decoder)->Uninitialize(s->decoder);
+    WelsDestroyDecoder(s->decoder);
+    s->decoder = NULL;
+}
+
+static uint64_t hash_openh264_picture(const SBufferInfo *info) {
+    const SSysMEMBuffer *buffer = &info->UsrData.sSystemBuffer;
+    uint8_t *const *dst = info->pDst;
+    uint64_t hash = FNV1A64_INIT;
+
+    for (int y = 0; y < buffer->iHeight; y++) {
+        hash = fnv1a64(hash, dst[0] + (size_t)y * buffer->iStride[0], buffer->iWidth);
+    }
+
+    for (int plane = 1; plane < 3; plane++) {
+        for (int y = 0; y < buffer->iHeight / 2; y++) {
+            hash = fnv1a64(hash, dst[plane] + (size_t)y * buffer->iStride[1], buffer->iWidth / 2);
+        }
+    }
+
+    return hash;
+}
+
+static void output_openh264_picture(OpenH264Stream *s, const SBufferInfo *info) {
+    if (info->iBufferStatus != 1) return;
+
+    DecodedFrame frame = {
+        .number = s->frames++,
+        .timestamp = info->uiOutYuvTimeStamp,
+        .width = info->UsrData.sSystemBuffer.iWidth,
+        .height = info->UsrData.sSystemBuffer.iHeight,
+        .hash = s->hash && info->pDst[0] ? hash_openh264_picture(info) : 0,
+    };
+
+    if (s->callback) s->callback(&frame, s->opaque);
+}
+
+// A parsed picture counts as a frame, without pixels to hash.
+static void output_openh264_parsed(OpenH264Stream *s, const SParserBsInfo *info) {
+    if (info->iNalNum <= 0) return;
+
+    DecodedFrame frame = {
+        .number = s->frames++,
+        .timestamp = info->uiOutBsTimeStamp,
+        .width = info->iSpsWidthInPixel,
+        .height = info->iSpsHeightInPixel,
+    };
+
+    if (s->callback) s->callback(&frame, s->opaque);
+}
+
+// Hands one unit of the stream's mode to the decoder: a NAL unit or a whole
+// access unit, starting with a start code. NULL ends the picture in
+// progress for batch and parse. Units too short to hold a start code and a
+// NAL header are dropped.
+static void decode_openh264_unit(OpenH264Stream *s, const uint8_t *data, size_t size) {
+    uint8_t *dst[3] = {NULL};
+    SBufferInfo buffer_info;
+
+    if (data && (size < 4 || size > INT32_MAX)) return;
+
+    s->calls++;
+
+    if (s->mode == OPENH264_MODE_PARSE) {
+        SParserBsInfo parser_info;
+
+        memset(&parser_info, 0, sizeof(SParserBsInfo));
+        parser_info.uiInBsTimeStamp = ++s->timestamp;
+        (*s->decoder)->DecodeParser(s->decoder, data, (int)size, &parser_info);
+        output_openh264_parsed(s, &parser_info);
+        return;
+    }
+
+    memset(&buffer_info, 0, sizeof(SBufferInfo));
+    buffer_info.uiInBsTimeStamp = ++s->timestamp;
+
+    if (s->mode == OPENH264_MODE_BATCH) {
+        (*s->decoder)->DecodeFrame2(s->decoder, data, (int)size, dst, &buffer_info);
+    } else {
+        (*s->decoder)->DecodeFrameNoDelay(s->decoder, data, (int)size, dst, &buffer_info);
+    }
+
+    output_openh264_picture(s, &buffer_info);
+}
+
+// Feeds a NAL unit from NALStreamParser, whose buffer only holds the unit
+// in progress. Outside nal mode the NAL units are copied together until the
+// next access unit begins, and the completed one goes to the decoder in one
+// call. Returns -1 when memory ran out.
+static inline int decode_openh264_stream_nal(OpenH264Stream *s, const NALUnit *nal) {
+    const uint8_t *data = nal->data - nal->start_code_size;
+    size_t size = nal->size + nal->start_code_size;
+    AccessUnit done;
+
+    if (s->mode == OPENH264_MODE_NAL) {
+        decode_openh264_unit(s, data, size);
+        return 0;
+    }
+
+    if (add_nal_to_access_unit(&s->assembler, nal, &done)) {
+        decode_openh264_unit(s, s->access_unit, s->access_unit_size);
+        s->access_unit_size = 0;
+    }
+
+    if (s->access_unit_size + size > s->access_unit_capacity) {
+        size_t capacity = s->access_unit_capacity ? s->access_unit_capacity : 64 * 1024;
+        while (capacity < s->access_unit_size + size) capacity *= 2;
+
+        uint8_t *buffer = realloc(s->access_unit, capacity);
+        if (!buffer) return -1;
+
+        s->access_unit = buffer;
+        s->access_unit_capacity = capacity;
+    }
+
+    memcpy(s->access_unit + s->access_unit_size, data, size);
+    s->access_unit_size += size;
+    return 0;
+}
+
+// Ends the stream: hands over the last access unit still gathered, ends the
+// last picture and takes the pictures the decoder still holds for
+// reordering.
+static void finish_openh264_stream(OpenH264Stream *s) {
+    int32_t end_of_stream = 1;
+    int32_t remaining = 0;
+
+    if (s->access_unit_size > 0) {
+        decode_openh264_unit(s, s->access_unit, s->access_unit_size);
+        s->access_unit_size = 0;
+    }
+
+    if (s->mode == OPENH264_MODE_BATCH || s->mode == OPENH264_MODE_PARSE) {
+        decode_openh264_unit(s, NULL, 0);
+    }
+
+    if (s->mode == OPENH264_MODE_PARSE) return;
+
+    (*s->decoder)->SetOption(s->decoder, DECODER_OPTION_END_OF_STREAM, (void *)&end_of_stream);
+    (*s->decoder)->GetOption(s->decoder, DECODER_OPTION_NUM_OF_FRAMES_REMAINING_IN_BUFFER, &remaining);
+
+    for (int32_t i = 0; i < remaining; i++) {
+        uint8_t *dst[3] = {NULL};
+        SBufferInfo buffer_info;
+
+        memset(&buffer_info, 0, sizeof(SBufferInfo));
+        s->calls++;
+        (*s->decoder)->FlushFrame(s->decoder, dst, &buffer_info);
+        output_openh264_picture(s, &buffer_info);
+    }
+}
+
+// GOP-parallel decoding of an indexed file. The file is cut in front of
+// every IDR access unit, so no picture of one GOP references another, and
+// each GOP goes to a fresh decoder on one of the worker threads, after the
+// SPS and PPS that were active where it starts. Workers take GOPs in file
+// order; the frames of each are kept as DecodedFrame records and handed to
+// the callback on the calling thread in file order, so the output is what a
+// single decoder gives, however the GOPs finish.
+
+typedef struct {
+    uint64_t start;
+    uint64_t end;
+    uint64_t first_access_unit;
+    uint64_t end_access_unit;
+
+    // Parameter set entries to feed first, in file order.
+    uint64_t prelude_start;
+    uint32_t prelude_count;
+
+    DecodedFrame *frames;
+    uint64_t count;
+    uint64_t capacity;
+    int done;
+    int failed;
+} DecodeGOP;
+
+typedef struct {
+    const MappedFile *file;
+    const H264Index *index;
+    int mode;
+    int hash;
+
+    DecodeGOP *gops;
+    uint64_t gop_count;
+    uint64_t *preludes;
+
+    pthread_mutex_t lock;
+    pthread_cond_t cond;
+    uint64_t next_gop;
+} GOPDecoder;
+
+static int compare_uint64(const void *a, const void *b) {
+    uint64_t x = *(const uint64_t *)a, y = *(const uint64_t *)b;
+    return x < y ? -1 : x > y;
+}
+
+// Cuts the file into GOPs and finds, in one sweep over the parameter set
+// table, the latest SPS and PPS of every id in front of each GOP. Anything
+// before the first IDR goes with the first GOP, so no byte is left out.
+static int plan_decode_gops(GOPDecoder *d) {
+    const H264Index *index = d->index;
+    const H264IndexHeader *header = index->header;
+    uint64_t sps[32], pps[256];
+    uint32_t live = 0;
+    uint64_t next_ps = 0;
+    uint64_t capacity = 0, used = 0;
+
+    d->gop_count = header->keyframe_count ? header->keyframe_count : 1;
+    d->gops = calloc(d->gop_count, sizeof(DecodeGOP));
+    if (!d->gops) return -1;
+
+    for (int i = 0; i < 32; i++) sps[i] = UINT64_MAX;
+    for (int i = 0; i < 256; i++) pps[i] = UINT64_MAX;
+
+    for (uint64_t g = 0; g < d->gop_count; g++) {
+        DecodeGOP *gop = &d->gops[g];
+        const H264IndexAccessUnit *next = h264_index_keyframe(index, g + 1);
+
+        gop->start = g == 0 ? 0 : h264_index_keyframe(index, g)->offset;
+        gop->end = next ? next->offset : d->file->size;
+        gop->first_access_unit = g == 0 ? 0 : index->keyframes[g];
+        gop->end_access_unit = next ? index->keyframes[g + 1] : header->access_unit_count;
+
+        for (; next_ps < header->parameter_set_count; next_ps++) {
+            const H264IndexParameterSet *entry = &index->parameter_sets[next_ps];
+            uint64_t *slot = entry->nal_unit_type == 7 ? &sps[entry->id & 31] : &pps[entry->id];
+
+            if (entry->offset + entry->size > gop->start) break;
+            if (*slot == UINT64_MAX) live++;
+            *slot = next_ps;
+        }
+
+        // live is at most 288, well below the first capacity, so one
+        // reservation always makes room for all of them.
+        if (live > 0 && reserve_index_entry((void **)&d->preludes, &capacity, used + live - 1, sizeof(uint64_t)) < 0) {
+            return -1;
+        }
+
+        gop->prelude_start = used;
+        for (int i = 0; i < 32; i++) if (sps[i] != UINT64_MAX) d->preludes[used++] = sps[i];
+        for (int i = 0; i < 256; i++) if (pps[i] != UINT64_MAX) d->preludes[used++] = pps[i];
+        gop->prelude_count = (uint32_t)(used - gop->prelude_start);
+
+        if (gop->prelude_count > 1) {
+            qsort(d->preludes + gop->prelude_start, gop->prelude_count, sizeof(uint64_t), compare_uint64);
+        }
+    }
+
+    return 0;
+}
+
+static void keep_gop_frame(const DecodedFrame *frame, void *opaque) {
+    DecodeGOP *gop = opaque;
+
+    if (gop->failed) return;
+
+    if (reserve_index_entry((void **)&gop->frames, &gop->capacity, gop->count, sizeof(DecodedFrame)) < 0) {
+        gop->failed = 1;
+        return;
+    }
+
+    gop->frames[gop->count++] = *frame;
+}
+
+static void decode_gop(GOPDecoder *d, DecodeGOP *gop) {
+    const uint8_t *data = d->file->data;
+    OpenH264Stream s;
+    NALIterator it;
+    NALUnit nal;
+
+    if (open_openh264_stream(&s, d->mode, d->hash, keep_gop_frame, gop) < 0) {
+        gop->failed = 1;
+        return;
+    }
+
+    for (uint32_t i = 0; i < gop->prelude_count; i++) {
+        const H264IndexParameterSet *entry = &d->index->parameter_sets[d->preludes[gop->prelude_start + i]];
+        decode_openh264_unit(&s, data + entry->offset, entry->size);
+    }
+
+    if (s.mode == OPENH264_MODE_NAL) {
+        init_nal_iterator(&it, data + gop->start, gop->end - gop->start);
+
+        while (next_nal_unit(&it, &nal)) {
+            decode_openh264_unit(&s, nal.data - nal.start_code_size, nal.size + nal.start_code_size);
+        }
+    } else {
+        // Access units are already delimited by the index.
+        for (uint64_t i = gop->first_access_unit; i < gop->end_access_unit; i++) {
+            const H264IndexAccessUnit *au = &d->index->access_units[i];
+            decode_openh264_unit(&s, data + au->offset, au->size);
+        }
+    }
+
+    finish_openh264_stream(&s);
+    close_openh264_stream(&s);
+}
+
+static void *run_gop_worker(void *arg) {
+    GOPDecoder *d = arg;
+
+    for (;;) {
+        pthread_mutex_lock(&d->lock);
+        uint64_t g = d->next_gop < d->gop_count ? d->next_gop++ : UINT64_MAX;
+        pthread_mutex_unlock(&d->lock);
+
+        if (g == UINT64_MAX) break;
+
+        decode_gop(d, &d->gops[g]);
+
+        pthread_mutex_lock(&d->lock);
+        d->gops[g].done = 1;
+        pthread_cond_broadcast(&d->cond);
+        pthread_mutex_unlock(&d->lock);
+    }
+
+    return NULL;
+}
+
+// Decodes file, which index describes, on threads decoders at once. Frames
+// are numbered across the whole file; timestamps count the calls of the
+// decoder of each GOP. Returns the number of frames or -1.
+static inline int64_t decode_openh264_gops(const MappedFile *file, const H264Index *index, int threads, int mode,
+                                           int hash, DecodedFrameCallback callback, void *opaque) {
+    GOPDecoder d;
+    pthread_t workers[MAX_DECODE_THREADS];
+    int started = 0;
+    uint64_t frames = 0;
+    int64_t ret = 0;
+
+    if (threads < 1) threads = 1;
+    if (threads > MAX_DECODE_THREADS) threads = MAX_DECODE_THREADS;
+
+    memset(&d, 0, sizeof(d));
+    d.file = file;
+    d.index = index;
+    d.mode = mode;
+    d.hash = hash;
+
+    if (plan_decode_gops(&d) < 0) {
+        fprintf(stderr, "Failed to allocate memory\n");
+        free(d.gops);
+        free(d.preludes);
+        return -1;
+    }
+
+    pthread_mutex_init(&d.lock, NULL);
+    pthread_cond_init(&d.cond, NULL);
+
+    for (int i = 0; i < threads && (uint64_t)i < d.gop_count; i++) {
+        if (pthread_create(&workers[i], NULL, run_gop_worker, &d) != 0) break;
+        started++;
+    }
+
+    if (started == 0) {
+        fprintf(stderr, "Failed to start decoder threads\n");
+        ret = -1;
+    }
+
+    // The reorder buffer: GOPs are released in file order as they complete,
+    // and their records freed.
+    for (uint64_t g = 0; ret == 0 && g < d.gop_count; g++) {
+        DecodeGOP *gop = &d.gops[g];
+
+        pthread_mutex_lock(&d.lock);
+        while (!gop->done) pthread_cond_wait(&d.cond, &d.lock);
+        pthread_mutex_unlock(&d.lock);
+
+        if (gop->failed) {
+            fprintf(stderr, "Failed to decode GOP %llu\n", (unsigned long long)g);
+            ret = -1;
+            break;
+        }
+
+        for (uint64_t i = 0; i < gop->count; i++) {
+            gop->frames[i].number = frames++;
+            if (callback) callback(&gop->frames[i], opaque);
+        }
+
+        free(gop->frames);
+        gop->frames = NULL;
+    }
+
+    if (ret < 0) {
+        // Let the workers run out of GOPs instead of decoding the rest.
+        pthread_mutex_lock(&d.lock);
+        d.next_gop = d.gop_count;
+        pthread_mutex_unlock(&d.lock);
+    }
+
+    for (int i = 0; i < started; i++) pthread_join(workers[i], NULL);
+
+    for (uint64_t g = 0; g < d.gop_count; g++) free(d.gops[g].frames);
+    free(d.gops);
+    free(d.preludes);
+    pthread_mutex_destroy(&d.lock);
+    pthread_cond_destroy(&d.cond);
+
+    return ret < 0 ? -1 : (int64_t)frames;
+}
+
+#endif // OPENH264_DECODER_H
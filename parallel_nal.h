@@ -0,0 +1,217 @@
+#ifndef PARALLEL_NAL_H
+#define PARALLEL_NAL_H
+
+#include <pthread.h>
+#include <stdint.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "annexb.h"
+
+#define MAX_NAL_THREADS 256
+#define NAL_CHUNK_SIZE (1024 * 1024)
+
+typedef struct {
+    NALUnit *nals;
+    size_t count;
+    size_t capacity;
+} NALList;
+
+static inline void free_nal_list(NALList *list) {
+    free(list->nals);
+    list->nals = NULL;
+    list->count = 0;
+    list->capacity = 0;
+}
+
+static inline int append_nal_list(NALList *list, const NALUnit *nal) {
+    if (list->count == list->capacity) {
+        size_t capacity = list->capacity ? list->capacity * 2 : 1024;
+        NALUnit *nals = realloc(list->nals, capacity * sizeof(NALUnit));
+        if (!nals) return -1;
+
+        list->nals = nals;
+        list->capacity = capacity;
+    }
+
+    list->nals[list->count++] = *nal;
+    return 0;
+}
+
+// The first start code at or after pos, or size when there is none. A zero
+// byte in front of the 00 00 01 makes it a 4 byte start code, exactly as
+// find_next_start_code sees it from the NAL unit before.
+static inline size_t align_to_start_code(const uint8_t *data, size_t size, size_t pos) {
+    if (pos >= size) return size;
+
+    const uint8_t *p = scan_start_code(data + pos, data + size);
+    if (!p) return size;
+
+    if (p > data && p[-1] == 0) p--;
+    return p - data;
+}
+
+typedef struct {
+    NALList nals;
+    int done;
+    int ret;
+} NALChunk;
+
+// Chunks are scanned on worker threads and handed to the callback on the
+// calling thread in file order. Only ring chunks are in flight at a time,
+// so memory stays bounded by the chunk size rather than the file size.
+typedef struct {
+    const uint8_t *data;
+    size_t size;
+    size_t chunk_count;
+    size_t claimed;
+    size_t consumed;
+    int ring;
+    int stop;
+    NALChunk chunks[2 * MAX_NAL_THREADS];
+    pthread_mutex_t lock;
+    pthread_cond_t cond;
+} NALPipeline;
+
+// Chunk i is the byte range [i, i + 1) * NAL_CHUNK_SIZE with both ends moved
+// forward to the next start code, so every chunk holds whole NAL units and
+// neighbours agree on the cut between them. The first chunk starts at 0, as
+// NALIterator does on the whole buffer.
+static void scan_nal_chunk(NALPipeline *p, size_t i, NALChunk *chunk) {
+    size_t begin = i == 0 ? 0 : align_to_start_code(p->data, p->size, i * NAL_CHUNK_SIZE);
+    size_t end = align_to_start_code(p->data, p->size, (i + 1) * NAL_CHUNK_SIZE);
+    NALIterator it;
+    NALUnit nal;
+
+    chunk->nals.count = 0;
+    chunk->ret = 0;
+    if (begin >= end) return;
+
+    init_nal_iterator(&it, p->data + begin, end - begin);
+
+    while (next_nal_unit(&it, &nal)) {
+        nal.offset += begin;
+
+        if (append_nal_list(&chunk->nals, &nal) < 0) {
+            chunk->ret = -1;
+            break;
+        }
+    }
+}
+
+static void *run_nal_scanner(void *arg) {
+    NALPipeline *p = arg;
+
+    pthread_mutex_lock(&p->lock);
+
+    for (;;) {
+        while (!p->stop && p->claimed < p->chunk_count && p->claimed >= p->consumed + p->ring) {
+            pthread_cond_wait(&p->cond, &p->lock);
+        }
+        if (p->stop || p->claimed == p->chunk_count) break;
+
+        size_t i = p->claimed++;
+        NALChunk *chunk = &p->chunks[i % p->ring];
+
+        pthread_mutex_unlock(&p->lock);
+        scan_nal_chunk(p, i, chunk);
+        pthread_mutex_lock(&p->lock);
+
+        chunk->done = 1;
+        pthread_cond_broadcast(&p->cond);
+    }
+
+    pthread_mutex_unlock(&p->lock);
+    return NULL;
+}
+
+// Start codes can be found independently in any byte range, so threads - 1
+// workers scan chunks ahead while the calling thread runs the callback over
+// them in order, scanning the next chunk itself when no worker has taken it.
+// Slice parsing and access unit assembly in the callback stay sequential.
+static inline int for_each_nal_unit_parallel(const uint8_t *data, size_t size, int threads, NALCallback callback,
+                                             void *opaque) {
+    if (threads > MAX_NAL_THREADS) threads = MAX_NAL_THREADS;
+
+    NALPipeline *p = calloc(1, sizeof(*p));
+    pthread_t workers[MAX_NAL_THREADS];
+    int started = 0;
+    int ret = 0;
+
+    if (!p) return -1;
+
+    p->data = data;
+    p->size = size;
+    p->chunk_count = (size + NAL_CHUNK_SIZE - 1) / NAL_CHUNK_SIZE;
+    p->ring = 2 * threads;
+    pthread_mutex_init(&p->lock, NULL);
+    pthread_cond_init(&p->cond, NULL);
+
+    for (int i = 1; i < threads; i++) {
+        if (pthread_create(&workers[started], NULL, run_nal_scanner, p) != 0) break;
+        started++;
+    }
+
+    pthread_mutex_lock(&p->lock);
+
+    while (p->consumed < p->chunk_count) {
+        NALChunk *chunk = &p->chunks[p->consumed % p->ring];
+
+        if (!chunk->done && p->claimed == p->consumed) {
+            p->claimed++;
+            pthread_mutex_unlock(&p->lock);
+            scan_nal_chunk(p, p->consumed, chunk);
+            pthread_mutex_lock(&p->lock);
+            chunk->done = 1;
+        }
+
+        if (!chunk->done) {
+            pthread_cond_wait(&p->cond, &p->lock);
+            continue;
+        }
+
+        if (chunk->ret < 0) {
+            ret = -1;
+            break;
+        }
+
+        // The chunk belongs to the calling thread until consumed moves past
+        // it, so the callback runs without the lock.
+        pthread_mutex_unlock(&p->lock);
+        for (size_t i = 0; i < chunk->nals.count; i++) callback(&chunk->nals.nals[i], opaque);
+        pthread_mutex_lock(&p->lock);
+
+        chunk->done = 0;
+        p->consumed++;
+        pthread_cond_broadcast(&p->cond);
+    }
+
+    p->stop = 1;
+    pthread_cond_broadcast(&p->cond);
+    pthread_mutex_unlock(&p->lock);
+
+    for (int i = 0; i < started; i++) pthread_join(workers[i], NULL);
+    for (int i = 0; i < p->ring; i++) free_nal_list(&p->chunks[i].nals);
+
+    pthread_mutex_destroy(&p->lock);
+    pthread_cond_destroy(&p->cond);
+    free(p);
+    return ret;
+}
+
+// Calls back with every NAL unit of the buffer in file order, scanning on
+// the given number of threads. Returns -1 if memory ran out.
+static inline int for_each_nal_unit(const uint8_t *data, size_t size, int threads, NALCallback callback, void *opaque) {
+    if (threads <= 1) {
+        NALIterator it;
+        NALUnit nal;
+
+        init_nal_iterator(&it, data, size);
+        while (next_nal_unit(&it, &nal)) callback(&nal, opaque);
+        return 0;
+    }
+
+    return for_each_nal_unit_parallel(data, size, threads, callback, opaque);
+}
+
+#endif // PARALLEL_NAL_H
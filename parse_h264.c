@@ -1,474 +1,449 @@
+#include <errno.h>
 #include <stdio.h>
 #include <stdlib.h>
 #include <stdint.h>
 #include <string.h>
+#include <sys/stat.h>
+#include <unistd.h>
 
-typedef struct {
-    uint8_t *data;
-    size_t size;
-    size_t pos;
-} BitStream;
-
-typedef struct {
-    uint8_t nal_unit_type;
-    uint8_t nal_ref_idc;
-    uint8_t forbidden_zero_bit;
-    uint8_t *rbsp_data;
-    size_t rbsp_size;
-} NALUnit;
+#include "annexb.h"
+#include "bitstream.h"
+#include "h264.h"
+#include "h264_index.h"
+#include "h264_macroblock.h"
+#include "h264_stats.h"
+#include "mapped_file.h"
+#include "parallel_nal.h"
 
-typedef struct {
-    uint8_t profile_idc;
-    uint8_t constraint_set_flags;
-    uint8_t level_idc;
-    uint8_t seq_parameter_set_id;
-    uint8_t log2_max_frame_num_minus4;
-    uint8_t pic_order_cnt_type;
-    uint8_t log2_max_pic_order_cnt_lsb_minus4;
-    uint8_t num_ref_frames;
-    uint8_t gaps_in_frame_num_value_allowed_flag;
-    uint16_t pic_width_in_mbs_minus1;
-    uint16_t pic_height_in_map_units_minus1;
-    uint8_t frame_mbs_only_flag;
-    uint8_t direct_8x8_inference_flag;
-    uint8_t frame_cropping_flag;
-    uint32_t frame_crop_left_offset;
-    uint32_t frame_crop_right_offset;
-    uint32_t frame_crop_top_offset;
-    uint32_t frame_crop_bottom_offset;
-} SPS;
+#define STREAM_CHUNK_SIZE (64 * 1024)
 
 typedef struct {
-    uint8_t pic_parameter_set_id;
-    uint8_t seq_parameter_set_id;
-    uint8_t entropy_coding_mode_flag;
-    uint8_t pic_order_present_flag;
-    uint8_t num_slice_groups_minus1;
-    uint8_t num_ref_idx_l0_active_minus1;
-    uint8_t num_ref_idx_l1_active_minus1;
-    uint8_t weighted_pred_flag;
-    uint8_t weighted_bipred_idc;
-    int8_t pic_init_qp_minus26;
-    int8_t pic_init_qs_minus26;
-    int8_t chroma_qp_index_offset;
-    uint8_t deblocking_filter_control_present_flag;
-    uint8_t constrained_intra_pred_flag;
-    uint8_t redundant_pic_cnt_present_flag;
-} PPS;
+    AccessUnitAssembler assembler;
+    uint64_t access_units;
+    uint64_t idr_access_units;
+} ParseContext;
+
+void print_parameter_set_change(uint8_t nal_unit_type, uint32_t id, void *opaque) {
+    (void)opaque;
+    printf("Parameter Set Changed: %s ID: %u\n", nal_unit_type == 7 ? "SPS" : "PPS", id);
+}
 
-typedef struct {
-    uint8_t *buffer;
-    size_t size;
-    size_t capacity;
-} NALBuffer;
-
-BitStream* create_bit_stream(uint8_t *data, size_t size) {
-    BitStream *bs = malloc(sizeof(BitStream));
-    bs->data = data;
-    bs->size = size;
-    bs->pos = 0;
-    return bs;
+void init_parse_context(ParseContext *ctx) {
+    init_access_unit_assembler(&ctx->assembler);
+    ctx->assembler.ps.changed = print_parameter_set_change;
+    ctx->access_units = 0;
+    ctx->idr_access_units = 0;
 }
 
-void free_bit_stream(BitStream *bs) {
-    free(bs);
+void print_access_unit(ParseContext *ctx, const AccessUnit *au) {
+    printf("Access Unit %llu: Offset: %llu, Size: %llu, NALs: %u, Slices: %u, Type: %s%s\n",
+           (unsigned long long)ctx->access_units, (unsigned long long)au->offset, (unsigned long long)au->size,
+           au->nal_count, au->slice_count,
+           au->slice_count ? slice_type_name(au->first_slice.slice_type) : "-", au->idr ? " (IDR)" : "");
+
+    ctx->access_units++;
+    ctx->idr_access_units += au->idr;
 }
 
-uint8_t read_bit(BitStream *bs) {
-    if (bs->pos >= bs->size * 8) return 0;
+void print_nal_unit(const NALUnit *nal, void *opaque) {
+    ParseContext *ctx = opaque;
+    AccessUnit done;
 
-    size_t byte_pos = bs->pos / 8;
-    size_t bit_pos = 7 - (bs->pos % 8);
+    if (add_nal_to_access_unit(&ctx->assembler, nal, &done)) {
+        print_access_unit(ctx, &done);
+    }
 
-    uint8_t bit = (bs->data[byte_pos] >> bit_pos) & 0x01;
-    bs->pos++;
+    printf("NAL Unit Type: %d\n", nal->nal_unit_type);
 
-    return bit;
-}
+    const ParameterSets *ps = &ctx->assembler.ps;
 
-uint32_t read_bits(BitStream *bs, uint8_t n) {
-    uint32_t val = 0;
+    if (nal->nal_unit_type == 7) {
+        const SPS *sps = ps->last_sps;
 
-    for (uint8_t i = 0; i < n; i++) {
-        val = (val << 1) | read_bit(bs);
-    }
+        if (sps) {
+            printf("SPS: Profile: %d, Level: %d, Resolution: %dx%d\n",
+                   sps->profile_idc, sps->level_idc,
+                   (sps->pic_width_in_mbs_minus1 + 1) * 16,
+                   (sps->pic_height_in_map_units_minus1 + 1) * 16 * (2 - sps->frame_mbs_only_flag));
+        }
+    } else if (nal->nal_unit_type == 8) {
+        const PPS *pps = ps->last_pps;
 
-    return val;
-}
+        if (pps) {
+            printf("PPS: PPS ID: %d, SPS ID: %d\n",
+                   pps->pic_parameter_set_id, pps->seq_parameter_set_id);
+        }
+    } else if (is_slice_nal_unit(nal->nal_unit_type)) {
+        const SliceHeader *sh = &ctx->assembler.last_slice;
 
-uint32_t read_ue(BitStream *bs) {
-    int leading_zero_bits = -1;
-    uint8_t bit;
+        printf("Slice: First MB: %u, Type: %s, PPS ID: %d, Frame Num: %u, POC LSB: %u",
+               sh->first_mb_in_slice, slice_type_name(sh->slice_type), sh->pic_parameter_set_id,
+               sh->frame_num, sh->pic_order_cnt_lsb);
 
-    do {
-        bit = read_bit(bs);
-        leading_zero_bits++;
-    } while (bit == 0);
+        if (nal->nal_unit_type == 5) {
+            printf(", IDR ID: %u", sh->idr_pic_id);
+        }
 
-    if (leading_zero_bits == 0) {
-        return 0;
+        printf("\n");
     }
-
-    uint32_t suffix = read_bits(bs, leading_zero_bits);
-    return (1 << leading_zero_bits) - 1 + suffix;
 }
 
-int32_t read_se(BitStream *bs) {
-    uint32_t val = read_ue(bs);
+void finish_parse_context(ParseContext *ctx) {
+    AccessUnit done;
 
-    if (val & 0x01) {
-        return (val + 1) / 2;
-    } else {
-        return -(val / 2);
+    if (finish_access_unit(&ctx->assembler, &done)) {
+        print_access_unit(ctx, &done);
     }
+
+    printf("Total access units: %llu, IDR: %llu\n",
+           (unsigned long long)ctx->access_units, (unsigned long long)ctx->idr_access_units);
+
+    free_access_unit_assembler(&ctx->assembler);
 }
 
-uint8_t* find_next_start_code(uint8_t *data, size_t size, size_t *offset) {
-    if (size < 3) return NULL;
+int parse_nal_units(const uint8_t *data, size_t size, int threads) {
+    ParseContext ctx;
 
-    for (size_t i = 0; i < size - 3; i++) {
-        if (data[i] == 0 && data[i + 1] == 0 &&
-            ((data[i + 2] == 1) || (data[i + 2] == 0 && data[i + 3] == 1))) {
+    init_parse_context(&ctx);
 
-            *offset = (data[i + 2] == 0) ? 4 : 3;
-            return &data[i];
-        }
+    if (for_each_nal_unit(data, size, threads, print_nal_unit, &ctx) < 0) {
+        fprintf(stderr, "Failed to allocate memory\n");
+        free_access_unit_assembler(&ctx.assembler);
+        return -1;
     }
 
-    return NULL;
+    finish_parse_context(&ctx);
+    return 0;
 }
 
-void remove_emulation_prevention_bytes(uint8_t *src, size_t src_size, uint8_t *dst, size_t *dst_size) {
-    size_t i = 0, j = 0;
+int parse_h264_file(const char *filename, int threads) {
+    MappedFile file;
 
-    while (i < src_size) {
-        if (i + 2 < src_size && src[i] == 0 && src[i + 1] == 0 && src[i + 2] == 3) {
-            dst[j++] = 0;
-            dst[j++] = 0;
-            i += 3;
-        } else {
-            dst[j++] = src[i++];
-        }
+    if (map_file(filename, &file) < 0) {
+        return -1;
     }
 
-    *dst_size = j;
-}
-
-NALUnit* parse_nal_unit(uint8_t *data, size_t size) {
-    if (size < 1) return NULL;
+    int ret = parse_nal_units(file.data, file.size, threads);
 
-    NALUnit *nal = malloc(sizeof(NALUnit));
+    unmap_file(&file);
+    return ret;
+}
 
-    nal->forbidden_zero_bit = (data[0] >> 7) & 0x01;
-    nal->nal_ref_idc = (data[0] >> 5) & 0x03;
-    nal->nal_unit_type = data[0] & 0x1F;
+// Feeds a live stream to callback chunk by chunk, memory stays bounded by
+// the largest NAL unit instead of the stream length.
+int read_nal_stream(int fd, NALCallback callback, void *opaque) {
+    static uint8_t chunk[STREAM_CHUNK_SIZE];
+    NALStreamParser parser;
 
-    uint8_t *rbsp = malloc(size);
-    size_t rbsp_size;
+    init_nal_stream_parser(&parser, callback, opaque);
 
-    remove_emulation_prevention_bytes(data + 1, size - 1, rbsp, &rbsp_size);
+    for (;;) {
+        ssize_t n = read(fd, chunk, sizeof(chunk));
 
-    nal->rbsp_data = rbsp;
-    nal->rbsp_size = rbsp_size;
+        if (n < 0) {
+            if (errno == EINTR) continue;
+            fprintf(stderr, "Failed to read stream\n");
+            free_nal_stream_parser(&parser);
+            return -1;
+        }
 
-    return nal;
-}
+        if (n == 0) break;
 
-void free_nal_unit(NALUnit *nal) {
-    if (nal) {
-        free(nal->rbsp_data);
-        free(nal);
+        if (feed_nal_stream_parser(&parser, chunk, n) < 0) {
+            fprintf(stderr, "Failed to allocate memory\n");
+            free_nal_stream_parser(&parser);
+            return -1;
+        }
     }
-}
-
-SPS* parse_sps(NALUnit *nal) {
-    if (nal->nal_unit_type != 7) return NULL;
 
-    BitStream *bs = create_bit_stream(nal->rbsp_data, nal->rbsp_size);
-    SPS *sps = malloc(sizeof(SPS));
+    flush_nal_stream_parser(&parser);
+    free_nal_stream_parser(&parser);
+    return 0;
+}
 
-    sps->profile_idc = read_bits(bs, 8);
-    sps->constraint_set_flags = read_bits(bs, 8);
-    sps->level_idc = read_bits(bs, 8);
-    sps->seq_parameter_set_id = read_ue(bs);
+int parse_h264_stream(int fd) {
+    ParseContext ctx;
 
-    if (sps->profile_idc == 100 || sps->profile_idc == 110 ||
-        sps->profile_idc == 122 || sps->profile_idc == 244 ||
-        sps->profile_idc == 44  || sps->profile_idc == 83  ||
-        sps->profile_idc == 86  || sps->profile_idc == 118 ||
-        sps->profile_idc == 128 || sps->profile_idc == 138) {
+    init_parse_context(&ctx);
 
-        uint32_t chroma_format_idc = read_ue(bs);
+    if (read_nal_stream(fd, print_nal_unit, &ctx) < 0) {
+        free_access_unit_assembler(&ctx.assembler);
+        return -1;
+    }
 
-        if (chroma_format_idc == 3) {
-            read_bit(bs); // separate_colour_plane_flag
-        }
+    finish_parse_context(&ctx);
+    return 0;
+}
 
-        read_ue(bs); // bit_depth_luma_minus8
-        read_ue(bs); // bit_depth_chroma_minus8
-        read_bit(bs); // qpprime_y_zero_transform_bypass_flag
-
-        uint8_t seq_scaling_matrix_present_flag = read_bit(bs);
-
-        if (seq_scaling_matrix_present_flag) {
-            int size = (chroma_format_idc != 3) ? 8 : 12;
-            for (int i = 0; i < size; i++) {
-                uint8_t seq_scaling_list_present_flag = read_bit(bs);
-                if (seq_scaling_list_present_flag) {
-                    if (i < 6) {
-                        // scaling_list(ScalingList4x4[i], 16)
-                        // Skip the scaling list
-                        for (int j = 0; j < 16; j++) {
-                            read_se(bs);
-                        }
-                    } else {
-                        // scaling_list(ScalingList8x8[i - 6], 64)
-                        // Skip the scaling list
-                        for (int j = 0; j < 64; j++) {
-                            read_se(bs);
-                        }
-                    }
-                }
-            }
-        }
-    }
+void stats_nal_unit(const NALUnit *nal, void *opaque) {
+    add_nal_to_h264_stats(opaque, nal);
+}
 
-    sps->log2_max_frame_num_minus4 = read_ue(bs);
-    sps->pic_order_cnt_type = read_ue(bs);
+// Bitstream statistics of a file or of stdin, as one CSV row per access unit
+// or as a JSON summary.
+int print_h264_stats(const char *filename, int threads, int json, double frame_rate, double window) {
+    static char output[1024 * 1024];
+    H264Stats stats;
+    int ret;
 
-    if (sps->pic_order_cnt_type == 0) {
-        sps->log2_max_pic_order_cnt_lsb_minus4 = read_ue(bs);
-    } else if (sps->pic_order_cnt_type == 1) {
-        // Skip
-        read_bit(bs); // delta_pic_order_always_zero_flag
-        read_se(bs);  // offset_for_non_ref_pic
-        read_se(bs);  // offset_for_top_to_bottom_field
+    setvbuf(stdout, output, _IOFBF, sizeof(output));
+    init_h264_stats(&stats, json ? NULL : stdout, frame_rate, window);
 
-        uint32_t num_ref_frames_in_pic_order_cnt_cycle = read_ue(bs);
+    if (strcmp(filename, "-") == 0) {
+        ret = read_nal_stream(STDIN_FILENO, stats_nal_unit, &stats);
+    } else {
+        MappedFile file;
 
-        for (uint32_t i = 0; i < num_ref_frames_in_pic_order_cnt_cycle; i++) {
-            read_se(bs); // offset_for_ref_frame[i]
+        if (map_file(filename, &file) < 0) {
+            free_h264_stats(&stats);
+            return -1;
         }
-    }
 
-    sps->num_ref_frames = read_ue(bs);
-    sps->gaps_in_frame_num_value_allowed_flag = read_bit(bs);
-    sps->pic_width_in_mbs_minus1 = read_ue(bs);
-    sps->pic_height_in_map_units_minus1 = read_ue(bs);
-    sps->frame_mbs_only_flag = read_bit(bs);
+        ret = for_each_nal_unit(file.data, file.size, threads, stats_nal_unit, &stats);
+        if (ret < 0) fprintf(stderr, "Failed to allocate memory\n");
 
-    if (!sps->frame_mbs_only_flag) {
-        read_bit(bs); // mb_adaptive_frame_field_flag
+        unmap_file(&file);
     }
 
-    sps->direct_8x8_inference_flag = read_bit(bs);
-    sps->frame_cropping_flag = read_bit(bs);
-
-    if (sps->frame_cropping_flag) {
-        sps->frame_crop_left_offset = read_ue(bs);
-        sps->frame_crop_right_offset = read_ue(bs);
-        sps->frame_crop_top_offset = read_ue(bs);
-        sps->frame_crop_bottom_offset = read_ue(bs);
+    if (ret == 0 && finish_h264_stats(&stats) < 0) {
+        fprintf(stderr, "Failed to allocate memory\n");
+        ret = -1;
     }
 
-    free_bit_stream(bs);
-    return sps;
-}
+    if (ret == 0 && json) {
+        print_h264_stats_json(&stats, stdout);
+    }
 
-void free_sps(SPS *sps) {
-    free(sps);
+    free_h264_stats(&stats);
+    return ret;
 }
 
-PPS* parse_pps(NALUnit *nal) {
-    if (nal->nal_unit_type != 8) return NULL;
-
-    BitStream *bs = create_bit_stream(nal->rbsp_data, nal->rbsp_size);
-    PPS *pps = malloc(sizeof(PPS));
-
-    pps->pic_parameter_set_id = read_ue(bs);
-    pps->seq_parameter_set_id = read_ue(bs);
-    pps->entropy_coding_mode_flag = read_bit(bs);
-    pps->pic_order_present_flag = read_bit(bs);
-    pps->num_slice_groups_minus1 = read_ue(bs);
-
-    if (pps->num_slice_groups_minus1 > 0) {
-        uint32_t slice_group_map_type = read_ue(bs);
-
-        if (slice_group_map_type == 0) {
-            for (uint32_t i = 0; i <= pps->num_slice_groups_minus1; i++) {
-                read_ue(bs); // run_length_minus1[i]
-            }
-        } else if (slice_group_map_type == 2) {
-            for (uint32_t i = 0; i < pps->num_slice_groups_minus1; i++) {
-                read_ue(bs); // top_left[i]
-                read_ue(bs); // bottom_right[i]
-            }
-        } else if (slice_group_map_type == 3 || slice_group_map_type == 4 || slice_group_map_type == 5) {
-            read_bit(bs); // slice_group_change_direction_flag
-            read_ue(bs);  // slice_group_change_rate_minus1
-        } else if (slice_group_map_type == 6) {
-            uint32_t pic_size_in_map_units_minus1 = read_ue(bs);
-
-            uint32_t bits_needed = 0;
-            uint32_t temp = pps->num_slice_groups_minus1 + 1;
-
-            while (temp > 0) {
-                bits_needed++;
-                temp >>= 1;
-            }
-
-            for (uint32_t i = 0; i <= pic_size_in_map_units_minus1; i++) {
-                read_bits(bs, bits_needed); // slice_group_id[i]
-            }
+typedef struct {
+    AccessUnitAssembler assembler;
+    MacroblockParser parser;
+    int per_macroblock;
+    uint64_t access_units;
+} MacroblockContext;
+
+void print_macroblock_picture(MacroblockContext *ctx, const AccessUnit *au) {
+    const MacroblockParser *p = &ctx->parser;
+    uint32_t count = p->width * p->height;
+    uint32_t types[MB_TYPE_COUNT] = {0};
+    uint32_t decoded = 0, qp_min = 51, qp_max = 0;
+    uint64_t qp_sum = 0;
+
+    for (uint32_t i = 0; i < count; i++) {
+        if (!is_macroblock_decoded(p, i)) continue;
+
+        const Macroblock *mb = &p->mbs[i];
+
+        if (ctx->per_macroblock) {
+            printf("%llu,%u,%u,%u,%s,%u,%d,%u,%u\n", (unsigned long long)ctx->access_units, i, i % p->width, i / p->width,
+                   mb_type_name(mb->type), mb->qp, mb->qp_delta, mb->cbp, mb->coeffs);
         }
+
+        types[mb->type]++;
+        decoded++;
+        qp_sum += mb->qp;
+        if (mb->qp < qp_min) qp_min = mb->qp;
+        if (mb->qp > qp_max) qp_max = mb->qp;
     }
 
-    pps->num_ref_idx_l0_active_minus1 = read_ue(bs);
-    pps->num_ref_idx_l1_active_minus1 = read_ue(bs);
-    pps->weighted_pred_flag = read_bit(bs);
-    pps->weighted_bipred_idc = read_bits(bs, 2);
-    pps->pic_init_qp_minus26 = read_se(bs);
-    pps->pic_init_qs_minus26 = read_se(bs);
-    pps->chroma_qp_index_offset = read_se(bs);
-    pps->deblocking_filter_control_present_flag = read_bit(bs);
-    pps->constrained_intra_pred_flag = read_bit(bs);
-    pps->redundant_pic_cnt_present_flag = read_bit(bs);
-
-    free_bit_stream(bs);
-    return pps;
-}
+    if (!ctx->per_macroblock) {
+        uint32_t intra = types[MB_TYPE_I4x4] + types[MB_TYPE_I16x16] + types[MB_TYPE_I_PCM];
+        uint32_t skip = types[MB_TYPE_P_SKIP];
 
-void free_pps(PPS *pps) {
-    free(pps);
-}
+        printf("%llu,%s,%u,%u,%u,%u,%u,%u,%u,", (unsigned long long)ctx->access_units, h264_stats_type_name(h264_stats_type(au)),
+               decoded, intra, decoded - intra - skip, skip, types[MB_TYPE_I4x4], types[MB_TYPE_I16x16], types[MB_TYPE_I_PCM]);
 
-void init_nal_buffer(NALBuffer *buffer) {
-    buffer->capacity = 1024;
-    buffer->size = 0;
-    buffer->buffer = malloc(buffer->capacity);
-}
+        if (decoded) {
+            printf("%.4f,%.4f,%u,%u,%.2f\n", (double)intra / decoded, (double)skip / decoded, qp_min, qp_max, (double)qp_sum / decoded);
+        } else {
+            printf(",,,,\n");
+        }
+    }
 
-void free_nal_buffer(NALBuffer *buffer) {
-    free(buffer->buffer);
-    buffer->buffer = NULL;
-    buffer->size = 0;
-    buffer->capacity = 0;
+    ctx->access_units++;
 }
 
-void add_to_nal_buffer(NALBuffer *buffer, uint8_t *data, size_t size) {
-    if (buffer->size + size > buffer->capacity) {
-        buffer->capacity = buffer->size + size + 1024;
-        buffer->buffer = realloc(buffer->buffer, buffer->capacity);
+void macroblock_nal_unit(const NALUnit *nal, void *opaque) {
+    MacroblockContext *ctx = opaque;
+    AccessUnit done;
+
+    if (add_nal_to_access_unit(&ctx->assembler, nal, &done)) {
+        print_macroblock_picture(ctx, &done);
+        start_macroblock_picture(&ctx->parser);
     }
 
-    memcpy(buffer->buffer + buffer->size, data, size);
-    buffer->size += size;
+    if (is_slice_nal_unit(nal->nal_unit_type) && parse_macroblocks(&ctx->parser, nal, &ctx->assembler.ps) < 0) {
+        fprintf(stderr, "Access unit %llu: skipping slice at offset %llu: %s\n",
+                (unsigned long long)ctx->access_units, (unsigned long long)nal->offset, ctx->parser.error);
+    }
 }
 
-void parse_nal_units(uint8_t *data, size_t size) {
-    size_t offset;
-    uint8_t *start = data;
-    size_t remaining = size;
-    NALBuffer nal_buffer;
-    init_nal_buffer(&nal_buffer);
+// Macroblock statistics from entropy decoding the CAVLC slice data, as one
+// CSV row per picture or per macroblock.
+int print_h264_macroblocks(const char *filename, int threads, int per_macroblock) {
+    static char output[1024 * 1024];
+    MacroblockContext ctx;
+    AccessUnit done;
+    int ret;
+
+    setvbuf(stdout, output, _IOFBF, sizeof(output));
+    memset(&ctx, 0, sizeof(ctx));
+    init_access_unit_assembler(&ctx.assembler);
+    ctx.per_macroblock = per_macroblock;
 
-    while ((start = find_next_start_code(start, remaining, &offset)) != NULL) {
-        start += offset;
-        remaining = size - (start - data);
+    if (init_macroblock_parser(&ctx.parser) < 0) {
+        fprintf(stderr, "Failed to allocate memory\n");
+        return -1;
+    }
 
-        if (remaining <= 0) break;
+    if (per_macroblock) {
+        printf("access_unit,mb,x,y,type,qp,qp_delta,cbp,coeffs\n");
+    } else {
+        printf("access_unit,type,macroblocks,intra,inter,skip,i4x4,i16x16,i_pcm,intra_ratio,skip_ratio,qp_min,qp_max,qp_mean\n");
+    }
 
-        uint8_t *next_start = find_next_start_code(start, remaining, &offset);
-        size_t nal_size;
+    if (strcmp(filename, "-") == 0) {
+        ret = read_nal_stream(STDIN_FILENO, macroblock_nal_unit, &ctx);
+    } else {
+        MappedFile file;
 
-        if (next_start) {
-            nal_size = next_start - start;
+        if (map_file(filename, &file) < 0) {
+            ret = -1;
         } else {
-            nal_size = remaining;
-        }
-
-        add_to_nal_buffer(&nal_buffer, start, nal_size);
+            ret = for_each_nal_unit(file.data, file.size, threads, macroblock_nal_unit, &ctx);
+            if (ret < 0) fprintf(stderr, "Failed to allocate memory\n");
 
-        NALUnit *nal = parse_nal_unit(nal_buffer.buffer, nal_buffer.size);
+            unmap_file(&file);
+        }
+    }
 
-        if (nal) {
-            printf("NAL Unit Type: %d\n", nal->nal_unit_type);
+    if (ret == 0 && finish_access_unit(&ctx.assembler, &done)) {
+        print_macroblock_picture(&ctx, &done);
+    }
 
-            if (nal->nal_unit_type == 7) {
-                SPS *sps = parse_sps(nal);
+    free_macroblock_parser(&ctx.parser);
+    free_access_unit_assembler(&ctx.assembler);
+    return ret;
+}
 
-                if (sps) {
-                    printf("SPS: Profile: %d, Level: %d, Resolution: %dx%d\n",
-                           sps->profile_idc, sps->level_idc,
-                           (sps->pic_width_in_mbs_minus1 + 1) * 16,
-                           (sps->pic_height_in_map_units_minus1 + 1) * 16 * (2 - sps->frame_mbs_only_flag));
+// Writes the sidecar index of filename to path.
+int index_h264_file(const char *filename, const char *path, int threads) {
+    H264IndexBuilder builder;
+    struct stat st;
 
-                    free_sps(sps);
-                }
-            } else if (nal->nal_unit_type == 8) {
-                PPS *pps = parse_pps(nal);
+    int ret = build_h264_index(filename, threads, &builder, &st);
+    if (ret == 0) ret = write_h264_index(&builder, path, &st);
 
-                if (pps) {
-                    printf("PPS: PPS ID: %d, SPS ID: %d\n",
-                           pps->pic_parameter_set_id, pps->seq_parameter_set_id);
+    if (ret == 0) {
+        printf("Index: %s, Access units: %llu, Keyframes: %llu, Parameter sets: %llu\n", path,
+               (unsigned long long)builder.access_unit_count, (unsigned long long)builder.keyframe_count,
+               (unsigned long long)builder.parameter_set_count);
+    }
 
-                    free_pps(pps);
-                }
-            }
+    free_h264_index_builder(&builder);
+    return ret;
+}
 
-            free_nal_unit(nal);
-        }
+// Looks up the nth keyframe in the sidecar index, which open_h264_index
+// (re)builds first when it is missing, corrupt or older than the file.
+int print_h264_keyframe(const char *filename, uint64_t n, int threads) {
+    H264Index index;
 
-        nal_buffer.size = 0;
+    if (open_h264_index(filename, threads, &index) < 0) return -1;
 
-        if (!next_start) break;
+    const H264IndexAccessUnit *au = h264_index_keyframe(&index, n);
 
-        start = next_start;
-        remaining = size - (start - data);
+    if (!au) {
+        fprintf(stderr, "Keyframe %llu out of range, the file has %llu\n",
+                (unsigned long long)n, (unsigned long long)index.header->keyframe_count);
+        unload_h264_index(&index);
+        return -1;
     }
 
-    free_nal_buffer(&nal_buffer);
+    printf("Keyframe %llu: Access Unit: %llu, Offset: %llu, Size: %u, GOP: %llu\n",
+           (unsigned long long)n, (unsigned long long)index.keyframes[n],
+           (unsigned long long)au->offset, au->size, (unsigned long long)h264_index_gop_length(&index, n));
+
+    unload_h264_index(&index);
+    return 0;
 }
 
-int parse_h264_file(const char *filename) {
-    FILE *file = fopen(filename, "rb");
+void usage(const char *name) {
+    fprintf(stderr, "Usage: %s [-j <threads>] [-index | -keyframe <n>] <h264_file | ->\n", name);
+    fprintf(stderr, "       %s [-j <threads>] -stats <csv | json> [-fps <rate>] [-window <seconds>] <h264_file | ->\n", name);
+    fprintf(stderr, "       %s [-j <threads>] -mb <frames | macroblocks> <h264_file | ->\n", name);
+}
 
-    if (!file) {
-        fprintf(stderr, "Failed to open file: %s\n", filename);
-        return -1;
+int main(int argc, char *argv[]) {
+    int threads = 1;
+    int index = 0;
+    int keyframe = 0;
+    uint64_t keyframe_number = 0;
+    const char *stats = NULL;
+    const char *macroblocks = NULL;
+    double frame_rate = 0;
+    double window = 1.0;
+    int i;
+
+    for (i = 1; i < argc - 1; i++) {
+        if (strcmp(argv[i], "-j") == 0 && i + 2 < argc) {
+            threads = atoi(argv[++i]);
+        } else if (strcmp(argv[i], "-index") == 0) {
+            index = 1;
+        } else if (strcmp(argv[i], "-keyframe") == 0 && i + 2 < argc) {
+            keyframe = 1;
+            keyframe_number = strtoull(argv[++i], NULL, 10);
+        } else if (strcmp(argv[i], "-stats") == 0 && i + 2 < argc) {
+            stats = argv[++i];
+        } else if (strcmp(argv[i], "-mb") == 0 && i + 2 < argc) {
+            macroblocks = argv[++i];
+        } else if (strcmp(argv[i], "-fps") == 0 && i + 2 < argc) {
+            frame_rate = atof(argv[++i]);
+        } else if (strcmp(argv[i], "-window") == 0 && i + 2 < argc) {
+            window = atof(argv[++i]);
+        } else {
+            break;
+        }
     }
 
-    fseek(file, 0, SEEK_END);
-    size_t file_size = ftell(file);
-    fseek(file, 0, SEEK_SET);
+    if (i != argc - 1 || threads < 1 || frame_rate < 0 || window <= 0 ||
+        (stats && ((strcmp(stats, "csv") != 0 && strcmp(stats, "json") != 0) || index || keyframe)) ||
+        (macroblocks && ((strcmp(macroblocks, "frames") != 0 && strcmp(macroblocks, "macroblocks") != 0) || stats || index || keyframe))) {
+        usage(argv[0]);
+        return 1;
+    }
 
-    uint8_t *buffer = malloc(file_size);
+    const char *filename = argv[i];
 
-    if (!buffer) {
-        fprintf(stderr, "Failed to allocate memory\n");
-        fclose(file);
-        return -1;
+    if (macroblocks) {
+        return print_h264_macroblocks(filename, threads, strcmp(macroblocks, "macroblocks") == 0) < 0 ? 1 : 0;
     }
 
-    if (fread(buffer, 1, file_size, file) != file_size) {
-        fprintf(stderr, "Failed to read file\n");
-        free(buffer);
-        fclose(file);
-        return -1;
+    if (stats) {
+        return print_h264_stats(filename, threads, strcmp(stats, "json") == 0, frame_rate, window) < 0 ? 1 : 0;
     }
 
-    parse_nal_units(buffer, file_size);
+    if (strcmp(filename, "-") == 0) {
+        if (index || keyframe) {
+            usage(argv[0]);
+            return 1;
+        }
 
-    free(buffer);
-    fclose(file);
-    return 0;
-}
+        return parse_h264_stream(STDIN_FILENO) < 0 ? 1 : 0;
+    }
 
-int main(int argc, char *argv[]) {
-    if (argc != 2) {
-        fprintf(stderr, "Usage: %s <h264_file>\n", argv[0]);
-        return 1;
+    if (index) {
+        char path[4096];
+        h264_index_path(filename, path, sizeof(path));
+        return index_h264_file(filename, path, threads) < 0 ? 1 : 0;
+    }
+
+    if (keyframe) {
+        return print_h264_keyframe(filename, keyframe_number, threads) < 0 ? 1 : 0;
     }
 
-    return parse_h264_file(argv[1]);
+    return parse_h264_file(filename, threads) < 0 ? 1 : 0;
 }
@@ -1,93 +1,260 @@
+#include <errno.h>
 #include <fcntl.h>
-#include <stdlib.h>
-#include <unistd.h>
 #include <stdio.h>
+#include <stdlib.h>
 #include <stdint.h>
+#include <string.h>
+#include <unistd.h>
+
+#include "mov.h"
+#include "mov_fragment.h"
+#include "mov_sample_table.h"
 
-#define BUFFER_SIZE (1024 * 1024 * 64)
+#define STREAM_CHUNK_SIZE (64 * 1024)
 
-uint32_t read_u32_be(char *buf) {
-    return ((uint8_t)buf[0] << (8*3)) |
-           ((uint8_t)buf[1] << (8*2)) |
-           ((uint8_t)buf[2] << (8*1)) |
-           ((uint8_t)buf[3] << (8*0)) ;
+// Up to this many bytes of a box are read to describe it.
+#define DESCRIBE_SIZE 96
+
+// A few fields of the boxes worth knowing about when looking at a file, read
+// from the first bytes of their payload.
+void describe_box(MovFile *file, const MovBox *box, char *out, size_t out_size) {
+    uint8_t p[DESCRIBE_SIZE];
+    int64_t n = read_mov_box(file, box, 0, p, sizeof(p));
+    char fourcc[5];
+
+    out[0] = '\0';
+    if (n < 0) return;
+
+    switch (box->type) {
+    case MOV_FOURCC('f', 't', 'y', 'p'):
+        if (n < 8) break;
+        mov_fourcc_string(read_u32_be(p), fourcc);
+        snprintf(out, out_size, ", Brand: %s, Version: %u", fourcc, read_u32_be(p + 4));
+        break;
+    case MOV_FOURCC('m', 'v', 'h', 'd'):
+    case MOV_FOURCC('m', 'd', 'h', 'd'):
+        if (n >= 20 && p[0] == 0) {
+            snprintf(out, out_size, ", Timescale: %u, Duration: %u", read_u32_be(p + 12), read_u32_be(p + 16));
+        } else if (n >= 32 && p[0] == 1) {
+            snprintf(out, out_size, ", Timescale: %u, Duration: %llu", read_u32_be(p + 20),
+                     (unsigned long long)read_u64_be(p + 24));
+        }
+        break;
+    case MOV_FOURCC('t', 'k', 'h', 'd'): {
+        // width and height close the box as 16.16 fixed point.
+        int64_t size = p[0] == 1 ? 96 : 84;
+        if (n < size) break;
+        snprintf(out, out_size, ", Track: %u, Width: %u, Height: %u", read_u32_be(p + (p[0] == 1 ? 20 : 12)),
+                 read_u32_be(p + size - 8) >> 16, read_u32_be(p + size - 4) >> 16);
+        break;
+    }
+    case MOV_FOURCC('h', 'd', 'l', 'r'):
+        if (n < 12) break;
+        mov_fourcc_string(read_u32_be(p + 8), fourcc);
+        snprintf(out, out_size, ", Handler: %s", fourcc);
+        break;
+    case MOV_FOURCC('s', 't', 's', 'd'):
+    case MOV_FOURCC('s', 't', 't', 's'):
+    case MOV_FOURCC('c', 't', 't', 's'):
+    case MOV_FOURCC('s', 't', 's', 'c'):
+    case MOV_FOURCC('s', 't', 's', 's'):
+    case MOV_FOURCC('s', 't', 'c', 'o'):
+    case MOV_FOURCC('c', 'o', '6', '4'):
+        if (n < 8) break;
+        snprintf(out, out_size, ", Entries: %u", read_u32_be(p + 4));
+        break;
+    case MOV_FOURCC('s', 't', 's', 'z'):
+        if (n < 12) break;
+        snprintf(out, out_size, ", Samples: %u, Sample Size: %u", read_u32_be(p + 8), read_u32_be(p + 4));
+        break;
+    case MOV_FOURCC('a', 'v', 'c', '1'):
+    case MOV_FOURCC('a', 'v', 'c', '3'):
+    case MOV_FOURCC('h', 'v', 'c', '1'):
+    case MOV_FOURCC('h', 'e', 'v', '1'):
+        if (n < 28) break;
+        snprintf(out, out_size, ", Width: %u, Height: %u", read_u16_be(p + 24), read_u16_be(p + 26));
+        break;
+    case MOV_FOURCC('a', 'v', 'c', 'C'):
+        if (n < 5) break;
+        snprintf(out, out_size, ", Profile: %u, Level: %u, Length Size: %u", p[1], p[3], (p[4] & 3) + 1);
+        break;
+    }
 }
 
-uint64_t read_u64_be(char *buf) {
-    return ((uint64_t)(uint8_t)buf[0] << (8*7)) |
-           ((uint64_t)(uint8_t)buf[1] << (8*6)) |
-           ((uint64_t)(uint8_t)buf[2] << (8*5)) |
-           ((uint64_t)(uint8_t)buf[3] << (8*4)) |
-           ((uint64_t)(uint8_t)buf[4] << (8*3)) |
-           ((uint64_t)(uint8_t)buf[5] << (8*2)) |
-           ((uint64_t)(uint8_t)buf[6] << (8*1)) |
-           ((uint64_t)(uint8_t)buf[7] << (8*0)) ;
+void print_sample(const MovSampleTable *table, uint32_t sample) {
+    printf("Sample %u: Offset: %llu, Size: %u, DTS: %lld, PTS: %lld%s\n", sample,
+           (unsigned long long)mov_sample_offset(table, sample), mov_sample_size(table, sample),
+           (long long)mov_sample_dts(table, sample), (long long)mov_sample_pts(table, sample),
+           mov_sample_is_sync(table, sample) ? " (sync)" : "");
 }
 
-int main(int argc, char **argv) {
-    if (argc != 2) {
-        printf("USAGE: %s <file>\n", argv[0]);
-        return 1;
+// Prints every track's sample table summary, then all samples or the
+// keyframe to start from to reach seek seconds.
+int print_tracks(MovFile *file, const MovBoxTree *tree, int samples, double seek) {
+    int moov = find_mov_box(tree, -1, MOV_FOURCC('m', 'o', 'o', 'v'), -1);
+
+    for (int trak = -1; moov >= 0 && (trak = find_mov_box(tree, moov, MOV_FOURCC('t', 'r', 'a', 'k'), trak)) >= 0;) {
+        MovSampleTable table;
+        char handler[5], codec[5];
+
+        if (load_mov_sample_table(file, tree, trak, &table) < 0) return -1;
+
+        mov_fourcc_string(table.handler, handler);
+        mov_fourcc_string(table.codec, codec);
+        printf("Track: %u, Handler: %s, Codec: %s, Timescale: %u, Duration: %llu, Samples: %u, Sync Samples: %s%u, "
+               "Time Runs: %u\n", table.track_id, handler, codec, table.timescale, (unsigned long long)table.duration,
+               table.sample_count, table.sync_samples ? "" : "all ", table.sync_samples ? table.sync_sample_count : table.sample_count,
+               table.time_run_count);
+
+        if (samples) {
+            for (uint32_t i = 0; i < table.sample_count; i++) print_sample(&table, i);
+        }
+
+        if (seek >= 0 && table.sample_count > 0) {
+            uint32_t sample = find_mov_sample(&table, (int64_t)(seek * table.timescale));
+            uint32_t keyframe = find_mov_keyframe(&table, sample);
+
+            printf("Seek %.3f: Sample %u, Keyframe %u\n", seek, sample, keyframe);
+            print_sample(&table, keyframe);
+        }
+
+        free_mov_sample_table(&table);
     }
 
-    char *buf = malloc(BUFFER_SIZE);
-    if (!buf) {
-        perror("malloc failed");
-        return 1;
+    return 0;
+}
+
+int parse_mov_file(const char *filename, int samples, double seek) {
+    MovFile *file = malloc(sizeof(MovFile));
+    MovBoxTree tree;
+
+    if (!file) {
+        fprintf(stderr, "Failed to allocate memory\n");
+        return -1;
     }
 
-    int fd = open(argv[1], O_RDONLY);
-    if (fd < 0) {
-        perror("open failed");
-        free(buf);
-        return 1;
+    if (open_mov_file(filename, file) < 0) {
+        free(file);
+        return -1;
     }
 
-    ssize_t bytes_read = read(fd, buf, BUFFER_SIZE);
-    if (bytes_read <= 0) {
-        perror("read failed");
-        close(fd);
-        free(buf);
-        return 1;
+    int ret = parse_mov_box_tree(file, &tree);
+
+    for (int i = 0; i < tree.count; i++) {
+        const MovBox *box = &tree.boxes[i];
+        char type[5];
+        char details[128];
+
+        mov_fourcc_string(box->type, type);
+        describe_box(file, box, details, sizeof(details));
+
+        printf("%*sBox: %s, Offset: %llu, Size: %llu%s%s\n", box->depth * 2, "", type,
+               (unsigned long long)box->offset, (unsigned long long)box->size, details,
+               box->truncated ? " (truncated)" : "");
     }
 
-    printf("bytes_read = %zd\n", bytes_read);
-
-    size_t i = 0;
-    while (i + 8 <= (size_t)bytes_read) {
-        uint32_t atom_size = read_u32_be(buf + i);
-        char atom_type[5] = {0};
-        atom_type[0] = buf[i+4];
-        atom_type[1] = buf[i+5];
-        atom_type[2] = buf[i+6];
-        atom_type[3] = buf[i+7];
-        atom_type[4] = '\0';
-
-        if (atom_size == 1) {
-            if (i + 16 > (size_t)bytes_read) {
-                printf("  Not enough data for extended size, stopping.\n");
-                break;
-            }
-            atom_size = read_u64_be(buf + i + 8);
-            printf("Found atom of type %s with extended size: %llu\n", atom_type, (unsigned long long)atom_size);
-        } else {
-            printf("Found atom of type %s with size: %u\n", atom_type, atom_size);
+    printf("File Size: %llu, Boxes: %d, Read: %llu bytes in %llu reads\n", (unsigned long long)file->size, tree.count,
+           (unsigned long long)file->bytes_read, (unsigned long long)file->reads);
+
+    if (ret == 0 && (samples || seek >= 0)) ret = print_tracks(file, &tree, samples, seek);
+
+    free_mov_box_tree(&tree);
+    close_mov_file(file);
+    free(file);
+    return ret;
+}
+
+int print_fragment_sample(const MovFragmentSample *sample, void *opaque) {
+    if (*(int *)opaque) {
+        printf("Fragment %u: Track: %u, Offset: %llu, Size: %u, DTS: %lld, PTS: %lld%s\n", sample->sequence_number,
+               sample->track_id, (unsigned long long)sample->offset, sample->size, (long long)sample->dts,
+               (long long)sample->pts, sample->keyframe ? " (sync)" : "");
+    }
+
+    return 0;
+}
+
+// Reads a fragmented file or stdin chunk by chunk, as a recording is read
+// while it is being written, printing samples as each moof arrives.
+int parse_mov_fragments(const char *filename, int samples) {
+    static uint8_t chunk[STREAM_CHUNK_SIZE];
+    int fd = strcmp(filename, "-") == 0 ? STDIN_FILENO : open(filename, O_RDONLY);
+    MovFragmentParser parser;
+    int ret = 0;
+
+    if (fd < 0) {
+        fprintf(stderr, "Failed to open file: %s\n", filename);
+        return -1;
+    }
+
+    init_mov_fragment_parser(&parser, print_fragment_sample, &samples);
+
+    for (;;) {
+        ssize_t n = read(fd, chunk, sizeof(chunk));
+
+        if (n < 0) {
+            if (errno == EINTR) continue;
+            fprintf(stderr, "Failed to read stream\n");
+            ret = -1;
+            break;
         }
 
-        if (atom_size < 8) {
-            printf("Invalid atom size (%u), stopping parsing.\n", atom_size);
+        if (n == 0) {
+            ret = finish_mov_fragment_parser(&parser);
             break;
         }
 
-        if (atom_size > (size_t)bytes_read - i) {
-            printf("Atom size %u exceeds remaining buffer (%zu), stopping.\n", atom_size, bytes_read - i);
+        if (feed_mov_fragment_parser(&parser, chunk, n) < 0) {
+            ret = -1;
             break;
         }
+    }
 
-        i += atom_size;
+    for (int i = 0; i < parser.track_count; i++) {
+        char handler[5];
+        mov_fourcc_string(parser.tracks[i].handler, handler);
+        printf("Track: %u, Handler: %s, Timescale: %u, Next DTS: %lld\n", parser.tracks[i].track_id, handler,
+               parser.tracks[i].timescale, (long long)parser.tracks[i].next_dts);
     }
 
-    close(fd);
-    free(buf);
-    return 0;
+    printf("Fragments: %llu, Samples: %llu, Read: %llu bytes, Buffered: %zu bytes\n",
+           (unsigned long long)parser.fragments, (unsigned long long)parser.samples, (unsigned long long)parser.offset,
+           parser.buffer_capacity);
+
+    free_mov_fragment_parser(&parser);
+    if (fd != STDIN_FILENO) close(fd);
+    return ret;
+}
+
+void usage(const char *name) {
+    fprintf(stderr, "Usage: %s [-samples] [-seek <seconds>] <mp4_file>\n", name);
+    fprintf(stderr, "       %s -fragments [-samples] <mp4_file | ->\n", name);
+}
+
+int main(int argc, char *argv[]) {
+    int samples = 0;
+    int fragments = 0;
+    double seek = -1;
+    int i;
+
+    for (i = 1; i < argc - 1; i++) {
+        if (strcmp(argv[i], "-samples") == 0) {
+            samples = 1;
+        } else if (strcmp(argv[i], "-fragments") == 0) {
+            fragments = 1;
+        } else if (strcmp(argv[i], "-seek") == 0 && i + 2 < argc) {
+            seek = atof(argv[++i]);
+        } else {
+            break;
+        }
+    }
+
+    if (i != argc - 1 || (seek < 0 && seek != -1) || (fragments && seek != -1)) {
+        usage(argv[0]);
+        return 1;
+    }
+
+    if (fragments) return parse_mov_fragments(argv[i], samples) < 0 ? 1 : 0;
+
+    return parse_mov_file(argv[i], samples, seek) < 0 ? 1 : 0;
 }
@@ -0,0 +1,388 @@
+#ifdef __linux__
+#define _GNU_SOURCE
+#endif
+
+#include <errno.h>
+#include <fcntl.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdint.h>
+#include <string.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+#include "annexb.h"
+#include "h264.h"
+#include "h264_index.h"
+#include "mapped_file.h"
+
+// Cuts and joins Annex B files at IDR access units without touching the
+// slices: every segment is one byte range of its input, found through the
+// sidecar index, and is copied as is. A segment starts at the IDR at or
+// before its first access unit and runs up to the IDR after its last one,
+// so each one decodes on its own. In front of a segment go the SPS and PPS
+// it relies on but does not carry itself, whenever they differ from what
+// the output has seen last.
+
+typedef struct {
+    const char *filename;
+    uint64_t first;
+    uint64_t last;
+    MappedFile file;
+    int fd;
+    H264Index index;
+} SpliceSegment;
+
+typedef struct {
+    int fd;
+    int copy_file_range;
+
+    // Payload of every parameter set id as the output has it now.
+    const uint8_t *sps[32];
+    size_t sps_size[32];
+    const uint8_t *pps[256];
+    size_t pps_size[256];
+} Splicer;
+
+static int write_all(int fd, const uint8_t *data, size_t size) {
+    while (size > 0) {
+        ssize_t n = write(fd, data, size);
+
+        if (n < 0) {
+            if (errno == EINTR) continue;
+            fprintf(stderr, "Failed to write output\n");
+            return -1;
+        }
+
+        data += n;
+        size -= n;
+    }
+
+    return 0;
+}
+
+// Copies size bytes at offset of the segment input to the output. Where the
+// kernel has copy_file_range the data stays in the kernel, or is not copied
+// at all on filesystems that share extents. Anything it refuses, such as a
+// pipe, is written from the mapping instead.
+static int copy_segment_range(Splicer *s, const SpliceSegment *seg, uint64_t offset, uint64_t size) {
+#ifdef __linux__
+    off_t in_offset = offset;
+
+    while (s->copy_file_range && size > 0) {
+        ssize_t n = copy_file_range(seg->fd, &in_offset, s->fd, NULL, size, 0);
+
+        if (n < 0 && errno == EINTR) continue;
+
+        if (n <= 0) {
+            s->copy_file_range = 0;
+            break;
+        }
+
+        offset += n;
+        size -= n;
+    }
+#endif
+
+    return write_all(s->fd, seg->file.data + offset, size);
+}
+
+// The NAL unit of an index entry without its start code and trailing zeros.
+static const uint8_t *parameter_set_payload(const SpliceSegment *seg, const H264IndexParameterSet *entry, size_t *size) {
+    const uint8_t *p = seg->file.data + entry->offset;
+    const uint8_t *end = p + entry->size;
+
+    while (p < end && *p == 0) p++;
+    if (p < end) p++;
+
+    while (end > p && end[-1] == 0) end--;
+
+    *size = end - p;
+    return p;
+}
+
+static void set_output_parameter_set(Splicer *s, const H264IndexParameterSet *entry, const uint8_t *payload, size_t size) {
+    if (entry->nal_unit_type == 7) {
+        s->sps[entry->id % 32] = payload;
+        s->sps_size[entry->id % 32] = size;
+    } else {
+        s->pps[entry->id] = payload;
+        s->pps_size[entry->id] = size;
+    }
+}
+
+static int output_has_parameter_set(const Splicer *s, const H264IndexParameterSet *entry, const uint8_t *payload, size_t size) {
+    const uint8_t *current = entry->nal_unit_type == 7 ? s->sps[entry->id % 32] : s->pps[entry->id];
+    size_t current_size = entry->nal_unit_type == 7 ? s->sps_size[entry->id % 32] : s->pps_size[entry->id];
+
+    return current && current_size == size && memcmp(current, payload, size) == 0;
+}
+
+// Access units [*start, *end) of the segment: its requested range widened to
+// IDR access units.
+static int find_segment_range(const SpliceSegment *seg, uint64_t *start, uint64_t *end) {
+    const H264Index *index = &seg->index;
+    uint64_t count = index->header->access_unit_count;
+    uint64_t keyframes = index->header->keyframe_count;
+
+    if (keyframes == 0) {
+        fprintf(stderr, "No IDR access unit in %s\n", seg->filename);
+        return -1;
+    }
+
+    if (seg->first >= count) {
+        fprintf(stderr, "Access unit %llu out of range, %s has %llu\n", (unsigned long long)seg->first, seg->filename,
+                (unsigned long long)count);
+        return -1;
+    }
+
+    uint64_t first = seg->first;
+    uint64_t last = seg->last < count ? seg->last : count - 1;
+
+    // The last IDR at or before first, or the first IDR at all.
+    uint64_t k = 0;
+    while (k + 1 < keyframes && index->keyframes[k + 1] <= first) k++;
+
+    *start = index->keyframes[k];
+
+    if (first > last || *start > last) {
+        fprintf(stderr, "No IDR access unit in %s:%llu-%llu\n", seg->filename,
+                (unsigned long long)seg->first, (unsigned long long)seg->last);
+        return -1;
+    }
+
+    while (k < keyframes && index->keyframes[k] <= last) k++;
+
+    *end = k < keyframes ? index->keyframes[k] : count;
+    return 0;
+}
+
+static int splice_segment(Splicer *s, const SpliceSegment *seg, uint64_t *start_au, uint64_t *end_au, int *inserted) {
+    const H264Index *index = &seg->index;
+
+    if (find_segment_range(seg, start_au, end_au) < 0) return -1;
+
+    const H264IndexAccessUnit *first = &index->access_units[*start_au];
+    const H264IndexAccessUnit *last = &index->access_units[*end_au - 1];
+    uint64_t start = first->offset;
+    uint64_t end = last->offset + last->size;
+
+    // The parameter sets in force at start, minus the ones the first access
+    // unit sends again.
+    const H264IndexParameterSet *sps[32] = {0};
+    const H264IndexParameterSet *pps[256] = {0};
+    uint64_t i;
+
+    for (i = 0; i < index->header->parameter_set_count; i++) {
+        const H264IndexParameterSet *entry = &index->parameter_sets[i];
+        if (entry->offset >= start + first->size) break;
+
+        if (entry->nal_unit_type == 7) {
+            sps[entry->id % 32] = entry->offset < start ? entry : NULL;
+        } else {
+            pps[entry->id] = entry->offset < start ? entry : NULL;
+        }
+    }
+
+    const H264IndexParameterSet *missing[32 + 256];
+    int missing_count = 0;
+
+    for (int id = 0; id < 32 + 256; id++) {
+        const H264IndexParameterSet *entry = id < 32 ? sps[id] : pps[id - 32];
+        size_t size;
+
+        if (!entry) continue;
+
+        const uint8_t *payload = parameter_set_payload(seg, entry, &size);
+        if (!output_has_parameter_set(s, entry, payload, size)) missing[missing_count++] = entry;
+    }
+
+    *inserted = missing_count;
+
+    if (missing_count > 0) {
+        // An access unit delimiter has to stay the first NAL unit (7.4.1.2.3).
+        const uint8_t *au_end = seg->file.data + start + first->size;
+        size_t start_code_size;
+        const uint8_t *nal = find_next_start_code(seg->file.data + start, first->size, &start_code_size);
+
+        if (nal && nal + start_code_size < au_end && (nal[start_code_size] & 0x1f) == 9) {
+            const uint8_t *payload = nal + start_code_size;
+            const uint8_t *next = find_next_start_code(payload, au_end - payload, &start_code_size);
+            uint64_t aud_end = (next ? next : au_end) - seg->file.data;
+
+            if (copy_segment_range(s, seg, start, aud_end - start) < 0) return -1;
+            start = aud_end;
+        }
+
+        for (int j = 0; j < missing_count; j++) {
+            static const uint8_t start_code[4] = {0, 0, 0, 1};
+            size_t size;
+            const uint8_t *payload = parameter_set_payload(seg, missing[j], &size);
+
+            if (write_all(s->fd, start_code, sizeof(start_code)) < 0 || write_all(s->fd, payload, size) < 0) return -1;
+            set_output_parameter_set(s, missing[j], payload, size);
+        }
+    }
+
+    if (copy_segment_range(s, seg, start, end - start) < 0) return -1;
+
+    // The parameter sets the segment itself sent are the output's now.
+    for (i = 0; i < index->header->parameter_set_count; i++) {
+        const H264IndexParameterSet *entry = &index->parameter_sets[i];
+        size_t size;
+
+        if (entry->offset < first->offset || entry->offset >= end) continue;
+
+        const uint8_t *payload = parameter_set_payload(seg, entry, &size);
+        set_output_parameter_set(s, entry, payload, size);
+    }
+
+    return 0;
+}
+
+// Splits <file>[:<first>[-<last>]]. Without a range the whole file is taken.
+static void parse_segment(char *arg, SpliceSegment *seg) {
+    char *colon = strrchr(arg, ':');
+
+    seg->filename = arg;
+    seg->first = 0;
+    seg->last = UINT64_MAX;
+
+    if (!colon || colon[1] < '0' || colon[1] > '9') return;
+
+    char *end;
+    uint64_t first = strtoull(colon + 1, &end, 10);
+    uint64_t last = UINT64_MAX;
+
+    if (*end == '-') {
+        char *range = end + 1;
+        if (*range) last = strtoull(range, &end, 10);
+    }
+
+    if (*end != '\0') return;
+
+    *colon = '\0';
+    seg->first = first;
+    seg->last = last;
+}
+
+int splice_h264_files(const char *output, SpliceSegment *segments, int count, int threads) {
+    Splicer s;
+    struct stat out_st;
+    int out_exists = strcmp(output, "-") != 0 && stat(output, &out_st) == 0;
+    int ret = 0;
+    int opened = 0;
+
+    memset(&s, 0, sizeof(s));
+    s.copy_file_range = 1;
+
+    for (opened = 0; opened < count; opened++) {
+        SpliceSegment *seg = &segments[opened];
+        struct stat st;
+
+        if (stat(seg->filename, &st) == 0 && out_exists && st.st_dev == out_st.st_dev && st.st_ino == out_st.st_ino) {
+            fprintf(stderr, "Output is also an input: %s\n", seg->filename);
+            ret = -1;
+            break;
+        }
+
+        if (open_h264_index(seg->filename, threads, &seg->index) < 0) {
+            ret = -1;
+            break;
+        }
+
+        if (map_file(seg->filename, &seg->file) < 0) {
+            unload_h264_index(&seg->index);
+            ret = -1;
+            break;
+        }
+
+        seg->fd = open(seg->filename, O_RDONLY);
+
+        // open_h264_index has checked every access unit and parameter set
+        // against source_size, so with the sizes equal the ranges sliced out
+        // of seg->file below stay inside it.
+        if (seg->fd < 0 || seg->file.size != seg->index.header->source_size) {
+            fprintf(stderr, "Failed to open file: %s\n", seg->filename);
+            if (seg->fd >= 0) close(seg->fd);
+            unmap_file(&seg->file);
+            unload_h264_index(&seg->index);
+            ret = -1;
+            break;
+        }
+    }
+
+    if (ret == 0) {
+        s.fd = strcmp(output, "-") == 0 ? STDOUT_FILENO : open(output, O_WRONLY | O_CREAT | O_TRUNC, 0644);
+
+        if (s.fd < 0) {
+            fprintf(stderr, "Failed to open file: %s\n", output);
+            ret = -1;
+        }
+    }
+
+    for (int i = 0; ret == 0 && i < count; i++) {
+        uint64_t start, end;
+        int inserted;
+
+        ret = splice_segment(&s, &segments[i], &start, &end, &inserted);
+
+        if (ret == 0) {
+            const H264IndexAccessUnit *last = &segments[i].index.access_units[end - 1];
+
+            fprintf(stderr, "Segment %d: %s, Access units: %llu-%llu, Bytes: %llu, Parameter sets inserted: %d\n", i,
+                    segments[i].filename, (unsigned long long)start, (unsigned long long)end - 1,
+                    (unsigned long long)(last->offset + last->size - segments[i].index.access_units[start].offset), inserted);
+        }
+    }
+
+    if (s.fd > 0 && s.fd != STDOUT_FILENO && close(s.fd) < 0 && ret == 0) {
+        fprintf(stderr, "Failed to write output\n");
+        ret = -1;
+    }
+
+    for (int i = 0; i < opened; i++) {
+        close(segments[i].fd);
+        unmap_file(&segments[i].file);
+        unload_h264_index(&segments[i].index);
+    }
+
+    return ret;
+}
+
+void usage(const char *name) {
+    fprintf(stderr, "Usage: %s [-j <threads>] <output_file | -> <h264_file>[:<first>[-<last>]]...\n", name);
+}
+
+int main(int argc, char *argv[]) {
+    int threads = 1;
+    int i = 1;
+
+    if (argc > 2 && strcmp(argv[1], "-j") == 0) {
+        threads = atoi(argv[2]);
+        i = 3;
+    }
+
+    if (argc - i < 2 || threads < 1) {
+        usage(argv[0]);
+        return 1;
+    }
+
+    const char *output = argv[i++];
+    int count = argc - i;
+    SpliceSegment *segments = calloc(count, sizeof(SpliceSegment));
+
+    if (!segments) {
+        fprintf(stderr, "Failed to allocate memory\n");
+        return 1;
+    }
+
+    for (int j = 0; j < count; j++) {
+        parse_segment(argv[i + j], &segments[j]);
+    }
+
+    int ret = splice_h264_files(output, segments, count, threads);
+
+    free(segments);
+    return ret < 0 ? 1 : 0;
+}
@@ -0,0 +1,219 @@
+#ifndef WORK_POOL_H
+#define WORK_POOL_H
+
+#include <pthread.h>
+#include <stdatomic.h>
+#include <stdint.h>
+#include <stdlib.h>
+#include <string.h>
+
+// Work-stealing thread pool for tasks that spawn more tasks, like walking a
+// directory tree. Every worker has its own deque: it pushes and pops new
+// tasks at the back, depth first, and an idle worker steals the oldest task
+// from the front of another worker's deque, which in a tree walk is the
+// biggest piece of work left there. A deque lock is only ever contended by
+// a thief. Workers with nothing to run or steal sleep until a task is pushed
+// or the last task finishes.
+
+#define MAX_WORK_THREADS 256
+
+typedef struct WorkPool WorkPool;
+
+typedef void (*WorkFunction)(WorkPool *pool, int worker, void *arg);
+
+typedef struct {
+    WorkFunction fn;
+    void *arg;
+} WorkTask;
+
+// A ring buffer, with head the oldest task. Padded so that neighbouring
+// deques do not share a cache line.
+typedef struct {
+    pthread_mutex_t lock;
+    WorkTask *tasks;
+    size_t head;
+    size_t count;
+    size_t capacity;
+    char padding[64];
+} WorkDeque;
+
+struct WorkPool {
+    WorkDeque deques[MAX_WORK_THREADS];
+    int threads;
+    void *opaque;
+
+    // pending counts tasks queued or running, queued those in a deque.
+    atomic_size_t pending;
+    atomic_size_t queued;
+    atomic_int sleepers;
+    pthread_mutex_t idle_lock;
+    pthread_cond_t idle_cond;
+
+    atomic_uint_fast64_t steals;
+};
+
+static inline void init_work_pool(WorkPool *pool, int threads, void *opaque) {
+    if (threads < 1) threads = 1;
+    if (threads > MAX_WORK_THREADS) threads = MAX_WORK_THREADS;
+
+    memset(pool, 0, sizeof(*pool));
+    pool->threads = threads;
+    pool->opaque = opaque;
+
+    for (int i = 0; i < threads; i++) pthread_mutex_init(&pool->deques[i].lock, NULL);
+
+    atomic_init(&pool->pending, 0);
+    atomic_init(&pool->queued, 0);
+    atomic_init(&pool->sleepers, 0);
+    atomic_init(&pool->steals, 0);
+    pthread_mutex_init(&pool->idle_lock, NULL);
+    pthread_cond_init(&pool->idle_cond, NULL);
+}
+
+static inline void free_work_pool(WorkPool *pool) {
+    for (int i = 0; i < pool->threads; i++) {
+        pthread_mutex_destroy(&pool->deques[i].lock);
+        free(pool->deques[i].tasks);
+    }
+
+    pthread_mutex_destroy(&pool->idle_lock);
+    pthread_cond_destroy(&pool->idle_cond);
+}
+
+static int grow_work_deque(WorkDeque *deque) {
+    size_t capacity = deque->capacity ? deque->capacity * 2 : 256;
+    WorkTask *tasks = malloc(capacity * sizeof(WorkTask));
+    if (!tasks) return -1;
+
+    for (size_t i = 0; i < deque->count; i++) {
+        tasks[i] = deque->tasks[(deque->head + i) & (deque->capacity - 1)];
+    }
+
+    free(deque->tasks);
+    deque->tasks = tasks;
+    deque->head = 0;
+    deque->capacity = capacity;
+    return 0;
+}
+
+// Queues a task on worker's deque, from a task running on that worker or
+// before run_work_pool. When memory runs out the task is run right away.
+static void push_work(WorkPool *pool, int worker, WorkFunction fn, void *arg) {
+    WorkDeque *deque = &pool->deques[worker];
+
+    pthread_mutex_lock(&deque->lock);
+
+    if (deque->count == deque->capacity && grow_work_deque(deque) < 0) {
+        pthread_mutex_unlock(&deque->lock);
+        fn(pool, worker, arg);
+        return;
+    }
+
+    // Counted before a thief can see the task, let alone finish it.
+    atomic_fetch_add(&pool->pending, 1);
+    atomic_fetch_add(&pool->queued, 1);
+
+    deque->tasks[(deque->head + deque->count++) & (deque->capacity - 1)] = (WorkTask){fn, arg};
+    pthread_mutex_unlock(&deque->lock);
+
+    // A sleeper counts itself before it looks at queued, so one of the two
+    // sides always sees the other.
+    if (atomic_load(&pool->sleepers) > 0) {
+        pthread_mutex_lock(&pool->idle_lock);
+        pthread_cond_signal(&pool->idle_cond);
+        pthread_mutex_unlock(&pool->idle_lock);
+    }
+}
+
+// Takes the newest task of the worker's own deque, or the oldest of another.
+static int take_work(WorkPool *pool, int worker, WorkTask *task) {
+    for (int i = 0; i < pool->threads; i++) {
+        WorkDeque *deque = &pool->deques[(worker + i) % pool->threads];
+        int found = 0;
+
+        pthread_mutex_lock(&deque->lock);
+
+        if (deque->count > 0) {
+            if (i == 0) {
+                *task = deque->tasks[(deque->head + deque->count - 1) & (deque->capacity - 1)];
+            } else {
+                *task = deque->tasks[deque->head];
+                deque->head = (deque->head + 1) & (deque->capacity - 1);
+            }
+
+            deque->count--;
+            found = 1;
+        }
+
+        pthread_mutex_unlock(&deque->lock);
+
+        if (found) {
+            atomic_fetch_sub(&pool->queued, 1);
+            if (i > 0) atomic_fetch_add(&pool->steals, 1);
+            return 1;
+        }
+    }
+
+    return 0;
+}
+
+typedef struct {
+    WorkPool *pool;
+    int worker;
+} WorkWorker;
+
+static void *run_work_worker(void *arg) {
+    WorkWorker *w = arg;
+    WorkPool *pool = w->pool;
+    WorkTask task;
+
+    for (;;) {
+        if (take_work(pool, w->worker, &task)) {
+            task.fn(pool, w->worker, task.arg);
+
+            if (atomic_fetch_sub(&pool->pending, 1) == 1) {
+                pthread_mutex_lock(&pool->idle_lock);
+                pthread_cond_broadcast(&pool->idle_cond);
+                pthread_mutex_unlock(&pool->idle_lock);
+            }
+
+            continue;
+        }
+
+        if (atomic_load(&pool->pending) == 0) break;
+
+        pthread_mutex_lock(&pool->idle_lock);
+        atomic_fetch_add(&pool->sleepers, 1);
+
+        while (atomic_load(&pool->pending) > 0 && atomic_load(&pool->queued) == 0) {
+            pthread_cond_wait(&pool->idle_cond, &pool->idle_lock);
+        }
+
+        atomic_fetch_sub(&pool->sleepers, 1);
+        pthread_mutex_unlock(&pool->idle_lock);
+    }
+
+    return NULL;
+}
+
+// Runs the queued tasks and everything they push until none are left, on
+// pool->threads threads counting the calling one.
+static inline void run_work_pool(WorkPool *pool) {
+    WorkWorker workers[MAX_WORK_THREADS];
+    pthread_t threads[MAX_WORK_THREADS];
+    int started = 1;
+
+    for (int i = 0; i < pool->threads; i++) workers[i] = (WorkWorker){pool, i};
+
+    for (int i = 1; i < pool->threads; i++) {
+        if (pthread_create(&threads[i], NULL, run_work_worker, &workers[i]) != 0) break;
+        started++;
+    }
+
+    // Tasks left on the deques of threads that could not be started are
+    // stolen by the rest.
+    run_work_worker(&workers[0]);
+    for (int i = 1; i < started; i++) pthread_join(threads[i], NULL);
+}
+
+#endif // WORK_POOL_H